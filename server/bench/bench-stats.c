@@ -0,0 +1,118 @@
+/*
+ * bench-stats.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <time.h>
+#include "bench-stats.h"
+
+bench_stats_t * bench_stats_init(bench_stats_t * stats, const char * name)
+{
+	if(NULL == stats) stats = calloc(1, sizeof(*stats));
+	assert(stats);
+	memset(stats, 0, sizeof(*stats));
+	if(name) strncpy(stats->name, name, sizeof(stats->name) - 1);
+	return stats;
+}
+
+void bench_stats_cleanup(bench_stats_t * stats)
+{
+	if(NULL == stats) return;
+	free(stats->samples);
+	stats->samples = NULL;
+	stats->count = 0;
+	stats->max_count = 0;
+}
+
+void bench_stats_add(bench_stats_t * stats, uint64_t latency_us)
+{
+	if(stats->count >= stats->max_count) {
+		size_t new_size = stats->max_count ? stats->max_count * 2 : 65536;
+		uint32_t * samples = realloc(stats->samples, new_size * sizeof(*samples));
+		assert(samples);
+		stats->samples = samples;
+		stats->max_count = new_size;
+	}
+	if(latency_us > UINT32_MAX) latency_us = UINT32_MAX;
+	stats->samples[stats->count++] = (uint32_t)latency_us;
+}
+
+void bench_stats_merge(bench_stats_t * stats, const bench_stats_t * other)
+{
+	for(size_t i = 0; i < other->count; ++i) bench_stats_add(stats, other->samples[i]);
+	stats->num_errors += other->num_errors;
+	for(int i = 0; i < 6; ++i) stats->status_classes[i] += other->status_classes[i];
+}
+
+static int compare_u32(const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double get_percentile(const bench_stats_t * stats, double percentile)
+{
+	if(0 == stats->count) return 0.0;
+	size_t index = (size_t)(percentile * stats->count);
+	if(index >= stats->count) index = stats->count - 1;
+	return stats->samples[index] / 1000.0;	// ms
+}
+
+void bench_stats_print_header(void)
+{
+	printf("%-24s %10s %12s %10s %10s %10s %10s %10s %8s\n", 
+		"name", "count", "ops/s", "mean(ms)", "p50(ms)", "p99(ms)", "p999(ms)", "max(ms)", "errors");
+}
+
+void bench_stats_report(bench_stats_t * stats, double elapsed_seconds)
+{
+	qsort(stats->samples, stats->count, sizeof(*stats->samples), compare_u32);
+	
+	double sum = 0;
+	for(size_t i = 0; i < stats->count; ++i) sum += stats->samples[i];
+	double mean = stats->count ? (sum / stats->count / 1000.0) : 0.0;
+	double max = stats->count ? (stats->samples[stats->count - 1] / 1000.0) : 0.0;
+	
+	printf("%-24s %10lu %12.1f %10.3f %10.3f %10.3f %10.3f %10.3f %8ld\n", 
+		stats->name, (unsigned long)stats->count, 
+		(elapsed_seconds > 0) ? (stats->count / elapsed_seconds) : 0.0,
+		mean, 
+		get_percentile(stats, 0.50), get_percentile(stats, 0.99), get_percentile(stats, 0.999), 
+		max, stats->num_errors);
+}
+
+double bench_now(void)
+{
+	struct timespec ts[1];
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return (double)ts->tv_sec + (double)ts->tv_nsec / 1000000000.0;
+}
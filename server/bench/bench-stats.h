@@ -0,0 +1,40 @@
+#ifndef WEBIX_DEMO_SERVER_BENCH_STATS_H_
+#define WEBIX_DEMO_SERVER_BENCH_STATS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+
+/*
+ * bench_stats: raw latency samples (microseconds), sorted once for the report.
+ * Not thread-safe, use one per thread (or per main loop).
+ */
+typedef struct bench_stats
+{
+	char name[64];
+	uint32_t * samples;
+	size_t count;
+	size_t max_count;
+	
+	long num_errors;
+	long status_classes[6];	// [status / 100], 0: transport errors
+}bench_stats_t;
+bench_stats_t * bench_stats_init(bench_stats_t * stats, const char * name);
+void bench_stats_cleanup(bench_stats_t * stats);
+
+void bench_stats_add(bench_stats_t * stats, uint64_t latency_us);
+void bench_stats_merge(bench_stats_t * stats, const bench_stats_t * other);
+
+/*
+ * prints ops/s and p50 / p99 / p99.9 / max (sorts the samples)
+ */
+void bench_stats_report(bench_stats_t * stats, double elapsed_seconds);
+void bench_stats_print_header(void);
+
+double bench_now(void);	// monotonic clock, in seconds
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,461 @@
+/*
+ * db-bench.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "app.h"
+#include "user-record.h"
+#include "json-writer.h"
+#include "bench-stats.h"
+
+/*
+ * users_db microbenchmarks, run directly on db_helpler (no http):
+ *   put:    db_helpler_put_user() in transactions of 'batch_size' rows (secondary indexes updated inline)
+ *   put(concurrent): one db_helpler_put_user() per transaction from every thread (page lock contention)
+ *   get:    users_db->get() by random uuid (of its shard)
+ *   list:   db_helpler_list_users() at a random position (DB_SET_RECNO), 100 rows
+ *   search: db_helpler_search_users() by a random name / email prefix (secondary index scan), 100 rows
+ *   text:   db_helpler_text_search() for a random 3-letter substring of any field (trigram index), 100 rows
+ *   json:   the list page encoded as /api/users does, with a json-c object per row or with json_writer
+ * --shards=N splits the users across N databases ("users_shards"), compare the runs with 1 and N.
+ */
+struct db_bench
+{
+	db_helpler_t * db;
+	long num_records;
+	long num_ops;	// per read benchmark, split across threads
+	int batch_size;
+	int num_threads;
+	int num_shards;
+	int nosync;
+	
+	uuid_t * uids;
+};
+
+struct bench_thread_context
+{
+	struct db_bench * bench;
+	pthread_t th;
+	unsigned int seed;
+	long num_ops;
+	bench_stats_t stats[1];
+};
+
+typedef void (* bench_op_fn)(struct db_bench * bench, struct bench_thread_context * ctx);
+
+static inline uint64_t elapsed_us(const struct timespec * start)
+{
+	struct timespec now[1];
+	clock_gettime(CLOCK_MONOTONIC, now);
+	return (now->tv_sec - start->tv_sec) * 1000000ULL + (now->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void random_string(char * buf, size_t length, const char * charset, unsigned int * seed)
+{
+	size_t cb_charset = strlen(charset);
+	for(size_t i = 0; i < length; ++i) buf[i] = charset[rand_r(seed) % cb_charset];
+	buf[length] = '\0';
+}
+
+/**********************************************
+ * put
+**********************************************/
+static int bench_put(struct db_bench * bench)
+{
+	db_helpler_t * db = bench->db;
+	DB_ENV * env = db->env;
+	unsigned int seed = 1;
+	
+	bench_stats_t put_stats[1], commit_stats[1];
+	bench_stats_init(put_stats, "put");
+	bench_stats_init(commit_stats, "put.commit");
+	
+	bench->uids = calloc(bench->num_records, sizeof(uuid_t));
+	assert(bench->uids);
+	
+	char name[32], email[64], phone[16];
+	struct db_user_record user[1];
+	memset(user, 0, sizeof(user));
+	user->name = name;
+	user->email = email;
+	user->phone = phone;
+	
+	int rc = 0;
+	DB_TXN * txn = NULL;
+	struct timespec start[1];
+	double start_time = bench_now();
+	for(long i = 0; i < bench->num_records && 0 == rc; ++i) {
+		if(NULL == txn) {
+			rc = env->txn_begin(env, NULL, &txn, bench->nosync?DB_TXN_NOSYNC:0);
+			if(rc) break;
+		}
+		
+		uuid_generate(bench->uids[i]);
+		uuid_copy(user->uid, bench->uids[i]);
+		random_string(name, 4 + rand_r(&seed) % 12, "abcdefghijklmnopqrstuvwxyz", &seed);
+		snprintf(email, sizeof(email), "%s@example.com", name);
+		random_string(phone, 11, "0123456789", &seed);
+		
+		clock_gettime(CLOCK_MONOTONIC, start);
+		rc = db_helpler_put_user(db, txn, user);
+		bench_stats_add(put_stats, elapsed_us(start));
+		
+		if(0 == rc && ((i + 1) % bench->batch_size == 0 || (i + 1) == bench->num_records)) {
+			clock_gettime(CLOCK_MONOTONIC, start);
+			rc = txn->commit(txn, 0);
+			txn = NULL;
+			bench_stats_add(commit_stats, elapsed_us(start));
+		}
+	}
+	if(txn) txn->abort(txn);
+	if(bench->nosync) env->log_flush(env, NULL);
+	double elapsed = bench_now() - start_time;
+	
+	if(rc) {
+		fprintf(stderr, "put failed: %s\n", db_strerror(rc));
+		++put_stats->num_errors;
+	}
+	bench_stats_report(put_stats, elapsed);
+	bench_stats_report(commit_stats, elapsed);
+	bench_stats_cleanup(put_stats);
+	bench_stats_cleanup(commit_stats);
+	return rc;
+}
+
+/**********************************************
+ * reads
+**********************************************/
+static void op_get(struct db_bench * bench, struct bench_thread_context * ctx)
+{
+	unsigned char * uid = bench->uids[rand_r(&ctx->seed) % bench->num_records];
+	DB * dbp = db_helpler_get_shard(bench->db, uid)->users_db;
+	unsigned char buf[USER_RECORD_MAX_SIZE];
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = uid;
+	key.size = sizeof(uuid_t);
+	value.data = buf;
+	value.ulen = sizeof(buf);
+	value.flags = DB_DBT_USERMEM;
+	
+	struct timespec start[1];
+	clock_gettime(CLOCK_MONOTONIC, start);
+	int rc = dbp->get(dbp, NULL, &key, &value, 0);
+	if(rc) ++ctx->stats->num_errors;
+	else bench_stats_add(ctx->stats, elapsed_us(start));
+}
+
+static int on_visit_user(const struct db_user_record * user, void * user_data)
+{
+	long * p_count = user_data;
+	++*p_count;
+	return 0;
+}
+
+static void op_list(struct db_bench * bench, struct bench_thread_context * ctx)
+{
+	long count = 0;
+	struct timespec start[1];
+	clock_gettime(CLOCK_MONOTONIC, start);
+	long rc = db_helpler_list_users(bench->db, NULL, rand_r(&ctx->seed) % bench->num_records, 100, on_visit_user, &count);
+	if(rc < 0) ++ctx->stats->num_errors;
+	else bench_stats_add(ctx->stats, elapsed_us(start));
+}
+
+static int on_encode_json_c(const struct db_user_record * user, void * user_data)
+{
+	GString * body = user_data;
+	char sz_uid[40] = "";
+	uuid_unparse_lower(user->uid, sz_uid);
+	
+	json_object * juser = json_object_new_object();
+	json_object_object_add(juser, "id", json_object_new_string(sz_uid));
+	json_object_object_add(juser, "name", json_object_new_string(user->name));
+	json_object_object_add(juser, "email", json_object_new_string(user->email));
+	json_object_object_add(juser, "phone", json_object_new_string(user->phone));
+	g_string_append_c(body, ',');
+	g_string_append(body, json_object_to_json_string_ext(juser, JSON_C_TO_STRING_PLAIN));
+	json_object_put(juser);
+	return 0;
+}
+
+static int on_encode_json_writer(const struct db_user_record * user, void * user_data)
+{
+	json_writer_t * json = user_data;
+	char sz_uid[40] = "";
+	uuid_unparse_lower(user->uid, sz_uid);
+	
+	json_writer_begin_object(json);
+	json_writer_add_string(json, "id", sz_uid);
+	json_writer_add_string(json, "name", user->name);
+	json_writer_add_string(json, "email", user->email);
+	json_writer_add_string(json, "phone", user->phone);
+	json_writer_end_object(json);
+	return 0;
+}
+
+static void op_list_json_c(struct db_bench * bench, struct bench_thread_context * ctx)
+{
+	GString * body = g_string_sized_new(16 * 1024);
+	struct timespec start[1];
+	clock_gettime(CLOCK_MONOTONIC, start);
+	long rc = db_helpler_list_users(bench->db, NULL, rand_r(&ctx->seed) % bench->num_records, 100, on_encode_json_c, body);
+	if(rc < 0) ++ctx->stats->num_errors;
+	else bench_stats_add(ctx->stats, elapsed_us(start));
+	g_string_free(body, TRUE);
+}
+
+static void op_list_json_writer(struct db_bench * bench, struct bench_thread_context * ctx)
+{
+	GString * body = g_string_sized_new(16 * 1024);
+	json_writer_t json[1];
+	json_writer_init(json, body);
+	
+	struct timespec start[1];
+	clock_gettime(CLOCK_MONOTONIC, start);
+	json_writer_begin_array(json);
+	long rc = db_helpler_list_users(bench->db, NULL, rand_r(&ctx->seed) % bench->num_records, 100, on_encode_json_writer, json);
+	json_writer_end_array(json);
+	if(rc < 0) ++ctx->stats->num_errors;
+	else bench_stats_add(ctx->stats, elapsed_us(start));
+	g_string_free(body, TRUE);
+}
+
+static void op_search(struct db_bench * bench, struct bench_thread_context * ctx)
+{
+	char prefix[3] = "";
+	random_string(prefix, 2, "abcdefghijklmnopqrstuvwxyz", &ctx->seed);
+	
+	struct db_user_query query[1];
+	memset(query, 0, sizeof(query));
+	query->conds[(rand_r(&ctx->seed) & 1) ? DB_USER_FIELD_NAME : DB_USER_FIELD_EMAIL].prefix = prefix;
+	query->limit = 100;
+	
+	long count = 0, num_matched = 0;
+	struct timespec start[1];
+	clock_gettime(CLOCK_MONOTONIC, start);
+	long rc = db_helpler_search_users(bench->db, NULL, query, on_visit_user, &count, &num_matched);
+	if(rc < 0) ++ctx->stats->num_errors;
+	else bench_stats_add(ctx->stats, elapsed_us(start));
+}
+
+static void op_text_search(struct db_bench * bench, struct bench_thread_context * ctx)
+{
+	char text[4] = "";
+	random_string(text, 3, "abcdefghijklmnopqrstuvwxyz", &ctx->seed);
+	
+	struct db_text_query query[1];
+	memset(query, 0, sizeof(query));
+	query->text = text;
+	query->field = -1;
+	query->limit = 100;
+	
+	long count = 0, num_matched = 0;
+	struct timespec start[1];
+	clock_gettime(CLOCK_MONOTONIC, start);
+	long rc = db_helpler_text_search(bench->db, NULL, query, on_visit_user, &count, &num_matched, NULL);
+	if(rc < 0) ++ctx->stats->num_errors;
+	else bench_stats_add(ctx->stats, elapsed_us(start));
+}
+
+static void op_put_concurrent(struct db_bench * bench, struct bench_thread_context * ctx)
+{
+	char name[32], email[64], phone[16];
+	struct db_user_record user[1];
+	memset(user, 0, sizeof(user));
+	uuid_generate(user->uid);
+	random_string(name, 4 + rand_r(&ctx->seed) % 12, "abcdefghijklmnopqrstuvwxyz", &ctx->seed);
+	snprintf(email, sizeof(email), "%s@example.com", name);
+	random_string(phone, 11, "0123456789", &ctx->seed);
+	user->name = name;
+	user->email = email;
+	user->phone = phone;
+	
+	struct timespec start[1];
+	clock_gettime(CLOCK_MONOTONIC, start);
+	int rc = db_helpler_put_user(bench->db, NULL, user);	// a local transaction (with its change record)
+	if(rc) ++ctx->stats->num_errors;
+	else bench_stats_add(ctx->stats, elapsed_us(start));
+}
+
+static bench_op_fn s_op;
+static void * bench_thread(void * user_data)
+{
+	struct bench_thread_context * ctx = user_data;
+	for(long i = 0; i < ctx->num_ops; ++i) s_op(ctx->bench, ctx);
+	return NULL;
+}
+
+static void run_read_bench(struct db_bench * bench, const char * name, bench_op_fn op)
+{
+	struct bench_thread_context * threads = calloc(bench->num_threads, sizeof(*threads));
+	assert(threads);
+	
+	s_op = op;
+	double start_time = bench_now();
+	for(int i = 0; i < bench->num_threads; ++i) {
+		struct bench_thread_context * ctx = &threads[i];
+		ctx->bench = bench;
+		ctx->seed = 12345 + i;
+		ctx->num_ops = bench->num_ops / bench->num_threads;
+		bench_stats_init(ctx->stats, name);
+		int rc = pthread_create(&ctx->th, NULL, bench_thread, ctx);
+		assert(0 == rc);
+	}
+	
+	bench_stats_t total[1];
+	bench_stats_init(total, name);
+	for(int i = 0; i < bench->num_threads; ++i) {
+		pthread_join(threads[i].th, NULL);
+		bench_stats_merge(total, threads[i].stats);
+		bench_stats_cleanup(threads[i].stats);
+	}
+	double elapsed = bench_now() - start_time;
+	
+	bench_stats_report(total, elapsed);
+	bench_stats_cleanup(total);
+	free(threads);
+}
+
+static void print_usage(const char * exe_name)
+{
+	fprintf(stderr, "Usage: %s [--db-home=DIR] [--records=100000] [--ops=100000]\n"
+		"    [--batch-size=1000] [--threads=1] [--shards=1] [--nosync]\n"
+		"\n"
+		"  --db-home    environment directory (default: a new temporary directory, removed at exit)\n"
+		"  --shards     users_shards of a new environment\n"
+		"  --nosync     commit with DB_TXN_NOSYNC, flush the log once at the end\n",
+		exe_name);
+}
+
+int main(int argc, char ** argv)
+{
+	static struct option options[] = {
+		{"db-home", required_argument, 0, 'd' },
+		{"records", required_argument, 0, 'r' },
+		{"ops", required_argument, 0, 'o' },
+		{"batch-size", required_argument, 0, 'b' },
+		{"threads", required_argument, 0, 't' },
+		{"shards", required_argument, 0, 's' },
+		{"nosync", no_argument, 0, 'n' },
+		{"help", no_argument, 0, 'h' },
+		{NULL},
+	};
+	
+	struct db_bench bench[1];
+	memset(bench, 0, sizeof(bench));
+	bench->num_records = 100000;
+	bench->num_ops = 100000;
+	bench->batch_size = 1000;
+	bench->num_threads = 1;
+	bench->num_shards = 1;
+	const char * db_home = NULL;
+	
+	while(1) {
+		int index = 0;
+		int c = getopt_long(argc, argv, "d:r:o:b:t:s:nh", options, &index);
+		if(c == -1) break;
+		
+		switch(c) {
+		case 'd': db_home = optarg; break;
+		case 'r': bench->num_records = atol(optarg); break;
+		case 'o': bench->num_ops = atol(optarg); break;
+		case 'b': bench->batch_size = atoi(optarg); break;
+		case 't': bench->num_threads = atoi(optarg); break;
+		case 's': bench->num_shards = atoi(optarg); break;
+		case 'n': bench->nosync = 1; break;
+		case 'h':
+		default:
+			print_usage(argv[0]);
+			exit(c != 'h');
+		}
+	}
+	if(bench->num_records <= 0) bench->num_records = 1;
+	if(bench->batch_size <= 0) bench->batch_size = 1000;
+	if(bench->num_threads <= 0) bench->num_threads = 1;
+	
+	char tmp_dir[] = "/tmp/webapi-db-bench-XXXXXX";
+	if(NULL == db_home) {
+		db_home = mkdtemp(tmp_dir);
+		assert(db_home);
+	}
+	
+	// db_helpler only needs the config from the app context
+	app_context_t app[1];
+	memset(app, 0, sizeof(app));
+	app->jconfig = json_object_new_object();
+	json_object_object_add(app->jconfig, "db_home", json_object_new_string(db_home));
+	json_object_object_add(app->jconfig, "users_shards", json_object_new_int(bench->num_shards));
+	
+	db_helpler_t * db = db_helpler_init(app->db, app);
+	assert(db);
+	bench->db = db;
+	
+	printf("db_home: %s, records: %ld, ops: %ld, batch: %d, threads: %d, shards: %d%s\n\n", 
+		db_home, bench->num_records, bench->num_ops, bench->batch_size, bench->num_threads, db->num_shards, 
+		bench->nosync?", nosync":"");
+	bench_stats_print_header();
+	
+	int rc = bench_put(bench);
+	if(0 == rc) {
+		run_read_bench(bench, "get", op_get);
+		run_read_bench(bench, "list(100)", op_list);
+		run_read_bench(bench, "search(prefix,100)", op_search);
+		run_read_bench(bench, "search(text,100)", op_text_search);
+		run_read_bench(bench, "list(100)+json-c", op_list_json_c);
+		run_read_bench(bench, "list(100)+json_writer", op_list_json_writer);
+		
+		// a commit per put: a tenth of the operations
+		long num_ops = bench->num_ops;
+		bench->num_ops = (num_ops >= 10 * bench->num_threads) ? num_ops / 10 : num_ops;
+		if(bench->nosync) db->env->set_flags(db->env, DB_TXN_NOSYNC, 1);
+		run_read_bench(bench, "put(concurrent)", op_put_concurrent);
+		bench->num_ops = num_ops;
+	}
+	
+	db_helpler_cleanup(db);
+	json_object_put(app->jconfig);
+	free(bench->uids);
+	
+	if(db_home == tmp_dir) {
+		char command[PATH_MAX] = "";
+		snprintf(command, sizeof(command), "rm -rf '%s'", tmp_dir);
+		if(system(command)) fprintf(stderr, "failed to remove %s\n", tmp_dir);
+	}
+	return rc?1:0;
+}
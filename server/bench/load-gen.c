@@ -0,0 +1,364 @@
+/*
+ * load-gen.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <getopt.h>
+#include <time.h>
+#include <libsoup/soup.h>
+#include <jwt.h>
+
+#include "bench-stats.h"
+
+/*
+ * load generator: 'concurrency' virtual clients, each sends one request at a time
+ * (picked from the weighted mix) and sends the next one as soon as the response arrives.
+ */
+enum request_kind
+{
+	REQUEST_KIND_STATIC,	// index.html, webix, icons
+	REQUEST_KIND_LOGIN,	// POST /login
+	REQUEST_KIND_AUTH,	// bearer token verification
+	REQUEST_KIND_USERS,	// paginated /api/users
+	REQUEST_KIND_SEARCH,	// /api/users with an index filter or range
+	REQUEST_KINDS_COUNT
+};
+static const char * s_kind_names[REQUEST_KINDS_COUNT] = { "static", "login", "auth", "users", "search" };
+
+static const char * s_static_paths[] = {
+	"/index.html",
+	"/webix/codebase/webix.js",
+	"/webix/codebase/webix.css",
+	"/material-design/css/materialdesignicons.css",
+};
+
+struct load_gen
+{
+	SoupSession * session;
+	GMainLoop * loop;
+	
+	char base_url[256];
+	int concurrency;
+	int keep_alive;
+	double duration;	// seconds
+	long max_requests;	// 0: until 'duration'
+	long num_users;	// range of the 'start' parameter
+	char * token;	// bearer token
+	
+	int weights[REQUEST_KINDS_COUNT];
+	int total_weight;
+	
+	double start_time;
+	long num_sent;
+	int num_active;	// clients still running
+	
+	bench_stats_t stats[REQUEST_KINDS_COUNT];
+};
+
+struct load_client
+{
+	struct load_gen * gen;
+	unsigned int seed;
+	enum request_kind kind;
+	gint64 sent_at;
+};
+
+static void client_send_next(struct load_client * client);
+
+static enum request_kind pick_request_kind(struct load_gen * gen, unsigned int * seed)
+{
+	int value = rand_r(seed) % gen->total_weight;
+	for(int i = 0; i < REQUEST_KINDS_COUNT; ++i) {
+		if(value < gen->weights[i]) return i;
+		value -= gen->weights[i];
+	}
+	return REQUEST_KIND_STATIC;
+}
+
+static SoupMessage * build_request(struct load_gen * gen, enum request_kind kind, unsigned int * seed)
+{
+	static const char * search_fields[] = { "name", "email", "phone" };
+	char url[1024] = "";
+	SoupMessage * msg = NULL;
+	
+	switch(kind) {
+	case REQUEST_KIND_STATIC:
+		snprintf(url, sizeof(url), "%s%s", gen->base_url, s_static_paths[rand_r(seed) % G_N_ELEMENTS(s_static_paths)]);
+		msg = soup_message_new(SOUP_METHOD_GET, url);
+		break;
+	case REQUEST_KIND_LOGIN:
+		snprintf(url, sizeof(url), "%s/login", gen->base_url);
+		msg = soup_message_new(SOUP_METHOD_POST, url);
+		if(msg) {
+			static const char form[] = "username=bench&password=bench";
+			soup_message_set_request(msg, "application/x-www-form-urlencoded", SOUP_MEMORY_STATIC, form, sizeof(form) - 1);
+		}
+		break;
+	case REQUEST_KIND_AUTH:
+		// any non-static path goes through the bearer token check
+		snprintf(url, sizeof(url), "%s/whoami", gen->base_url);
+		msg = soup_message_new(SOUP_METHOD_GET, url);
+		break;
+	case REQUEST_KIND_USERS:
+		snprintf(url, sizeof(url), "%s/api/users?start=%ld&count=100", gen->base_url, 
+			gen->num_users > 0 ? (long)(rand_r(seed) % gen->num_users) : 0L);
+		msg = soup_message_new(SOUP_METHOD_GET, url);
+		break;
+	case REQUEST_KIND_SEARCH:
+		{
+			char prefix[3] = { 'a' + rand_r(seed) % 26, 'a' + rand_r(seed) % 26, '\0' };
+			if(rand_r(seed) % 4 == 0) {	// range
+				char upper[2] = { prefix[0] + 1, '\0' };
+				snprintf(url, sizeof(url), "%s/api/users?by=name&from=%c&to=%s&count=100", gen->base_url, prefix[0], upper);
+			}else {
+				const char * field = search_fields[rand_r(seed) % G_N_ELEMENTS(search_fields)];
+				if(field[0] == 'p') { prefix[0] = '0' + rand_r(seed) % 10; prefix[1] = '\0'; }
+				snprintf(url, sizeof(url), "%s/api/users?filter%%5B%s%%5D=%s&count=100", gen->base_url, field, prefix);
+			}
+			msg = soup_message_new(SOUP_METHOD_GET, url);
+		}
+		break;
+	default:
+		break;
+	}
+	if(NULL == msg) return NULL;
+	
+	if(gen->token) {
+		char auth[4096] = "";
+		snprintf(auth, sizeof(auth), "Bearer %s", gen->token);
+		soup_message_headers_replace(msg->request_headers, "Authorization", auth);
+	}
+	if(!gen->keep_alive) soup_message_headers_replace(msg->request_headers, "Connection", "close");
+	return msg;
+}
+
+static void on_response(SoupSession * session, SoupMessage * msg, gpointer user_data)
+{
+	struct load_client * client = user_data;
+	struct load_gen * gen = client->gen;
+	bench_stats_t * stats = &gen->stats[client->kind];
+	
+	unsigned int status_class = msg->status_code / 100;
+	if(status_class >= 6) status_class = 0;
+	++stats->status_classes[status_class];
+	
+	if(SOUP_STATUS_IS_TRANSPORT_ERROR(msg->status_code)) ++stats->num_errors;
+	else bench_stats_add(stats, g_get_monotonic_time() - client->sent_at);
+	
+	client_send_next(client);
+}
+
+static void client_send_next(struct load_client * client)
+{
+	struct load_gen * gen = client->gen;
+	int done = (gen->max_requests > 0) ? (gen->num_sent >= gen->max_requests) 
+		: ((bench_now() - gen->start_time) >= gen->duration);
+	
+	SoupMessage * msg = NULL;
+	if(!done) {
+		client->kind = pick_request_kind(gen, &client->seed);
+		msg = build_request(gen, client->kind, &client->seed);
+	}
+	if(NULL == msg) {
+		if(--gen->num_active == 0) g_main_loop_quit(gen->loop);
+		return;
+	}
+	
+	++gen->num_sent;
+	client->sent_at = g_get_monotonic_time();
+	soup_session_queue_message(gen->session, msg, on_response, client);	// takes the msg reference
+}
+
+static int parse_mix(struct load_gen * gen, const char * mix)
+{
+	// "static:40,login:5,auth:10,users:30,search:15"
+	memset(gen->weights, 0, sizeof(gen->weights));
+	gen->total_weight = 0;
+	
+	char * buf = strdup(mix);
+	char * saveptr = NULL;
+	for(char * item = strtok_r(buf, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char * colon = strchr(item, ':');
+		int weight = 1;
+		if(colon) {
+			*colon = '\0';
+			weight = atoi(colon + 1);
+		}
+		int kind = 0;
+		for(; kind < REQUEST_KINDS_COUNT; ++kind) if(strcmp(item, s_kind_names[kind]) == 0) break;
+		if(kind == REQUEST_KINDS_COUNT || weight < 0) {
+			fprintf(stderr, "invalid mix item: '%s'\n", item);
+			free(buf);
+			return -1;
+		}
+		gen->weights[kind] = weight;
+		gen->total_weight += weight;
+	}
+	free(buf);
+	return (gen->total_weight > 0) ? 0 : -1;
+}
+
+static char * generate_token(const char * secret)
+{
+	jwt_t * jwt = NULL;
+	int rc = jwt_new(&jwt);
+	if(rc) return NULL;
+	
+	time_t now = time(NULL);
+	jwt_add_grant(jwt, "sub", "bench");
+	jwt_add_grant_int(jwt, "iat", now);
+	jwt_add_grant_int(jwt, "exp", now + 3600);
+	rc = jwt_set_alg(jwt, JWT_ALG_HS256, (const unsigned char *)secret, strlen(secret));
+	char * token = rc ? NULL : jwt_encode_str(jwt);
+	jwt_free(jwt);
+	return token;
+}
+
+static void print_usage(const char * exe_name)
+{
+	fprintf(stderr, "Usage: %s [--url=http://127.0.0.1:8081] [--concurrency=32]\n"
+		"    [--duration=10 | --requests=N] [--no-keep-alive]\n"
+		"    [--mix=static:40,login:5,auth:10,users:30,search:15]\n"
+		"    [--users=10000] [--jwt-secret=SECRET]\n",
+		exe_name);
+}
+
+int main(int argc, char ** argv)
+{
+	static struct option options[] = {
+		{"url", required_argument, 0, 'u' },
+		{"concurrency", required_argument, 0, 'c' },
+		{"duration", required_argument, 0, 'd' },
+		{"requests", required_argument, 0, 'n' },
+		{"no-keep-alive", no_argument, 0, 'k' },
+		{"mix", required_argument, 0, 'm' },
+		{"users", required_argument, 0, 'U' },
+		{"jwt-secret", required_argument, 0, 's' },
+		{"help", no_argument, 0, 'h' },
+		{NULL},
+	};
+	
+	struct load_gen gen[1];
+	memset(gen, 0, sizeof(gen));
+	strncpy(gen->base_url, "http://127.0.0.1:8081", sizeof(gen->base_url) - 1);
+	gen->concurrency = 32;
+	gen->keep_alive = 1;
+	gen->duration = 10;
+	gen->num_users = 10000;
+	const char * mix = "static:40,login:5,auth:10,users:30,search:15";
+	const char * jwt_secret = NULL;
+	
+	while(1) {
+		int index = 0;
+		int c = getopt_long(argc, argv, "u:c:d:n:km:U:s:h", options, &index);
+		if(c == -1) break;
+		
+		switch(c) {
+		case 'u': strncpy(gen->base_url, optarg, sizeof(gen->base_url) - 1); break;
+		case 'c': gen->concurrency = atoi(optarg); break;
+		case 'd': gen->duration = atof(optarg); break;
+		case 'n': gen->max_requests = atol(optarg); break;
+		case 'k': gen->keep_alive = 0; break;
+		case 'm': mix = optarg; break;
+		case 'U': gen->num_users = atol(optarg); break;
+		case 's': jwt_secret = optarg; break;
+		case 'h':
+		default:
+			print_usage(argv[0]);
+			exit(c != 'h');
+		}
+	}
+	
+	size_t cb_url = strlen(gen->base_url);
+	while(cb_url > 0 && gen->base_url[cb_url - 1] == '/') gen->base_url[--cb_url] = '\0';
+	if(gen->concurrency <= 0) gen->concurrency = 1;
+	if(parse_mix(gen, mix)) {
+		print_usage(argv[0]);
+		exit(1);
+	}
+	
+	if(jwt_secret && jwt_secret[0]) {
+		gen->token = generate_token(jwt_secret);
+		if(NULL == gen->token) fprintf(stderr, "WARNING: failed to generate a bearer token\n");
+	}
+	
+	for(int i = 0; i < REQUEST_KINDS_COUNT; ++i) bench_stats_init(&gen->stats[i], s_kind_names[i]);
+	
+	gen->session = soup_session_new_with_options(
+		SOUP_SESSION_MAX_CONNS, gen->concurrency,
+		SOUP_SESSION_MAX_CONNS_PER_HOST, gen->concurrency,
+		SOUP_SESSION_TIMEOUT, 30,
+		NULL);
+	assert(gen->session);
+	gen->loop = g_main_loop_new(NULL, FALSE);
+	
+	printf("url: %s, concurrency: %d, keep-alive: %s, mix: %s\n", 
+		gen->base_url, gen->concurrency, gen->keep_alive?"on":"off", mix);
+	
+	struct load_client * clients = calloc(gen->concurrency, sizeof(*clients));
+	assert(clients);
+	
+	gen->start_time = bench_now();
+	gen->num_active = gen->concurrency;
+	for(int i = 0; i < gen->concurrency; ++i) {
+		clients[i].gen = gen;
+		clients[i].seed = (unsigned int)time(NULL) ^ (i * 2654435761u);
+		client_send_next(&clients[i]);
+	}
+	g_main_loop_run(gen->loop);
+	double elapsed = bench_now() - gen->start_time;
+	
+	bench_stats_t total[1];
+	bench_stats_init(total, "total");
+	
+	printf("\n");
+	bench_stats_print_header();
+	for(int i = 0; i < REQUEST_KINDS_COUNT; ++i) {
+		if(0 == gen->weights[i]) continue;
+		bench_stats_merge(total, &gen->stats[i]);
+		bench_stats_report(&gen->stats[i], elapsed);
+	}
+	bench_stats_report(total, elapsed);
+	
+	printf("\nstatus: 2xx=%ld, 3xx=%ld, 4xx=%ld, 5xx=%ld, transport errors=%ld, elapsed: %.3f s\n", 
+		total->status_classes[2], total->status_classes[3], total->status_classes[4], total->status_classes[5], 
+		total->status_classes[0], elapsed);
+	
+	bench_stats_cleanup(total);
+	for(int i = 0; i < REQUEST_KINDS_COUNT; ++i) bench_stats_cleanup(&gen->stats[i]);
+	free(clients);
+	free(gen->token);
+	
+	soup_session_abort(gen->session);
+	g_object_unref(gen->session);
+	g_main_loop_unref(gen->loop);
+	return 0;
+}
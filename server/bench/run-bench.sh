@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# starts a local webapi-user on a scratch db, replays the request mixes with load-gen,
+# then runs the users_db microbenchmarks.
+#
+# usage: bench/run-bench.sh [concurrency] [duration]
+#   env: PORT (18081), USERS_JSON (../users_db/users.json), JWT_SECRET, LOGIN_THREADS (0: a quarter of the cores),
+#        USERS_SHARDS (1), DB_BENCH_SHARDS ("1 4": db-bench is run once per shard count), LOAD_GEN_ARGS, DB_BENCH_ARGS
+#
+
+cd "$(dirname "$0")/.."
+
+CONCURRENCY=${1:-32}
+DURATION=${2:-10}
+PORT=${PORT:-18081}
+USERS_JSON=${USERS_JSON:-../users_db/users.json}
+JWT_SECRET=${JWT_SECRET:-bench-secret}
+LOGIN_THREADS=${LOGIN_THREADS:-0}
+USERS_SHARDS=${USERS_SHARDS:-1}
+DB_BENCH_SHARDS=${DB_BENCH_SHARDS:-1 4}
+
+WORK_DIR=$(mktemp -d /tmp/webapi-bench-XXXXXX)
+trap 'kill $SERVER_PID 2>/dev/null; wait $SERVER_PID 2>/dev/null; rm -rf "$WORK_DIR"' EXIT
+
+# the account used by the "login" requests (bench / bench), yescrypt if mkpasswd is installed
+LOGIN_HASH=$(mkpasswd -m yescrypt bench 2>/dev/null || openssl passwd -6 bench)
+echo "bench:$LOGIN_HASH" > "$WORK_DIR/credentials"
+
+cat > "$WORK_DIR/config.json" <<CONF
+{
+	"port": $PORT,
+	"use_ssl": 0,
+	"db_home": "$WORK_DIR/db",
+	"document_root": "../public",
+	"jwt_secret": "$JWT_SECRET",
+	"login_credentials": "$WORK_DIR/credentials",
+	"worker_threads": 0,
+	"worker_queue_limit": 4096,
+	"login_threads": $LOGIN_THREADS,
+	"users_shards": $USERS_SHARDS
+}
+CONF
+mkdir -p "$WORK_DIR/db"
+
+NUM_USERS=10000
+if [ -f "$USERS_JSON" ]; then
+	./webapi-user --conf="$WORK_DIR/config.json" --import="$USERS_JSON" || exit 1
+	NUM_USERS=$(grep -o '"id"' "$USERS_JSON" | wc -l)
+fi
+
+./webapi-user --conf="$WORK_DIR/config.json" &
+SERVER_PID=$!
+for i in $(seq 50); do
+	curl -s -o /dev/null "http://127.0.0.1:$PORT/index.html" && break
+	sleep 0.1
+done
+
+run_mix() {
+	echo "=== $1 ==="
+	bench/load-gen --url="http://127.0.0.1:$PORT" --concurrency=$CONCURRENCY --duration=$DURATION \
+		--users=$NUM_USERS --jwt-secret="$JWT_SECRET" --mix="$2" $3 $LOAD_GEN_ARGS
+	echo
+}
+
+run_mix "mixed" "static:40,login:5,auth:10,users:30,search:15"
+run_mix "static assets" "static:1"
+run_mix "token auth" "auth:1"
+run_mix "user listing" "users:1"
+run_mix "index search" "search:1"
+run_mix "login" "login:1"
+# compare the static / users / search p99 with the "mixed" run: the logins are bounded to their own pool
+run_mix "login burst" "static:20,login:50,users:20,search:10"
+run_mix "mixed, no keep-alive" "static:40,login:5,auth:10,users:30,search:15" --no-keep-alive
+
+for shards in $DB_BENCH_SHARDS; do
+	echo "=== users_db, $shards shard(s) ==="
+	bench/db-bench --shards=$shards $DB_BENCH_ARGS
+done
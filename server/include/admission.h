@@ -0,0 +1,89 @@
+#ifndef WEBIX_DEMO_SERVER_ADMISSION_H_
+#define WEBIX_DEMO_SERVER_ADMISSION_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * admission: per-client rate limits and a global concurrency limit,
+ * checked before the route handlers run.
+ *
+ * Token buckets live in a fixed-size open-addressing table (no locks, no allocation after init):
+ * each slot is a 64-bit key (hash of the client address, and of the route for route buckets)
+ * and a 64-bit state (last refill time, tokens) updated with compare-and-swap.
+ * A full probe window recycles its least recently used slot, so a flood of new addresses
+ * only costs precision, never memory.
+ *
+ * Every request takes a token from its client's bucket ('ip_rate' / 'ip_burst'),
+ * and from its (client, route) bucket if the route has its own limit (e.g. /login).
+ * Rejections: 429 with the seconds until the next token in Retry-After,
+ * 503 with Retry-After: 1 when 'max_inflight' requests are already admitted.
+ */
+#define ADMISSION_MAX_ROUTES	(8)
+#define HTTP_STATUS_TOO_MANY_REQUESTS	(429)	// not in libsoup-2.4's SoupStatus
+#define HTTP_STATUS_SERVICE_UNAVAILABLE	(503)
+
+struct admission_route
+{
+	char path[64];	// prefix
+	double rate;	// tokens per second
+	double burst;
+};
+
+struct admission_stats
+{
+	uint64_t admitted;
+	uint64_t rejected_ip;	// 429, per-client bucket
+	uint64_t rejected_route;	// 429, per-route bucket
+	uint64_t rejected_busy;	// 503, concurrency limit
+	uint64_t recycled;	// slots taken over from other clients
+};
+
+typedef struct admission
+{
+	void * user_data;
+	void * priv;
+	
+	unsigned int num_slots;	// power of two
+	double ip_rate;	// 0: no per-client limit
+	double ip_burst;
+	long max_inflight;	// 0: unlimited
+	
+	int num_routes;
+	struct admission_route routes[ADMISSION_MAX_ROUTES];
+	
+	long inflight;	// atomic
+	struct admission_stats stats;	// atomic counters
+}admission_t;
+admission_t * admission_init(admission_t * adm, unsigned int num_slots, void * user_data);
+void admission_cleanup(admission_t * adm);
+
+/*
+ * ip_rate: requests per second per client (0: no limit), ip_burst: bucket size,
+ * max_inflight: admitted requests not yet finished (0: no limit)
+ */
+void admission_set_limits(admission_t * adm, double ip_rate, double ip_burst, long max_inflight);
+
+/*
+ * "path:rate:burst,..." e.g. "/login:1:5,/auth:5:20",
+ * returns the number of routes, or -1 on a syntax error
+ */
+int admission_set_routes(admission_t * adm, const char * spec);
+
+/*
+ * returns 0 if the request is admitted (if 'count_inflight', release it with admission_release()),
+ * or the http status to respond with, *p_retry_after: seconds
+ */
+unsigned int admission_check(admission_t * adm, const char * client_host, const char * path, int count_inflight, unsigned int * p_retry_after);
+void admission_release(admission_t * adm);
+
+void admission_get_stats(admission_t * adm, struct admission_stats * stats);
+void admission_append_metrics(admission_t * adm, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -8,6 +8,22 @@ extern "C" {
 #include <libsoup/soup.h>
 #include <json-c/json.h>
 #include <db.h>
+#include <uuid/uuid.h>
+
+#include "worker-pool.h"
+#include "file-cache.h"
+#include "asset-manifest.h"
+#include "jwt-cache.h"
+#include "credentials.h"
+#include "metrics.h"
+#include "db-replication.h"
+#include "db-maintenance.h"
+#include "bitmap.h"
+#include "change-feed.h"
+#include "admission.h"
+#include "write-batch.h"
+#include "server-timing.h"
+#include "request-arena.h"
 
 #ifndef json_get_value
 typedef char * string;
@@ -28,10 +44,78 @@ typedef struct http_server
 	char document_root[PATH_MAX];
 	unsigned int port;
 	SoupServer * server;
+	struct file_cache static_files[1];	// mmapped files under document_root
+	struct asset_manifest assets[1];	// fingerprinted assets (immutable), precompressed variants
+	struct jwt_cache jwt_cache[1];	// verified bearer tokens
+	struct credentials credentials[1];	// /login accounts
+	unsigned int token_ttl;	// seconds, tokens issued by /login
+	struct metrics metrics[1];	// per-route counters, served on /metrics
+	int metrics_remote;	// /metrics also answers non-loopback clients
+	struct admission admission[1];	// rate limits / concurrency limit, checked before the handlers
+	struct server_timing timing[1];	// Server-Timing header, sampled request spans (/debug/timings)
+	struct request_arena_pool arenas[1];	// chunks of the per-request arenas
+	SoupSession * master_session;	// replica: forwards writes to the replication master
 }http_server_t;
 http_server_t * http_server_init(http_server_t * http, void * user_data);
 void http_server_cleanup(http_server_t * http);
 
+/*
+ * the request's phase spans, NULL if server timing is disabled
+ */
+request_timing_t * http_server_get_timing(SoupMessage * msg);
+
+/*
+ * (main loop) the request's arena, created on first use.
+ * 'msg' drops its reference when it is finished, the tasks and the response buffers hold their own.
+ */
+request_arena_t * http_server_get_arena(http_server_t * http, SoupMessage * msg);
+
+/*
+ * replica: forwards the request to the replication master ("master_url") and relays the response.
+ * returns 0 if the message was paused (completed when the master answers),
+ * or -1 if there is no master to forward to (503 is set)
+ */
+int http_server_forward_to_master(http_server_t * http, SoupMessage * msg);
+
+/*
+ * http_task: runs the blocking part of a request on the worker pool.
+ * The message is paused while 'run' executes on a worker thread,
+ * 'run' must not touch 'msg', it only fills the response fields of the task.
+ * The response is applied to 'msg' on the main loop, then the message is unpaused.
+ */
+typedef struct http_task http_task_t;
+typedef void (* http_task_fn)(http_task_t * task);
+struct http_task
+{
+	http_server_t * http;
+	SoupMessage * msg;
+	int finished;	// the client has gone away (atomic: set on the main loop, read by the worker)
+	
+	http_task_fn run;
+	void * task_data;
+	GDestroyNotify free_data;
+	
+	// response
+	guint status;
+	const char * content_type;
+	GString * body;
+	
+	int chunked;	// stream 'body' with chunked encoding, see http_task_flush()
+	request_timing_t * timing;	// owned by 'msg', NULL if server timing is disabled
+	int64_t queued_us;
+	request_arena_t * arena;	// the request's arena (a reference held by the task)
+	void * priv;
+};
+int http_server_dispatch(http_server_t * http, SoupMessage * msg, http_task_fn run, void * task_data, GDestroyNotify free_data);
+// runs the task on 'pool' instead of app->workers (e.g. app->login_workers); 503 + Retry-After if it is saturated
+int http_server_dispatch_to(http_server_t * http, worker_pool_t * pool, SoupMessage * msg, http_task_fn run, void * task_data, GDestroyNotify free_data);
+
+/*
+ * (worker thread) sends the current content of task->body as a chunk (handed to libsoup without a copy, task->body is a new buffer),
+ * 'status' and 'content_type' must have been set before the first flush.
+ */
+void http_task_flush(http_task_t * task);
+
 typedef struct db_helpler
 {
 	void * user_data;
@@ -39,34 +123,311 @@ typedef struct db_helpler
 	
 	char db_home[PATH_MAX];
 	DB_ENV * env;
-	struct { // users_db with indexes
+	int defer_indexes;	// bulk load: do not associate the secondary indexes on open
+	int lazy_indexes;	// "lazy_indexes" in config.json: new / incomplete indexes are built in the background
+	int snapshot_reads;	// "snapshot_reads" in config.json: DB_MULTIVERSION databases, see db_helpler_begin_snapshot()
+	int run_recovery;	// open with DB_RECOVER (no other process may use the environment)
+	int skip_change_log;	// bulk load: no per-row change records (see db_helpler_append_change())
+	struct db_replication rep[1];	// "replication" in config.json, read-only databases on a replica
+	struct db_maintenance maint[1];	// checkpoints / log archival, startup timings
+	DB * meta_db;	// name ==> value, e.g. the on-disk format versions
+	DB * changes_db;	// change feed (DB_QUEUE): sequence number ==> struct db_change (db-changes.c)
+	int num_shards;	// "users_shards" in config.json, see struct db_users_shard
+	struct db_users_shard * shards;	// [num_shards]
+	struct { // users_db with indexes (the first shard)
 		DB * users_db;		// primary db, key ==> "user_uuid"
 		union
 		{
 			struct {
-				DB * user_emails_sdb;	// index db, sorted by email
+				// same order as enum db_user_field
 				DB * user_names_sdb;	// index db, sorted by username
+				DB * user_emails_sdb;	// index db, sorted by email
 				DB * user_phones_sdb;	// index db, sorted by phone number
+				DB * user_trigrams_sdb;	// index db, [field][trigram] ==> user_uuid, several keys per record
 				// ...
 			};
 			DB * users_sdbs[0];	// variable length
 		};
 	};
 
+	struct {	// membership bitmaps are keyed by a dense user number (db-members.c)
+		DB * user_nos_db;	// user number (u32, big-endian) ==> user_uuid
+		DB * user_nos_sdb;	// index db, user_uuid ==> user number
+	};
+	
 	struct {
-		DB * groups_db;
-		DB * group_users_db;
-		DB * users_group_sdb;
+		DB * groups_db;	// group id (u32, big-endian) ==> number of members (u32)
+		DB * group_users_db;	// [group id][high 16 bits of the user number] ==> bitmap container
+		DB * users_group_sdb;	// user_uuid ==> group ids (u32[])
 	};
 	
 	struct {
-		DB * roles_db;
-		DB * role_users_db;
-		DB * users_role_sdb;
+		DB * roles_db;	// role id ==> number of members
+		DB * role_users_db;	// [role id][high 16 bits] ==> bitmap container
+		DB * users_role_sdb;	// user_uuid ==> role ids
 	};
+	DB * live_users_db;	// [0][high 16 bits] ==> bitmap container of the users not deleted, [0] ==> their number
+	int batch_live_users;	// bulk load: db_helpler_put_user() leaves the live users to db_members_batch_add_user()
 }db_helpler_t;
 db_helpler_t * db_helpler_init(db_helpler_t * db, void * user_data);
 void db_helpler_cleanup(db_helpler_t * db);
+/*
+ * multi-process mode: releases the locks and aborts the transactions of dead processes.
+ * returns DB_RUNRECOVERY if the environment must be recovered (all processes restarted)
+ */
+int db_helpler_failchk(db_helpler_t * db);
+
+/*
+ * decoded users_db record, 
+ * the strings point into the db buffer and are only valid inside the visit callback
+ */
+struct db_user_record
+{
+	uuid_t uid;
+	const char * name;
+	const char * email;
+	const char * phone;
+};
+typedef int (* db_user_visit_fn)(const struct db_user_record * user, void * user_data); // return non-zero to stop
+
+/*
+ * snapshot reads: a DB_TXN_SNAPSHOT transaction sees the databases as of its start and takes no read locks,
+ * writers never wait for it (and it never waits for them).
+ * Until it ends, the pages updated meanwhile are kept as versions in the cache: keep it as short as the request.
+ * *p_txn is NULL (plain reads) without "snapshot_reads". Pass it as 'txn' to the query functions below.
+ */
+int db_helpler_begin_snapshot(db_helpler_t * db, DB_TXN ** p_txn);
+void db_helpler_end_snapshot(db_helpler_t * db, DB_TXN * txn);
+
+/*
+ * the number of users, cached for a few seconds (not read in a snapshot)
+ */
+long db_helpler_count_users(db_helpler_t * db);
+/*
+ * walks users_db with a cursor, starting at the 'start'-th record (0-based),
+ * sharded: the shards' cursors are merged in uuid order.
+ * returns the number of visited records, or -1 on error
+ */
+long db_helpler_list_users(db_helpler_t * db, DB_TXN * txn, long start, long count, db_user_visit_fn visit, void * user_data);
+
+/*
+ * search by the secondary indexes (user-names.sdb, user-emails.sdb, user-phones.sdb),
+ * and / or by membership: the bitmaps of the filtered roles / groups are combined first,
+ * then the matching users are read in user number order.
+ */
+enum db_user_field
+{
+	DB_USER_FIELD_NAME,
+	DB_USER_FIELD_EMAIL,
+	DB_USER_FIELD_PHONE,
+	DB_USER_FIELDS_COUNT
+};
+#define DB_USERS_SDBS_COUNT	(DB_USER_FIELDS_COUNT + 1)	// the field indexes, then user-trigrams.sdb
+
+/*
+ * sharding (db-shards.c): with "users_shards": N > 1, the users are split by a hash of the uuid across
+ * users.<i>.db (0 <= i < N), each with its own secondary indexes (user-names.<i>.sdb, ...).
+ * Reads and writes of one user go to its shard; the lists and searches scan every shard and merge the results
+ * (uuid order for the list, index order for the searches). The membership databases are not sharded.
+ * N is recorded in meta_db when the databases are created, changing it needs a new import.
+ */
+#define DB_USERS_MAX_SHARDS	(64)
+struct db_users_shard
+{
+	DB * users_db;
+	DB * sdbs[DB_USERS_SDBS_COUNT];	// same order as users_sdbs
+};
+int db_helpler_get_shard_index(const db_helpler_t * db, const uuid_t uid);
+struct db_users_shard * db_helpler_get_shard(db_helpler_t * db, const uuid_t uid);
+/*
+ * runs fn() for every shard in turn, in the caller's transaction (one snapshot for all the shards),
+ * with 'contexts' split in num_shards items of 'ctx_size' bytes. stops at the first error.
+ */
+typedef int (* db_shard_fn)(db_helpler_t * db, int shard, DB_TXN * txn, void * shard_ctx);
+int db_helpler_foreach_shard(db_helpler_t * db, DB_TXN * txn, db_shard_fn fn, void * contexts, size_t ctx_size);
+struct db_user_condition
+{
+	const char * prefix;	// value starts with 'prefix'
+	const char * lower;	// or: lower <= value < upper (either bound can be NULL)
+	const char * upper;
+};
+/*
+ * role / group membership (bitmap intersections, see db-members.c)
+ */
+enum db_member_kind
+{
+	DB_MEMBER_ROLE,
+	DB_MEMBER_GROUP,
+	DB_MEMBER_KINDS_COUNT
+};
+struct db_member_filter
+{
+	const uint32_t * all;	// member of every id (AND)
+	int num_all;
+	const uint32_t * any;	// member of at least one id (OR)
+	int num_any;
+	const uint32_t * none;	// member of none of the ids (ANDNOT)
+	int num_none;
+};
+struct db_user_query
+{
+	struct db_user_condition conds[DB_USER_FIELDS_COUNT];	// all conditions must match
+	struct db_member_filter members[DB_MEMBER_KINDS_COUNT];
+	long offset;
+	long limit;
+	long max_count;	// stop counting matches after 'max_count' (0: stop after the page)
+};
+/*
+ * without membership filters, the first field with a condition is scanned with DB_SET_RANGE on its index,
+ * the other conditions are checked on the record.
+ * returns the number of visited records, or -1 on error.
+ * *p_count: number of matches found (capped by max_count)
+ */
+long db_helpler_search_users(db_helpler_t * db, DB_TXN * txn, const struct db_user_query * query, db_user_visit_fn visit, void * user_data, long * p_count);
+int db_helpler_query_index(const struct db_user_query * query);	// the index scanned by db_helpler_search_users(), or -1
+
+/*
+ * reads one user, the strings of 'user' point into *p_buf (free() it after use).
+ * returns 0, DB_NOTFOUND, or a db error
+ */
+int db_helpler_get_user(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, struct db_user_record * user, void ** p_buf);
+
+/*
+ * substring search (db-text-index.c): user-trigrams.sdb maps every 3-byte window of
+ * each field (ASCII lowercased) to the users containing it, the duplicates (posting lists) are sorted by uuid.
+ * The posting lists of the query's trigrams are intersected (smallest first, seeking the others),
+ * the candidates are verified on the record and ranked:
+ * exact match, then prefix, then substring; name before email before phone; shorter values first.
+ */
+#define DB_TEXT_QUERY_MIN_LENGTH	(3)
+struct db_text_query
+{
+	const char * text;	// at least DB_TEXT_QUERY_MIN_LENGTH bytes
+	int field;	// a db_user_field, or -1: any field
+	long offset;
+	long limit;
+	long max_candidates;	// verified and ranked at most (0: default), bounds the work per query
+};
+/*
+ * returns the number of visited records, or -1 on error (e.g. 'text' is too short).
+ * *p_count: number of matches. *p_truncated: the intersection had more than max_candidates uuids,
+ * only the first ones (in uuid order) were verified and ranked: the count is a lower bound
+ * and the pages are not the best ranked of all the matches.
+ */
+long db_helpler_text_search(db_helpler_t * db, DB_TXN * txn, const struct db_text_query * query, db_user_visit_fn visit, void * user_data, 
+	long * p_count, int * p_truncated);
+int db_text_index_associate(DB * sdbp, const DBT * key, const DBT * value, DBT * skey);	// DB_DBT_MULTIPLE keys
+
+/*
+ * writes (or overwrites) one user record, 'txn' can be NULL (auto commit).
+ * the change (insert or update) is appended to changes_db in the same transaction
+ */
+int db_helpler_put_user(db_helpler_t * db, DB_TXN * txn, const struct db_user_record * user);
+/*
+ * deletes a user and its memberships. returns 0, DB_NOTFOUND, or a db error
+ */
+int db_helpler_delete_user(db_helpler_t * db, DB_TXN * txn, const uuid_t uid);
+
+/*
+ * change feed (db-changes.c): every write to users_db appends a record to changes_db,
+ * the sequence numbers (queue record numbers) are shared by all processes using the environment.
+ * DB_CHANGE_RESET tells readers to reload everything (e.g. after a bulk import).
+ */
+enum db_change_op
+{
+	DB_CHANGE_INSERT = 1,
+	DB_CHANGE_UPDATE,
+	DB_CHANGE_DELETE,
+	DB_CHANGE_RESET,
+};
+struct db_change
+{
+	uint32_t seq;
+	enum db_change_op op;
+	int64_t time_ms;	// CLOCK_REALTIME
+	uuid_t uid;
+};
+#define DB_CHANGE_RECORD_SIZE	(32)	// on-disk size
+typedef int (* db_change_visit_fn)(const struct db_change * change, void * user_data); // return non-zero to stop
+
+int db_helpler_append_change(db_helpler_t * db, DB_TXN * txn, enum db_change_op op, const uuid_t uid);
+/*
+ * first and last sequence numbers in changes_db (both 0 if it is empty)
+ */
+int db_helpler_get_changes_range(db_helpler_t * db, uint32_t * p_first, uint32_t * p_last);
+/*
+ * visits the changes from_seq <= seq <= to_seq, returns the number of visited changes or -1 on error
+ */
+long db_helpler_read_changes(db_helpler_t * db, uint32_t from_seq, uint32_t to_seq, db_change_visit_fn visit, void * user_data);
+/*
+ * removes the oldest changes, keeping the last 'retention' records (at most 'max_records' per call).
+ * returns the number of removed records, or -1 on error
+ */
+long db_helpler_trim_changes(db_helpler_t * db, uint32_t retention, long max_records);
+/*
+ * replaces the roles (or groups) of a user, updates the membership bitmaps.
+ * returns 0 on success
+ */
+int db_helpler_set_user_members(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, enum db_member_kind kind, const uint32_t * ids, int count);
+/*
+ * adds (or removes) the user to the live users, the starting set of the queries with only exclusions.
+ * called by db_helpler_put_user() / db_helpler_delete_user()
+ */
+int db_helpler_set_user_live(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, int live);
+/*
+ * loads the bitmap of user numbers of a role / group (ORed into 'members')
+ */
+int db_helpler_load_members(db_helpler_t * db, DB_TXN * txn, enum db_member_kind kind, uint32_t id, bitmap_t * members);
+int db_helpler_get_user_by_number(db_helpler_t * db, DB_TXN * txn, uint32_t user_no, uuid_t uid);
+/*
+ * evaluates the membership filters of a query into a bitmap of user numbers.
+ * returns 0 on success, 1 if the query has no membership filter, -1 on error
+ */
+int db_helpler_query_members(db_helpler_t * db, DB_TXN * txn, const struct db_user_query * query, bitmap_t * result);
+
+/*
+ * bulk load: memberships of new users are collected in memory,
+ * then merged into the bitmaps with one write per container (db_members_batch_flush(), once per transaction)
+ */
+typedef struct db_members_batch db_members_batch_t;
+db_members_batch_t * db_members_batch_new(db_helpler_t * db);
+int db_members_batch_add(db_members_batch_t * batch, DB_TXN * txn, const uuid_t uid, enum db_member_kind kind, const uint32_t * ids, int count);
+int db_members_batch_add_user(db_members_batch_t * batch, DB_TXN * txn, const uuid_t uid);	// to the live users
+int db_members_batch_flush(db_members_batch_t * batch, DB_TXN * txn);
+void db_members_batch_free(db_members_batch_t * batch);
+int db_members_fill_live_users(db_helpler_t * db);	// startup: once, from users_db (databases created before the live users)
+/*
+ * bulk load: rebuilds the deferred secondary indexes from users_db (one thread per index),
+ * then associates them. returns 0 on success
+ */
+int db_helpler_rebuild_indexes(db_helpler_t * db, int batch_size);
+
+/*
+ * startup: an index that is new (or whose build was interrupted) is associated without DB_CREATE,
+ * so users_db is served at once and the writes maintain the index, and is then built from users_db
+ * by a background thread per index (in the prefork supervisor for all the workers).
+ * Queries must not read an index before it is DB_INDEX_READY.
+ * With "lazy_indexes": 0, db_helpler_init() waits for the builds.
+ */
+enum db_index_state
+{
+	DB_INDEX_READY,
+	DB_INDEX_BUILDING,
+	DB_INDEX_FAILED,	// retried by the next start
+};
+enum db_index_state db_helpler_get_index_state(db_helpler_t * db, int index);	// index: a db_user_field, or DB_USER_FIELDS_COUNT (user-trigrams.sdb)
+const char * db_helpler_get_index_name(int index);
+
+/*
+ * appends the environment statistics (memp / lock / txn) in prometheus text format
+ */
+int db_helpler_append_metrics(db_helpler_t * db, GString * out);
+
+/*
+ * web api handlers (users-api.c), registered in http_server_init()
+ */
+void on_api_users(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+void on_ws_users(SoupServer * server, SoupWebsocketConnection * conn, const char * path, SoupClientContext * client, gpointer user_data);
 
 typedef struct app_context
 {
@@ -76,13 +437,40 @@ typedef struct app_context
 	
 	struct http_server http[1];
 	struct db_helpler db[1];
+	struct worker_pool workers[1];	// blocking db / crypto jobs
+	struct worker_pool login_workers[1];	// password hashing (/login), bounded apart from the other routes
+	struct change_feed changes[1];	// users_db changes pushed to /ws/users
+	struct write_batcher writes[1];	// group commit of the /api/users writes
 	
 	GMainLoop * loop;
 	int is_running;
+	
+	struct {	// --import: bulk load users.json into users_db, then exit
+		const char * file;
+		int batch_size;
+		int defer_indexes;
+	}import;
+	
+	struct {	// --processes: prefork mode (prefork.c)
+		int num_processes;	// 0: single process
+		int worker_id;	// -1 in the supervisor
+		int ready_fd;	// worker: written once the server is listening
+	}prefork;
 }app_context_t;
 app_context_t * app_context_init(app_context_t * app, int argc, char ** argv, void * user_data);
 void app_context_cleanup(app_context_t * app);
 
+int users_import(app_context_t * app);	// users-import.c
+int users_api_check_ws_handshake(app_context_t * app, SoupMessage * msg);	// users-api.c, 0: the /ws/users upgrade may proceed, otherwise the status is set
+
+/*
+ * prefork.c: runs the supervisor until SIGTERM / SIGINT,
+ * 'worker_main' runs in every forked worker and must call prefork_notify_ready() once listening.
+ */
+typedef int (* prefork_worker_fn)(app_context_t * app);
+int prefork_run(app_context_t * app, prefork_worker_fn worker_main);
+void prefork_notify_ready(app_context_t * app);
+
 #ifdef __cplusplus
 }
 #endif
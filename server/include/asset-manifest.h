@@ -0,0 +1,60 @@
+#ifndef WEBIX_DEMO_SERVER_ASSET_MANIFEST_H_
+#define WEBIX_DEMO_SERVER_ASSET_MANIFEST_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <limits.h>
+#include <stddef.h>
+#include "file-cache.h"
+
+/*
+ * asset_manifest: the fingerprinted assets built by tools/build-assets.sh.
+ *
+ * The manifest maps each asset to its content-hashed copy ("webix/codebase/webix.js" -> "assets/webix/codebase/webix.<hash>.js"),
+ * the precompressed variants (.gz / .br) sit next to the copies.
+ * A hashed url never changes content: it is served as immutable, index.html is rewritten to reference them,
+ * so a returning browser only revalidates index.html.
+ * Nothing is compressed by the server: a variant is only picked if it exists on disk.
+ * All functions must be called from the main loop.
+ */
+enum asset_encoding
+{
+	ASSET_ENCODING_GZIP = 1,
+	ASSET_ENCODING_BR = 2,
+};
+
+typedef struct asset_entry
+{
+	const char * path;	// hashed, relative to document_root, starts with '/'
+	const char * content_type;
+	int encodings;	// enum asset_encoding flags, variants found at startup
+}asset_entry_t;
+
+typedef struct asset_manifest
+{
+	void * user_data;
+	void * priv;
+	char document_root[PATH_MAX];
+	
+	size_t num_assets;
+	long num_rewrites;	// index.html (re)written with the hashed urls
+}asset_manifest_t;
+/*
+ * manifest_file: relative to document_root, a missing manifest leaves the assets unversioned (num_assets == 0)
+ */
+asset_manifest_t * asset_manifest_init(asset_manifest_t * manifest, const char * document_root, const char * manifest_file, void * user_data);
+void asset_manifest_cleanup(asset_manifest_t * manifest);
+
+const asset_entry_t * asset_manifest_find(asset_manifest_t * manifest, const char * path);	// by hashed path, NULL if not an asset
+
+/*
+ * returns 'index' (index.html from the file cache) with the asset references replaced by the hashed urls,
+ * and its etag. The result is kept until index.html changes, it stays valid until the next call.
+ */
+const char * asset_manifest_rewrite_index(asset_manifest_t * manifest, const file_cache_entry_t * index, size_t * p_length, const char ** p_etag);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,90 @@
+#ifndef WEBIX_DEMO_SERVER_BITMAP_H_
+#define WEBIX_DEMO_SERVER_BITMAP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * bitmap: compressed sets of 32-bit integers (roaring-style).
+ * Values are grouped by their high 16 bits into containers (sorted by key):
+ *   array container:  sorted uint16_t low bits, up to BITMAP_ARRAY_MAX values
+ *   bitset container: 65536 bits (1024 x uint64_t), for denser groups
+ * AND / OR / ANDNOT on two bitsets run on 256-bit vectors (gcc vector extensions,
+ * SSE2 by default, AVX2 with -mavx2).
+ * Not thread-safe.
+ */
+#define BITMAP_ARRAY_MAX	(4096)
+#define BITMAP_BITSET_WORDS	(1024)
+
+enum bitmap_container_type
+{
+	BITMAP_CONTAINER_ARRAY = 1,
+	BITMAP_CONTAINER_BITSET = 2,
+};
+
+typedef struct bitmap_container
+{
+	uint16_t key;	// high 16 bits
+	uint16_t type;
+	uint32_t cardinality;
+	uint32_t capacity;	// array: allocated values
+	union {
+		uint16_t * values;
+		uint64_t * words;	// 32-byte aligned
+	};
+}bitmap_container_t;
+void bitmap_container_cleanup(bitmap_container_t * container);
+
+typedef struct bitmap
+{
+	uint32_t num_containers;
+	uint32_t max_containers;
+	bitmap_container_t * containers;
+}bitmap_t;
+bitmap_t * bitmap_init(bitmap_t * bitmap);
+void bitmap_cleanup(bitmap_t * bitmap);
+void bitmap_clear(bitmap_t * bitmap);
+void bitmap_swap(bitmap_t * a, bitmap_t * b);
+
+int bitmap_add(bitmap_t * bitmap, uint32_t value);	// returns 1 if added, 0 if already set
+int bitmap_remove(bitmap_t * bitmap, uint32_t value);	// returns 1 if removed
+int bitmap_contains(const bitmap_t * bitmap, uint32_t value);
+void bitmap_add_range(bitmap_t * bitmap, uint32_t begin, uint32_t end);	// [begin, end)
+uint64_t bitmap_cardinality(const bitmap_t * bitmap);
+
+/*
+ * dst = a op b, 'dst' must be distinct from 'a' and 'b' (its content is replaced)
+ */
+void bitmap_and(bitmap_t * dst, const bitmap_t * a, const bitmap_t * b);
+void bitmap_or(bitmap_t * dst, const bitmap_t * a, const bitmap_t * b);
+void bitmap_andnot(bitmap_t * dst, const bitmap_t * a, const bitmap_t * b);
+
+/*
+ * visits the values in ascending order, after skipping the first 'offset' values.
+ * returns the number of visited values, stops when 'visit' returns non-zero
+ */
+typedef int (* bitmap_visit_fn)(uint32_t value, void * user_data);
+long bitmap_foreach(const bitmap_t * bitmap, uint64_t offset, bitmap_visit_fn visit, void * user_data);
+
+/*
+ * persistence: one record per container.
+ * format: [u8 type][u8 0][u16 0][u32 cardinality] + (u16 values | 1024 x u64 words), little-endian
+ */
+#define BITMAP_CONTAINER_MAX_SIZE	(8 + BITMAP_BITSET_WORDS * 8)
+ssize_t bitmap_container_serialize(const bitmap_container_t * container, void * buf, size_t size);
+int bitmap_container_deserialize(bitmap_container_t * container, uint16_t key, const void * data, size_t length);
+
+/*
+ * takes ownership of 'container' (moved, the source is reset),
+ * keys must be appended in ascending order. returns 0 on success
+ */
+int bitmap_append_container(bitmap_t * bitmap, bitmap_container_t * container);
+const bitmap_container_t * bitmap_find_container(const bitmap_t * bitmap, uint16_t key);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
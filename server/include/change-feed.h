@@ -0,0 +1,58 @@
+#ifndef WEBIX_DEMO_SERVER_CHANGE_FEED_H_
+#define WEBIX_DEMO_SERVER_CHANGE_FEED_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <time.h>
+#include <libsoup/soup.h>
+
+/*
+ * change_feed: pushes users_db changes to WebSocket clients (/ws/users).
+ * changes_db is polled (and trimmed) by a background thread, the changes are encoded there and handed to
+ * the main loop, which keeps the last 'max_events' in memory (encoded once, shared by all clients).
+ * 
+ * protocol (text frames, JSON):
+ *   server: {"type":"hello","seq":N}	the current sequence number
+ *           {"type":"changes","seq":N,"changes":[{"seq":..,"op":"insert|update|delete","id":..,"data":{..}},..]}
+ *           {"type":"reset","seq":N}	the client is too far behind (or the data was bulk loaded): reload the list
+ *   client: {"type":"ack","seq":N}	after applying a message
+ * A client resumes with /ws/users?since=N (the last applied seq).
+ * 
+ * flow control: at most 'window' changes are sent without an ack.
+ * Changes that arrive meanwhile are coalesced (only the last change per user is sent),
+ * a client that stays blocked for 'slow_timeout' seconds is disconnected.
+ */
+struct db_helpler;
+typedef struct change_feed
+{
+	void * user_data;
+	void * priv;
+	
+	unsigned int max_events;	// changes kept in memory for the clients
+	unsigned int window;	// changes sent and not acknowledged
+	unsigned int retention;	// records kept in changes_db (trimmed by the master)
+	unsigned int slow_timeout;	// seconds
+	unsigned int poll_interval;	// milliseconds
+	int trim;	// this process trims changes_db: a single one (prefork: the first worker), on the master
+	
+	uint32_t last_seq;
+	long num_clients;
+	long num_messages;
+	long num_resets;	// clients that had to reload
+	long num_dropped;	// slow clients disconnected
+}change_feed_t;
+change_feed_t * change_feed_init(change_feed_t * feed, struct db_helpler * db, void * user_data);
+void change_feed_cleanup(change_feed_t * feed);
+
+/*
+ * takes a reference on 'conn'. 'since' is the last sequence number the client has applied (0: none)
+ */
+void change_feed_add_client(change_feed_t * feed, SoupWebsocketConnection * conn, uint32_t since);
+void change_feed_append_metrics(change_feed_t * feed, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
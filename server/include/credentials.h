@@ -0,0 +1,38 @@
+#ifndef WEBIX_DEMO_SERVER_CREDENTIALS_H_
+#define WEBIX_DEMO_SERVER_CREDENTIALS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+
+/*
+ * credentials: the /login accounts, loaded once from a "username:hash" file (one per line, '#' comments),
+ * the hashes in crypt(3) format, e.g. yescrypt ("$y$...", mkpasswd -m yescrypt) or sha512-crypt ("$6$...").
+ *
+ * credentials_verify() hashes the password with the account's settings: tens of milliseconds of CPU
+ * (and memory for yescrypt) by design, it must run on the login worker pool.
+ * An unknown user is checked against the first account's hash, so it costs the same time.
+ */
+typedef struct credentials
+{
+	void * user_data;
+	void * priv;
+	
+	unsigned int num_users;
+	
+	uint64_t num_verified;	// atomic counters
+	uint64_t num_failed;
+}credentials_t;
+credentials_t * credentials_init(credentials_t * cred, const char * file, void * user_data);	// file: NULL or "" for no accounts
+void credentials_cleanup(credentials_t * cred);
+
+/*
+ * returns 0 if the password matches, -1 if not. thread-safe (the table is read-only after init).
+ */
+int credentials_verify(credentials_t * cred, const char * username, const char * password);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,78 @@
+#ifndef WEBIX_DEMO_SERVER_DB_MAINTENANCE_H_
+#define WEBIX_DEMO_SERVER_DB_MAINTENANCE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <db.h>
+#include <glib.h>
+#include <json-c/json.h>
+
+/*
+ * db_maintenance: checkpoints and log archival on a background thread.
+ *
+ * Recovery replays the log written since the last checkpoint, so restart time is bounded by
+ * 'checkpoint_kbytes' (log volume) and 'checkpoint_interval' (seconds, for a slow trickle of writes).
+ * After each checkpoint, the log files that are no longer needed are removed or moved to 'archive_dir'
+ * (keep them for catastrophic recovery / backups).
+ * db_maintenance_cleanup() stops the thread and checkpoints once more, so a clean restart has nothing to replay.
+ *
+ * config.json:
+ *   "db_checkpoint_interval": 60,	// seconds (default 60)
+ *   "db_checkpoint_kbytes": 8192,	// (default 8 MB)
+ *   "db_log_archive": "remove" | "move" | "keep",
+ *   "db_log_archive_dir": "db-archive"	// "move" only
+ */
+enum db_log_archive_mode
+{
+	DB_LOG_ARCHIVE_REMOVE,
+	DB_LOG_ARCHIVE_MOVE,
+	DB_LOG_ARCHIVE_KEEP,
+};
+
+typedef struct db_maintenance
+{
+	void * user_data;
+	void * priv;
+	
+	unsigned int checkpoint_interval;
+	unsigned int checkpoint_kbytes;
+	enum db_log_archive_mode archive_mode;
+	char archive_dir[PATH_MAX];
+	
+	// startup, measured by db_helpler_init()
+	int recovered;	// opened with DB_RECOVER
+	double open_seconds;	// DB_ENV->open(), including recovery
+	double startup_seconds;	// until the databases are open
+	
+	uint64_t num_checkpoints;
+	uint64_t num_archived;	// log files removed / moved
+	double last_checkpoint_seconds;	// duration
+	time_t last_checkpoint_time;
+}db_maintenance_t;
+db_maintenance_t * db_maintenance_init(db_maintenance_t * maint, json_object * jconfig, void * user_data);
+void db_maintenance_cleanup(db_maintenance_t * maint);	// stops the thread, then checkpoints (the environment must still be open)
+
+int db_maintenance_start(db_maintenance_t * maint, DB_ENV * env);	// after the databases are open
+/*
+ * checkpoints if enough log was written (or always with 'force'), then archives the unused log files.
+ * thread-safe
+ */
+int db_maintenance_run(db_maintenance_t * maint, DB_ENV * env, int force);
+void db_maintenance_append_metrics(db_maintenance_t * maint, DB_ENV * env, GString * out);
+
+// seconds since 'begin' (CLOCK_MONOTONIC): startup, checkpoint and bulk load timings
+static inline double elapsed_seconds(const struct timespec * begin)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - begin->tv_sec) + (double)(now.tv_nsec - begin->tv_nsec) / 1000000000.0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,65 @@
+#ifndef WEBIX_DEMO_SERVER_DB_REPLICATION_H_
+#define WEBIX_DEMO_SERVER_DB_REPLICATION_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <db.h>
+#include <glib.h>
+#include <json-c/json.h>
+
+/*
+ * db_replication: Berkeley DB Replication Manager, one master and read-only replicas.
+ * Every process has its own db_home. The master is fixed by configuration (no elections),
+ * replicas have priority 0 and forward writes to 'master_url'.
+ *
+ * config.json:
+ *   "replication": {
+ *       "role": "master" | "replica",
+ *       "local": "127.0.0.1:5001",
+ *       "sites": [ "127.0.0.1:5000" ],	// other sites to connect to (at least the master)
+ *       "ack_policy": "one" | "none" | "all" | "quorum",
+ *       "master_url": "http://127.0.0.1:8081",	// replicas only
+ *       "startup_timeout": 60	// seconds a replica waits for the initial sync
+ *   }
+ *
+ * Replica lag: the master writes a heartbeat (wall clock, ms) to meta.db every second,
+ * the lag is the age of the replicated heartbeat.
+ */
+typedef struct db_replication
+{
+	void * user_data;
+	void * priv;
+	
+	int is_master;
+	char local_host[256];
+	unsigned int local_port;
+	char master_url[256];
+	int ack_policy;
+	int startup_timeout;
+}db_replication_t;
+db_replication_t * db_replication_init(db_replication_t * rep, json_object * jconfig, void * user_data);
+void db_replication_cleanup(db_replication_t * rep);
+
+#define db_replication_is_enabled(rep) ((rep)->priv != NULL)
+#define db_replication_is_replica(rep) (db_replication_is_enabled(rep) && !(rep)->is_master)
+
+int db_replication_configure(db_replication_t * rep, DB_ENV * env);	// before DB_ENV->open()
+/*
+ * starts the replication manager (after DB_ENV->open()),
+ * a replica blocks until the initial sync with the master is done.
+ */
+int db_replication_start(db_replication_t * rep, DB_ENV * env);
+/*
+ * master: starts the heartbeat thread, writes to 'meta_db'
+ * replica: reads the lag from 'meta_db'
+ */
+int db_replication_attach(db_replication_t * rep, DB * meta_db);
+
+double db_replication_get_lag(db_replication_t * rep);	// seconds, -1 if unknown (or on the master)
+void db_replication_append_metrics(db_replication_t * rep, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
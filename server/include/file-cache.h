@@ -0,0 +1,59 @@
+#ifndef WEBIX_DEMO_SERVER_FILE_CACHE_H_
+#define WEBIX_DEMO_SERVER_FILE_CACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * file_cache: memory-mapped static files under document_root.
+ * Hot files are kept in a bounded LRU (keyed by path, revalidated by mtime/size),
+ * big files are mapped per request and unmapped when the response is sent.
+ * All functions must be called from the main loop.
+ */
+typedef struct file_cache_entry
+{
+	const char * path;	// relative to document_root, starts with '/'
+	const char * content_type;
+	const unsigned char * data;
+	size_t length;
+	time_t mtime;
+	char etag[64];
+	char last_modified[64];
+}file_cache_entry_t;
+
+typedef struct file_cache
+{
+	void * user_data;
+	void * priv;
+	char document_root[PATH_MAX];
+	
+	size_t max_entries;
+	size_t max_bytes;
+	size_t max_file_size;	// bigger files are not cached
+	
+	size_t num_entries;
+	size_t bytes_cached;
+	long num_hits;
+	long num_misses;
+	long num_evictions;
+}file_cache_t;
+file_cache_t * file_cache_init(file_cache_t * cache, const char * document_root, size_t max_entries, size_t max_bytes, void * user_data);
+void file_cache_cleanup(file_cache_t * cache);
+
+/*
+ * returns a referenced entry, or NULL if the file does not exist (or is outside document_root).
+ * release it with file_cache_entry_unref()
+ */
+const file_cache_entry_t * file_cache_get(file_cache_t * cache, const char * path);
+void file_cache_entry_ref(const file_cache_entry_t * entry);
+void file_cache_entry_unref(void * entry);	// GDestroyNotify compatible
+const char * file_cache_get_content_type(const char * path);	// by extension
+
+#ifdef __cplusplus
+}
+#endif
+#endif
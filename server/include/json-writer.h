@@ -0,0 +1,53 @@
+#ifndef WEBIX_DEMO_SERVER_JSON_WRITER_H_
+#define WEBIX_DEMO_SERVER_JSON_WRITER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * json_writer: streams JSON text into a GString, without building a json_object tree.
+ * Separators (',' / ':') are inserted automatically, strings are escaped while copied.
+ * 'out' can be replaced between two values (e.g. after http_task_flush()).
+ */
+#define JSON_WRITER_MAX_DEPTH	(64)
+typedef struct json_writer
+{
+	GString * out;
+	int depth;
+	int after_key;
+	uint64_t has_members;	// bit n: a value was written at depth n + 1
+}json_writer_t;
+json_writer_t * json_writer_init(json_writer_t * writer, GString * out);
+
+void json_writer_begin_object(json_writer_t * writer);
+void json_writer_end_object(json_writer_t * writer);
+void json_writer_begin_array(json_writer_t * writer);
+void json_writer_end_array(json_writer_t * writer);
+void json_writer_key(json_writer_t * writer, const char * key);
+
+void json_writer_string(json_writer_t * writer, const char * value);	// NULL: null
+void json_writer_string_len(json_writer_t * writer, const char * value, size_t length);
+void json_writer_int64(json_writer_t * writer, int64_t value);
+void json_writer_uint64(json_writer_t * writer, uint64_t value);
+void json_writer_double(json_writer_t * writer, double value);
+void json_writer_bool(json_writer_t * writer, int value);
+void json_writer_null(json_writer_t * writer);
+void json_writer_raw(json_writer_t * writer, const char * json, size_t length);	// an already encoded value
+
+// "key": value
+#define json_writer_add_string(writer, key, value)	do { json_writer_key(writer, key); json_writer_string(writer, value); } while(0)
+#define json_writer_add_int64(writer, key, value)	do { json_writer_key(writer, key); json_writer_int64(writer, value); } while(0)
+#define json_writer_add_bool(writer, key, value)	do { json_writer_key(writer, key); json_writer_bool(writer, value); } while(0)
+
+/*
+ * appends the quoted, escaped string
+ */
+void json_append_escaped(GString * out, const char * value, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,73 @@
+#ifndef WEBIX_DEMO_SERVER_JWT_CACHE_H_
+#define WEBIX_DEMO_SERVER_JWT_CACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * jwt_cache: verified tokens, so that jwt_decode() and the signature check
+ * only run once per token.
+ *
+ * The cache is split into shards (selected by a hash of the token string),
+ * each shard is a set-associative table protected by its own rwlock.
+ * A hit compares the full token, the hash is only used to find the slot.
+ * Entries expire with the token's 'exp' claim (or max_ttl if it has none).
+ */
+typedef struct jwt_claims
+{
+	char sub[64];
+	time_t iat;
+	time_t exp;
+	char * json;	// all claims (optional, see jwt_cache_verify())
+}jwt_claims_t;
+void jwt_claims_clear(jwt_claims_t * claims);
+
+struct jwt_cache_stats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t expired;
+	uint64_t failures;	// invalid tokens
+};
+
+typedef struct jwt_cache
+{
+	void * user_data;
+	void * priv;
+	
+	unsigned char * key;	// HMAC secret
+	size_t cb_key;
+	
+	unsigned int num_shards;
+	unsigned int max_entries;
+	time_t max_ttl;
+}jwt_cache_t;
+jwt_cache_t * jwt_cache_init(jwt_cache_t * cache, const char * secret, unsigned int max_entries, unsigned int num_shards, void * user_data);
+void jwt_cache_cleanup(jwt_cache_t * cache);
+
+/*
+ * returns 0 if the token is valid (from the cache, or decoded and verified),
+ * -1 if not. Only HS256 tokens are accepted, none at all without a secret.
+ * if 'claims' is not NULL, it receives a copy of the decoded claims,
+ * claims->json is only filled with JWT_CACHE_WITH_JSON.
+ * thread-safe.
+ */
+#define JWT_CACHE_WITH_JSON	(1)
+int jwt_cache_verify(jwt_cache_t * cache, const char * token, jwt_claims_t * claims, int flags);
+void jwt_cache_get_stats(jwt_cache_t * cache, struct jwt_cache_stats * stats);
+
+/*
+ * signs a new token (HS256, with 'sub', 'iat' and 'exp' = now + ttl),
+ * returns NULL on error, free() it. thread-safe.
+ */
+char * jwt_cache_issue(jwt_cache_t * cache, const char * sub, time_t ttl);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
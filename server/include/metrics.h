@@ -0,0 +1,50 @@
+#ifndef WEBIX_DEMO_SERVER_METRICS_H_
+#define WEBIX_DEMO_SERVER_METRICS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * metrics: per-route request counters and latency histograms.
+ *
+ * Every thread records into its own shard (no locks, relaxed atomic stores),
+ * the shards are merged when /metrics is scraped.
+ * Latencies (in microseconds) go to log-linear (HDR-style) buckets:
+ * 8 sub-buckets per power of two, i.e. about 12% relative precision.
+ */
+#define METRICS_MAX_ROUTES	(16)
+#define METRICS_SUB_BUCKETS	(8)
+#define METRICS_NUM_BUCKETS	(2 * METRICS_SUB_BUCKETS + 32 * METRICS_SUB_BUCKETS)
+
+typedef struct metrics
+{
+	void * user_data;
+	void * priv;
+	
+	int num_routes;
+	char routes[METRICS_MAX_ROUTES][64];
+}metrics_t;
+metrics_t * metrics_init(metrics_t * metrics, void * user_data);
+void metrics_cleanup(metrics_t * metrics);
+
+/*
+ * routes must be registered before the first request (main thread),
+ * returns the route id
+ */
+int metrics_register_route(metrics_t * metrics, const char * path);
+int metrics_find_route(metrics_t * metrics, const char * path);	// longest registered prefix
+
+void metrics_record_request(metrics_t * metrics, int route, unsigned int status, uint64_t latency_us);
+
+/*
+ * appends the request metrics in prometheus text format
+ */
+void metrics_render(metrics_t * metrics, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
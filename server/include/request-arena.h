@@ -0,0 +1,59 @@
+#ifndef WEBIX_DEMO_SERVER_REQUEST_ARENA_H_
+#define WEBIX_DEMO_SERVER_REQUEST_ARENA_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <libsoup/soup.h>
+
+/*
+ * request_arena: scratch memory of one request (query copies, decode buffers, response chunks),
+ * released in one step when the last reference is dropped.
+ *
+ * The memory comes in fixed-size chunks from a pool shared by all requests, freed chunks are
+ * kept (up to max_free_chunks) for the next requests instead of going back to malloc.
+ * An allocation larger than a chunk gets its own block, freed with the arena.
+ *
+ * Allocations are not thread-safe: a request allocates from one thread at a time
+ * (the handler on the main loop, then its task on a worker). ref / unref are.
+ * Memory handed to libsoup with request_arena_append() keeps the arena alive until libsoup drops it.
+ */
+typedef struct request_arena request_arena_t;
+
+typedef struct request_arena_pool
+{
+	void * user_data;
+	void * priv;
+	size_t chunk_size;
+	unsigned int max_free_chunks;
+	
+	uint64_t num_arenas;	// atomic counters
+	uint64_t num_chunk_mallocs;
+	uint64_t num_chunk_reuses;
+	uint64_t num_large_allocs;
+}request_arena_pool_t;
+request_arena_pool_t * request_arena_pool_init(request_arena_pool_t * pool, size_t chunk_size, unsigned int max_free_chunks, void * user_data);
+void request_arena_pool_cleanup(request_arena_pool_t * pool);	// arenas still referenced free their chunks when released
+unsigned int request_arena_pool_get_free_chunks(request_arena_pool_t * pool);
+
+request_arena_t * request_arena_new(request_arena_pool_t * pool);
+request_arena_t * request_arena_ref(request_arena_t * arena);
+void request_arena_unref(request_arena_t * arena);
+
+void * request_arena_alloc(request_arena_t * arena, size_t size);	// 16-byte aligned, never NULL
+void * request_arena_alloc0(request_arena_t * arena, size_t size);
+char * request_arena_strdup(request_arena_t * arena, const char * str);	// NULL if str is NULL
+char * request_arena_strndup(request_arena_t * arena, const char * str, size_t length);
+char * request_arena_printf(request_arena_t * arena, size_t * p_length, const char * fmt, ...) __attribute__((format(printf, 3, 4)));
+
+/*
+ * appends 'data' (allocated from 'arena') to 'body' without copying
+ */
+void request_arena_append(request_arena_t * arena, SoupMessageBody * body, const void * data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
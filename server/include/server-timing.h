@@ -0,0 +1,75 @@
+#ifndef WEBIX_DEMO_SERVER_SERVER_TIMING_H_
+#define WEBIX_DEMO_SERVER_SERVER_TIMING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+
+/*
+ * server_timing: per-request phase spans (monotonic microseconds),
+ * sent in a Server-Timing response header and sampled (1 request in 'sample_rate') into a ring buffer
+ * that /debug/timings dumps.
+ *
+ * A request_timing is attached to the SoupMessage at request-started only if one of them is enabled,
+ * otherwise every request_timing_*() call is a NULL check (no clock read).
+ * Spans are recorded by one thread at a time: the main loop, then the worker running the task,
+ * then the main loop again (ordered by the worker pool queue and the idle callbacks).
+ *
+ * Ring slots are claimed with an atomic counter and written under a per-slot sequence number (seqlock):
+ * writers never wait, the reader skips the slots being written.
+ */
+#define REQUEST_TIMING_MAX_SPANS	(12)
+
+struct request_span
+{
+	const char * name;	// static string, a Server-Timing metric name
+	int64_t dur_us;	// accumulated if the span is recorded several times
+};
+
+typedef struct request_timing
+{
+	int64_t start_us;	// request-started
+	int sampled;	// recorded into the ring when the request is finished
+	int num_spans;
+	struct request_span spans[REQUEST_TIMING_MAX_SPANS];
+}request_timing_t;
+
+static inline int64_t request_timing_now(const request_timing_t * timing)
+{
+	return timing ? g_get_monotonic_time() : 0;
+}
+void request_timing_add(request_timing_t * timing, const char * name, int64_t begin_us);	// from begin_us to now
+void request_timing_add_us(request_timing_t * timing, const char * name, int64_t dur_us);
+int64_t request_timing_get_us(const request_timing_t * timing, const char * name);	// 0 if not recorded
+
+typedef struct server_timing
+{
+	void * user_data;
+	void * priv;
+	
+	int emit_header;	// Server-Timing response header
+	unsigned int sample_rate;	// 1 request in N into the ring, 0: off
+	unsigned int ring_size;	// power of two
+	
+	uint64_t num_requests;	// atomic
+	uint64_t num_sampled;
+}server_timing_t;
+server_timing_t * server_timing_init(server_timing_t * st, int emit_header, unsigned int sample_rate, unsigned int ring_size, void * user_data);
+void server_timing_cleanup(server_timing_t * st);
+
+request_timing_t * server_timing_start(server_timing_t * st);	// NULL if disabled, g_free() it
+void server_timing_set_header(server_timing_t * st, const request_timing_t * timing, SoupMessageHeaders * headers);	// spans so far, and "total"
+void server_timing_record(server_timing_t * st, const request_timing_t * timing, const char * method, const char * path, unsigned int status);
+
+/*
+ * the sampled requests in json, newest first
+ */
+void server_timing_dump(server_timing_t * st, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
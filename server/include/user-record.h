@@ -0,0 +1,45 @@
+#ifndef WEBIX_DEMO_SERVER_USER_RECORD_H_
+#define WEBIX_DEMO_SERVER_USER_RECORD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * on-disk encoding of the users_db values (the uuid is the key).
+ *
+ * v1:  [version: u8 = 1] { [length: varint] [bytes] [0] } x USER_RECORD_FIELDS
+ *      fields in enum db_user_field order (name, email, phone),
+ *      strings keep their nul terminator, so they can be used in place.
+ * v0:  legacy fixed layout, char name[128], email[128], phone[32] (288 bytes),
+ *      still readable, rewritten to v1 by db_helpler_init().
+ */
+#define USER_RECORD_VERSION	(1)
+#define USER_RECORD_FIELDS	(3)
+#define USER_RECORD_V0_SIZE	(288)
+#define USER_RECORD_MAX_SIZE	(1 + USER_RECORD_FIELDS * (5 + 1024))
+#define USER_RECORD_FIELD_MAX	(1023)	// longer strings are truncated
+
+struct db_user_record;
+/*
+ * returns the encoded length, or -1 if 'size' is too small
+ */
+ssize_t user_record_encode(const struct db_user_record * user, unsigned char * buf, size_t size);
+/*
+ * fills name / email / phone (pointing into 'data'), not the uid.
+ * returns the record version, or -1 on error
+ */
+int user_record_decode(const void * data, size_t size, struct db_user_record * user);
+/*
+ * secondary-key extraction: locates one field without decoding the others.
+ * *p_value is nul-terminated, *p_length does not include the terminator
+ */
+int user_record_get_field(const void * data, size_t size, int field, const char ** p_value, size_t * p_length);
+int user_record_get_version(const void * data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,41 @@
+#ifndef WEBIX_DEMO_SERVER_WORKER_POOL_H_
+#define WEBIX_DEMO_SERVER_WORKER_POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * worker_pool: a fixed number of threads that run blocking work (db / crypto)
+ * off the GMainLoop.
+ * 'task' runs on a worker thread, 'on_complete' is dispatched back to the default main context.
+ */
+typedef void (* worker_task_fn)(void * task_data);
+typedef void (* worker_complete_fn)(void * task_data);
+
+typedef struct worker_pool
+{
+	void * user_data;
+	void * priv;
+	
+	char name[32];
+	int num_workers;
+	int max_queue;	// max pending tasks (queued + running + waiting for completion)
+	
+	long num_completed;
+	long num_rejected;
+}worker_pool_t;
+worker_pool_t * worker_pool_init(worker_pool_t * pool, const char * name, int num_workers, int max_queue, void * user_data);
+void worker_pool_cleanup(worker_pool_t * pool);
+
+/*
+ * returns 0 on success,
+ * or -1 if the pool is saturated (the caller should reject the request)
+ */
+int worker_pool_push(worker_pool_t * pool, worker_task_fn task, worker_complete_fn on_complete, void * task_data);
+long worker_pool_get_pending(worker_pool_t * pool);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,51 @@
+#ifndef WEBIX_DEMO_SERVER_WRITE_BATCH_H_
+#define WEBIX_DEMO_SERVER_WRITE_BATCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <db.h>
+#include <glib.h>
+
+/*
+ * write_batcher: group commit for users_db writes.
+ *
+ * Writers (worker threads) queue their mutation and block until it is durable.
+ * A committer thread takes up to 'max_batch' queued writes, waiting at most 'window_us'
+ * for more after the first one, and runs them in one transaction:
+ * each write in its own child transaction (a failed write is aborted alone),
+ * then a single commit, i.e. one log flush per batch.
+ * While a batch is being flushed, the next one fills up.
+ */
+struct db_helpler;
+typedef int (* write_batch_fn)(struct db_helpler * db, DB_TXN * txn, void * data);	// returns 0 or a db error
+
+typedef struct write_batcher
+{
+	void * user_data;
+	void * priv;
+	struct db_helpler * db;
+	
+	int max_batch;
+	unsigned int window_us;
+	
+	uint64_t num_batches;	// atomic counters
+	uint64_t num_writes;
+	uint64_t num_failed;
+	uint64_t num_retries;	// deadlocked child transactions
+}write_batcher_t;
+write_batcher_t * write_batcher_init(write_batcher_t * batcher, struct db_helpler * db, int max_batch, unsigned int window_us, void * user_data);
+void write_batcher_cleanup(write_batcher_t * batcher);
+
+/*
+ * runs 'write' in the next batch, returns once the batch is committed (durable):
+ * 0, the error returned by 'write', or the commit error (the whole batch failed)
+ */
+int write_batcher_submit(write_batcher_t * batcher, write_batch_fn write, void * data);
+void write_batcher_append_metrics(write_batcher_t * batcher, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,318 @@
+/*
+ * admission.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <glib.h>
+#include "admission.h"
+
+#define ADMISSION_DEFAULT_SLOTS	(65536)
+#define ADMISSION_PROBES	(8)	// slots searched before one is recycled
+
+/*
+ * bucket state: [refill time, ms since init: 40 bits][tokens, 1/256 units: 24 bits]
+ * 0 means a new bucket (full)
+ */
+#define TOKEN_BITS	(24)
+#define TOKEN_SCALE	(256.0)
+#define TOKEN_MAX	(((1 << TOKEN_BITS) - 1) / TOKEN_SCALE)
+
+struct admission_slot
+{
+	uint64_t key;	// 0: empty
+	uint64_t state;
+}__attribute__((aligned(16)));
+
+struct admission_private
+{
+	admission_t * adm;
+	unsigned int mask;
+	struct admission_slot * slots;
+	gint64 epoch_ms;
+};
+
+#define atomic_inc(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+
+static uint64_t hash_client(const char * host, int route)
+{
+	// FNV-1a, then a splitmix64 finalizer so that the low bits (the slot index) are well mixed
+	uint64_t hash = 14695981039346656037ULL;
+	for(const char * p = host; *p; ++p) {
+		hash ^= (unsigned char)*p;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= (uint64_t)(route + 1) * 0x9e3779b97f4a7c15ULL;
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash | 1;	// never 0 (empty slot)
+}
+
+static struct admission_slot * find_slot(struct admission_private * priv, uint64_t key)
+{
+	admission_t * adm = priv->adm;
+	struct admission_slot * victim = NULL;
+	uint64_t oldest = UINT64_MAX;
+	
+	for(unsigned int i = 0; i < ADMISSION_PROBES; ++i) {
+		struct admission_slot * slot = &priv->slots[(key + i) & priv->mask];
+		uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if(slot_key == key) return slot;
+		if(slot_key == 0) {
+			if(__atomic_compare_exchange_n(&slot->key, &slot_key, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return slot;
+			if(slot_key == key) return slot;	// claimed by another thread for the same client
+		}
+		
+		uint64_t refill_time = __atomic_load_n(&slot->state, __ATOMIC_RELAXED) >> TOKEN_BITS;
+		if(refill_time < oldest) {
+			oldest = refill_time;
+			victim = slot;
+		}
+	}
+	
+	// the probe window is full: take over the least recently refilled bucket.
+	// a request of the previous owner racing with this only sees a reset bucket.
+	uint64_t victim_key = __atomic_load_n(&victim->key, __ATOMIC_ACQUIRE);
+	if(!__atomic_compare_exchange_n(&victim->key, &victim_key, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if(victim_key != key) return NULL;	// lost the race, admit without this bucket
+		return victim;
+	}
+	__atomic_store_n(&victim->state, 0, __ATOMIC_RELEASE);
+	atomic_inc(&adm->stats.recycled);
+	return victim;
+}
+
+/*
+ * returns 1 if a token was taken, 0 if the bucket is empty (*p_wait: seconds until the next token)
+ */
+static int take_token(struct admission_slot * slot, double rate, double burst, uint64_t now_ms, double * p_wait)
+{
+	uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+	for(;;) {
+		double tokens = burst;
+		uint64_t last_ms = now_ms;
+		if(state) {
+			last_ms = state >> TOKEN_BITS;
+			tokens = (state & ((1 << TOKEN_BITS) - 1)) / TOKEN_SCALE;
+			if(now_ms > last_ms) {
+				tokens += (now_ms - last_ms) * rate / 1000.0;
+				last_ms = now_ms;
+			}
+			if(tokens > burst) tokens = burst;
+		}
+		
+		if(tokens < 1.0) {
+			*p_wait = (1.0 - tokens) / rate;
+			return 0;
+		}
+		tokens -= 1.0;
+		
+		uint64_t new_state = (last_ms << TOKEN_BITS) | (uint64_t)(tokens * TOKEN_SCALE);
+		if(__atomic_compare_exchange_n(&slot->state, &state, new_state, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return 1;
+	}
+}
+
+static int find_route(admission_t * adm, const char * path)
+{
+	for(int i = 0; i < adm->num_routes; ++i) {
+		size_t cb = strlen(adm->routes[i].path);
+		if(strncmp(path, adm->routes[i].path, cb) == 0 && (path[cb] == '\0' || path[cb] == '/')) return i;
+	}
+	return -1;
+}
+
+static unsigned int retry_after_seconds(double wait)
+{
+	if(wait > 3600) return 3600;
+	unsigned int seconds = (unsigned int)wait;
+	if(seconds < wait) ++seconds;	// round up
+	return seconds ? seconds : 1;
+}
+
+unsigned int admission_check(admission_t * adm, const char * client_host, const char * path, int count_inflight, unsigned int * p_retry_after)
+{
+	assert(adm && adm->priv);
+	struct admission_private * priv = adm->priv;
+	if(NULL == client_host) client_host = "";
+	
+	uint64_t now_ms = g_get_monotonic_time() / 1000 - priv->epoch_ms;
+	double wait = 0;
+	
+	if(adm->ip_rate > 0) {
+		struct admission_slot * slot = find_slot(priv, hash_client(client_host, -1));
+		if(slot && !take_token(slot, adm->ip_rate, adm->ip_burst, now_ms, &wait)) {
+			atomic_inc(&adm->stats.rejected_ip);
+			*p_retry_after = retry_after_seconds(wait);
+			return HTTP_STATUS_TOO_MANY_REQUESTS;
+		}
+	}
+	
+	int route = path ? find_route(adm, path) : -1;
+	if(route >= 0) {
+		const struct admission_route * limit = &adm->routes[route];
+		struct admission_slot * slot = find_slot(priv, hash_client(client_host, route));
+		if(slot && !take_token(slot, limit->rate, limit->burst, now_ms, &wait)) {
+			atomic_inc(&adm->stats.rejected_route);
+			*p_retry_after = retry_after_seconds(wait);
+			return HTTP_STATUS_TOO_MANY_REQUESTS;
+		}
+	}
+	
+	if(count_inflight) {
+		long inflight = __atomic_add_fetch(&adm->inflight, 1, __ATOMIC_ACQ_REL);
+		if(adm->max_inflight > 0 && inflight > adm->max_inflight) {
+			__atomic_sub_fetch(&adm->inflight, 1, __ATOMIC_ACQ_REL);
+			atomic_inc(&adm->stats.rejected_busy);
+			*p_retry_after = 1;
+			return HTTP_STATUS_SERVICE_UNAVAILABLE;
+		}
+	}
+	atomic_inc(&adm->stats.admitted);
+	return 0;
+}
+
+void admission_release(admission_t * adm)
+{
+	__atomic_sub_fetch(&adm->inflight, 1, __ATOMIC_ACQ_REL);
+}
+
+int admission_set_routes(admission_t * adm, const char * spec)
+{
+	adm->num_routes = 0;
+	if(NULL == spec) return 0;
+	
+	char * routes = strdup(spec);
+	assert(routes);
+	char * saveptr = NULL;
+	for(char * token = strtok_r(routes, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		if(adm->num_routes >= ADMISSION_MAX_ROUTES) break;
+		
+		struct admission_route * route = &adm->routes[adm->num_routes];
+		char * p_rate = strchr(token, ':');
+		char * p_burst = p_rate ? strchr(p_rate + 1, ':') : NULL;
+		if(NULL == p_burst || token[0] != '/' || (p_rate - token) >= sizeof(route->path)) {
+			free(routes);
+			adm->num_routes = 0;
+			return -1;
+		}
+		*p_rate++ = '\0';
+		*p_burst++ = '\0';
+		
+		memset(route, 0, sizeof(*route));
+		strncpy(route->path, token, sizeof(route->path) - 1);
+		route->rate = atof(p_rate);
+		route->burst = atof(p_burst);
+		if(route->rate <= 0) continue;	// no limit
+		if(route->burst < 1) route->burst = 1;
+		if(route->burst > TOKEN_MAX) route->burst = TOKEN_MAX;
+		++adm->num_routes;
+	}
+	free(routes);
+	return adm->num_routes;
+}
+
+void admission_set_limits(admission_t * adm, double ip_rate, double ip_burst, long max_inflight)
+{
+	if(ip_burst < 1) ip_burst = (ip_rate > 1) ? ip_rate : 1;
+	if(ip_burst > TOKEN_MAX) ip_burst = TOKEN_MAX;
+	adm->ip_rate = (ip_rate > 0) ? ip_rate : 0;
+	adm->ip_burst = ip_burst;
+	adm->max_inflight = (max_inflight > 0) ? max_inflight : 0;
+}
+
+admission_t * admission_init(admission_t * adm, unsigned int num_slots, void * user_data)
+{
+	if(NULL == adm) adm = calloc(1, sizeof(*adm));
+	assert(adm);
+	adm->user_data = user_data;
+	
+	if(0 == num_slots) num_slots = ADMISSION_DEFAULT_SLOTS;
+	unsigned int size = ADMISSION_PROBES;
+	while(size < num_slots) size <<= 1;
+	adm->num_slots = size;
+	
+	struct admission_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->adm = adm;
+	priv->mask = size - 1;
+	priv->slots = calloc(size, sizeof(*priv->slots));
+	assert(priv->slots);
+	priv->epoch_ms = g_get_monotonic_time() / 1000 - 1;	// now_ms is never 0
+	adm->priv = priv;
+	return adm;
+}
+
+void admission_cleanup(admission_t * adm)
+{
+	if(NULL == adm || NULL == adm->priv) return;
+	struct admission_private * priv = adm->priv;
+	adm->priv = NULL;
+	
+	free(priv->slots);
+	free(priv);
+	return;
+}
+
+void admission_get_stats(admission_t * adm, struct admission_stats * stats)
+{
+	stats->admitted       = __atomic_load_n(&adm->stats.admitted, __ATOMIC_RELAXED);
+	stats->rejected_ip    = __atomic_load_n(&adm->stats.rejected_ip, __ATOMIC_RELAXED);
+	stats->rejected_route = __atomic_load_n(&adm->stats.rejected_route, __ATOMIC_RELAXED);
+	stats->rejected_busy  = __atomic_load_n(&adm->stats.rejected_busy, __ATOMIC_RELAXED);
+	stats->recycled       = __atomic_load_n(&adm->stats.recycled, __ATOMIC_RELAXED);
+}
+
+void admission_append_metrics(admission_t * adm, GString * out)
+{
+	struct admission_stats stats[1];
+	memset(stats, 0, sizeof(stats));
+	admission_get_stats(adm, stats);
+	g_string_append_printf(out,
+		"# HELP webapi_admission_inflight Requests admitted and not finished.\n"
+		"# TYPE webapi_admission_inflight gauge\n"
+		"webapi_admission_inflight %ld\n"
+		"# HELP webapi_admission_admitted_total Requests that passed the admission checks.\n"
+		"# TYPE webapi_admission_admitted_total counter\n"
+		"webapi_admission_admitted_total %lu\n"
+		"# HELP webapi_admission_rejected_total Requests rejected before the route handler.\n"
+		"# TYPE webapi_admission_rejected_total counter\n"
+		"webapi_admission_rejected_total{reason=\"ip_rate\"} %lu\n"
+		"webapi_admission_rejected_total{reason=\"route_rate\"} %lu\n"
+		"webapi_admission_rejected_total{reason=\"concurrency\"} %lu\n"
+		"# HELP webapi_admission_recycled_total Rate limit slots taken over from other clients (the table is full).\n"
+		"# TYPE webapi_admission_recycled_total counter\n"
+		"webapi_admission_recycled_total %lu\n",
+		__atomic_load_n(&adm->inflight, __ATOMIC_RELAXED),
+		(unsigned long)stats->admitted, (unsigned long)stats->rejected_ip, (unsigned long)stats->rejected_route,
+		(unsigned long)stats->rejected_busy, (unsigned long)stats->recycled);
+}
@@ -0,0 +1,222 @@
+/*
+ * asset-manifest.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/stat.h>
+#include <glib.h>
+#include <json-c/json.h>
+
+#include "asset-manifest.h"
+
+struct asset_item
+{
+	asset_entry_t base;
+	char * source;	// unversioned path, as referenced by index.html (no leading '/')
+	char * hashed;	// same, hashed
+};
+
+struct asset_manifest_private
+{
+	GHashTable * assets;	// '/' + hashed path -> struct asset_item
+	GPtrArray * items;
+	char tag[32];	// manifest version, part of the index etag
+	
+	char * index_html;	// rewritten
+	size_t cb_index;
+	char index_source_etag[64];	// etag of the index.html it was rewritten from
+	char index_etag[128];
+};
+
+static void asset_item_free(void * data)
+{
+	struct asset_item * item = data;
+	if(NULL == item) return;
+	free((char *)item->base.path);
+	free(item->source);
+	free(item->hashed);
+	free(item);
+}
+
+static int file_exists(const char * document_root, const char * path, const char * suffix)
+{
+	char full_path[PATH_MAX] = "";
+	struct stat st[1];
+	int cb = snprintf(full_path, sizeof(full_path), "%s%s%s", document_root, path, suffix);
+	if(cb <= 0 || cb >= sizeof(full_path)) return 0;
+	return (0 == stat(full_path, st) && S_ISREG(st->st_mode));
+}
+
+static int load_manifest(asset_manifest_t * manifest, const char * file)
+{
+	struct asset_manifest_private * priv = manifest->priv;
+	char manifest_path[PATH_MAX] = "";
+	if(file[0] == '/') strncpy(manifest_path, file, sizeof(manifest_path) - 1);
+	else snprintf(manifest_path, sizeof(manifest_path), "%s/%s", manifest->document_root, file);
+	
+	struct stat st[1];
+	if(stat(manifest_path, st)) {
+		fprintf(stderr, "no asset manifest (%s), the assets are served unversioned (make assets)\n", manifest_path);
+		return 0;
+	}
+	snprintf(priv->tag, sizeof(priv->tag), "%lx-%lx", (long)st->st_size, (long)st->st_mtime);
+	
+	json_object * jmanifest = json_object_from_file(manifest_path);
+	if(NULL == jmanifest || !json_object_is_type(jmanifest, json_type_object)) {
+		fprintf(stderr, "invalid asset manifest: %s\n", manifest_path);
+		if(jmanifest) json_object_put(jmanifest);
+		return -1;
+	}
+	
+	json_object_object_foreach(jmanifest, source, jhashed) {
+		const char * hashed = json_object_get_string(jhashed);
+		if(NULL == hashed || !hashed[0] || !source[0]) continue;
+		
+		struct asset_item * item = calloc(1, sizeof(*item));
+		assert(item);
+		item->source = strdup(source);
+		item->hashed = strdup(hashed);
+		
+		char * path = NULL;
+		int cb = asprintf(&path, "/%s", hashed);
+		assert(cb > 0 && path);
+		item->base.path = path;
+		item->base.content_type = file_cache_get_content_type(path);
+		if(!file_exists(manifest->document_root, path, "")) {
+			fprintf(stderr, "asset manifest: %s is missing\n", path);
+			asset_item_free(item);
+			continue;
+		}
+		if(file_exists(manifest->document_root, path, ".gz")) item->base.encodings |= ASSET_ENCODING_GZIP;
+		if(file_exists(manifest->document_root, path, ".br")) item->base.encodings |= ASSET_ENCODING_BR;
+		
+		g_ptr_array_add(priv->items, item);
+		g_hash_table_replace(priv->assets, (char *)item->base.path, item);
+	}
+	json_object_put(jmanifest);
+	
+	manifest->num_assets = priv->items->len;
+	fprintf(stderr, "asset manifest: %lu assets\n", (unsigned long)manifest->num_assets);
+	return 0;
+}
+
+const asset_entry_t * asset_manifest_find(asset_manifest_t * manifest, const char * path)
+{
+	struct asset_manifest_private * priv = manifest->priv;
+	if(NULL == priv || 0 == manifest->num_assets || NULL == path) return NULL;
+	return g_hash_table_lookup(priv->assets, path);
+}
+
+static void replace_quoted(GString * html, const char * from, const char * to)
+{
+	// only whole attribute values: "from" or 'from'
+	static const char quotes[] = { '"', '\'' };
+	size_t cb_from = strlen(from);
+	size_t cb_to = strlen(to);
+	for(int i = 0; i < sizeof(quotes); ++i) {
+		size_t pos = 0;
+		while(pos < html->len) {
+			char * p = strstr(html->str + pos, from);
+			if(NULL == p) break;
+			pos = p - html->str;
+			if(pos > 0 && html->str[pos - 1] == quotes[i] && html->str[pos + cb_from] == quotes[i]) {
+				g_string_erase(html, pos, cb_from);
+				g_string_insert_len(html, pos, to, cb_to);
+				pos += cb_to;
+			}else {
+				pos += cb_from;
+			}
+		}
+	}
+}
+
+const char * asset_manifest_rewrite_index(asset_manifest_t * manifest, const file_cache_entry_t * index, size_t * p_length, const char ** p_etag)
+{
+	struct asset_manifest_private * priv = manifest->priv;
+	if(NULL == priv || 0 == manifest->num_assets || NULL == index) return NULL;
+	
+	if(NULL == priv->index_html || strcmp(priv->index_source_etag, index->etag) != 0) {
+		GString * html = g_string_new_len((const char *)index->data, index->length);
+		for(guint i = 0; i < priv->items->len; ++i) {
+			struct asset_item * item = g_ptr_array_index(priv->items, i);
+			replace_quoted(html, item->source, item->hashed);
+		}
+		
+		g_free(priv->index_html);
+		priv->cb_index = html->len;
+		priv->index_html = g_string_free(html, FALSE);
+		strncpy(priv->index_source_etag, index->etag, sizeof(priv->index_source_etag) - 1);
+		
+		// "<size>-<mtime>" of index.html and of the manifest
+		size_t cb_etag = strlen(index->etag);
+		snprintf(priv->index_etag, sizeof(priv->index_etag), "%.*s-%s\"", (int)(cb_etag > 0 ? cb_etag - 1 : 0), index->etag, priv->tag);
+		++manifest->num_rewrites;
+	}
+	
+	if(p_length) *p_length = priv->cb_index;
+	if(p_etag) *p_etag = priv->index_etag;
+	return priv->index_html;
+}
+
+asset_manifest_t * asset_manifest_init(asset_manifest_t * manifest, const char * document_root, const char * manifest_file, void * user_data)
+{
+	if(NULL == manifest) manifest = calloc(1, sizeof(*manifest));
+	assert(manifest);
+	manifest->user_data = user_data;
+	strncpy(manifest->document_root, document_root, sizeof(manifest->document_root) - 1);
+	
+	struct asset_manifest_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->assets = g_hash_table_new(g_str_hash, g_str_equal);
+	priv->items = g_ptr_array_new_with_free_func(asset_item_free);
+	manifest->priv = priv;
+	
+	if(!manifest->document_root[0]) return manifest; // static files are not served
+	if(NULL == manifest_file || !manifest_file[0]) manifest_file = "assets/manifest.json";
+	if(load_manifest(manifest, manifest_file)) {
+		asset_manifest_cleanup(manifest);
+		return NULL;
+	}
+	return manifest;
+}
+
+void asset_manifest_cleanup(asset_manifest_t * manifest)
+{
+	if(NULL == manifest || NULL == manifest->priv) return;
+	struct asset_manifest_private * priv = manifest->priv;
+	manifest->priv = NULL;
+	
+	g_hash_table_destroy(priv->assets);
+	g_ptr_array_free(priv->items, TRUE);
+	g_free(priv->index_html);
+	free(priv);
+	manifest->num_assets = 0;
+}
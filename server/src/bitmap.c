@@ -0,0 +1,603 @@
+/*
+ * bitmap.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <endian.h>
+#include "bitmap.h"
+
+typedef uint64_t bitmap_vec_t __attribute__((vector_size(32)));
+#define BITMAP_VEC_WORDS	(sizeof(bitmap_vec_t) / sizeof(uint64_t))
+
+/**********************************************
+ * containers
+**********************************************/
+static uint64_t * bitset_new(void)
+{
+	uint64_t * words = aligned_alloc(sizeof(bitmap_vec_t), BITMAP_BITSET_WORDS * sizeof(uint64_t));
+	assert(words);
+	return words;
+}
+
+static void array_reserve(bitmap_container_t * container, uint32_t size)
+{
+	if(size <= container->capacity) return;
+	uint32_t capacity = container->capacity ? container->capacity : 16;
+	while(capacity < size) capacity *= 2;
+	if(capacity > BITMAP_ARRAY_MAX) capacity = BITMAP_ARRAY_MAX;
+	
+	uint16_t * values = realloc(container->values, capacity * sizeof(*values));
+	assert(values);
+	container->values = values;
+	container->capacity = capacity;
+}
+
+void bitmap_container_cleanup(bitmap_container_t * container)
+{
+	if(NULL == container) return;
+	free(container->words);	// same pointer for both types
+	memset(container, 0, sizeof(*container));
+}
+
+static void container_init_array(bitmap_container_t * container, uint16_t key, uint32_t capacity)
+{
+	memset(container, 0, sizeof(*container));
+	container->key = key;
+	container->type = BITMAP_CONTAINER_ARRAY;
+	array_reserve(container, capacity ? capacity : 1);
+}
+
+static void container_init_bitset(bitmap_container_t * container, uint16_t key)
+{
+	memset(container, 0, sizeof(*container));
+	container->key = key;
+	container->type = BITMAP_CONTAINER_BITSET;
+	container->words = bitset_new();
+	memset(container->words, 0, BITMAP_BITSET_WORDS * sizeof(uint64_t));
+}
+
+static uint32_t bitset_count(const uint64_t * words)
+{
+	uint32_t count = 0;
+	for(int i = 0; i < BITMAP_BITSET_WORDS; ++i) count += __builtin_popcountll(words[i]);
+	return count;
+}
+
+static void array_to_bitset(bitmap_container_t * container)
+{
+	uint64_t * words = bitset_new();
+	memset(words, 0, BITMAP_BITSET_WORDS * sizeof(uint64_t));
+	for(uint32_t i = 0; i < container->cardinality; ++i) {
+		uint16_t v = container->values[i];
+		words[v >> 6] |= 1ULL << (v & 63);
+	}
+	free(container->values);
+	container->words = words;
+	container->type = BITMAP_CONTAINER_BITSET;
+	container->capacity = 0;
+}
+
+static void bitset_to_array(bitmap_container_t * container)
+{
+	uint64_t * words = container->words;
+	uint16_t * values = malloc((container->cardinality ? container->cardinality : 1) * sizeof(*values));
+	assert(values);
+	
+	uint32_t n = 0;
+	for(int i = 0; i < BITMAP_BITSET_WORDS; ++i) {
+		uint64_t w = words[i];
+		while(w) {
+			values[n++] = (uint16_t)(i * 64 + __builtin_ctzll(w));
+			w &= w - 1;
+		}
+	}
+	assert(n == container->cardinality);
+	free(words);
+	container->values = values;
+	container->capacity = container->cardinality ? container->cardinality : 1;
+	container->type = BITMAP_CONTAINER_ARRAY;
+}
+
+// keeps the representation that matches the cardinality
+static void container_normalize(bitmap_container_t * container)
+{
+	if(container->type == BITMAP_CONTAINER_BITSET && container->cardinality <= BITMAP_ARRAY_MAX) bitset_to_array(container);
+	else if(container->type == BITMAP_CONTAINER_ARRAY && container->cardinality > BITMAP_ARRAY_MAX) array_to_bitset(container);
+}
+
+static int array_find(const uint16_t * values, uint32_t count, uint16_t v)	// index, or -(insert position) - 1
+{
+	int lo = 0, hi = (int)count - 1;
+	while(lo <= hi) {
+		int mid = (lo + hi) >> 1;
+		if(values[mid] < v) lo = mid + 1;
+		else if(values[mid] > v) hi = mid - 1;
+		else return mid;
+	}
+	return -(lo + 1);
+}
+
+static int container_add(bitmap_container_t * container, uint16_t v)
+{
+	if(container->type == BITMAP_CONTAINER_BITSET) {
+		uint64_t mask = 1ULL << (v & 63);
+		if(container->words[v >> 6] & mask) return 0;
+		container->words[v >> 6] |= mask;
+		++container->cardinality;
+		return 1;
+	}
+	
+	int index = array_find(container->values, container->cardinality, v);
+	if(index >= 0) return 0;
+	if(container->cardinality >= BITMAP_ARRAY_MAX) {
+		array_to_bitset(container);
+		return container_add(container, v);
+	}
+	
+	index = -index - 1;
+	array_reserve(container, container->cardinality + 1);
+	memmove(&container->values[index + 1], &container->values[index], (container->cardinality - index) * sizeof(uint16_t));
+	container->values[index] = v;
+	++container->cardinality;
+	return 1;
+}
+
+static int container_remove(bitmap_container_t * container, uint16_t v)
+{
+	if(container->type == BITMAP_CONTAINER_BITSET) {
+		uint64_t mask = 1ULL << (v & 63);
+		if(0 == (container->words[v >> 6] & mask)) return 0;
+		container->words[v >> 6] &= ~mask;
+		--container->cardinality;
+		container_normalize(container);
+		return 1;
+	}
+	
+	int index = array_find(container->values, container->cardinality, v);
+	if(index < 0) return 0;
+	memmove(&container->values[index], &container->values[index + 1], (container->cardinality - index - 1) * sizeof(uint16_t));
+	--container->cardinality;
+	return 1;
+}
+
+static int container_contains(const bitmap_container_t * container, uint16_t v)
+{
+	if(container->type == BITMAP_CONTAINER_BITSET) return (container->words[v >> 6] >> (v & 63)) & 1;
+	return array_find(container->values, container->cardinality, v) >= 0;
+}
+
+/**********************************************
+ * bitmap
+**********************************************/
+bitmap_t * bitmap_init(bitmap_t * bitmap)
+{
+	if(NULL == bitmap) bitmap = calloc(1, sizeof(*bitmap));
+	assert(bitmap);
+	memset(bitmap, 0, sizeof(*bitmap));
+	return bitmap;
+}
+
+void bitmap_clear(bitmap_t * bitmap)
+{
+	for(uint32_t i = 0; i < bitmap->num_containers; ++i) bitmap_container_cleanup(&bitmap->containers[i]);
+	bitmap->num_containers = 0;
+}
+
+void bitmap_cleanup(bitmap_t * bitmap)
+{
+	if(NULL == bitmap) return;
+	bitmap_clear(bitmap);
+	free(bitmap->containers);
+	bitmap->containers = NULL;
+	bitmap->max_containers = 0;
+}
+
+void bitmap_swap(bitmap_t * a, bitmap_t * b)
+{
+	bitmap_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static int find_container_index(const bitmap_t * bitmap, uint16_t key)	// index, or -(insert position) - 1
+{
+	int lo = 0, hi = (int)bitmap->num_containers - 1;
+	while(lo <= hi) {
+		int mid = (lo + hi) >> 1;
+		uint16_t k = bitmap->containers[mid].key;
+		if(k < key) lo = mid + 1;
+		else if(k > key) hi = mid - 1;
+		else return mid;
+	}
+	return -(lo + 1);
+}
+
+static bitmap_container_t * insert_container(bitmap_t * bitmap, int index)
+{
+	if(bitmap->num_containers >= bitmap->max_containers) {
+		uint32_t new_size = bitmap->max_containers ? bitmap->max_containers * 2 : 8;
+		bitmap_container_t * containers = realloc(bitmap->containers, new_size * sizeof(*containers));
+		assert(containers);
+		bitmap->containers = containers;
+		bitmap->max_containers = new_size;
+	}
+	memmove(&bitmap->containers[index + 1], &bitmap->containers[index], (bitmap->num_containers - index) * sizeof(bitmap_container_t));
+	++bitmap->num_containers;
+	return &bitmap->containers[index];
+}
+
+static void erase_container(bitmap_t * bitmap, int index)
+{
+	bitmap_container_cleanup(&bitmap->containers[index]);
+	memmove(&bitmap->containers[index], &bitmap->containers[index + 1], (bitmap->num_containers - index - 1) * sizeof(bitmap_container_t));
+	--bitmap->num_containers;
+}
+
+const bitmap_container_t * bitmap_find_container(const bitmap_t * bitmap, uint16_t key)
+{
+	int index = find_container_index(bitmap, key);
+	return (index >= 0) ? &bitmap->containers[index] : NULL;
+}
+
+int bitmap_append_container(bitmap_t * bitmap, bitmap_container_t * container)
+{
+	if(bitmap->num_containers > 0 && bitmap->containers[bitmap->num_containers - 1].key >= container->key) return -1;
+	if(0 == container->cardinality) {
+		bitmap_container_cleanup(container);
+		return 0;
+	}
+	bitmap_container_t * dst = insert_container(bitmap, bitmap->num_containers);
+	*dst = *container;
+	memset(container, 0, sizeof(*container));
+	return 0;
+}
+
+int bitmap_add(bitmap_t * bitmap, uint32_t value)
+{
+	uint16_t key = value >> 16;
+	int index = find_container_index(bitmap, key);
+	if(index < 0) {
+		index = -index - 1;
+		container_init_array(insert_container(bitmap, index), key, 1);
+	}
+	return container_add(&bitmap->containers[index], value & 0xffff);
+}
+
+int bitmap_remove(bitmap_t * bitmap, uint32_t value)
+{
+	int index = find_container_index(bitmap, value >> 16);
+	if(index < 0) return 0;
+	
+	bitmap_container_t * container = &bitmap->containers[index];
+	int ok = container_remove(container, value & 0xffff);
+	if(ok && 0 == container->cardinality) erase_container(bitmap, index);
+	return ok;
+}
+
+int bitmap_contains(const bitmap_t * bitmap, uint32_t value)
+{
+	const bitmap_container_t * container = bitmap_find_container(bitmap, value >> 16);
+	return container ? container_contains(container, value & 0xffff) : 0;
+}
+
+void bitmap_add_range(bitmap_t * bitmap, uint32_t begin, uint32_t end)
+{
+	while(begin < end) {
+		uint16_t key = begin >> 16;
+		uint32_t container_end = ((uint32_t)key + 1) << 16;
+		if(container_end == 0 || container_end > end) container_end = end;	// (wraps for key 0xffff)
+		
+		int index = find_container_index(bitmap, key);
+		if(index < 0) {
+			index = -index - 1;
+			container_init_bitset(insert_container(bitmap, index), key);
+		}
+		bitmap_container_t * container = &bitmap->containers[index];
+		if(container->type == BITMAP_CONTAINER_ARRAY) array_to_bitset(container);
+		
+		for(uint32_t v = begin & 0xffff; v < ((container_end - 1) & 0xffff) + 1; ++v) {
+			container->words[v >> 6] |= 1ULL << (v & 63);
+		}
+		container->cardinality = bitset_count(container->words);
+		container_normalize(container);
+		
+		if(container_end <= begin) break;
+		begin = container_end;
+	}
+}
+
+uint64_t bitmap_cardinality(const bitmap_t * bitmap)
+{
+	uint64_t count = 0;
+	for(uint32_t i = 0; i < bitmap->num_containers; ++i) count += bitmap->containers[i].cardinality;
+	return count;
+}
+
+/**********************************************
+ * set operations
+**********************************************/
+enum bitmap_op { BITMAP_OP_AND, BITMAP_OP_OR, BITMAP_OP_ANDNOT };
+
+// 256-bit lanes, the compiler emits SSE2 / AVX2 instructions
+static uint32_t bitset_op(uint64_t * dst, const uint64_t * a, const uint64_t * b, enum bitmap_op op)
+{
+	bitmap_vec_t * vd = (bitmap_vec_t *)dst;
+	const bitmap_vec_t * va = (const bitmap_vec_t *)a;
+	const bitmap_vec_t * vb = (const bitmap_vec_t *)b;
+	const int num_vecs = BITMAP_BITSET_WORDS / BITMAP_VEC_WORDS;
+	
+	switch(op) {
+	case BITMAP_OP_AND:    for(int i = 0; i < num_vecs; ++i) vd[i] = va[i] & vb[i]; break;
+	case BITMAP_OP_OR:     for(int i = 0; i < num_vecs; ++i) vd[i] = va[i] | vb[i]; break;
+	case BITMAP_OP_ANDNOT: for(int i = 0; i < num_vecs; ++i) vd[i] = va[i] & ~vb[i]; break;
+	}
+	return bitset_count(dst);
+}
+
+static void array_array_op(bitmap_container_t * dst, const bitmap_container_t * a, const bitmap_container_t * b, enum bitmap_op op)
+{
+	uint32_t capacity = (op == BITMAP_OP_OR) ? (a->cardinality + b->cardinality) : a->cardinality;
+	if(capacity > BITMAP_ARRAY_MAX) {	// union of two big arrays: build a bitset
+		container_init_bitset(dst, a->key);
+		for(uint32_t i = 0; i < a->cardinality; ++i) dst->words[a->values[i] >> 6] |= 1ULL << (a->values[i] & 63);
+		for(uint32_t i = 0; i < b->cardinality; ++i) dst->words[b->values[i] >> 6] |= 1ULL << (b->values[i] & 63);
+		dst->cardinality = bitset_count(dst->words);
+		container_normalize(dst);
+		return;
+	}
+	
+	container_init_array(dst, a->key, capacity);
+	uint16_t * out = dst->values;
+	uint32_t i = 0, j = 0, n = 0;
+	while(i < a->cardinality && j < b->cardinality) {
+		uint16_t x = a->values[i], y = b->values[j];
+		if(x < y) {
+			if(op != BITMAP_OP_AND) out[n++] = x;
+			++i;
+		}else if(x > y) {
+			if(op == BITMAP_OP_OR) out[n++] = y;
+			++j;
+		}else {
+			if(op != BITMAP_OP_ANDNOT) out[n++] = x;
+			++i; ++j;
+		}
+	}
+	if(op != BITMAP_OP_AND) while(i < a->cardinality) out[n++] = a->values[i++];
+	if(op == BITMAP_OP_OR) while(j < b->cardinality) out[n++] = b->values[j++];
+	dst->cardinality = n;
+}
+
+static void container_op(bitmap_container_t * dst, const bitmap_container_t * a, const bitmap_container_t * b, enum bitmap_op op)
+{
+	if(a->type == BITMAP_CONTAINER_ARRAY && b->type == BITMAP_CONTAINER_ARRAY) {
+		array_array_op(dst, a, b, op);
+		return;
+	}
+	
+	if(a->type == BITMAP_CONTAINER_BITSET && b->type == BITMAP_CONTAINER_BITSET) {
+		container_init_bitset(dst, a->key);
+		dst->cardinality = bitset_op(dst->words, a->words, b->words, op);
+		container_normalize(dst);
+		return;
+	}
+	
+	// mixed: array and bitset
+	if(op == BITMAP_OP_AND || (op == BITMAP_OP_ANDNOT && a->type == BITMAP_CONTAINER_ARRAY)) {
+		const bitmap_container_t * array = (a->type == BITMAP_CONTAINER_ARRAY) ? a : b;
+		const bitmap_container_t * bitset = (a->type == BITMAP_CONTAINER_ARRAY) ? b : a;
+		int keep = (op == BITMAP_OP_AND);
+		
+		container_init_array(dst, a->key, array->cardinality);
+		uint32_t n = 0;
+		for(uint32_t i = 0; i < array->cardinality; ++i) {
+			uint16_t v = array->values[i];
+			int found = (bitset->words[v >> 6] >> (v & 63)) & 1;
+			if(found == keep) dst->values[n++] = v;
+		}
+		dst->cardinality = n;
+		return;
+	}
+	
+	// OR, or bitset ANDNOT array: copy the bitset, then set / clear the array's bits
+	const bitmap_container_t * bitset = (a->type == BITMAP_CONTAINER_BITSET) ? a : b;
+	const bitmap_container_t * array = (a->type == BITMAP_CONTAINER_BITSET) ? b : a;
+	container_init_bitset(dst, a->key);
+	memcpy(dst->words, bitset->words, BITMAP_BITSET_WORDS * sizeof(uint64_t));
+	for(uint32_t i = 0; i < array->cardinality; ++i) {
+		uint16_t v = array->values[i];
+		if(op == BITMAP_OP_OR) dst->words[v >> 6] |= 1ULL << (v & 63);
+		else dst->words[v >> 6] &= ~(1ULL << (v & 63));
+	}
+	dst->cardinality = bitset_count(dst->words);
+	container_normalize(dst);
+}
+
+static void container_copy(bitmap_container_t * dst, const bitmap_container_t * src)
+{
+	*dst = *src;
+	if(src->type == BITMAP_CONTAINER_BITSET) {
+		dst->words = bitset_new();
+		memcpy(dst->words, src->words, BITMAP_BITSET_WORDS * sizeof(uint64_t));
+	}else {
+		dst->values = malloc((src->capacity ? src->capacity : 1) * sizeof(uint16_t));
+		assert(dst->values);
+		memcpy(dst->values, src->values, src->cardinality * sizeof(uint16_t));
+	}
+}
+
+static void bitmap_op(bitmap_t * dst, const bitmap_t * a, const bitmap_t * b, enum bitmap_op op)
+{
+	assert(dst != a && dst != b);
+	bitmap_clear(dst);
+	
+	uint32_t i = 0, j = 0;
+	bitmap_container_t container;
+	while(i < a->num_containers || j < b->num_containers) {
+		const bitmap_container_t * ca = (i < a->num_containers) ? &a->containers[i] : NULL;
+		const bitmap_container_t * cb = (j < b->num_containers) ? &b->containers[j] : NULL;
+		
+		if(ca && cb && ca->key == cb->key) {
+			container_op(&container, ca, cb, op);
+			++i; ++j;
+		}else if(ca && (NULL == cb || ca->key < cb->key)) {
+			++i;
+			if(op == BITMAP_OP_AND) continue;
+			container_copy(&container, ca);
+		}else {
+			++j;
+			if(op != BITMAP_OP_OR) {
+				if(op == BITMAP_OP_AND && NULL == ca) break;
+				if(op == BITMAP_OP_ANDNOT && NULL == ca) break;
+				continue;
+			}
+			container_copy(&container, cb);
+		}
+		bitmap_append_container(dst, &container);
+	}
+}
+
+void bitmap_and(bitmap_t * dst, const bitmap_t * a, const bitmap_t * b) { bitmap_op(dst, a, b, BITMAP_OP_AND); }
+void bitmap_or(bitmap_t * dst, const bitmap_t * a, const bitmap_t * b) { bitmap_op(dst, a, b, BITMAP_OP_OR); }
+void bitmap_andnot(bitmap_t * dst, const bitmap_t * a, const bitmap_t * b) { bitmap_op(dst, a, b, BITMAP_OP_ANDNOT); }
+
+/**********************************************
+ * iteration
+**********************************************/
+long bitmap_foreach(const bitmap_t * bitmap, uint64_t offset, bitmap_visit_fn visit, void * user_data)
+{
+	long num_visited = 0;
+	for(uint32_t i = 0; i < bitmap->num_containers; ++i) {
+		const bitmap_container_t * container = &bitmap->containers[i];
+		if(offset >= container->cardinality) {	// skip whole containers
+			offset -= container->cardinality;
+			continue;
+		}
+		
+		uint32_t high = (uint32_t)container->key << 16;
+		if(container->type == BITMAP_CONTAINER_ARRAY) {
+			for(uint32_t k = offset; k < container->cardinality; ++k) {
+				++num_visited;
+				if(visit(high | container->values[k], user_data)) return num_visited;
+			}
+			offset = 0;
+			continue;
+		}
+		
+		for(int w = 0; w < BITMAP_BITSET_WORDS; ++w) {
+			uint64_t word = container->words[w];
+			if(0 == word) continue;
+			
+			uint32_t count = __builtin_popcountll(word);
+			if(offset >= count) {
+				offset -= count;
+				continue;
+			}
+			for(; offset > 0; --offset) word &= word - 1;
+			while(word) {
+				++num_visited;
+				if(visit(high | (w * 64 + __builtin_ctzll(word)), user_data)) return num_visited;
+				word &= word - 1;
+			}
+		}
+	}
+	return num_visited;
+}
+
+/**********************************************
+ * persistence
+**********************************************/
+ssize_t bitmap_container_serialize(const bitmap_container_t * container, void * buf, size_t size)
+{
+	unsigned char * p = buf;
+	size_t cb_payload = (container->type == BITMAP_CONTAINER_BITSET) 
+		? (BITMAP_BITSET_WORDS * sizeof(uint64_t)) 
+		: (container->cardinality * sizeof(uint16_t));
+	if(size < 8 + cb_payload) return -1;
+	
+	p[0] = (unsigned char)container->type;
+	p[1] = 0;
+	p[2] = 0;
+	p[3] = 0;
+	uint32_t cardinality = htole32(container->cardinality);
+	memcpy(p + 4, &cardinality, 4);
+	p += 8;
+	
+	if(container->type == BITMAP_CONTAINER_BITSET) {
+		for(int i = 0; i < BITMAP_BITSET_WORDS; ++i) {
+			uint64_t w = htole64(container->words[i]);
+			memcpy(p + i * 8, &w, 8);
+		}
+	}else {
+		for(uint32_t i = 0; i < container->cardinality; ++i) {
+			uint16_t v = htole16(container->values[i]);
+			memcpy(p + i * 2, &v, 2);
+		}
+	}
+	return 8 + cb_payload;
+}
+
+int bitmap_container_deserialize(bitmap_container_t * container, uint16_t key, const void * data, size_t length)
+{
+	const unsigned char * p = data;
+	if(length < 8) return -1;
+	
+	uint32_t cardinality = 0;
+	memcpy(&cardinality, p + 4, 4);
+	cardinality = le32toh(cardinality);
+	p += 8;
+	length -= 8;
+	
+	switch(p[-8]) {
+	case BITMAP_CONTAINER_BITSET:
+		if(length != BITMAP_BITSET_WORDS * sizeof(uint64_t)) return -1;
+		container_init_bitset(container, key);
+		for(int i = 0; i < BITMAP_BITSET_WORDS; ++i) {
+			uint64_t w;
+			memcpy(&w, p + i * 8, 8);
+			container->words[i] = le64toh(w);
+		}
+		container->cardinality = bitset_count(container->words);
+		break;
+	case BITMAP_CONTAINER_ARRAY:
+		if(cardinality > BITMAP_ARRAY_MAX || length != cardinality * sizeof(uint16_t)) return -1;
+		container_init_array(container, key, cardinality);
+		for(uint32_t i = 0; i < cardinality; ++i) {
+			uint16_t v;
+			memcpy(&v, p + i * 2, 2);
+			container->values[i] = le16toh(v);
+		}
+		container->cardinality = cardinality;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,633 @@
+/*
+ * change-feed.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <json-c/json.h>
+#include <uuid/uuid.h>
+#include "app.h"
+#include "change-feed.h"
+#include "json-writer.h"
+
+#define CHANGE_FEED_TRIM_INTERVAL	(10)	// seconds
+#define CHANGE_FEED_TRIM_BATCH	(10000)	// records removed per transaction
+
+struct feed_event
+{
+	uint32_t seq;	// 0: empty slot
+	enum db_change_op op;
+	uuid_t uid;
+	char * json;	// {"seq":..,"op":..,"id":..,"data":{..}}
+	size_t length;
+};
+
+/*
+ * the changes read by one poll, encoded on the poller thread and applied on the main loop
+ */
+struct feed_batch
+{
+	int reset;	// the environment was recreated: everyone reloads
+	uint32_t from;	// first change read (a gap before it: older changes are lost)
+	uint32_t last;
+	struct feed_event events[];	// events[seq - from], seq 0: a hole
+};
+
+struct feed_client
+{
+	change_feed_t * feed;
+	SoupWebsocketConnection * conn;
+	struct feed_client * prev;
+	struct feed_client * next;
+	
+	uint32_t next_seq;	// first change not sent yet
+	uint32_t acked_seq;
+	time_t blocked_since;
+};
+
+struct change_feed_private
+{
+	change_feed_t * feed;
+	db_helpler_t * db;
+	
+	struct feed_event * events;	// ring buffer, events[seq % max_events]
+	uint32_t first_seq;	// oldest change in memory (0: none yet)
+	struct feed_client * clients;
+	
+	guint pump_timer;
+	GAsyncQueue * batches;	// poller thread ==> main loop
+	GHashTable * latest;	// coalescing: uuid ==> seq of its last change in the batch
+	GString * message;
+	
+	// poller thread: reads (and trims) changes_db, off the main loop
+	pthread_t poll_th;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+	int running;
+	uint32_t polled_seq;
+	struct feed_batch * polling;
+	time_t trimmed_at;
+};
+
+static const char * s_change_ops[] = {
+	[DB_CHANGE_INSERT] = "insert",
+	[DB_CHANGE_UPDATE] = "update",
+	[DB_CHANGE_DELETE] = "delete",
+	[DB_CHANGE_RESET] = "reset",
+};
+
+static guint uuid_hash(gconstpointer key)
+{
+	guint hash = 0;
+	memcpy(&hash, key, sizeof(hash));	// uuids are random enough
+	return hash;
+}
+static gboolean uuid_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, sizeof(uuid_t)) == 0;
+}
+
+/**********************************************
+ * events
+**********************************************/
+static void feed_event_clear(struct feed_event * event)
+{
+	free(event->json);
+	memset(event, 0, sizeof(*event));
+}
+
+static struct feed_event * get_event(struct change_feed_private * priv, uint32_t seq)
+{
+	struct feed_event * event = &priv->events[seq % priv->feed->max_events];
+	return (event->seq == seq) ? event : NULL;
+}
+
+static void feed_batch_free(struct feed_batch * batch, unsigned int num_events)
+{
+	if(NULL == batch) return;
+	for(unsigned int i = 0; i < num_events; ++i) free(batch->events[i].json);
+	free(batch);
+}
+
+static int on_read_change(const struct db_change * change, void * user_data)
+{
+	struct change_feed_private * priv = user_data;
+	struct feed_batch * batch = priv->polling;
+	if(change->seq < batch->from || change->seq > batch->last) return 0;
+	
+	struct feed_event * event = &batch->events[change->seq - batch->from];
+	feed_event_clear(event);
+	event->seq = change->seq;
+	event->op = change->op;
+	memcpy(event->uid, change->uid, sizeof(uuid_t));
+	
+	// the row is read once, when the change is polled (a later change of the same user follows anyway)
+	struct db_user_record user[1];
+	void * buf = NULL;
+	enum db_change_op op = change->op;
+	if(op == DB_CHANGE_INSERT || op == DB_CHANGE_UPDATE) {
+		if(db_helpler_get_user(priv->db, NULL, change->uid, user, &buf)) op = DB_CHANGE_DELETE;
+	}
+	if(op <= 0 || op > DB_CHANGE_RESET) op = DB_CHANGE_RESET;
+	event->op = op;
+	
+	char sz_uid[40] = "";
+	uuid_unparse_lower(change->uid, sz_uid);
+	
+	GString * out = g_string_sized_new(256);
+	json_writer_t json[1];
+	json_writer_init(json, out);
+	json_writer_begin_object(json);
+	json_writer_add_int64(json, "seq", change->seq);
+	json_writer_add_string(json, "op", s_change_ops[op]);
+	if(op != DB_CHANGE_RESET) json_writer_add_string(json, "id", sz_uid);
+	if(buf) {
+		json_writer_key(json, "data");
+		json_writer_begin_object(json);
+		json_writer_add_string(json, "id", sz_uid);
+		json_writer_add_string(json, "name", user->name);
+		json_writer_add_string(json, "email", user->email);
+		json_writer_add_string(json, "phone", user->phone);
+		json_writer_end_object(json);
+		free(buf);
+	}
+	json_writer_end_object(json);
+	
+	event->length = out->len;
+	event->json = g_string_free(out, FALSE);
+	return 0;
+}
+
+static void clear_events(struct change_feed_private * priv, uint32_t first_seq)
+{
+	for(unsigned int i = 0; i < priv->feed->max_events; ++i) feed_event_clear(&priv->events[i]);
+	priv->first_seq = first_seq;
+}
+
+/*
+ * reads the new changes from changes_db (written by any process using the environment).
+ * poller thread: returns NULL when there is nothing new
+ */
+static struct feed_batch * poll_changes(struct change_feed_private * priv)
+{
+	change_feed_t * feed = priv->feed;
+	uint32_t first = 0, last = 0;
+	if(db_helpler_get_changes_range(priv->db, &first, &last)) return NULL;
+	if(last == priv->polled_seq) return NULL;
+	
+	struct feed_batch * batch = NULL;
+	if(last < priv->polled_seq) {
+		batch = calloc(1, sizeof(*batch));
+		assert(batch);
+		batch->reset = 1;
+		batch->last = last;
+		priv->polled_seq = last;
+		return batch;
+	}
+	
+	uint32_t from = priv->polled_seq + 1;
+	if(first > from) from = first;
+	if(last - from >= feed->max_events) from = last - (feed->max_events - 1);
+	
+	unsigned int num_events = last - from + 1;
+	batch = calloc(1, sizeof(*batch) + num_events * sizeof(batch->events[0]));
+	assert(batch);
+	batch->from = from;
+	batch->last = last;
+	
+	priv->polling = batch;
+	long num_changes = db_helpler_read_changes(priv->db, from, last, on_read_change, priv);
+	priv->polling = NULL;
+	if(num_changes < 0) {
+		feed_batch_free(batch, num_events);
+		return NULL;
+	}
+	priv->polled_seq = last;	// aborted appends leave holes
+	return batch;
+}
+
+/*
+ * main loop: moves the events of a batch to the ring buffer
+ */
+static void apply_batch(struct change_feed_private * priv, struct feed_batch * batch)
+{
+	change_feed_t * feed = priv->feed;
+	if(batch->reset) {
+		clear_events(priv, 0);
+		feed->last_seq = batch->last;
+		for(struct feed_client * client = priv->clients; client; client = client->next) client->next_seq = 0;
+		free(batch);
+		return;
+	}
+	
+	if(batch->from != feed->last_seq + 1) clear_events(priv, batch->from);	// a gap: older changes are lost
+	unsigned int num_events = batch->last - batch->from + 1;
+	for(unsigned int i = 0; i < num_events; ++i) {
+		struct feed_event * event = &batch->events[i];
+		if(0 == event->seq) continue;
+		
+		struct feed_event * slot = &priv->events[event->seq % feed->max_events];
+		feed_event_clear(slot);
+		*slot = *event;
+		event->json = NULL;
+		
+		if(0 == priv->first_seq || event->seq - priv->first_seq >= feed->max_events) {
+			priv->first_seq = event->seq - (feed->max_events - 1);
+			if(priv->first_seq > event->seq) priv->first_seq = 1;	// seq < max_events
+		}
+	}
+	feed->last_seq = batch->last;
+	if(0 == priv->first_seq) priv->first_seq = batch->from;
+	feed_batch_free(batch, num_events);
+}
+
+/**********************************************
+ * clients
+**********************************************/
+static void client_send(struct feed_client * client, GString * message)
+{
+	soup_websocket_connection_send_text(client->conn, message->str);
+	++client->feed->num_messages;
+}
+
+static void client_send_status(struct feed_client * client, const char * type)
+{
+	struct change_feed_private * priv = client->feed->priv;
+	GString * message = priv->message;
+	g_string_truncate(message, 0);
+	
+	json_writer_t json[1];
+	json_writer_init(json, message);
+	json_writer_begin_object(json);
+	json_writer_add_string(json, "type", type);
+	json_writer_add_int64(json, "seq", client->feed->last_seq);
+	json_writer_end_object(json);
+	client_send(client, message);
+}
+
+static void client_reset(struct feed_client * client)
+{
+	change_feed_t * feed = client->feed;
+	client_send_status(client, "reset");
+	client->next_seq = feed->last_seq + 1;
+	client->acked_seq = feed->last_seq;
+	client->blocked_since = 0;
+	++feed->num_resets;
+}
+
+/*
+ * sends the pending changes of a client as one message, only the last change per user
+ */
+static void client_pump(struct feed_client * client)
+{
+	change_feed_t * feed = client->feed;
+	struct change_feed_private * priv = feed->priv;
+	if(soup_websocket_connection_get_state(client->conn) != SOUP_WEBSOCKET_STATE_OPEN) return;
+	if(client->next_seq > feed->last_seq) return;
+	
+	if(0 == client->next_seq || client->next_seq < priv->first_seq) {
+		client_reset(client);
+		return;
+	}
+	
+	uint32_t in_flight = (client->next_seq - 1) - client->acked_seq;
+	if(in_flight >= feed->window) {
+		time_t now = time(NULL);
+		if(0 == client->blocked_since) client->blocked_since = now;
+		else if((now - client->blocked_since) >= feed->slow_timeout) {
+			++feed->num_dropped;
+			soup_websocket_connection_close(client->conn, SOUP_WEBSOCKET_CLOSE_POLICY_VIOLATION, "too slow");
+		}
+		return;
+	}
+	client->blocked_since = 0;
+	
+	GHashTable * latest = priv->latest;
+	g_hash_table_remove_all(latest);
+	int has_reset = 0;
+	for(uint32_t seq = client->next_seq; seq <= feed->last_seq && seq != 0; ++seq) {
+		struct feed_event * event = get_event(priv, seq);
+		if(NULL == event) continue;
+		if(event->op == DB_CHANGE_RESET) has_reset = 1;
+		g_hash_table_insert(latest, event->uid, GUINT_TO_POINTER(seq));
+	}
+	if(has_reset) {
+		// nothing before a reset matters
+		client_reset(client);
+		return;
+	}
+	
+	GString * message = priv->message;
+	g_string_truncate(message, 0);
+	json_writer_t json[1];
+	json_writer_init(json, message);
+	json_writer_begin_object(json);
+	json_writer_add_string(json, "type", "changes");
+	json_writer_add_int64(json, "seq", feed->last_seq);
+	json_writer_key(json, "changes");
+	json_writer_begin_array(json);
+	for(uint32_t seq = client->next_seq; seq <= feed->last_seq && seq != 0; ++seq) {
+		struct feed_event * event = get_event(priv, seq);
+		if(NULL == event) continue;
+		if(GPOINTER_TO_UINT(g_hash_table_lookup(latest, event->uid)) != seq) continue;	// superseded
+		json_writer_raw(json, event->json, event->length);
+	}
+	json_writer_end_array(json);
+	json_writer_end_object(json);
+	
+	client_send(client, message);
+	client->next_seq = feed->last_seq + 1;
+}
+
+static void on_client_message(SoupWebsocketConnection * conn, gint type, GBytes * message, struct feed_client * client)
+{
+	if(type != SOUP_WEBSOCKET_DATA_TEXT) return;
+	
+	gsize length = 0;
+	const char * data = g_bytes_get_data(message, &length);
+	if(NULL == data || length == 0 || length > 1024) return;
+	
+	json_tokener * tok = json_tokener_new();
+	json_object * jmsg = json_tokener_parse_ex(tok, data, length);
+	json_tokener_free(tok);
+	if(NULL == jmsg) return;
+	
+	const char * msg_type = json_get_value(jmsg, string, type);
+	if(msg_type && strcmp(msg_type, "ack") == 0) {
+		json_object * jseq = NULL;
+		json_object_object_get_ex(jmsg, "seq", &jseq);
+		uint32_t seq = (uint32_t)json_object_get_int64(jseq);
+		if(seq >= client->next_seq) seq = client->next_seq - 1;	// can not ack unsent changes
+		if(seq > client->acked_seq) client->acked_seq = seq;
+		client_pump(client);
+	}
+	json_object_put(jmsg);
+}
+
+static void on_client_closed(SoupWebsocketConnection * conn, struct feed_client * client)
+{
+	change_feed_t * feed = client->feed;
+	struct change_feed_private * priv = feed->priv;
+	
+	if(client->prev) client->prev->next = client->next;
+	else priv->clients = client->next;
+	if(client->next) client->next->prev = client->prev;
+	--feed->num_clients;
+	
+	g_signal_handlers_disconnect_by_func(conn, on_client_message, client);
+	g_signal_handlers_disconnect_by_func(conn, on_client_closed, client);
+	g_object_unref(conn);
+	free(client);
+}
+
+void change_feed_add_client(change_feed_t * feed, SoupWebsocketConnection * conn, uint32_t since)
+{
+	assert(feed && feed->priv && conn);
+	struct change_feed_private * priv = feed->priv;
+	
+	struct feed_client * client = calloc(1, sizeof(*client));
+	assert(client);
+	client->feed = feed;
+	client->conn = g_object_ref(conn);
+	
+	client->next = priv->clients;
+	if(priv->clients) priv->clients->prev = client;
+	priv->clients = client;
+	++feed->num_clients;
+	
+	g_signal_connect(conn, "message", G_CALLBACK(on_client_message), client);
+	g_signal_connect(conn, "closed", G_CALLBACK(on_client_closed), client);
+	
+	client_send_status(client, "hello");
+	if(0 == since || since > feed->last_seq) {
+		// new client (or unknown position): starts from now
+		client->next_seq = feed->last_seq + 1;
+		client->acked_seq = feed->last_seq;
+		if(since) client_reset(client);
+		return;
+	}
+	client->next_seq = since + 1;
+	client->acked_seq = since;
+	client_pump(client);
+}
+
+/**********************************************
+ * change_feed
+**********************************************/
+static void pump_clients(struct change_feed_private * priv)
+{
+	for(struct feed_client * client = priv->clients; client; ) {
+		struct feed_client * next = client->next;	// a slow client may be closed
+		client_pump(client);
+		client = next;
+	}
+}
+
+static gboolean on_changes_ready(gpointer user_data)
+{
+	change_feed_t * feed = user_data;
+	struct change_feed_private * priv = feed->priv;
+	
+	struct feed_batch * batch = NULL;
+	while((batch = g_async_queue_try_pop(priv->batches))) apply_batch(priv, batch);
+	pump_clients(priv);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean on_pump_clients(gpointer user_data)
+{
+	change_feed_t * feed = user_data;
+	struct change_feed_private * priv = feed->priv;
+	
+	// blocked clients are checked against 'slow_timeout'
+	if(priv->clients) pump_clients(priv);
+	return G_SOURCE_CONTINUE;
+}
+
+static void trim_changes(struct change_feed_private * priv)
+{
+	change_feed_t * feed = priv->feed;
+	
+	// only the master writes (the replicas receive the trimmed queue), and only one of its processes:
+	// concurrent consumers would each remove a batch and go below 'retention'
+	time_t now = time(NULL);
+	if(feed->trim && (now - priv->trimmed_at) >= CHANGE_FEED_TRIM_INTERVAL && !db_replication_is_replica(priv->db->rep)) {
+		priv->trimmed_at = now;
+		db_helpler_trim_changes(priv->db, feed->retention, CHANGE_FEED_TRIM_BATCH);
+	}
+}
+
+/*
+ * reads and trims changes_db: a lock wait must not stall the HTTP and WebSocket connections
+ */
+static void * poll_thread(void * user_data)
+{
+	change_feed_t * feed = user_data;
+	struct change_feed_private * priv = feed->priv;
+	
+	pthread_mutex_lock(&priv->mutex);
+	while(!priv->quit) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long)feed->poll_interval * 1000000;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		while(!priv->quit && pthread_cond_timedwait(&priv->cond, &priv->mutex, &deadline) != ETIMEDOUT);
+		if(priv->quit) break;
+		
+		pthread_mutex_unlock(&priv->mutex);
+		struct feed_batch * batch = poll_changes(priv);
+		if(batch) {
+			g_async_queue_push(priv->batches, batch);
+			g_idle_add(on_changes_ready, feed);
+		}
+		trim_changes(priv);
+		pthread_mutex_lock(&priv->mutex);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	return NULL;
+}
+
+change_feed_t * change_feed_init(change_feed_t * feed, struct db_helpler * db, void * user_data)
+{
+	assert(db);
+	if(NULL == feed) feed = calloc(1, sizeof(*feed));
+	assert(feed);
+	feed->user_data = user_data;
+	
+	if(0 == feed->max_events) feed->max_events = 4096;
+	if(0 == feed->window) feed->window = 1024;
+	if(feed->retention < feed->max_events) feed->retention = feed->max_events * 16;
+	if(0 == feed->slow_timeout) feed->slow_timeout = 30;
+	if(0 == feed->poll_interval) feed->poll_interval = 100;
+	
+	struct change_feed_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->feed = feed;
+	priv->db = db;
+	priv->events = calloc(feed->max_events, sizeof(*priv->events));
+	assert(priv->events);
+	priv->latest = g_hash_table_new(uuid_hash, uuid_equal);
+	priv->message = g_string_sized_new(64 * 1024);
+	priv->batches = g_async_queue_new();
+	priv->trimmed_at = time(NULL);
+	pthread_mutex_init(&priv->mutex, NULL);
+	pthread_cond_init(&priv->cond, NULL);
+	feed->priv = priv;
+	
+	// the recent changes are loaded, clients can resume across restarts
+	uint32_t first = 0, last = 0;
+	if(0 == db_helpler_get_changes_range(db, &first, &last) && last > feed->max_events) {
+		feed->last_seq = last - feed->max_events;
+	}
+	priv->polled_seq = feed->last_seq;
+	struct feed_batch * batch = poll_changes(priv);
+	if(batch) apply_batch(priv, batch);
+	
+	int rc = pthread_create(&priv->poll_th, NULL, poll_thread, feed);
+	if(rc) {
+		fprintf(stderr, "%s(): pthread_create: %s\n", __FUNCTION__, strerror(rc));
+		exit(1);
+	}
+	priv->running = 1;
+	priv->pump_timer = g_timeout_add(feed->poll_interval, on_pump_clients, feed);
+	return feed;
+}
+
+void change_feed_cleanup(change_feed_t * feed)
+{
+	if(NULL == feed || NULL == feed->priv) return;
+	struct change_feed_private * priv = feed->priv;
+	
+	if(priv->running) {
+		pthread_mutex_lock(&priv->mutex);
+		priv->quit = 1;
+		pthread_cond_broadcast(&priv->cond);
+		pthread_mutex_unlock(&priv->mutex);
+		pthread_join(priv->poll_th, NULL);
+		priv->running = 0;
+	}
+	if(priv->pump_timer) g_source_remove(priv->pump_timer);
+	priv->pump_timer = 0;
+	while(g_source_remove_by_user_data(feed));	// on_changes_ready not run yet
+	
+	struct feed_batch * batch = NULL;
+	while((batch = g_async_queue_try_pop(priv->batches))) {
+		feed_batch_free(batch, batch->reset ? 0 : (batch->last - batch->from + 1));
+	}
+	g_async_queue_unref(priv->batches);
+	
+	while(priv->clients) {
+		struct feed_client * client = priv->clients;
+		SoupWebsocketConnection * conn = g_object_ref(client->conn);
+		on_client_closed(conn, client);	// releases the client's reference
+		if(soup_websocket_connection_get_state(conn) == SOUP_WEBSOCKET_STATE_OPEN) {
+			soup_websocket_connection_close(conn, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, NULL);
+		}
+		g_object_unref(conn);
+	}
+	
+	clear_events(priv, 0);
+	free(priv->events);
+	g_hash_table_destroy(priv->latest);
+	g_string_free(priv->message, TRUE);
+	pthread_cond_destroy(&priv->cond);
+	pthread_mutex_destroy(&priv->mutex);
+	
+	feed->priv = NULL;
+	free(priv);
+	return;
+}
+
+void change_feed_append_metrics(change_feed_t * feed, GString * out)
+{
+	g_string_append_printf(out, 
+		"# HELP webapi_change_feed_clients Connected /ws/users clients.\n"
+		"# TYPE webapi_change_feed_clients gauge\n"
+		"webapi_change_feed_clients %ld\n"
+		"# HELP webapi_change_feed_seq Last change sequence number.\n"
+		"# TYPE webapi_change_feed_seq gauge\n"
+		"webapi_change_feed_seq %lu\n"
+		"# HELP webapi_change_feed_messages_total Messages sent to /ws/users clients.\n"
+		"# TYPE webapi_change_feed_messages_total counter\n"
+		"webapi_change_feed_messages_total %ld\n"
+		"# HELP webapi_change_feed_resets_total Clients told to reload (too far behind, or after a bulk load).\n"
+		"# TYPE webapi_change_feed_resets_total counter\n"
+		"webapi_change_feed_resets_total %ld\n"
+		"# HELP webapi_change_feed_dropped_total Slow clients disconnected.\n"
+		"# TYPE webapi_change_feed_dropped_total counter\n"
+		"webapi_change_feed_dropped_total %ld\n",
+		feed->num_clients, (unsigned long)feed->last_seq, feed->num_messages, feed->num_resets, feed->num_dropped);
+}
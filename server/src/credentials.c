@@ -0,0 +1,141 @@
+/*
+ * credentials.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <crypt.h>
+#include <glib.h>
+
+#include "credentials.h"
+
+struct credentials_private
+{
+	GHashTable * users;	// username -> hash
+	char * dummy_hash;	// checked for unknown users
+};
+
+static int secure_compare(const char * a, const char * b)
+{
+	size_t cb_a = strlen(a);
+	size_t cb_b = strlen(b);
+	if(cb_a != cb_b) return -1;
+	
+	unsigned char diff = 0;
+	for(size_t i = 0; i < cb_a; ++i) diff |= (unsigned char)a[i] ^ (unsigned char)b[i];
+	return diff ? -1 : 0;
+}
+
+int credentials_verify(credentials_t * cred, const char * username, const char * password)
+{
+	assert(cred && cred->priv);
+	struct credentials_private * priv = cred->priv;
+	if(NULL == username || NULL == password || NULL == priv->dummy_hash) return -1;
+	
+	const char * hash = g_hash_table_lookup(priv->users, username);
+	int known = (NULL != hash);
+	if(!known) hash = priv->dummy_hash;
+	
+	// struct crypt_data is too large for the worker stacks (about 32 KB)
+	struct crypt_data * data = calloc(1, sizeof(*data));
+	assert(data);
+	const char * result = crypt_r(password, hash, data);
+	int rc = (known && result && result[0] != '*' && 0 == secure_compare(result, hash)) ? 0 : -1;
+	explicit_bzero(data, sizeof(*data));
+	free(data);
+	
+	if(rc) __atomic_add_fetch(&cred->num_failed, 1, __ATOMIC_RELAXED);
+	else __atomic_add_fetch(&cred->num_verified, 1, __ATOMIC_RELAXED);
+	return rc;
+}
+
+static int load_file(credentials_t * cred, const char * file)
+{
+	struct credentials_private * priv = cred->priv;
+	FILE * fp = fopen(file, "r");
+	if(NULL == fp) {
+		perror(file);
+		return -1;
+	}
+	
+	char line[1024] = "";
+	int line_no = 0;
+	while(fgets(line, sizeof(line), fp)) {
+		++line_no;
+		char * p = line;
+		while(*p == ' ' || *p == '\t') ++p;
+		if(*p == '#' || *p == '\n' || *p == '\0') continue;
+		
+		char * colon = strchr(p, ':');
+		char * end = p + strcspn(p, "\r\n");
+		*end = '\0';
+		if(NULL == colon || colon == p || colon[1] != '$') {
+			fprintf(stderr, "%s:%d: expected \"username:$id$...\"\n", file, line_no);
+			continue;
+		}
+		*colon = '\0';
+		
+		if(NULL == priv->dummy_hash) priv->dummy_hash = strdup(colon + 1);
+		g_hash_table_replace(priv->users, g_strdup(p), g_strdup(colon + 1));
+	}
+	fclose(fp);
+	cred->num_users = g_hash_table_size(priv->users);
+	return 0;
+}
+
+credentials_t * credentials_init(credentials_t * cred, const char * file, void * user_data)
+{
+	if(NULL == cred) cred = calloc(1, sizeof(*cred));
+	assert(cred);
+	cred->user_data = user_data;
+	
+	struct credentials_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->users = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	cred->priv = priv;
+	
+	if(file && file[0] && load_file(cred, file)) {
+		credentials_cleanup(cred);
+		return NULL;
+	}
+	if(0 == cred->num_users) fprintf(stderr, "WARNING: no login accounts ('login_credentials'), every login will be rejected.\n");
+	return cred;
+}
+
+void credentials_cleanup(credentials_t * cred)
+{
+	if(NULL == cred || NULL == cred->priv) return;
+	struct credentials_private * priv = cred->priv;
+	cred->priv = NULL;
+	
+	g_hash_table_destroy(priv->users);
+	free(priv->dummy_hash);
+	free(priv);
+}
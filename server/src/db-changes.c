@@ -0,0 +1,203 @@
+/*
+ * db-changes.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <endian.h>
+#include <time.h>
+#include <db.h>
+#include <uuid/uuid.h>
+#include "app.h"
+
+/*
+ * changes_db record (fixed length, DB_QUEUE):
+ *   [op (u8)][reserved (7 bytes)][time_ms (i64, big-endian)][user_uuid (16 bytes)]
+ */
+
+static void encode_change(unsigned char data[DB_CHANGE_RECORD_SIZE], enum db_change_op op, int64_t time_ms, const uuid_t uid)
+{
+	memset(data, 0, DB_CHANGE_RECORD_SIZE);
+	data[0] = (unsigned char)op;
+	uint64_t be_time = htobe64((uint64_t)time_ms);
+	memcpy(data + 8, &be_time, 8);
+	if(uid) memcpy(data + 16, uid, sizeof(uuid_t));
+}
+
+static int decode_change(const DBT * key, const DBT * value, struct db_change * change)
+{
+	if(key->size != sizeof(db_recno_t) || value->size != DB_CHANGE_RECORD_SIZE) return -1;
+	const unsigned char * data = value->data;
+	
+	memset(change, 0, sizeof(*change));
+	change->seq = *(db_recno_t *)key->data;
+	change->op = data[0];
+	uint64_t be_time = 0;
+	memcpy(&be_time, data + 8, 8);
+	change->time_ms = (int64_t)be64toh(be_time);
+	memcpy(change->uid, data + 16, sizeof(uuid_t));
+	return 0;
+}
+
+int db_helpler_append_change(db_helpler_t * db, DB_TXN * txn, enum db_change_op op, const uuid_t uid)
+{
+	DB * dbp = db->changes_db;
+	if(NULL == dbp) return 0;
+	
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	
+	unsigned char data[DB_CHANGE_RECORD_SIZE];
+	encode_change(data, op, (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, uid);
+	
+	db_recno_t seq = 0;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &seq;
+	key.ulen = sizeof(seq);
+	key.flags = DB_DBT_USERMEM;
+	value.data = data;
+	value.size = sizeof(data);
+	
+	int rc = dbp->put(dbp, txn, &key, &value, DB_APPEND);
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+int db_helpler_get_changes_range(db_helpler_t * db, uint32_t * p_first, uint32_t * p_last)
+{
+	DB * dbp = db->changes_db;
+	*p_first = *p_last = 0;
+	if(NULL == dbp) return -1;
+	
+	DBC * cursorp = NULL;
+	int rc = dbp->cursor(dbp, NULL, &cursorp, 0);
+	if(rc) return rc;
+	
+	db_recno_t seq = 0;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &seq;
+	key.ulen = sizeof(seq);
+	key.flags = DB_DBT_USERMEM;
+	value.flags = DB_DBT_PARTIAL;	// keys only
+	
+	rc = cursorp->get(cursorp, &key, &value, DB_FIRST);
+	if(0 == rc) {
+		*p_first = seq;
+		rc = cursorp->get(cursorp, &key, &value, DB_LAST);
+		if(0 == rc) *p_last = seq;
+	}
+	cursorp->close(cursorp);
+	
+	if(rc == DB_NOTFOUND) {
+		*p_first = *p_last = 0;
+		rc = 0;
+	}
+	return rc;
+}
+
+long db_helpler_read_changes(db_helpler_t * db, uint32_t from_seq, uint32_t to_seq, db_change_visit_fn visit, void * user_data)
+{
+	DB * dbp = db->changes_db;
+	if(NULL == dbp) return -1;
+	if(from_seq == 0) from_seq = 1;
+	
+	unsigned char data[DB_CHANGE_RECORD_SIZE];
+	long num_visited = 0;
+	for(uint32_t seq = from_seq; seq <= to_seq && seq != 0; ++seq) {
+		db_recno_t recno = seq;
+		DBT key, value;
+		memset(&key, 0, sizeof(key));
+		memset(&value, 0, sizeof(value));
+		key.data = &recno;
+		key.size = sizeof(recno);
+		value.data = data;
+		value.ulen = sizeof(data);
+		value.flags = DB_DBT_USERMEM;
+		
+		int rc = dbp->get(dbp, NULL, &key, &value, 0);
+		if(rc == DB_NOTFOUND || rc == DB_KEYEMPTY) continue;	// trimmed, or an aborted append
+		if(rc) {
+			fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+			return -1;
+		}
+		
+		struct db_change change[1];
+		if(decode_change(&key, &value, change)) continue;
+		++num_visited;
+		if(visit && visit(change, user_data)) break;
+	}
+	return num_visited;
+}
+
+long db_helpler_trim_changes(db_helpler_t * db, uint32_t retention, long max_records)
+{
+	uint32_t first = 0, last = 0;
+	int rc = db_helpler_get_changes_range(db, &first, &last);
+	if(rc) return -1;
+	if(0 == last || (last - first) < retention) return 0;
+	
+	long num_records = (long)(last - first) + 1 - retention;
+	if(num_records > max_records) num_records = max_records;
+	
+	// DB_CONSUME removes the head of the queue
+	DB * dbp = db->changes_db;
+	DB_TXN * txn = NULL;
+	rc = db->env->txn_begin(db->env, NULL, &txn, DB_TXN_NOSYNC);
+	if(rc) return -1;
+	
+	unsigned char data[DB_CHANGE_RECORD_SIZE];
+	long num_removed = 0;
+	while(num_removed < num_records) {
+		db_recno_t recno = 0;
+		DBT key, value;
+		memset(&key, 0, sizeof(key));
+		memset(&value, 0, sizeof(value));
+		key.data = &recno;
+		key.ulen = sizeof(recno);
+		key.flags = DB_DBT_USERMEM;
+		value.data = data;
+		value.ulen = sizeof(data);
+		value.flags = DB_DBT_USERMEM;
+		rc = dbp->get(dbp, txn, &key, &value, DB_CONSUME);
+		if(rc) break;
+		++num_removed;
+	}
+	if(rc && rc != DB_NOTFOUND) {
+		txn->abort(txn);
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return -1;
+	}
+	rc = txn->commit(txn, 0);
+	return rc ? -1 : num_removed;
+}
@@ -0,0 +1,267 @@
+/*
+ * db-maintenance.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "app.h"
+
+#define DB_MAINTENANCE_TICK	(1)	// seconds
+#define DB_MAINTENANCE_DEFAULT_INTERVAL	(60)
+#define DB_MAINTENANCE_DEFAULT_KBYTES	(8192)
+
+struct db_maintenance_private
+{
+	db_maintenance_t * maint;
+	DB_ENV * env;
+	
+	pthread_mutex_t run_mutex;	// one checkpoint at a time
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+	
+	pthread_t th;
+	int running;
+};
+
+/*
+ * log written since the last checkpoint, i.e. what recovery would have to replay
+ */
+static int get_log_since_checkpoint(DB_ENV * env, uint64_t * p_bytes)
+{
+	DB_LOG_STAT * stat = NULL;
+	int rc = env->log_stat(env, &stat, 0);
+	if(rc) return rc;
+	*p_bytes = (uint64_t)stat->st_wc_mbytes * 1024 * 1024 + stat->st_wc_bytes;
+	free(stat);
+	return 0;
+}
+
+static int archive_logs(db_maintenance_t * maint, DB_ENV * env)
+{
+	if(maint->archive_mode == DB_LOG_ARCHIVE_KEEP) return 0;
+	
+	char ** files = NULL;
+	int rc = env->log_archive(env, &files, DB_ARCH_ABS);	// log files no longer involved in active transactions
+	if(rc || NULL == files) return rc;
+	
+	for(char ** p_file = files; *p_file; ++p_file) {
+		const char * file = *p_file;
+		if(maint->archive_mode == DB_LOG_ARCHIVE_REMOVE) {
+			if(unlink(file)) {
+				perror(file);
+				continue;
+			}
+		}else {
+			char name[PATH_MAX] = "";
+			char dst[PATH_MAX] = "";
+			strncpy(name, file, sizeof(name) - 1);
+			snprintf(dst, sizeof(dst), "%s/%s", maint->archive_dir, basename(name));
+			if(rename(file, dst)) {
+				perror(dst);
+				continue;
+			}
+		}
+		++maint->num_archived;
+	}
+	free(files);
+	return 0;
+}
+
+int db_maintenance_run(db_maintenance_t * maint, DB_ENV * env, int force)
+{
+	assert(maint && maint->priv && env);
+	struct db_maintenance_private * priv = maint->priv;
+	
+	pthread_mutex_lock(&priv->run_mutex);
+	uint64_t log_bytes = 0;
+	int rc = get_log_since_checkpoint(env, &log_bytes);
+	
+	time_t now = time(NULL);
+	int due = force
+		|| (log_bytes >= (uint64_t)maint->checkpoint_kbytes * 1024)
+		|| (log_bytes > 0 && (now - maint->last_checkpoint_time) >= maint->checkpoint_interval);
+	if(0 == rc && due) {
+		struct timespec begin;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		rc = env->txn_checkpoint(env, 0, 0, force ? DB_FORCE : 0);
+		if(0 == rc) {
+			maint->last_checkpoint_seconds = elapsed_seconds(&begin);
+			maint->last_checkpoint_time = now;
+			++maint->num_checkpoints;
+			rc = archive_logs(maint, env);
+		}
+	}
+	pthread_mutex_unlock(&priv->run_mutex);
+	
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+static void * maintenance_thread(void * user_data)
+{
+	struct db_maintenance_private * priv = user_data;
+	
+	pthread_mutex_lock(&priv->mutex);
+	while(!priv->quit) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += DB_MAINTENANCE_TICK;
+		while(!priv->quit && pthread_cond_timedwait(&priv->cond, &priv->mutex, &deadline) != ETIMEDOUT);
+		if(priv->quit) break;
+		
+		pthread_mutex_unlock(&priv->mutex);
+		db_maintenance_run(priv->maint, priv->env, 0);
+		pthread_mutex_lock(&priv->mutex);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	return NULL;
+}
+
+int db_maintenance_start(db_maintenance_t * maint, DB_ENV * env)
+{
+	assert(maint && maint->priv && env);
+	struct db_maintenance_private * priv = maint->priv;
+	if(priv->running) return 0;
+	
+	priv->env = env;
+	maint->last_checkpoint_time = time(NULL);
+	int rc = pthread_create(&priv->th, NULL, maintenance_thread, priv);
+	if(rc) return rc;
+	priv->running = 1;
+	return 0;
+}
+
+db_maintenance_t * db_maintenance_init(db_maintenance_t * maint, json_object * jconfig, void * user_data)
+{
+	if(NULL == maint) maint = calloc(1, sizeof(*maint));
+	assert(maint);
+	maint->user_data = user_data;
+	
+	maint->checkpoint_interval = json_get_value(jconfig, int, db_checkpoint_interval);
+	maint->checkpoint_kbytes = json_get_value(jconfig, int, db_checkpoint_kbytes);
+	if(0 == maint->checkpoint_interval) maint->checkpoint_interval = DB_MAINTENANCE_DEFAULT_INTERVAL;
+	if(0 == maint->checkpoint_kbytes) maint->checkpoint_kbytes = DB_MAINTENANCE_DEFAULT_KBYTES;
+	
+	const char * archive = json_get_value(jconfig, string, db_log_archive);
+	maint->archive_mode = DB_LOG_ARCHIVE_REMOVE;
+	if(archive && strcasecmp(archive, "keep") == 0) maint->archive_mode = DB_LOG_ARCHIVE_KEEP;
+	else if(archive && strcasecmp(archive, "move") == 0) maint->archive_mode = DB_LOG_ARCHIVE_MOVE;
+	else if(archive && archive[0] && strcasecmp(archive, "remove") != 0) {
+		fprintf(stderr, "invalid 'db_log_archive': %s (remove | move | keep)\n", archive);
+		exit(1);
+	}
+	
+	if(maint->archive_mode == DB_LOG_ARCHIVE_MOVE) {
+		const char * archive_dir = json_get_value(jconfig, string, db_log_archive_dir);
+		if(NULL == archive_dir || !archive_dir[0]) archive_dir = "db-archive";
+		strncpy(maint->archive_dir, archive_dir, sizeof(maint->archive_dir) - 1);
+		if(mkdir(archive_dir, 0775) && errno != EEXIST) {
+			perror(archive_dir);
+			exit(1);
+		}
+	}
+	
+	struct db_maintenance_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->maint = maint;
+	pthread_mutex_init(&priv->run_mutex, NULL);
+	pthread_mutex_init(&priv->mutex, NULL);
+	pthread_cond_init(&priv->cond, NULL);
+	maint->priv = priv;
+	return maint;
+}
+
+void db_maintenance_cleanup(db_maintenance_t * maint)
+{
+	if(NULL == maint || NULL == maint->priv) return;
+	struct db_maintenance_private * priv = maint->priv;
+	
+	pthread_mutex_lock(&priv->mutex);
+	priv->quit = 1;
+	pthread_cond_signal(&priv->cond);
+	pthread_mutex_unlock(&priv->mutex);
+	if(priv->running) {
+		pthread_join(priv->th, NULL);
+		db_maintenance_run(maint, priv->env, 1);
+		priv->running = 0;
+	}
+	
+	pthread_cond_destroy(&priv->cond);
+	pthread_mutex_destroy(&priv->mutex);
+	pthread_mutex_destroy(&priv->run_mutex);
+	maint->priv = NULL;
+	free(priv);
+	return;
+}
+
+void db_maintenance_append_metrics(db_maintenance_t * maint, DB_ENV * env, GString * out)
+{
+	uint64_t log_bytes = 0;
+	if(env) get_log_since_checkpoint(env, &log_bytes);
+	
+	long checkpoint_age = maint->last_checkpoint_time ? (long)(time(NULL) - maint->last_checkpoint_time) : -1;
+	g_string_append_printf(out,
+		"# HELP webapi_bdb_startup_seconds Time to open the environment and the databases.\n"
+		"# TYPE webapi_bdb_startup_seconds gauge\n"
+		"webapi_bdb_startup_seconds %.6f\n"
+		"# HELP webapi_bdb_env_open_seconds Time to open the environment (including recovery).\n"
+		"# TYPE webapi_bdb_env_open_seconds gauge\n"
+		"webapi_bdb_env_open_seconds{recovery=\"%s\"} %.6f\n"
+		"# HELP webapi_bdb_log_since_checkpoint_bytes Log written since the last checkpoint (replayed by recovery).\n"
+		"# TYPE webapi_bdb_log_since_checkpoint_bytes gauge\n"
+		"webapi_bdb_log_since_checkpoint_bytes %lu\n"
+		"# HELP webapi_bdb_checkpoints_total Checkpoints taken by this process.\n"
+		"# TYPE webapi_bdb_checkpoints_total counter\n"
+		"webapi_bdb_checkpoints_total %lu\n"
+		"# HELP webapi_bdb_checkpoint_duration_seconds Duration of the last checkpoint.\n"
+		"# TYPE webapi_bdb_checkpoint_duration_seconds gauge\n"
+		"webapi_bdb_checkpoint_duration_seconds %.6f\n"
+		"# HELP webapi_bdb_checkpoint_age_seconds Time since the last checkpoint (-1: no maintenance thread in this process).\n"
+		"# TYPE webapi_bdb_checkpoint_age_seconds gauge\n"
+		"webapi_bdb_checkpoint_age_seconds %ld\n"
+		"# HELP webapi_bdb_log_files_archived_total Log files removed or moved to the archive directory.\n"
+		"# TYPE webapi_bdb_log_files_archived_total counter\n"
+		"webapi_bdb_log_files_archived_total %lu\n",
+		maint->startup_seconds,
+		maint->recovered ? "yes" : "no", maint->open_seconds,
+		(unsigned long)log_bytes,
+		(unsigned long)maint->num_checkpoints,
+		maint->last_checkpoint_seconds,
+		checkpoint_age,
+		(unsigned long)maint->num_archived);
+}
@@ -0,0 +1,797 @@
+/*
+ * db-members.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <endian.h>
+#include <db.h>
+#include <uuid/uuid.h>
+#include "app.h"
+
+/*
+ * role / group membership:
+ *   every user gets a dense, never reused number (user_nos_db), 
+ *   the members of a role are a compressed bitmap of user numbers, one record per 64K-user container:
+ *     role_users_db: [role id (BE32)][high 16 bits (BE16)] ==> serialized container
+ *   users_role_sdb keeps the role ids of each user, to compute the changes on updates.
+ *   live_users_db: the same bitmap of every user not deleted (a query with only exclusions starts from it).
+ */
+#define MEMBERS_NEXT_USER_NO_KEY	"members.next_user_no"
+#define MEMBERS_LIVE_USERS_KEY	"members.live_users"	// meta_db: live_users_db has been filled from users_db
+#define MEMBERS_MAX_IDS	(4096)	// roles (or groups) per user
+
+// live_users_db holds one bitmap (id 0): the users not deleted, for the queries with only exclusions
+#define MEMBERS_KIND_LIVE	((enum db_member_kind)DB_MEMBER_KINDS_COUNT)
+
+struct member_dbs
+{
+	DB * ids_db;	// id ==> number of members
+	DB * bitmaps_db;	// [id][high] ==> container
+	DB * user_ids_db;	// uuid ==> ids
+};
+
+static int get_member_dbs(db_helpler_t * db, enum db_member_kind kind, struct member_dbs * dbs)
+{
+	switch(kind) {
+	case DB_MEMBER_ROLE:
+		dbs->ids_db = db->roles_db;
+		dbs->bitmaps_db = db->role_users_db;
+		dbs->user_ids_db = db->users_role_sdb;
+		break;
+	case DB_MEMBER_GROUP:
+		dbs->ids_db = db->groups_db;
+		dbs->bitmaps_db = db->group_users_db;
+		dbs->user_ids_db = db->users_group_sdb;
+		break;
+	case MEMBERS_KIND_LIVE:	// the count (4-byte key) and the containers (6-byte keys) in the same database
+		dbs->ids_db = db->live_users_db;
+		dbs->bitmaps_db = db->live_users_db;
+		dbs->user_ids_db = NULL;
+		return dbs->ids_db ? 0 : -1;
+	default:
+		return -1;
+	}
+	return (dbs->ids_db && dbs->bitmaps_db && dbs->user_ids_db) ? 0 : -1;
+}
+
+static int compare_u32(const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int sort_unique_ids(uint32_t * ids, int count)
+{
+	if(count <= 1) return count;
+	qsort(ids, count, sizeof(*ids), compare_u32);
+	int n = 1;
+	for(int i = 1; i < count; ++i) if(ids[i] != ids[n - 1]) ids[n++] = ids[i];
+	return n;
+}
+
+static int contains_id(const uint32_t * ids, int count, uint32_t id)
+{
+	return NULL != bsearch(&id, ids, count, sizeof(*ids), compare_u32);
+}
+
+/**********************************************
+ * user numbers
+**********************************************/
+static int get_user_no(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, uint32_t * p_user_no, int create)
+{
+	DB * sdbp = db->user_nos_sdb;
+	uint32_t user_no = 0;
+	
+	DBT skey, pkey, value;
+	memset(&skey, 0, sizeof(skey));
+	memset(&pkey, 0, sizeof(pkey));
+	memset(&value, 0, sizeof(value));
+	skey.data = (void *)uid;
+	skey.size = sizeof(uuid_t);
+	pkey.data = &user_no;
+	pkey.ulen = sizeof(user_no);
+	pkey.flags = DB_DBT_USERMEM;
+	value.flags = DB_DBT_PARTIAL;	// the uuid is already known
+	
+	int rc = sdbp->pget(sdbp, txn, &skey, &pkey, &value, 0);
+	if(0 == rc) {
+		*p_user_no = be32toh(user_no);
+		return 0;
+	}
+	if(rc != DB_NOTFOUND || !create) return rc;
+	
+	// allocate the next number (the meta record is write-locked until the transaction ends)
+	DB * meta_db = db->meta_db;
+	uint32_t next_no = 0;
+	DBT key, data;
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = MEMBERS_NEXT_USER_NO_KEY;
+	key.size = sizeof(MEMBERS_NEXT_USER_NO_KEY) - 1;
+	data.data = &next_no;
+	data.ulen = sizeof(next_no);
+	data.flags = DB_DBT_USERMEM;
+	rc = meta_db->get(meta_db, txn, &key, &data, DB_RMW);
+	if(rc && rc != DB_NOTFOUND) return rc;
+	if(rc == DB_NOTFOUND) next_no = 0;
+	if(next_no == UINT32_MAX) return ENOSPC;
+	
+	*p_user_no = next_no++;
+	data.size = sizeof(next_no);
+	rc = meta_db->put(meta_db, txn, &key, &data, 0);
+	if(rc) return rc;
+	
+	user_no = htobe32(*p_user_no);
+	memset(&pkey, 0, sizeof(pkey));
+	memset(&value, 0, sizeof(value));
+	pkey.data = &user_no;
+	pkey.size = sizeof(user_no);
+	value.data = (void *)uid;
+	value.size = sizeof(uuid_t);
+	DB * dbp = db->user_nos_db;
+	return dbp->put(dbp, txn, &pkey, &value, 0);	// user_nos_sdb is updated by the association
+}
+
+int db_helpler_get_user_by_number(db_helpler_t * db, DB_TXN * txn, uint32_t user_no, uuid_t uid)
+{
+	DB * dbp = db->user_nos_db;
+	uint32_t be_no = htobe32(user_no);
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &be_no;
+	key.size = sizeof(be_no);
+	value.data = uid;
+	value.ulen = sizeof(uuid_t);
+	value.flags = DB_DBT_USERMEM;
+	return dbp->get(dbp, txn, &key, &value, 0);
+}
+
+/**********************************************
+ * per-user id lists
+**********************************************/
+static int get_user_ids(const struct member_dbs * dbs, DB_TXN * txn, const uuid_t uid, uint32_t * ids, int * p_count)
+{
+	DB * dbp = dbs->user_ids_db;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)uid;
+	key.size = sizeof(uuid_t);
+	value.data = ids;
+	value.ulen = MEMBERS_MAX_IDS * sizeof(uint32_t);
+	value.flags = DB_DBT_USERMEM;
+	
+	*p_count = 0;
+	int rc = dbp->get(dbp, txn, &key, &value, DB_RMW);
+	if(rc == DB_NOTFOUND) return 0;
+	if(rc) return rc;
+	*p_count = value.size / sizeof(uint32_t);
+	return 0;
+}
+
+static int put_user_ids(const struct member_dbs * dbs, DB_TXN * txn, const uuid_t uid, const uint32_t * ids, int count)
+{
+	DB * dbp = dbs->user_ids_db;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)uid;
+	key.size = sizeof(uuid_t);
+	if(0 == count) {
+		int rc = dbp->del(dbp, txn, &key, 0);
+		return (rc == DB_NOTFOUND) ? 0 : rc;
+	}
+	value.data = (void *)ids;
+	value.size = count * sizeof(uint32_t);
+	return dbp->put(dbp, txn, &key, &value, 0);
+}
+
+static int adjust_member_count(const struct member_dbs * dbs, DB_TXN * txn, uint32_t id, int64_t delta)
+{
+	if(0 == delta) return 0;
+	DB * dbp = dbs->ids_db;
+	uint32_t be_id = htobe32(id);
+	uint32_t count = 0;
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &be_id;
+	key.size = sizeof(be_id);
+	value.data = &count;
+	value.ulen = sizeof(count);
+	value.flags = DB_DBT_USERMEM;
+	
+	int rc = dbp->get(dbp, txn, &key, &value, DB_RMW);
+	if(rc && rc != DB_NOTFOUND) return rc;
+	if(rc == DB_NOTFOUND) count = 0;
+	
+	int64_t new_count = (int64_t)count + delta;
+	count = (new_count > 0) ? (uint32_t)new_count : 0;
+	value.size = sizeof(count);
+	return dbp->put(dbp, txn, &key, &value, 0);
+}
+
+static uint32_t get_member_count(const struct member_dbs * dbs, DB_TXN * txn, uint32_t id)
+{
+	DB * dbp = dbs->ids_db;
+	uint32_t be_id = htobe32(id);
+	uint32_t count = 0;
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &be_id;
+	key.size = sizeof(be_id);
+	value.data = &count;
+	value.ulen = sizeof(count);
+	value.flags = DB_DBT_USERMEM;
+	int rc = dbp->get(dbp, txn, &key, &value, 0);
+	return rc ? 0 : count;
+}
+
+/**********************************************
+ * bitmap containers
+**********************************************/
+static void make_container_key(unsigned char key[6], uint32_t id, uint16_t high)
+{
+	uint32_t be_id = htobe32(id);
+	uint16_t be_high = htobe16(high);
+	memcpy(key, &be_id, 4);
+	memcpy(key + 4, &be_high, 2);
+}
+
+/*
+ * merges 'changes' (one container) into the stored container: OR (add) or ANDNOT (remove).
+ * returns the cardinality change through *p_delta
+ */
+static int update_container(const struct member_dbs * dbs, DB_TXN * txn, uint32_t id, const bitmap_container_t * changes, int remove, int64_t * p_delta)
+{
+	DB * dbp = dbs->bitmaps_db;
+	unsigned char key_data[6];
+	make_container_key(key_data, id, changes->key);
+	
+	unsigned char * buf = malloc(BITMAP_CONTAINER_MAX_SIZE);
+	assert(buf);
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = key_data;
+	key.size = sizeof(key_data);
+	value.data = buf;
+	value.ulen = BITMAP_CONTAINER_MAX_SIZE;
+	value.flags = DB_DBT_USERMEM;
+	
+	bitmap_t stored[1], result[1];
+	bitmap_init(stored);
+	bitmap_init(result);
+	
+	int rc = dbp->get(dbp, txn, &key, &value, DB_RMW);
+	if(0 == rc) {
+		bitmap_container_t container;
+		rc = bitmap_container_deserialize(&container, changes->key, buf, value.size);
+		if(0 == rc) bitmap_append_container(stored, &container);
+	}else if(rc == DB_NOTFOUND) rc = 0;
+	
+	if(0 == rc) {
+		// a single-container view of 'changes' (not owned)
+		bitmap_t view = { .num_containers = 1, .max_containers = 1, .containers = (bitmap_container_t *)changes };
+		if(remove) bitmap_andnot(result, stored, &view);
+		else bitmap_or(result, stored, &view);
+		*p_delta = (int64_t)bitmap_cardinality(result) - (int64_t)bitmap_cardinality(stored);
+		
+		if(0 == *p_delta) rc = 0;
+		else if(0 == result->num_containers) rc = dbp->del(dbp, txn, &key, 0);
+		else {
+			ssize_t cb = bitmap_container_serialize(&result->containers[0], buf, BITMAP_CONTAINER_MAX_SIZE);
+			assert(cb > 0);
+			value.size = cb;
+			rc = dbp->put(dbp, txn, &key, &value, 0);
+		}
+	}
+	
+	bitmap_cleanup(stored);
+	bitmap_cleanup(result);
+	free(buf);
+	return rc;
+}
+
+static int update_members(const struct member_dbs * dbs, DB_TXN * txn, uint32_t id, const bitmap_t * changes, int remove)
+{
+	int64_t total_delta = 0;
+	int rc = 0;
+	for(uint32_t i = 0; 0 == rc && i < changes->num_containers; ++i) {
+		int64_t delta = 0;
+		rc = update_container(dbs, txn, id, &changes->containers[i], remove, &delta);
+		total_delta += delta;
+	}
+	if(0 == rc) rc = adjust_member_count(dbs, txn, id, total_delta);
+	return rc;
+}
+
+static int update_member(const struct member_dbs * dbs, DB_TXN * txn, uint32_t id, uint32_t user_no, int remove)
+{
+	bitmap_t changes[1];
+	bitmap_init(changes);
+	bitmap_add(changes, user_no);
+	int rc = update_members(dbs, txn, id, changes, remove);
+	bitmap_cleanup(changes);
+	return rc;
+}
+
+int db_helpler_load_members(db_helpler_t * db, DB_TXN * txn, enum db_member_kind kind, uint32_t id, bitmap_t * members)
+{
+	struct member_dbs dbs[1];
+	if(get_member_dbs(db, kind, dbs)) return -1;
+	
+	DB * dbp = dbs->bitmaps_db;
+	DBC * cursorp = NULL;
+	int rc = dbp->cursor(dbp, txn, &cursorp, 0);
+	if(rc) return rc;
+	
+	unsigned char prefix[6];
+	make_container_key(prefix, id, 0);
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.flags = DB_DBT_REALLOC;
+	value.flags = DB_DBT_REALLOC;
+	key.data = malloc(sizeof(prefix));
+	assert(key.data);
+	memcpy(key.data, prefix, sizeof(prefix));
+	key.size = sizeof(prefix);
+	
+	bitmap_t loaded[1];
+	bitmap_init(loaded);
+	
+	// containers of the same id are adjacent, in ascending key order
+	int flags = DB_SET_RANGE;
+	while(0 == (rc = cursorp->get(cursorp, &key, &value, flags))) {
+		flags = DB_NEXT;
+		if(key.size != sizeof(prefix) || memcmp(key.data, prefix, 4) != 0) break;
+		
+		uint16_t high = 0;
+		memcpy(&high, (unsigned char *)key.data + 4, 2);
+		
+		bitmap_container_t container;
+		rc = bitmap_container_deserialize(&container, be16toh(high), value.data, value.size);
+		if(rc) break;
+		bitmap_append_container(loaded, &container);
+	}
+	cursorp->close(cursorp);
+	free(key.data);
+	free(value.data);
+	if(rc == DB_NOTFOUND) rc = 0;
+	
+	if(0 == rc) {
+		if(0 == members->num_containers) bitmap_swap(members, loaded);
+		else {
+			bitmap_t merged[1];
+			bitmap_init(merged);
+			bitmap_or(merged, members, loaded);
+			bitmap_swap(members, merged);
+			bitmap_cleanup(merged);
+		}
+	}
+	bitmap_cleanup(loaded);
+	return rc;
+}
+
+/**********************************************
+ * updates
+**********************************************/
+static int set_user_members(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, enum db_member_kind kind, const uint32_t * new_ids, int num_new)
+{
+	struct member_dbs dbs[1];
+	if(get_member_dbs(db, kind, dbs)) return -1;
+	
+	// clearing the memberships of a user without a number (e.g. on delete) is a no-op
+	uint32_t user_no = 0;
+	int rc = get_user_no(db, txn, uid, &user_no, num_new > 0);
+	if(rc == DB_NOTFOUND && 0 == num_new) return 0;
+	if(rc) return rc;
+	
+	uint32_t * old_ids = malloc(MEMBERS_MAX_IDS * sizeof(uint32_t));
+	assert(old_ids);
+	int num_old = 0;
+	rc = get_user_ids(dbs, txn, uid, old_ids, &num_old);
+	
+	for(int i = 0; 0 == rc && i < num_old; ++i) {
+		if(!contains_id(new_ids, num_new, old_ids[i])) rc = update_member(dbs, txn, old_ids[i], user_no, 1);
+	}
+	for(int i = 0; 0 == rc && i < num_new; ++i) {
+		if(!contains_id(old_ids, num_old, new_ids[i])) rc = update_member(dbs, txn, new_ids[i], user_no, 0);
+	}
+	if(0 == rc) rc = put_user_ids(dbs, txn, uid, new_ids, num_new);
+	free(old_ids);
+	return rc;
+}
+
+int db_helpler_set_user_live(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, int live)
+{
+	assert(db && uid);
+	struct member_dbs dbs[1];
+	if(get_member_dbs(db, MEMBERS_KIND_LIVE, dbs)) return -1;
+	
+	uint32_t user_no = 0;
+	int rc = get_user_no(db, txn, uid, &user_no, live);
+	if(rc == DB_NOTFOUND && !live) return 0;
+	if(0 == rc) rc = update_member(dbs, txn, 0, user_no, !live);
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+int db_helpler_set_user_members(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, enum db_member_kind kind, const uint32_t * ids, int count)
+{
+	assert(db && uid);
+	if(count < 0 || count > MEMBERS_MAX_IDS) return -1;
+	
+	uint32_t * new_ids = malloc((count + 1) * sizeof(uint32_t));
+	assert(new_ids);
+	if(count > 0) memcpy(new_ids, ids, count * sizeof(uint32_t));
+	count = sort_unique_ids(new_ids, count);
+	
+	// several records change together, use a transaction if the caller has none
+	DB_TXN * local_txn = NULL;
+	int rc = 0;
+	if(NULL == txn) {
+		rc = db->env->txn_begin(db->env, NULL, &local_txn, 0);
+		txn = local_txn;
+	}
+	if(0 == rc) rc = set_user_members(db, txn, uid, kind, new_ids, count);
+	if(local_txn) {
+		if(0 == rc) rc = local_txn->commit(local_txn, 0);
+		else local_txn->abort(local_txn);
+	}
+	free(new_ids);
+	
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+/**********************************************
+ * queries
+**********************************************/
+struct id_count
+{
+	uint32_t id;
+	uint32_t count;
+};
+static int compare_id_count(const void * a, const void * b)
+{
+	const struct id_count * x = a;
+	const struct id_count * y = b;
+	return (x->count > y->count) - (x->count < y->count);
+}
+
+static int load_union(db_helpler_t * db, DB_TXN * txn, enum db_member_kind kind, const uint32_t * ids, int count, bitmap_t * result)
+{
+	int rc = 0;
+	for(int i = 0; 0 == rc && i < count; ++i) rc = db_helpler_load_members(db, txn, kind, ids[i], result);
+	return rc;
+}
+
+int db_helpler_query_members(db_helpler_t * db, DB_TXN * txn, const struct db_user_query * query, bitmap_t * result)
+{
+	assert(db && query && result);
+	bitmap_clear(result);
+	
+	int has_filter = 0;
+	for(int kind = 0; kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		const struct db_member_filter * filter = &query->members[kind];
+		has_filter |= (filter->num_all > 0 || filter->num_any > 0 || filter->num_none > 0);
+	}
+	if(!has_filter) return 1;
+	
+	bitmap_t acc[1], loaded[1], tmp[1], excluded[1];
+	bitmap_init(acc);
+	bitmap_init(loaded);
+	bitmap_init(tmp);
+	bitmap_init(excluded);
+	int acc_set = 0;
+	int rc = 0;
+	
+	for(int kind = 0; 0 == rc && kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		const struct db_member_filter * filter = &query->members[kind];
+		struct member_dbs dbs[1];
+		if(get_member_dbs(db, kind, dbs)) {
+			rc = -1;
+			break;
+		}
+		
+		// AND: smallest sets first, stop as soon as the intersection is empty
+		if(filter->num_all > 0) {
+			struct id_count * order = calloc(filter->num_all, sizeof(*order));
+			assert(order);
+			for(int i = 0; i < filter->num_all; ++i) {
+				order[i].id = filter->all[i];
+				order[i].count = get_member_count(dbs, txn, filter->all[i]);
+			}
+			qsort(order, filter->num_all, sizeof(*order), compare_id_count);
+			
+			for(int i = 0; 0 == rc && i < filter->num_all; ++i) {
+				if(acc_set && 0 == acc->num_containers) break;
+				bitmap_clear(loaded);
+				rc = db_helpler_load_members(db, txn, kind, order[i].id, loaded);
+				if(rc) break;
+				if(!acc_set) {
+					bitmap_swap(acc, loaded);
+					acc_set = 1;
+					continue;
+				}
+				bitmap_and(tmp, acc, loaded);
+				bitmap_swap(acc, tmp);
+			}
+			free(order);
+		}
+		
+		// OR
+		if(0 == rc && filter->num_any > 0) {
+			bitmap_clear(loaded);
+			rc = load_union(db, txn, kind, filter->any, filter->num_any, loaded);
+			if(0 == rc) {
+				if(!acc_set) {
+					bitmap_swap(acc, loaded);
+					acc_set = 1;
+				}else {
+					bitmap_and(tmp, acc, loaded);
+					bitmap_swap(acc, tmp);
+				}
+			}
+		}
+		
+		// ANDNOT
+		if(0 == rc && filter->num_none > 0) rc = load_union(db, txn, kind, filter->none, filter->num_none, excluded);
+	}
+	
+	if(0 == rc) {
+		// only exclusions: every user not deleted
+		if(!acc_set) rc = db_helpler_load_members(db, txn, MEMBERS_KIND_LIVE, 0, acc);
+	}
+	if(0 == rc) {
+		if(excluded->num_containers > 0) bitmap_andnot(result, acc, excluded);
+		else bitmap_swap(result, acc);
+	}
+	
+	bitmap_cleanup(acc);
+	bitmap_cleanup(loaded);
+	bitmap_cleanup(tmp);
+	bitmap_cleanup(excluded);
+	if(rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return -1;
+	}
+	return 0;
+}
+
+/**********************************************
+ * bulk load
+**********************************************/
+struct db_members_batch_entry
+{
+	enum db_member_kind kind;
+	uint32_t id;
+	bitmap_t users[1];	// new members (user numbers)
+};
+
+struct db_members_batch
+{
+	db_helpler_t * db;
+	int num_entries;
+	int max_entries;
+	struct db_members_batch_entry * entries;
+};
+
+db_members_batch_t * db_members_batch_new(db_helpler_t * db)
+{
+	db_members_batch_t * batch = calloc(1, sizeof(*batch));
+	assert(batch);
+	batch->db = db;
+	return batch;
+}
+
+void db_members_batch_free(db_members_batch_t * batch)
+{
+	if(NULL == batch) return;
+	for(int i = 0; i < batch->num_entries; ++i) bitmap_cleanup(batch->entries[i].users);
+	free(batch->entries);
+	free(batch);
+}
+
+static struct db_members_batch_entry * batch_get_entry(db_members_batch_t * batch, enum db_member_kind kind, uint32_t id)
+{
+	// few distinct roles / groups: linear search
+	for(int i = 0; i < batch->num_entries; ++i) {
+		struct db_members_batch_entry * entry = &batch->entries[i];
+		if(entry->kind == kind && entry->id == id) return entry;
+	}
+	
+	if(batch->num_entries >= batch->max_entries) {
+		int new_size = batch->max_entries ? batch->max_entries * 2 : 16;
+		struct db_members_batch_entry * entries = realloc(batch->entries, new_size * sizeof(*entries));
+		assert(entries);
+		batch->entries = entries;
+		batch->max_entries = new_size;
+	}
+	struct db_members_batch_entry * entry = &batch->entries[batch->num_entries++];
+	entry->kind = kind;
+	entry->id = id;
+	bitmap_init(entry->users);
+	return entry;
+}
+
+int db_members_batch_add(db_members_batch_t * batch, DB_TXN * txn, const uuid_t uid, enum db_member_kind kind, const uint32_t * ids, int count)
+{
+	db_helpler_t * db = batch->db;
+	struct member_dbs dbs[1];
+	if(get_member_dbs(db, kind, dbs) || count < 0 || count > MEMBERS_MAX_IDS) return -1;
+	
+	uint32_t * new_ids = malloc(MEMBERS_MAX_IDS * sizeof(uint32_t));
+	assert(new_ids);
+	if(count > 0) memcpy(new_ids, ids, count * sizeof(uint32_t));
+	count = sort_unique_ids(new_ids, count);
+	
+	int num_old = 0;
+	uint32_t * old_ids = malloc(MEMBERS_MAX_IDS * sizeof(uint32_t));
+	assert(old_ids);
+	int rc = get_user_ids(dbs, txn, uid, old_ids, &num_old);
+	if(0 == rc && num_old > 0) {
+		// existing user (re-import): apply the pending bitmaps first, then update this user's memberships in place
+		rc = db_members_batch_flush(batch, txn);
+		if(0 == rc) rc = set_user_members(db, txn, uid, kind, new_ids, count);
+	}else if(0 == rc && count > 0) {
+		uint32_t user_no = 0;
+		rc = get_user_no(db, txn, uid, &user_no, 1);
+		if(0 == rc) rc = put_user_ids(dbs, txn, uid, new_ids, count);
+		for(int i = 0; 0 == rc && i < count; ++i) {
+			bitmap_add(batch_get_entry(batch, kind, new_ids[i])->users, user_no);
+		}
+	}
+	free(old_ids);
+	free(new_ids);
+	
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+int db_members_batch_add_user(db_members_batch_t * batch, DB_TXN * txn, const uuid_t uid)
+{
+	uint32_t user_no = 0;
+	int rc = get_user_no(batch->db, txn, uid, &user_no, 1);
+	if(0 == rc) bitmap_add(batch_get_entry(batch, MEMBERS_KIND_LIVE, 0)->users, user_no);
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+int db_members_batch_flush(db_members_batch_t * batch, DB_TXN * txn)
+{
+	int rc = 0;
+	for(int i = 0; 0 == rc && i < batch->num_entries; ++i) {
+		struct db_members_batch_entry * entry = &batch->entries[i];
+		if(0 == entry->users->num_containers) continue;
+		
+		struct member_dbs dbs[1];
+		rc = get_member_dbs(batch->db, entry->kind, dbs);
+		if(0 == rc) rc = update_members(dbs, txn, entry->id, entry->users, 0);
+		bitmap_clear(entry->users);
+	}
+	return rc;
+}
+
+/**********************************************
+ * startup
+**********************************************/
+static int is_live_users_filled(db_helpler_t * db)
+{
+	DB * meta_db = db->meta_db;
+	uint32_t filled = 0;
+	DBT key, data;
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = MEMBERS_LIVE_USERS_KEY;
+	key.size = sizeof(MEMBERS_LIVE_USERS_KEY) - 1;
+	data.data = &filled;
+	data.ulen = sizeof(filled);
+	data.flags = DB_DBT_USERMEM;
+	int rc = meta_db->get(meta_db, NULL, &key, &data, 0);
+	return (0 == rc && filled);
+}
+
+static int fill_live_users_shard(db_members_batch_t * batch, DB * dbp, long * p_num_users)
+{
+	DB_ENV * env = batch->db->env;
+	DB_TXN * txn = NULL;
+	DBC * cursorp = NULL;
+	int rc = env->txn_begin(env, NULL, &txn, 0);
+	if(0 == rc) rc = dbp->cursor(dbp, txn, &cursorp, 0);
+	if(rc) {
+		if(txn) txn->abort(txn);
+		return rc;
+	}
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.flags = DB_DBT_REALLOC;
+	value.flags = DB_DBT_PARTIAL;	// the uuids only
+	
+	while(0 == (rc = cursorp->get(cursorp, &key, &value, DB_NEXT))) {
+		if(key.size != sizeof(uuid_t)) continue;
+		rc = db_members_batch_add_user(batch, txn, key.data);
+		if(rc) break;
+		++*p_num_users;
+	}
+	cursorp->close(cursorp);
+	free(key.data);
+	
+	if(rc == DB_NOTFOUND) rc = 0;
+	if(0 == rc) rc = db_members_batch_flush(batch, txn);
+	if(rc) txn->abort(txn);
+	else rc = txn->commit(txn, 0);
+	return rc;
+}
+
+int db_members_fill_live_users(db_helpler_t * db)
+{
+	assert(db && db->live_users_db);
+	if(is_live_users_filled(db)) return 0;
+	
+	// idempotent: an interrupted fill is redone by the next start
+	db_members_batch_t * batch = db_members_batch_new(db);
+	long num_users = 0;
+	int rc = 0;
+	for(int shard = 0; 0 == rc && shard < db->num_shards; ++shard) {
+		rc = fill_live_users_shard(batch, db->shards[shard].users_db, &num_users);
+	}
+	db_members_batch_free(batch);
+	
+	if(0 == rc) {
+		DB * meta_db = db->meta_db;
+		uint32_t filled = 1;
+		DBT key, data;
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		key.data = MEMBERS_LIVE_USERS_KEY;
+		key.size = sizeof(MEMBERS_LIVE_USERS_KEY) - 1;
+		data.data = &filled;
+		data.size = sizeof(filled);
+		rc = meta_db->put(meta_db, NULL, &key, &data, DB_AUTO_COMMIT);
+	}
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	else if(num_users > 0) fprintf(stderr, "live users: %ld\n", num_users);
+	return rc;
+}
@@ -0,0 +1,392 @@
+/*
+ * db-replication.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/time.h>
+
+#include "app.h"
+
+#define DB_REPLICATION_HEARTBEAT_KEY	"rep.heartbeat"
+#define DB_REPLICATION_HEARTBEAT_INTERVAL	(1)	// seconds
+#define DB_REPLICATION_MAX_SITES	(16)
+
+struct db_replication_private
+{
+	db_replication_t * rep;
+	DB_ENV * env;
+	DB * meta_db;
+	
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int startup_done;
+	int is_master;	// current role, as reported by the replication events
+	
+	int num_sites;
+	struct {
+		char host[256];
+		unsigned int port;
+	}sites[DB_REPLICATION_MAX_SITES];
+	
+	pthread_t heartbeat_th;
+	int heartbeat_running;
+	int quit;
+};
+
+static int parse_host_port(const char * address, char * host, size_t size, unsigned int * p_port)
+{
+	if(NULL == address) return -1;
+	const char * colon = strrchr(address, ':');
+	if(NULL == colon || colon == address || (colon - address) >= size) return -1;
+	
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+	
+	int port = atoi(colon + 1);
+	if(port <= 0 || port > 65535) return -1;
+	*p_port = port;
+	return 0;
+}
+
+static int get_ack_policy(const char * name)
+{
+	if(NULL == name || !name[0]) return DB_REPMGR_ACKS_ONE;
+	if(strcasecmp(name, "none") == 0) return DB_REPMGR_ACKS_NONE;
+	if(strcasecmp(name, "all") == 0) return DB_REPMGR_ACKS_ALL;
+	if(strcasecmp(name, "quorum") == 0) return DB_REPMGR_ACKS_QUORUM;
+	return DB_REPMGR_ACKS_ONE;
+}
+
+db_replication_t * db_replication_init(db_replication_t * rep, json_object * jconfig, void * user_data)
+{
+	if(NULL == rep) rep = calloc(1, sizeof(*rep));
+	assert(rep);
+	rep->user_data = user_data;
+	
+	// no "replication" section (or no role): standalone environment, priv stays NULL
+	json_object * jrep = NULL;
+	if(NULL == jconfig || !json_object_object_get_ex(jconfig, "replication", &jrep)) return rep;
+	
+	const char * role = json_get_value(jrep, string, role);
+	if(NULL == role || !role[0]) return rep;
+	
+	if(strcasecmp(role, "master") == 0) rep->is_master = 1;
+	else if(strcasecmp(role, "replica") != 0) {
+		fprintf(stderr, "replication: invalid role '%s'\n", role);
+		exit(1);
+	}
+	
+	if(parse_host_port(json_get_value(jrep, string, local), rep->local_host, sizeof(rep->local_host), &rep->local_port)) {
+		fprintf(stderr, "replication: invalid or missing 'local' address (host:port)\n");
+		exit(1);
+	}
+	
+	const char * master_url = json_get_value(jrep, string, master_url);
+	if(master_url) strncpy(rep->master_url, master_url, sizeof(rep->master_url) - 1);
+	rep->ack_policy = get_ack_policy(json_get_value(jrep, string, ack_policy));
+	rep->startup_timeout = json_get_value(jrep, int, startup_timeout);
+	if(rep->startup_timeout <= 0) rep->startup_timeout = 60;
+	
+	struct db_replication_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->rep = rep;
+	pthread_mutex_init(&priv->mutex, NULL);
+	pthread_cond_init(&priv->cond, NULL);
+	
+	json_object * jsites = NULL;
+	if(json_object_object_get_ex(jrep, "sites", &jsites)) {
+		int num_sites = json_object_array_length(jsites);
+		for(int i = 0; i < num_sites && priv->num_sites < DB_REPLICATION_MAX_SITES; ++i) {
+			const char * address = json_object_get_string(json_object_array_get_idx(jsites, i));
+			if(parse_host_port(address, priv->sites[priv->num_sites].host, sizeof(priv->sites[0].host), &priv->sites[priv->num_sites].port)) {
+				fprintf(stderr, "replication: invalid site address '%s'\n", address);
+				exit(1);
+			}
+			++priv->num_sites;
+		}
+	}
+	if(!rep->is_master && 0 == priv->num_sites) {
+		fprintf(stderr, "replication: a replica needs the master's address in 'sites'\n");
+		exit(1);
+	}
+	if(!rep->is_master && !rep->master_url[0]) {
+		fprintf(stderr, "WARNING: replication: no 'master_url', writes on this replica will be rejected.\n");
+	}
+	
+	rep->priv = priv;
+	return rep;
+}
+
+static void * heartbeat_thread(void * user_data);
+void db_replication_cleanup(db_replication_t * rep)
+{
+	if(NULL == rep || NULL == rep->priv) return;
+	struct db_replication_private * priv = rep->priv;
+	
+	pthread_mutex_lock(&priv->mutex);
+	priv->quit = 1;
+	pthread_cond_broadcast(&priv->cond);
+	pthread_mutex_unlock(&priv->mutex);
+	
+	if(priv->heartbeat_running) pthread_join(priv->heartbeat_th, NULL);
+	priv->heartbeat_running = 0;
+	
+	// the environment (and the replication manager threads) are closed by db_helpler_cleanup()
+	if(priv->env) priv->env->app_private = NULL;
+	pthread_mutex_destroy(&priv->mutex);
+	pthread_cond_destroy(&priv->cond);
+	rep->priv = NULL;
+	free(priv);
+}
+
+static void on_replication_event(DB_ENV * env, u_int32_t event, void * event_info)
+{
+	db_replication_t * rep = env->app_private;
+	if(NULL == rep || NULL == rep->priv) return;
+	struct db_replication_private * priv = rep->priv;
+	
+	switch(event) {
+	case DB_EVENT_REP_STARTUPDONE:
+		pthread_mutex_lock(&priv->mutex);
+		priv->startup_done = 1;
+		pthread_cond_broadcast(&priv->cond);
+		pthread_mutex_unlock(&priv->mutex);
+		fprintf(stderr, "replication: initial sync done\n");
+		break;
+	case DB_EVENT_REP_MASTER:
+		__atomic_store_n(&priv->is_master, 1, __ATOMIC_RELAXED);
+		fprintf(stderr, "replication: this site is the master\n");
+		break;
+	case DB_EVENT_REP_CLIENT:
+		__atomic_store_n(&priv->is_master, 0, __ATOMIC_RELAXED);
+		fprintf(stderr, "replication: this site is a replica\n");
+		break;
+	case DB_EVENT_REP_NEWMASTER:
+		fprintf(stderr, "replication: new master, env_id=%d\n", event_info ? *(int *)event_info : -1);
+		break;
+	case DB_EVENT_REP_PERM_FAILED:
+		fprintf(stderr, "replication: a transaction was not acknowledged by enough replicas\n");
+		break;
+	case DB_EVENT_PANIC:
+		fprintf(stderr, "replication: environment panic\n");
+		break;
+	default:
+		break;
+	}
+}
+
+int db_replication_configure(db_replication_t * rep, DB_ENV * env)
+{
+	if(!db_replication_is_enabled(rep)) return 0;
+	struct db_replication_private * priv = rep->priv;
+	priv->env = env;
+	env->app_private = rep;
+	
+	int rc = env->set_event_notify(env, on_replication_event);
+	if(0 == rc) {
+		DB_SITE * site = NULL;
+		rc = env->repmgr_site(env, rep->local_host, rep->local_port, &site, 0);
+		if(0 == rc) {
+			rc = site->set_config(site, DB_LOCAL_SITE, 1);
+			site->close(site);
+		}
+	}
+	for(int i = 0; 0 == rc && i < priv->num_sites; ++i) {
+		DB_SITE * site = NULL;
+		rc = env->repmgr_site(env, priv->sites[i].host, priv->sites[i].port, &site, 0);
+		if(rc) break;
+		rc = site->set_config(site, DB_BOOTSTRAP_HELPER, 1);
+		site->close(site);
+	}
+	
+	// fixed master: no elections, replicas can never be elected
+	if(0 == rc) rc = env->rep_set_config(env, DB_REPMGR_CONF_ELECTIONS, 0);
+	if(0 == rc) rc = env->rep_set_priority(env, rep->is_master ? 100 : 0);
+	if(0 == rc) rc = env->repmgr_set_ack_policy(env, rep->ack_policy);
+	
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+int db_replication_start(db_replication_t * rep, DB_ENV * env)
+{
+	if(!db_replication_is_enabled(rep)) return 0;
+	struct db_replication_private * priv = rep->priv;
+	
+	int rc = env->repmgr_start(env, 3, rep->is_master ? DB_REP_MASTER : DB_REP_CLIENT);
+	if(rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return rc;
+	}
+	fprintf(stderr, "replication: %s on %s:%u\n", rep->is_master?"master":"replica", rep->local_host, rep->local_port);
+	if(rep->is_master) return 0;
+	
+	// the databases can only be opened once they have been replicated
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += rep->startup_timeout;
+	
+	pthread_mutex_lock(&priv->mutex);
+	while(!priv->startup_done && 0 == rc) {
+		rc = pthread_cond_timedwait(&priv->cond, &priv->mutex, &deadline);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	
+	if(rc) {
+		fprintf(stderr, "replication: initial sync with the master did not complete in %d seconds\n", rep->startup_timeout);
+		return DB_REP_UNAVAIL;
+	}
+	return 0;
+}
+
+/**********************************************
+ * heartbeat / lag
+**********************************************/
+static uint64_t get_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void * heartbeat_thread(void * user_data)
+{
+	struct db_replication_private * priv = user_data;
+	DB * meta_db = priv->meta_db;
+	
+	pthread_mutex_lock(&priv->mutex);
+	while(!priv->quit) {
+		pthread_mutex_unlock(&priv->mutex);
+		
+		uint64_t now = htobe64(get_time_ms());
+		DBT key, value;
+		memset(&key, 0, sizeof(key));
+		memset(&value, 0, sizeof(value));
+		key.data = DB_REPLICATION_HEARTBEAT_KEY;
+		key.size = sizeof(DB_REPLICATION_HEARTBEAT_KEY) - 1;
+		value.data = &now;
+		value.size = sizeof(now);
+		int rc = meta_db->put(meta_db, NULL, &key, &value, 0);
+		if(rc) fprintf(stderr, "replication heartbeat: %s\n", db_strerror(rc));
+		
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += DB_REPLICATION_HEARTBEAT_INTERVAL;
+		
+		pthread_mutex_lock(&priv->mutex);
+		while(!priv->quit && pthread_cond_timedwait(&priv->cond, &priv->mutex, &deadline) != ETIMEDOUT);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	return NULL;
+}
+
+int db_replication_attach(db_replication_t * rep, DB * meta_db)
+{
+	if(!db_replication_is_enabled(rep)) return 0;
+	struct db_replication_private * priv = rep->priv;
+	priv->meta_db = meta_db;
+	if(!rep->is_master) return 0;
+	
+	int rc = pthread_create(&priv->heartbeat_th, NULL, heartbeat_thread, priv);
+	if(rc) return rc;
+	priv->heartbeat_running = 1;
+	return 0;
+}
+
+double db_replication_get_lag(db_replication_t * rep)
+{
+	if(!db_replication_is_replica(rep)) return -1;
+	struct db_replication_private * priv = rep->priv;
+	DB * meta_db = priv->meta_db;
+	if(NULL == meta_db) return -1;
+	
+	uint64_t heartbeat = 0;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = DB_REPLICATION_HEARTBEAT_KEY;
+	key.size = sizeof(DB_REPLICATION_HEARTBEAT_KEY) - 1;
+	value.data = &heartbeat;
+	value.ulen = sizeof(heartbeat);
+	value.flags = DB_DBT_USERMEM;
+	
+	int rc = meta_db->get(meta_db, NULL, &key, &value, 0);
+	if(rc || value.size != sizeof(heartbeat)) return -1;
+	
+	int64_t lag_ms = (int64_t)(get_time_ms() - be64toh(heartbeat)) - DB_REPLICATION_HEARTBEAT_INTERVAL * 1000;
+	return (lag_ms > 0) ? (lag_ms / 1000.0) : 0.0;
+}
+
+void db_replication_append_metrics(db_replication_t * rep, GString * out)
+{
+	if(!db_replication_is_enabled(rep)) return;
+	struct db_replication_private * priv = rep->priv;
+	DB_ENV * env = priv->env;
+	
+	g_string_append_printf(out, 
+		"# HELP webapi_bdb_rep_is_master 1 if this site is the replication master.\n"
+		"# TYPE webapi_bdb_rep_is_master gauge\n"
+		"webapi_bdb_rep_is_master %d\n"
+		"# HELP webapi_bdb_rep_lag_seconds Age of the last replicated master heartbeat (-1: unknown or master).\n"
+		"# TYPE webapi_bdb_rep_lag_seconds gauge\n"
+		"webapi_bdb_rep_lag_seconds %.3f\n",
+		__atomic_load_n(&priv->is_master, __ATOMIC_RELAXED), db_replication_get_lag(rep));
+	
+	DB_REP_STAT * stat = NULL;
+	if(env && 0 == env->rep_stat(env, &stat, 0) && stat) {
+		g_string_append_printf(out, 
+			"# HELP webapi_bdb_rep_log_queued Log records queued on this replica (waiting for missing records).\n"
+			"# TYPE webapi_bdb_rep_log_queued gauge\n"
+			"webapi_bdb_rep_log_queued %lu\n"
+			"# HELP webapi_bdb_rep_sites Sites in the replication group.\n"
+			"# TYPE webapi_bdb_rep_sites gauge\n"
+			"webapi_bdb_rep_sites %lu\n",
+			(unsigned long)stat->st_log_queued, (unsigned long)stat->st_nsites);
+		free(stat);
+	}
+	
+	DB_REPMGR_STAT * repmgr_stat = NULL;
+	if(env && 0 == env->repmgr_stat(env, &repmgr_stat, 0) && repmgr_stat) {
+		g_string_append_printf(out, 
+			"# HELP webapi_bdb_repmgr_perm_failed_total Transactions not acknowledged per the ack policy.\n"
+			"# TYPE webapi_bdb_repmgr_perm_failed_total counter\n"
+			"webapi_bdb_repmgr_perm_failed_total %lu\n"
+			"# HELP webapi_bdb_repmgr_connection_drops_total Dropped replication connections.\n"
+			"# TYPE webapi_bdb_repmgr_connection_drops_total counter\n"
+			"webapi_bdb_repmgr_connection_drops_total %lu\n",
+			(unsigned long)repmgr_stat->st_perm_failed, (unsigned long)repmgr_stat->st_connection_drop);
+		free(repmgr_stat);
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * db-shards.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <db.h>
+#include <uuid/uuid.h>
+#include "app.h"
+
+int db_helpler_get_shard_index(const db_helpler_t * db, const uuid_t uid)
+{
+	if(db->num_shards <= 1) return 0;
+	
+	// FNV-1a over the whole uuid: the bytes of time-based (v1) uuids are not uniform on their own
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < sizeof(uuid_t); ++i) hash = (hash ^ uid[i]) * 16777619u;
+	return hash % db->num_shards;
+}
+
+struct db_users_shard * db_helpler_get_shard(db_helpler_t * db, const uuid_t uid)
+{
+	assert(db && db->shards);
+	return &db->shards[db_helpler_get_shard_index(db, uid)];
+}
+
+/*
+ * sequential, on the caller's transaction: with snapshot_reads every shard is read from the same snapshot
+ * (a transaction can't be shared by threads), and the request already runs on a worker of the pool
+ */
+int db_helpler_foreach_shard(db_helpler_t * db, DB_TXN * txn, db_shard_fn fn, void * contexts, size_t ctx_size)
+{
+	assert(db && fn);
+	int rc = 0;
+	for(int i = 0; 0 == rc && i < db->num_shards; ++i) {
+		rc = fn(db, i, txn, (char *)contexts + i * ctx_size);
+	}
+	return rc;
+}
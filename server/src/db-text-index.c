@@ -0,0 +1,463 @@
+/*
+ * db-text-index.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <db.h>
+#include <uuid/uuid.h>
+#include "app.h"
+#include "user-record.h"
+
+/*
+ * user-trigrams.sdb:
+ *   [field (u8)][3 bytes, ASCII lowercased] ==> user uuid (DB_DUPSORT: each posting list is sorted by uuid)
+ * the associate callback returns all the trigrams of a record at once (DB_DBT_MULTIPLE),
+ * non-ASCII bytes are indexed as they are.
+ */
+#define TEXT_TRIGRAM_KEY_SIZE	(4)
+#define TEXT_DEFAULT_MAX_CANDIDATES	(10000)
+
+static inline unsigned char text_lower(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+}
+
+static size_t text_lower_copy(char * dst, const char * src, size_t length)
+{
+	for(size_t i = 0; i < length; ++i) dst[i] = text_lower(src[i]);
+	dst[length] = '\0';
+	return length;
+}
+
+static int compare_trigram(const void * a, const void * b)
+{
+	return memcmp(a, b, TEXT_TRIGRAM_KEY_SIZE);
+}
+
+/*
+ * appends the trigrams of 'value' to 'keys', returns the number added
+ */
+static size_t make_trigrams(int field, const char * value, size_t length, unsigned char (* keys)[TEXT_TRIGRAM_KEY_SIZE])
+{
+	if(length < 3) return 0;
+	size_t count = 0;
+	for(size_t i = 0; i + 3 <= length; ++i) {
+		unsigned char * key = keys[count++];
+		key[0] = (unsigned char)field;
+		key[1] = text_lower(value[i]);
+		key[2] = text_lower(value[i + 1]);
+		key[3] = text_lower(value[i + 2]);
+	}
+	return count;
+}
+
+static size_t sort_unique_trigrams(unsigned char (* keys)[TEXT_TRIGRAM_KEY_SIZE], size_t count)
+{
+	if(count < 2) return count;
+	qsort(keys, count, TEXT_TRIGRAM_KEY_SIZE, compare_trigram);
+	
+	size_t num_unique = 1;
+	for(size_t i = 1; i < count; ++i) {
+		if(memcmp(keys[i], keys[num_unique - 1], TEXT_TRIGRAM_KEY_SIZE) == 0) continue;
+		if(i != num_unique) memcpy(keys[num_unique], keys[i], TEXT_TRIGRAM_KEY_SIZE);
+		++num_unique;
+	}
+	return num_unique;
+}
+
+/*
+ * skey->data: one malloc'ed block, the DBT array followed by the key bytes (freed by libdb, DB_DBT_APPMALLOC)
+ */
+int db_text_index_associate(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
+{
+	memset(skey, 0, sizeof(*skey));
+	
+	size_t lengths[USER_RECORD_FIELDS] = { 0 };
+	const char * values[USER_RECORD_FIELDS] = { NULL };
+	size_t max_trigrams = 0;
+	for(int field = 0; field < DB_USER_FIELDS_COUNT; ++field) {
+		if(user_record_get_field(value->data, value->size, field, &values[field], &lengths[field])) return DB_DONOTINDEX;
+		if(lengths[field] >= 3) max_trigrams += lengths[field] - 2;
+	}
+	if(0 == max_trigrams) return DB_DONOTINDEX;
+	
+	unsigned char * block = malloc(max_trigrams * (sizeof(DBT) + TEXT_TRIGRAM_KEY_SIZE));
+	if(NULL == block) return ENOMEM;
+	
+	DBT * skeys = (DBT *)block;
+	unsigned char (* keys)[TEXT_TRIGRAM_KEY_SIZE] = (void *)(block + max_trigrams * sizeof(DBT));
+	
+	size_t count = 0;
+	for(int field = 0; field < DB_USER_FIELDS_COUNT; ++field) {
+		count += make_trigrams(field, values[field], lengths[field], &keys[count]);
+	}
+	count = sort_unique_trigrams(keys, count);
+	
+	memset(skeys, 0, count * sizeof(DBT));
+	for(size_t i = 0; i < count; ++i) {
+		skeys[i].data = keys[i];
+		skeys[i].size = TEXT_TRIGRAM_KEY_SIZE;
+	}
+	
+	skey->flags = DB_DBT_MULTIPLE | DB_DBT_APPMALLOC;
+	skey->data = skeys;
+	skey->size = count;
+	return 0;
+}
+
+
+/**********************************************
+ * search
+**********************************************/
+struct text_posting
+{
+	DBC * cursorp;
+	unsigned char key[TEXT_TRIGRAM_KEY_SIZE];
+	db_recno_t count;
+};
+
+struct text_candidate
+{
+	uuid_t uid;
+	int match;	// 0: exact, 1: prefix, 2: substring
+	int field;
+	size_t length;
+};
+
+struct text_search_context
+{
+	struct text_candidate * candidates;
+	long num_candidates;
+	long max_candidates;
+	long num_matched;	// verified and ranked, at the start of 'candidates'
+	int truncated;	// more candidates than max_candidates
+	
+	const char * text;	// lowercased
+	size_t length;
+	int field;
+	
+	DB_TXN * txn;	// snapshot, or NULL
+	DBT value;	// primary records are not needed while intersecting
+};
+
+static int compare_posting_count(const void * a, const void * b)
+{
+	const struct text_posting * pa = a;
+	const struct text_posting * pb = b;
+	return (pa->count > pb->count) - (pa->count < pb->count);
+}
+
+/*
+ * positions 'posting' at the first uuid >= 'uid' (DB_GET_BOTH_RANGE), 'found' receives the uuid
+ */
+static int seek_posting(struct text_posting * posting, DBT * value, const uuid_t uid, int flags, uuid_t found)
+{
+	DBT skey, pkey;
+	memset(&skey, 0, sizeof(skey));
+	memset(&pkey, 0, sizeof(pkey));
+	skey.data = posting->key;
+	skey.size = skey.ulen = TEXT_TRIGRAM_KEY_SIZE;
+	skey.flags = DB_DBT_USERMEM;
+	
+	if(uid) memcpy(found, uid, sizeof(uuid_t));
+	pkey.data = found;
+	pkey.size = pkey.ulen = sizeof(uuid_t);
+	pkey.flags = DB_DBT_USERMEM;
+	
+	int rc = posting->cursorp->pget(posting->cursorp, &skey, &pkey, value, flags);
+	if(0 == rc && pkey.size != sizeof(uuid_t)) rc = DB_NOTFOUND;
+	return rc;
+}
+
+static int add_candidate(struct text_search_context * ctx, const uuid_t uid)
+{
+	if(ctx->num_candidates >= ctx->max_candidates) {
+		ctx->truncated = 1;
+		return 1;
+	}
+	memcpy(ctx->candidates[ctx->num_candidates++].uid, uid, sizeof(uuid_t));
+	return 0;
+}
+
+/*
+ * leapfrog intersection of the posting lists of one field:
+ * the shortest list drives, the others are positioned with DB_GET_BOTH_RANGE,
+ * a bigger uuid from any list becomes the new candidate.
+ */
+static int intersect_postings(struct text_search_context * ctx, struct text_posting * postings, size_t count)
+{
+	int rc = 0;
+	uuid_t candidate;
+	for(size_t i = 0; i < count; ++i) {
+		rc = seek_posting(&postings[i], &ctx->value, NULL, DB_SET, candidate);
+		if(rc) return rc;	// DB_NOTFOUND: a trigram without any user
+		rc = postings[i].cursorp->count(postings[i].cursorp, &postings[i].count, 0);
+		if(rc) return rc;
+	}
+	qsort(postings, count, sizeof(*postings), compare_posting_count);
+	
+	rc = seek_posting(&postings[0], &ctx->value, NULL, DB_SET, candidate);
+	while(0 == rc) {
+		size_t i = 1;
+		for(; i < count; ++i) {
+			uuid_t found;
+			rc = seek_posting(&postings[i], &ctx->value, candidate, DB_GET_BOTH_RANGE, found);
+			if(rc) return rc;
+			if(uuid_compare(found, candidate) == 0) continue;
+			
+			// leapfrog: move the driver to the bigger uuid
+			rc = seek_posting(&postings[0], &ctx->value, found, DB_GET_BOTH_RANGE, candidate);
+			break;
+		}
+		if(i < count) continue;
+		
+		if(add_candidate(ctx, candidate)) return 0;
+		rc = seek_posting(&postings[0], &ctx->value, NULL, DB_NEXT_DUP, candidate);
+	}
+	return rc;
+}
+
+static int search_field(DB * sdbp, struct text_search_context * ctx, int field, const char * text, size_t length)
+{
+	unsigned char (* keys)[TEXT_TRIGRAM_KEY_SIZE] = calloc(length, TEXT_TRIGRAM_KEY_SIZE);
+	struct text_posting * postings = calloc(length, sizeof(*postings));
+	assert(keys && postings);
+	
+	size_t count = make_trigrams(field, text, length, keys);
+	count = sort_unique_trigrams(keys, count);
+	
+	int rc = 0;
+	size_t num_cursors = 0;
+	for(; num_cursors < count; ++num_cursors) {
+		struct text_posting * posting = &postings[num_cursors];
+		memcpy(posting->key, keys[num_cursors], TEXT_TRIGRAM_KEY_SIZE);
+		rc = sdbp->cursor(sdbp, ctx->txn, &posting->cursorp, 0);
+		if(rc) break;
+	}
+	if(0 == rc) rc = intersect_postings(ctx, postings, count);
+	
+	for(size_t i = 0; i < num_cursors; ++i) postings[i].cursorp->close(postings[i].cursorp);
+	free(postings);
+	free(keys);
+	return (rc == DB_NOTFOUND) ? 0 : rc;
+}
+
+static int compare_candidate_uid(const void * a, const void * b)
+{
+	const struct text_candidate * ca = a;
+	const struct text_candidate * cb = b;
+	return uuid_compare(ca->uid, cb->uid);
+}
+
+static int compare_candidate_rank(const void * a, const void * b)
+{
+	const struct text_candidate * ca = a;
+	const struct text_candidate * cb = b;
+	if(ca->match != cb->match) return ca->match - cb->match;
+	if(ca->field != cb->field) return ca->field - cb->field;
+	if(ca->length != cb->length) return (ca->length > cb->length) - (ca->length < cb->length);
+	return uuid_compare(ca->uid, cb->uid);
+}
+
+/*
+ * trigrams only tell that all the 3-byte windows occur, the substring is checked on the record.
+ * returns 0 if one of the searched fields matches
+ */
+static int rank_candidate(struct text_candidate * candidate, const struct db_user_record * user, int field, const char * text, size_t length)
+{
+	const char * values[DB_USER_FIELDS_COUNT] = {
+		[DB_USER_FIELD_NAME] = user->name,
+		[DB_USER_FIELD_EMAIL] = user->email,
+		[DB_USER_FIELD_PHONE] = user->phone,
+	};
+	char lower[USER_RECORD_FIELD_MAX + 1];
+	
+	int ret = -1;
+	for(int i = 0; i < DB_USER_FIELDS_COUNT; ++i) {
+		if(field >= 0 && i != field) continue;
+		if(NULL == values[i]) continue;
+		
+		size_t cb_value = strlen(values[i]);
+		if(cb_value < length || cb_value > USER_RECORD_FIELD_MAX) continue;
+		text_lower_copy(lower, values[i], cb_value);
+		
+		const char * p = strstr(lower, text);
+		if(NULL == p) continue;
+		
+		struct text_candidate rank = { .field = i, .length = cb_value };
+		rank.match = (p != lower) ? 2 : (cb_value == length) ? 0 : 1;
+		if(ret == 0 && compare_candidate_rank(&rank, candidate) >= 0) continue;
+		
+		candidate->match = rank.match;
+		candidate->field = rank.field;
+		candidate->length = rank.length;
+		ret = 0;
+	}
+	return ret;
+}
+
+static int get_user_record(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, DBT * value, struct db_user_record * user)
+{
+	DB * dbp = db_helpler_get_shard(db, uid)->users_db;
+	DBT key;
+	memset(&key, 0, sizeof(key));
+	key.data = (void *)uid;
+	key.size = sizeof(uuid_t);
+	
+	int rc = dbp->get(dbp, txn, &key, value, 0);
+	if(rc) return rc;
+	
+	memset(user, 0, sizeof(*user));
+	if(user_record_decode(value->data, value->size, user) < 0) return DB_NOTFOUND;
+	memcpy(user->uid, uid, sizeof(uuid_t));
+	return 0;
+}
+
+/*
+ * one shard: the candidates of its trigram index are verified on its records
+ */
+static int search_shard(db_helpler_t * db, int shard, DB_TXN * txn, void * shard_ctx)
+{
+	struct text_search_context * ctx = shard_ctx;
+	DB * sdbp = db->shards[shard].sdbs[DB_USER_FIELDS_COUNT];
+	ctx->txn = txn;
+	ctx->value.flags = DB_DBT_PARTIAL;	// pget() would copy the primary record otherwise
+	ctx->candidates = calloc(ctx->max_candidates, sizeof(*ctx->candidates));
+	assert(ctx->candidates);
+	
+	// union of the fields: the same user can be found in several of them
+	int rc = 0;
+	for(int field = 0; 0 == rc && field < DB_USER_FIELDS_COUNT; ++field) {
+		if(ctx->field >= 0 && field != ctx->field) continue;
+		rc = search_field(sdbp, ctx, field, ctx->text, ctx->length);
+	}
+	if(rc) return rc;
+	
+	qsort(ctx->candidates, ctx->num_candidates, sizeof(*ctx->candidates), compare_candidate_uid);
+	
+	DBT value;
+	memset(&value, 0, sizeof(value));
+	value.flags = DB_DBT_REALLOC;
+	
+	long num_matched = 0;
+	for(long i = 0; i < ctx->num_candidates; ++i) {
+		struct text_candidate * candidate = &ctx->candidates[i];
+		if(num_matched > 0 && uuid_compare(candidate->uid, ctx->candidates[num_matched - 1].uid) == 0) continue;
+		
+		struct db_user_record user[1];
+		if(get_user_record(db, txn, candidate->uid, &value, user)) continue;
+		if(rank_candidate(candidate, user, ctx->field, ctx->text, ctx->length)) continue;
+		
+		if(i != num_matched) ctx->candidates[num_matched] = *candidate;
+		++num_matched;
+	}
+	free(value.data);
+	ctx->num_matched = num_matched;
+	return 0;
+}
+
+long db_helpler_text_search(db_helpler_t * db, DB_TXN * txn, const struct db_text_query * query, db_user_visit_fn visit, void * user_data, 
+	long * p_count, int * p_truncated)
+{
+	assert(db && query);
+	if(p_count) *p_count = 0;
+	if(p_truncated) *p_truncated = 0;
+	if(NULL == query->text || NULL == db->user_trigrams_sdb) return -1;
+	
+	size_t length = strlen(query->text);
+	if(length < DB_TEXT_QUERY_MIN_LENGTH || length > USER_RECORD_FIELD_MAX) return -1;
+	if(query->field >= DB_USER_FIELDS_COUNT) return -1;
+	
+	char text[USER_RECORD_FIELD_MAX + 1];
+	text_lower_copy(text, query->text, length);
+	
+	// sharded: every shard verifies up to max_candidates, the best ranked max_candidates are kept
+	int num_shards = db->num_shards;
+	long max_candidates = (query->max_candidates > 0) ? query->max_candidates : TEXT_DEFAULT_MAX_CANDIDATES;
+	struct text_search_context * contexts = calloc(num_shards, sizeof(*contexts));
+	assert(contexts);
+	for(int i = 0; i < num_shards; ++i) {
+		contexts[i].max_candidates = max_candidates;
+		contexts[i].text = text;
+		contexts[i].length = length;
+		contexts[i].field = query->field;
+	}
+	int rc = db_helpler_foreach_shard(db, txn, search_shard, contexts, sizeof(*contexts));
+	
+	struct text_search_context * ctx = &contexts[0];
+	long num_matched = ctx->num_matched;
+	int truncated = ctx->truncated;
+	for(int i = 1; 0 == rc && i < num_shards; ++i) {
+		num_matched += contexts[i].num_matched;
+		truncated |= contexts[i].truncated;
+	}
+	if(0 == rc && num_shards > 1) {
+		ctx->candidates = realloc(ctx->candidates, (num_matched + 1) * sizeof(*ctx->candidates));
+		assert(ctx->candidates);
+		for(int i = 1; i < num_shards; ++i) {
+			memcpy(ctx->candidates + ctx->num_matched, contexts[i].candidates, contexts[i].num_matched * sizeof(*ctx->candidates));
+			ctx->num_matched += contexts[i].num_matched;
+		}
+	}
+	for(int i = 1; i < num_shards; ++i) free(contexts[i].candidates);
+	if(rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		free(ctx->candidates);
+		free(contexts);
+		return -1;
+	}
+	
+	qsort(ctx->candidates, num_matched, sizeof(*ctx->candidates), compare_candidate_rank);
+	if(num_matched > max_candidates) {
+		num_matched = max_candidates;
+		truncated = 1;
+	}
+	
+	DBT value;
+	memset(&value, 0, sizeof(value));
+	value.flags = DB_DBT_REALLOC;
+	
+	long num_visited = 0;
+	for(long i = query->offset; i < num_matched && num_visited < query->limit; ++i) {
+		struct db_user_record user[1];
+		if(get_user_record(db, txn, ctx->candidates[i].uid, &value, user)) continue;
+		++num_visited;
+		if(visit && visit(user, user_data)) break;
+	}
+	
+	free(value.data);
+	free(ctx->candidates);
+	free(contexts);
+	if(p_count) *p_count = num_matched;
+	if(p_truncated) *p_truncated = truncated;
+	return num_visited;
+}
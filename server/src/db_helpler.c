@@ -30,12 +30,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
 
 #include <unistd.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 #include <db.h>
 #include <uuid/uuid.h>
+#include <pthread.h>
 #include "app.h"
+#include "user-record.h"
 
 #define db_check_error(rc) do { \
 		if(0 == rc) break; \
@@ -45,6 +51,53 @@
 
 static int init_databases(db_helpler_t * db, DB_ENV * env);
 static void close_databases(db_helpler_t * db);
+static int migrate_users_db(db_helpler_t * db);
+static int start_index_builds(db_helpler_t * db);
+static void stop_index_builds(db_helpler_t * db);
+static int index_record_for_write(db_helpler_t * db, DB_TXN * txn, int shard, const DBT * key, const DBT * value);
+
+struct build_index_context
+{
+	db_helpler_t * db;
+	int index;
+	long num_keys;
+	int rc;
+};
+struct db_snapshot
+{
+	struct db_snapshot * newer;
+	struct db_snapshot * older;
+	DB_TXN * txn;
+	struct timespec begin;	// CLOCK_MONOTONIC
+};
+struct db_helpler_private
+{
+	int index_states[DB_USERS_SDBS_COUNT];	// enum db_index_state (atomic)
+	DB ** build_sdbs;	// [shard * DB_USERS_SDBS_COUNT + index]: unassociated handles of the indexes not ready at startup
+	
+	pthread_mutex_t snapshot_mutex;
+	struct db_snapshot * newest;	// active snapshots, by start time
+	struct db_snapshot * oldest;
+	uint64_t num_snapshots;
+	
+	pthread_mutex_t count_mutex;
+	long user_counts[DB_USERS_MAX_SHARDS];	// records per shard, counted at 'counted_at' (0: never)
+	time_t counted_at;
+	
+	int quit;	// stops the background index builds
+	int num_builds;
+	pthread_t build_threads[DB_USERS_SDBS_COUNT];
+	struct build_index_context builds[DB_USERS_SDBS_COUNT];
+};
+
+#define DB_HELPLER_MAX_THREADS	(1024)	// threads of all processes sharing the environment
+static int env_is_alive(DB_ENV * env, pid_t pid, db_threadid_t tid, u_int32_t flags)
+{
+	// a process is alive as long as it exists, threads never exit while holding db resources
+	if(pid == getpid()) return 1;
+	return (0 == kill(pid, 0) || errno == EPERM);
+}
+
 db_helpler_t * db_helpler_init(db_helpler_t * db, void * user_data)
 {
 	app_context_t * app = user_data;
@@ -59,6 +112,17 @@ db_helpler_t * db_helpler_init(db_helpler_t * db, void * user_data)
 	const char * db_home = json_get_value(jconfig, string, db_home);
 	if(NULL == db_home) db_home = "db";
 	strncpy(db->db_home, db_home, sizeof(db->db_home));
+	db->lazy_indexes = json_get_value(jconfig, int, lazy_indexes);
+	db->snapshot_reads = json_get_value(jconfig, int, snapshot_reads);
+	db->num_shards = json_get_value(jconfig, int, users_shards);
+	if(db->num_shards <= 0) db->num_shards = 1;
+	if(db->num_shards > DB_USERS_MAX_SHARDS) db->num_shards = DB_USERS_MAX_SHARDS;
+	
+	struct db_helpler_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	pthread_mutex_init(&priv->snapshot_mutex, NULL);
+	pthread_mutex_init(&priv->count_mutex, NULL);
+	db->priv = priv;
 	
 	DB_ENV * env = NULL;
 	int rc = db_env_create(&env, 0);
@@ -69,20 +133,100 @@ db_helpler_t * db_helpler_init(db_helpler_t * db, void * user_data)
 		| DB_INIT_TXN  // Initialize the transaction subsystem. 
 		| DB_INIT_LOCK // Initialize the locking subsystem.
 		| DB_INIT_REP  // Initialize the replication subsystem. 
+		| DB_THREAD    // handles are shared by the worker threads
 		| 0;
+	if(db->run_recovery) env_flags |= DB_RECOVER;
+	
+	// failchk() support, for processes sharing the environment (prefork mode)
+	rc = env->set_thread_count(env, DB_HELPLER_MAX_THREADS);
+	db_check_error(rc);
+	
+	// background index builds hold read locks on users_db while writers update the indexes
+	rc = env->set_lk_detect(env, DB_LOCK_DEFAULT);
+	db_check_error(rc);
+	
+	// snapshot reads keep the versions of the pages updated meanwhile in the cache
+	unsigned int cache_mb = json_get_value(jconfig, int, db_cache_mb);
+	if(cache_mb > 0) {
+		rc = env->set_cachesize(env, cache_mb / 1024, (cache_mb % 1024) * 1024 * 1024, 1);
+		db_check_error(rc);
+	}
+	rc = env->set_isalive(env, env_is_alive);
+	db_check_error(rc);
+	
+	db_replication_t * rep = db_replication_init(db->rep, jconfig, db);
+	assert(rep);
+	if(db_replication_is_enabled(rep) && app->prefork.num_processes > 0) {
+		fprintf(stderr, "replication and prefork mode (processes > 0) can not be combined\n");
+		exit(1);
+	}
+	rc = db_replication_configure(rep, env);
+	db_check_error(rc);
+	
+	db_maintenance_t * maint = db_maintenance_init(db->maint, jconfig, db);
+	assert(maint);
+	
+	struct timespec startup_begin;
+	clock_gettime(CLOCK_MONOTONIC, &startup_begin);
 	
 	rc = env->open(env, db_home, env_flags, 0664);
-	assert(0 == rc);
+	db_check_error(rc);
+	db->env = env;
+	maint->recovered = db->run_recovery;
+	maint->open_seconds = elapsed_seconds(&startup_begin);
+	
+	rc = db_replication_start(rep, env);
+	db_check_error(rc);
 	
 	init_databases(db, env);
+	maint->startup_seconds = elapsed_seconds(&startup_begin);
+	fprintf(stderr, "db: environment opened in %.3f s%s, databases ready in %.3f s\n", 
+		maint->open_seconds, db->run_recovery?" (with recovery)":"", maint->startup_seconds);
+	
+	rc = db_replication_attach(rep, db->meta_db);
+	db_check_error(rc);
+	
+	// prefork mode: the supervisor checkpoints and builds the indexes for all the workers
+	if(app->prefork.worker_id < 0) {
+		rc = db_maintenance_start(maint, env);
+		db_check_error(rc);
+		
+		rc = start_index_builds(db);
+		db_check_error(rc);
+	}
 	return db;
 }
 void db_helpler_cleanup(db_helpler_t * db)
 {
+	db_replication_cleanup(db->rep);	// stops the heartbeat writer
+	stop_index_builds(db);	// resumed on the next start
+	db_maintenance_cleanup(db->maint);	// final checkpoint: nothing to replay on the next start
 	close_databases(db);
+	
+	DB_ENV * env = db->env;
+	db->env = NULL;
+	if(env) env->close(env, 0);
+	
+	struct db_helpler_private * priv = db->priv;
+	db->priv = NULL;
+	if(priv) {
+		pthread_mutex_destroy(&priv->snapshot_mutex);
+		pthread_mutex_destroy(&priv->count_mutex);
+		free(priv);
+	}
 	return;
 }
 
+int db_helpler_failchk(db_helpler_t * db)
+{
+	DB_ENV * env = db->env;
+	if(NULL == env) return -1;
+	
+	int rc = env->failchk(env, 0);
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
 
 
 
@@ -93,102 +237,1684 @@ struct index_db_desc
 	sdb_associate_fn fn;
 };
 
-struct user_data
+/*
+ * secondary keys point into the encoded record (see user-record.h),
+ * only the requested field is located, the record is not decoded.
+ */
+static inline int associate_user_field(const DBT * value, int field, DBT * skey)
 {
-	char name[128];
-	char email[128];
-	char phone[32];
-	// ...
-};
-struct user_model
+	const char * data = NULL;
+	size_t length = 0;
+	memset(skey, 0, sizeof(*skey));
+	if(user_record_get_field(value->data, value->size, field, &data, &length)) return DB_DONOTINDEX;
+	
+	skey->data = (void *)data;
+	skey->size = length + 1;
+	return 0;
+}
+static int associate_user_name(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
 {
-	uuid_t uid;
-	struct user_data user;
+	return associate_user_field(value, DB_USER_FIELD_NAME, skey);
+}
+static int associate_user_email(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
+{
+	return associate_user_field(value, DB_USER_FIELD_EMAIL, skey);
+}
+static int associate_user_phone(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
+{
+	return associate_user_field(value, DB_USER_FIELD_PHONE, skey);
+}
+
+static const struct index_db_desc s_users_index_desc[] = {
+	[DB_USER_FIELD_NAME]  = { "user-names.sdb",  associate_user_name },
+	[DB_USER_FIELD_EMAIL] = { "user-emails.sdb", associate_user_email },
+	[DB_USER_FIELD_PHONE] = { "user-phones.sdb", associate_user_phone },
+	[DB_USER_FIELDS_COUNT] = { "user-trigrams.sdb", db_text_index_associate },
+	{ NULL, }
 };
 
+static int meta_get_u32(db_helpler_t * db, const char * name, u_int32_t * p_value)
+{
+	DB * meta_db = db->meta_db;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)name;
+	key.size = strlen(name);
+	value.data = p_value;
+	value.ulen = sizeof(*p_value);
+	value.flags = DB_DBT_USERMEM;
+	return meta_db->get(meta_db, NULL, &key, &value, 0);
+}
 
+static int meta_put_u32(db_helpler_t * db, const char * name, u_int32_t v)
+{
+	DB * meta_db = db->meta_db;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)name;
+	key.size = strlen(name);
+	value.data = &v;
+	value.size = sizeof(v);
+	return meta_db->put(meta_db, NULL, &key, &value, 0);
+}
 
-static int associate_user_name(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
+/*
+ * rewrites v0 (fixed 288-byte) records with the current encoding, 
+ * in batches of DB_MIGRATE_BATCH_SIZE records per transaction.
+ */
+#define DB_MIGRATE_BATCH_SIZE	(1000)
+static int migrate_users_shard(db_helpler_t * db, int shard, long * p_num_migrated)
 {
-	struct user_data * user = (void *)value->data;
-	assert(user);
-	memset(skey, 0, sizeof(*skey));
-	skey->data = user->name;
-	skey->size = strlen(user->name) + 1;
+	DB_ENV * env = db->env;
+	DB * dbp = db->shards[shard].users_db;
+	unsigned char last_key[sizeof(uuid_t)];
+	int has_last_key = 0;
+	long num_migrated = 0;
+	int rc = 0;
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.flags = DB_DBT_REALLOC;
+	value.flags = DB_DBT_REALLOC;
+	
+	int done = 0;
+	while(!done) {
+		DB_TXN * txn = NULL;
+		DBC * cursorp = NULL;
+		rc = env->txn_begin(env, NULL, &txn, 0);
+		if(rc) break;
+		rc = dbp->cursor(dbp, txn, &cursorp, 0);
+		if(rc) {
+			txn->abort(txn);
+			break;
+		}
+		
+		if(has_last_key) {
+			// continue after the last key of the previous batch
+			key.data = realloc(key.data, sizeof(last_key));
+			assert(key.data);
+			memcpy(key.data, last_key, sizeof(last_key));
+			key.size = sizeof(last_key);
+			rc = cursorp->get(cursorp, &key, &value, DB_SET_RANGE);
+			if(0 == rc && key.size == sizeof(last_key) && memcmp(key.data, last_key, sizeof(last_key)) == 0) {
+				rc = cursorp->get(cursorp, &key, &value, DB_NEXT);
+			}
+		}else {
+			rc = cursorp->get(cursorp, &key, &value, DB_FIRST);
+		}
+		
+		for(int i = 0; 0 == rc && i < DB_MIGRATE_BATCH_SIZE; ++i) {
+			if(user_record_get_version(value.data, value.size) == 0) {
+				struct db_user_record user[1];
+				memset(user, 0, sizeof(user));
+				
+				unsigned char data[USER_RECORD_MAX_SIZE];
+				ssize_t cb_data = -1;
+				if(user_record_decode(value.data, value.size, user) == 0) cb_data = user_record_encode(user, data, sizeof(data));
+				if(cb_data > 0) {
+					DBT new_value;
+					memset(&new_value, 0, sizeof(new_value));
+					new_value.data = data;
+					new_value.size = cb_data;
+					rc = index_record_for_write(db, txn, shard, &key, &value);
+					if(0 == rc) rc = cursorp->put(cursorp, &key, &new_value, DB_CURRENT);
+					if(rc) break;
+					++num_migrated;
+				}
+			}
+			if(key.size == sizeof(last_key)) {
+				memcpy(last_key, key.data, sizeof(last_key));
+				has_last_key = 1;
+			}
+			rc = cursorp->get(cursorp, &key, &value, DB_NEXT);
+		}
+		if(rc == DB_NOTFOUND) {
+			done = 1;
+			rc = 0;
+		}
+		cursorp->close(cursorp);
+		
+		if(rc) {
+			txn->abort(txn);
+			break;
+		}
+		rc = txn->commit(txn, 0);
+		if(rc) break;
+	}
+	free(key.data);
+	free(value.data);
+	*p_num_migrated += num_migrated;
+	return rc;
+}
+
+static int migrate_users_db(db_helpler_t * db)
+{
+	static const char * format_name = "users_db.format";
+	u_int32_t format = 0;
+	if(0 == meta_get_u32(db, format_name, &format) && format >= USER_RECORD_VERSION) return 0;
+	
+	long num_migrated = 0;
+	for(int i = 0; i < db->num_shards; ++i) {
+		int rc = migrate_users_shard(db, i, &num_migrated);
+		if(rc) return rc;
+	}
+	
+	if(num_migrated > 0) fprintf(stderr, "users_db: %ld records migrated to format v%d\n", num_migrated, USER_RECORD_VERSION);
+	return meta_put_u32(db, format_name, USER_RECORD_VERSION);
+}
+
+static int associate_user_no(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
+{
+	// user_nos_db: user number ==> uuid,  user_nos_sdb: uuid ==> user number
+	if(value->size != sizeof(uuid_t)) return DB_DONOTINDEX;
+	skey->data = value->data;
+	skey->size = value->size;
 	return 0;
 }
-static int associate_user_email(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
+
+static int open_member_databases(db_helpler_t * db, DB_ENV * env, int db_flags, int is_replica)
 {
-	struct user_data * user = (void *)value->data;
-	assert(user);
-	memset(skey, 0, sizeof(*skey));
-	skey->data = user->email;
-	skey->size = strlen(user->email) + 1;
+	static const struct {
+		const char * name;
+		size_t offset;
+	}member_dbs[] = {
+		{ "user-nos.db",    offsetof(db_helpler_t, user_nos_db) },
+		{ "user-nos.sdb",   offsetof(db_helpler_t, user_nos_sdb) },
+		{ "groups.db",      offsetof(db_helpler_t, groups_db) },
+		{ "group-users.db", offsetof(db_helpler_t, group_users_db) },
+		{ "user-groups.db", offsetof(db_helpler_t, users_group_sdb) },
+		{ "roles.db",       offsetof(db_helpler_t, roles_db) },
+		{ "role-users.db",  offsetof(db_helpler_t, role_users_db) },
+		{ "user-roles.db",  offsetof(db_helpler_t, users_role_sdb) },
+		{ "live-users.db",  offsetof(db_helpler_t, live_users_db) },
+	};
+	const int mode = 0666;
+	int rc = 0;
+	for(size_t i = 0; i < sizeof(member_dbs) / sizeof(member_dbs[0]); ++i) {
+		DB * dbp = NULL;
+		rc = db_create(&dbp, env, 0);
+		if(rc) return rc;
+		rc = dbp->open(dbp, NULL, member_dbs[i].name, NULL, DB_BTREE, db_flags, mode);
+		if(rc) {
+			dbp->close(dbp, 0);
+			return rc;
+		}
+		*(DB **)((char *)db + member_dbs[i].offset) = dbp;
+	}
+	
+	DB * dbp = db->user_nos_db;
+	return dbp->associate(dbp, NULL, db->user_nos_sdb, associate_user_no, is_replica ? 0 : DB_CREATE);
+}
+
+static void close_member_databases(db_helpler_t * db)
+{
+	DB ** dbs[] = {
+		&db->user_nos_sdb, &db->user_nos_db,	// secondary first
+		&db->groups_db, &db->group_users_db, &db->users_group_sdb,
+		&db->roles_db, &db->role_users_db, &db->users_role_sdb,
+		&db->live_users_db,
+	};
+	for(size_t i = 0; i < sizeof(dbs) / sizeof(dbs[0]); ++i) {
+		DB * dbp = *dbs[i];
+		*dbs[i] = NULL;
+		if(dbp) dbp->close(dbp, 0);
+	}
+}
+
+/*
+ * secondary index states, persisted in meta_db as "index.<sdb name>" (shared by all processes, replicated):
+ * DB_INDEX_BUILDING until the background build has indexed every record.
+ * No record: the index was built by associate(DB_CREATE) before the states were recorded.
+ */
+static int set_index_state(db_helpler_t * db, int index, enum db_index_state state)
+{
+	struct db_helpler_private * priv = db->priv;
+	int rc = 0;
+	if(state != DB_INDEX_FAILED) {	// a failed build is retried by the next start
+		char name[100] = "";
+		snprintf(name, sizeof(name), "index.%s", s_users_index_desc[index].sdb_name);
+		rc = meta_put_u32(db, name, state);
+	}
+	if(0 == rc) __atomic_store_n(&priv->index_states[index], state, __ATOMIC_RELEASE);
+	return rc;
+}
+static enum db_index_state load_index_state(db_helpler_t * db, int index)
+{
+	char name[100] = "";
+	snprintf(name, sizeof(name), "index.%s", s_users_index_desc[index].sdb_name);
+	u_int32_t state = 0;
+	if(meta_get_u32(db, name, &state) || state != DB_INDEX_BUILDING) return DB_INDEX_READY;
+	return DB_INDEX_BUILDING;
+}
+
+static int open_index_db(DB_ENV * env, const char * sdb_name, int db_flags, DB ** p_sdbp, int * p_created)
+{
+	// a handle can't be reused after a failed open
+	for(int create = 0; create < 2; ++create) {
+		if(create && !(db_flags & DB_CREATE)) break;
+		
+		DB * sdbp = NULL;
+		int rc = db_create(&sdbp, env, 0);
+		if(rc) return rc;
+		rc = sdbp->set_flags(sdbp, DB_DUPSORT);	// support duplicates for index db
+		if(0 == rc) rc = sdbp->open(sdbp, NULL, sdb_name, NULL, DB_BTREE, create ? db_flags : (db_flags & ~DB_CREATE), 0666);
+		if(0 == rc) {
+			*p_sdbp = sdbp;
+			*p_created = create;
+			return 0;
+		}
+		sdbp->close(sdbp, 0);
+		if(rc != ENOENT) return rc;
+	}
+	return ENOENT;
+}
+
+/*
+ * "users.db" ==> "users.<shard>.db" when the users are sharded
+ */
+static const char * get_shard_file_name(const db_helpler_t * db, int shard, const char * name, char * buf, size_t size)
+{
+	if(db->num_shards <= 1) return name;
+	const char * ext = strrchr(name, '.');
+	if(NULL == ext) ext = name + strlen(name);
+	snprintf(buf, size, "%.*s.%d%s", (int)(ext - name), name, shard, ext);
+	return buf;
+}
+
+/*
+ * the shard count is fixed once the users are stored: a different one would look them up in the wrong shard
+ */
+static int check_users_shards(db_helpler_t * db, int is_replica)
+{
+	static const char * shards_name = "users_db.shards";
+	u_int32_t num_shards = 0;
+	int rc = meta_get_u32(db, shards_name, &num_shards);
+	if(rc == DB_NOTFOUND) {
+		// new databases, or created before sharding (one users.db)
+		char path[PATH_MAX] = "";
+		snprintf(path, sizeof(path), "%s/users.db", db->db_home);
+		num_shards = (0 == access(path, F_OK)) ? 1 : db->num_shards;
+		rc = is_replica ? 0 : meta_put_u32(db, shards_name, num_shards);
+	}
+	if(rc) return rc;
+	if(num_shards != db->num_shards) {
+		fprintf(stderr, "users_shards is %d, but the users in %s are stored in %u shard(s): "
+			"import them into a new db_home to change it\n", db->num_shards, db->db_home, num_shards);
+		return EINVAL;
+	}
 	return 0;
 }
-static int associate_user_phone(DB * sdbp, const DBT * key, const DBT * value, DBT * skey)
+
+/*
+ * created[i]: set if index i is new in this shard
+ */
+static int open_users_shard(db_helpler_t * db, DB_ENV * env, int shard, int db_flags, int created[DB_USERS_SDBS_COUNT])
 {
-	struct user_data * user = (void *)value->data;
-	assert(user);
-	memset(skey, 0, sizeof(*skey));
-	skey->data = user->phone;
-	skey->size = strlen(user->phone) + 1;
+	struct db_users_shard * users = &db->shards[shard];
+	char name[100] = "";
+	DB * dbp = NULL;
+	int rc = db_create(&dbp, env, 0);
+	if(rc) return rc;
+	
+	// no DB_RECNUM: it would serialize the writers on the root page (and could not be set on an existing users.db).
+	// The lists skip to their start with a cursor, total_count is cached (see get_user_counts())
+	rc = dbp->open(dbp, NULL, get_shard_file_name(db, shard, "users.db", name, sizeof(name)), NULL, DB_BTREE, db_flags, 0666);
+	if(rc) {
+		dbp->close(dbp, 0);
+		return rc;
+	}
+	users->users_db = dbp;
+	
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+		const struct index_db_desc * desc = &s_users_index_desc[i];
+		int is_new = 0;
+		DB * sdbp = NULL;
+		rc = open_index_db(env, get_shard_file_name(db, shard, desc->sdb_name, name, sizeof(name)), db_flags, &sdbp, &is_new);
+		if(rc) return rc;
+		users->sdbs[i] = sdbp;
+		
+		// deferred: the index is rebuilt by db_helpler_rebuild_indexes() after a bulk load
+		if(db->defer_indexes) continue;
+		
+		// no DB_CREATE (which would build a new index here, before the first request is served):
+		// the writes maintain the index from now on, a new or incomplete one is built by start_index_builds()
+		// (until then, a record is indexed before it is updated or deleted: see index_record_for_write())
+		rc = dbp->associate(dbp, NULL, sdbp, desc->fn, 0);
+		if(rc) return rc;
+		created[i] |= is_new;
+	}
+	return 0;
+}
+
+/*
+ * an associated secondary can't be written directly: the keys put by the writers into an index
+ * that is not ready yet go through a second, unassociated handle (see index_record_for_write())
+ */
+static int open_build_sdbs(db_helpler_t * db, DB_ENV * env, int db_flags)
+{
+	struct db_helpler_private * priv = db->priv;
+	priv->build_sdbs = calloc(db->num_shards * DB_USERS_SDBS_COUNT, sizeof(*priv->build_sdbs));
+	assert(priv->build_sdbs);
+	
+	for(int shard = 0; shard < db->num_shards; ++shard) {
+		for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+			if(priv->index_states[i] == DB_INDEX_READY) continue;
+			
+			char name[100] = "";
+			DB * sdbp = NULL;
+			int rc = db_create(&sdbp, env, 0);
+			if(0 == rc) rc = sdbp->set_flags(sdbp, DB_DUPSORT);
+			if(0 == rc) rc = sdbp->open(sdbp, NULL, get_shard_file_name(db, shard, s_users_index_desc[i].sdb_name, name, sizeof(name)), NULL, DB_BTREE, 
+				db_flags & ~DB_CREATE, 0666);
+			if(rc) {
+				if(sdbp) sdbp->close(sdbp, 0);
+				return rc;
+			}
+			priv->build_sdbs[shard * DB_USERS_SDBS_COUNT + i] = sdbp;
+		}
+	}
 	return 0;
 }
 
+/*
+ * bulk load: the indexes are marked as being built before the first row is written, and emptied
+ * (an overwritten row would leave its old keys behind). If the load or db_helpler_rebuild_indexes()
+ * does not complete, the next start builds them from users_db.
+ */
+static int begin_deferred_indexes(db_helpler_t * db)
+{
+	int rc = 0;
+	for(int i = 0; 0 == rc && i < DB_USERS_SDBS_COUNT; ++i) {
+		rc = set_index_state(db, i, DB_INDEX_BUILDING);
+	}
+	for(int shard = 0; 0 == rc && shard < db->num_shards; ++shard) {
+		for(int i = 0; 0 == rc && i < DB_USERS_SDBS_COUNT; ++i) {
+			DB * sdbp = db->shards[shard].sdbs[i];
+			u_int32_t num_discarded = 0;
+			rc = sdbp->truncate(sdbp, NULL, &num_discarded, DB_AUTO_COMMIT);
+		}
+	}
+	return rc;
+}
+
 static int init_databases(db_helpler_t * db, DB_ENV * env)
 {
 	// TODO:
 	
-	DB * dbp = NULL;
-	DB * sdbp = NULL;
 	int rc = 0;
 	
-	rc = db_create(&dbp, env, 0);
-	if(rc) {
-		fprintf(stderr, "%s: %s\n", __FUNCTION__, db_strerror(rc));
-		exit(1);
-	}
+	// a replica opens the databases created by the master, read-only
+	int is_replica = db_replication_is_replica(db->rep);
 	
 	const int mode = 0666;
-	int db_flags = DB_AUTO_COMMIT | DB_CREATE;
-	rc = dbp->open(dbp, NULL, "users.db", NULL, DB_BTREE, db_flags, mode);
+	int db_flags = DB_AUTO_COMMIT | DB_THREAD | (is_replica ? 0 : DB_CREATE);
+	int queue_flags = db_flags;	// DB_QUEUE does not support multiversion
+	if(db->snapshot_reads) db_flags |= DB_MULTIVERSION;	// copy-on-write pages for DB_TXN_SNAPSHOT readers
+	
+	DB * meta_db = NULL;
+	rc = db_create(&meta_db, env, 0);
 	db_check_error(rc);
-	db->users_db = dbp;
+	rc = meta_db->open(meta_db, NULL, "meta.db", NULL, DB_BTREE, db_flags, mode);
+	db_check_error(rc);
+	db->meta_db = meta_db;
 	
+	rc = check_users_shards(db, is_replica);
+	if(rc) exit(1);
 	
-	static struct index_db_desc index_users_db[] = {
-		[0] = { "user-names.sdb",  associate_user_name },
-		[1] = { "user-emails.sdb", associate_user_email },
-		[2] = { "user-phones.sdb", associate_user_phone },
-		{ NULL, }
-	};
+	// change feed: fixed-length records, the queue extents are removed once consumed
+	DB * changes_db = NULL;
+	rc = db_create(&changes_db, env, 0);
+	db_check_error(rc);
+	rc = changes_db->set_re_len(changes_db, DB_CHANGE_RECORD_SIZE);
+	db_check_error(rc);
+	rc = changes_db->set_q_extentsize(changes_db, 64);
+	db_check_error(rc);
+	rc = changes_db->open(changes_db, NULL, "changes.db", NULL, DB_QUEUE, queue_flags, mode);
+	db_check_error(rc);
+	db->changes_db = changes_db;
 	
-	for(int i = 0; ; ++i) {
-		struct index_db_desc * desc = &index_users_db[i];
-		if(NULL == desc->sdb_name) break;
-		sdbp = NULL;
-		rc = db_create(&sdbp, env, 0); 
+	db->shards = calloc(db->num_shards, sizeof(*db->shards));
+	assert(db->shards);
+	int created[DB_USERS_SDBS_COUNT] = { 0 };
+	for(int shard = 0; shard < db->num_shards; ++shard) {
+		rc = open_users_shard(db, env, shard, db_flags, created);
 		db_check_error(rc);
-		
-		rc = sdbp->set_flags(sdbp, DB_DUPSORT);	// support duplicates for index db
-		db_check_error(rc);
-		
-		rc = sdbp->open(sdbp, NULL, desc->sdb_name, NULL, DB_BTREE, db_flags, mode);
+	}
+	db->users_db = db->shards[0].users_db;
+	memcpy(db->users_sdbs, db->shards[0].sdbs, sizeof(db->shards[0].sdbs));
+	
+	// one state per index, for all the shards
+	struct db_helpler_private * priv = db->priv;
+	if(db->defer_indexes && !is_replica) {
+		rc = begin_deferred_indexes(db);
 		db_check_error(rc);
-		
-		dbp->associate(dbp, NULL, sdbp, desc->fn, DB_CREATE);
+	}
+	for(int i = 0; !db->defer_indexes && i < DB_USERS_SDBS_COUNT; ++i) {
+		if(created[i]) {
+			rc = set_index_state(db, i, DB_INDEX_BUILDING);
+			db_check_error(rc);
+		}else priv->index_states[i] = load_index_state(db, i);
+	}
+	if(!db->defer_indexes && !is_replica) {
+		rc = open_build_sdbs(db, env, db_flags);
 		db_check_error(rc);
-		
-		db->users_sdbs[i] = sdbp;
 	}
 	
-	return -1;
+	rc = open_member_databases(db, env, db_flags, is_replica);
+	db_check_error(rc);
+	
+	if(is_replica) return 0;	// migrated on the master
+	rc = migrate_users_db(db);
+	db_check_error(rc);
+	rc = db_members_fill_live_users(db);
+	db_check_error(rc);
+	return 0;
 }
 static void close_databases(db_helpler_t * db)
 {
-	// TODO
+	close_member_databases(db);
 	
+	struct db_helpler_private * priv = db->priv;
+	for(int i = 0; priv->build_sdbs && i < db->num_shards * DB_USERS_SDBS_COUNT; ++i) {
+		DB * sdbp = priv->build_sdbs[i];
+		if(sdbp) sdbp->close(sdbp, 0);
+	}
+	free(priv->build_sdbs);
+	priv->build_sdbs = NULL;
+	
+	for(int shard = 0; db->shards && shard < db->num_shards; ++shard) {
+		struct db_users_shard * users = &db->shards[shard];
+		
+		// secondaries first
+		for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+			DB * sdbp = users->sdbs[i];
+			users->sdbs[i] = NULL;
+			if(sdbp) sdbp->close(sdbp, 0);
+		}
+		
+		DB * dbp = users->users_db;
+		users->users_db = NULL;
+		if(dbp) dbp->close(dbp, 0);
+	}
+	free(db->shards);
+	db->shards = NULL;
+	db->users_db = NULL;
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) db->users_sdbs[i] = NULL;
+	
+	DB * changes_db = db->changes_db;
+	db->changes_db = NULL;
+	if(changes_db) changes_db->close(changes_db, 0);
 	
+	DB * meta_db = db->meta_db;
+	db->meta_db = NULL;
+	if(meta_db) meta_db->close(meta_db, 0);
 	return;
 }
+
+
+/**********************************************
+ * users_db queries
+**********************************************/
+static int decode_user_record(const DBT * key, const DBT * value, struct db_user_record * user)
+{
+	if(key->size != sizeof(uuid_t)) return -1;
+	if(user_record_decode(value->data, value->size, user) < 0) return -1;
+	
+	memcpy(user->uid, key->data, sizeof(uuid_t));
+	return 0;
+}
+
+#define DB_USERS_COUNT_TTL	(10)	// seconds
+
+/*
+ * records per shard. Without record numbers only a full stat (a walk of the leaf pages) is exact:
+ * the counts are cached for DB_USERS_COUNT_TTL seconds, the writes made meanwhile are not in them.
+ */
+static int get_user_counts(db_helpler_t * db, long counts[])
+{
+	struct db_helpler_private * priv = db->priv;
+	int rc = 0;
+	
+	pthread_mutex_lock(&priv->count_mutex);
+	time_t now = time(NULL);
+	if(0 == priv->counted_at || (now - priv->counted_at) >= DB_USERS_COUNT_TTL) {
+		long user_counts[DB_USERS_MAX_SHARDS] = { 0 };
+		for(int i = 0; 0 == rc && i < db->num_shards; ++i) {
+			DB * dbp = db->shards[i].users_db;
+			DB_BTREE_STAT * stat = NULL;
+			rc = dbp->stat(dbp, NULL, &stat, DB_READ_COMMITTED);
+			if(0 == rc) user_counts[i] = stat->bt_nkeys;
+			free(stat);
+		}
+		if(0 == rc) {
+			memcpy(priv->user_counts, user_counts, sizeof(priv->user_counts));
+			priv->counted_at = now;
+		}
+	}
+	if(0 == rc) memcpy(counts, priv->user_counts, sizeof(long) * db->num_shards);
+	pthread_mutex_unlock(&priv->count_mutex);
+	return rc;
+}
+
+/*
+ * environment statistics (buffer pool, locks, transactions), prometheus text format
+ */
+#define append_stat(out, name, type, help, value) g_string_append_printf(out, \
+		"# HELP " name " " help "\n"	\
+		"# TYPE " name " " type "\n"	\
+		name " %lu\n", (unsigned long)(value))
+int db_helpler_append_metrics(db_helpler_t * db, GString * out)
+{
+	DB_ENV * env = db->env;
+	if(NULL == env) return -1;
+	
+	DB_MPOOL_STAT * mpool = NULL;
+	int rc = env->memp_stat(env, &mpool, NULL, 0);
+	if(0 == rc && mpool) {
+		append_stat(out, "webapi_bdb_cache_hits_total", "counter", "Pages found in the buffer pool.", mpool->st_cache_hit);
+		append_stat(out, "webapi_bdb_cache_misses_total", "counter", "Pages not found in the buffer pool.", mpool->st_cache_miss);
+		append_stat(out, "webapi_bdb_pages_read_total", "counter", "Pages read into the buffer pool.", mpool->st_page_in);
+		append_stat(out, "webapi_bdb_pages_written_total", "counter", "Pages written from the buffer pool.", mpool->st_page_out);
+		append_stat(out, "webapi_bdb_clean_evictions_total", "counter", "Clean pages evicted from the buffer pool.", mpool->st_ro_evict);
+		append_stat(out, "webapi_bdb_dirty_evictions_total", "counter", "Dirty pages evicted from the buffer pool.", mpool->st_rw_evict);
+		append_stat(out, "webapi_bdb_dirty_pages", "gauge", "Dirty pages in the buffer pool.", mpool->st_page_dirty);
+		append_stat(out, "webapi_bdb_cache_pages", "gauge", "Pages in the buffer pool, including the versions kept for snapshots.", mpool->st_pages);
+		append_stat(out, "webapi_bdb_cache_bytes", "gauge", "Size of the buffer pool.", (uint64_t)mpool->st_gbytes * 1024 * 1024 * 1024 + mpool->st_bytes);
+		append_stat(out, "webapi_bdb_mvcc_frozen_total", "counter", "Page versions written to freezer files because the buffer pool was full.", mpool->st_mvcc_frozen);
+		append_stat(out, "webapi_bdb_mvcc_thawed_total", "counter", "Frozen page versions read back.", mpool->st_mvcc_thawed);
+		append_stat(out, "webapi_bdb_mvcc_freed_total", "counter", "Page versions freed after the last snapshot using them ended.", mpool->st_mvcc_freed);
+		free(mpool);
+	}
+	
+	DB_LOCK_STAT * lock = NULL;
+	if(0 == rc) rc = env->lock_stat(env, &lock, 0);
+	if(0 == rc && lock) {
+		append_stat(out, "webapi_bdb_lock_requests_total", "counter", "Lock requests.", lock->st_nrequests);
+		append_stat(out, "webapi_bdb_lock_waits_total", "counter", "Lock requests that had to wait.", lock->st_lock_wait);
+		append_stat(out, "webapi_bdb_lock_nowaits_total", "counter", "Lock requests granted without waiting.", lock->st_lock_nowait);
+		append_stat(out, "webapi_bdb_deadlocks_total", "counter", "Deadlocks detected.", lock->st_ndeadlocks);
+		append_stat(out, "webapi_bdb_lock_timeouts_total", "counter", "Lock requests that timed out.", lock->st_nlocktimeouts);
+		append_stat(out, "webapi_bdb_locks", "gauge", "Locks currently held.", lock->st_nlocks);
+		free(lock);
+	}
+	
+	DB_TXN_STAT * txn = NULL;
+	if(0 == rc) rc = env->txn_stat(env, &txn, 0);
+	if(0 == rc && txn) {
+		append_stat(out, "webapi_bdb_txn_begins_total", "counter", "Transactions started.", txn->st_nbegins);
+		append_stat(out, "webapi_bdb_txn_commits_total", "counter", "Transactions committed.", txn->st_ncommits);
+		append_stat(out, "webapi_bdb_txn_aborts_total", "counter", "Transactions aborted.", txn->st_naborts);
+		append_stat(out, "webapi_bdb_txn_active", "gauge", "Active transactions.", txn->st_nactive);
+		append_stat(out, "webapi_bdb_txn_max_active", "gauge", "Max active transactions since the environment was opened.", txn->st_maxnactive);
+		append_stat(out, "webapi_bdb_txn_snapshots", "gauge", "Active snapshot transactions (all processes).", txn->st_nsnapshot);
+		free(txn);
+	}
+	
+	struct db_helpler_private * priv = db->priv;
+	pthread_mutex_lock(&priv->snapshot_mutex);
+	double oldest_age = 0;
+	if(priv->oldest) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		oldest_age = (double)(now.tv_sec - priv->oldest->begin.tv_sec) + (double)(now.tv_nsec - priv->oldest->begin.tv_nsec) / 1000000000.0;
+	}
+	uint64_t num_snapshots = priv->num_snapshots;
+	pthread_mutex_unlock(&priv->snapshot_mutex);
+	append_stat(out, "webapi_snapshot_reads_total", "counter", "Read-only requests served from a snapshot.", num_snapshots);
+	g_string_append_printf(out, 
+		"# HELP webapi_snapshot_oldest_seconds Age of the oldest active snapshot of this process (versions since then are kept).\n"
+		"# TYPE webapi_snapshot_oldest_seconds gauge\n"
+		"webapi_snapshot_oldest_seconds %.3f\n", oldest_age);
+	
+	db_replication_append_metrics(db->rep, out);
+	db_maintenance_append_metrics(db->maint, env, out);
+	
+	g_string_append(out, 
+		"# HELP webapi_bdb_index_ready Secondary index ready to serve queries (0: being built).\n"
+		"# TYPE webapi_bdb_index_ready gauge\n");
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+		g_string_append_printf(out, "webapi_bdb_index_ready{index=\"%s\"} %d\n", 
+			s_users_index_desc[i].sdb_name, db_helpler_get_index_state(db, i) == DB_INDEX_READY);
+	}
+	
+	// the last counts of the lists (a scrape does not walk the shards)
+	pthread_mutex_lock(&priv->count_mutex);
+	if(db->num_shards > 1 && priv->counted_at) {
+		g_string_append(out, 
+			"# HELP webapi_users_shard_records Users stored in each shard (the uuid hash should spread them evenly).\n"
+			"# TYPE webapi_users_shard_records gauge\n");
+		for(int i = 0; i < db->num_shards; ++i) {
+			g_string_append_printf(out, "webapi_users_shard_records{shard=\"%d\"} %ld\n", i, priv->user_counts[i]);
+		}
+	}
+	pthread_mutex_unlock(&priv->count_mutex);
+	
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+#undef append_stat
+
+int db_helpler_begin_snapshot(db_helpler_t * db, DB_TXN ** p_txn)
+{
+	assert(db && db->priv && p_txn);
+	*p_txn = NULL;
+	if(!db->snapshot_reads) return 0;
+	
+	DB_ENV * env = db->env;
+	DB_TXN * txn = NULL;
+	int rc = env->txn_begin(env, NULL, &txn, DB_TXN_SNAPSHOT);
+	if(rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return rc;
+	}
+	
+	struct db_snapshot * snapshot = calloc(1, sizeof(*snapshot));
+	assert(snapshot);
+	snapshot->txn = txn;
+	clock_gettime(CLOCK_MONOTONIC, &snapshot->begin);
+	txn->app_private = snapshot;
+	
+	struct db_helpler_private * priv = db->priv;
+	pthread_mutex_lock(&priv->snapshot_mutex);
+	snapshot->older = priv->newest;
+	if(priv->newest) priv->newest->newer = snapshot;
+	else priv->oldest = snapshot;
+	priv->newest = snapshot;
+	++priv->num_snapshots;
+	pthread_mutex_unlock(&priv->snapshot_mutex);
+	
+	*p_txn = txn;
+	return 0;
+}
+
+void db_helpler_end_snapshot(db_helpler_t * db, DB_TXN * txn)
+{
+	if(NULL == txn) return;
+	struct db_helpler_private * priv = db->priv;
+	struct db_snapshot * snapshot = txn->app_private;
+	if(snapshot) {
+		pthread_mutex_lock(&priv->snapshot_mutex);
+		if(snapshot->newer) snapshot->newer->older = snapshot->older;
+		else priv->newest = snapshot->older;
+		if(snapshot->older) snapshot->older->newer = snapshot->newer;
+		else priv->oldest = snapshot->newer;
+		pthread_mutex_unlock(&priv->snapshot_mutex);
+		free(snapshot);
+	}
+	
+	// nothing was written: commit only releases the versions held for this snapshot
+	int rc = txn->commit(txn, 0);
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+}
+
+long db_helpler_count_users(db_helpler_t * db)
+{
+	long counts[DB_USERS_MAX_SHARDS] = { 0 };
+	int rc = get_user_counts(db, counts);
+	if(rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return -1;
+	}
+	
+	long count = 0;
+	for(int i = 0; i < db->num_shards; ++i) count += counts[i];
+	return count;
+}
+
+/*
+ * the list: a cursor per shard, merged by uuid (the order of a single users_db).
+ * The first 'start' records are skipped with the cursors (keys only, the records are not read).
+ */
+struct shard_cursor
+{
+	DBC * cursorp;
+	DBT key, value;
+	int rc;	// 0: key holds the current uuid
+};
+
+static int shard_cursor_next(struct shard_cursor * shard, u_int32_t flags)
+{
+	DBT value;
+	memset(&value, 0, sizeof(value));
+	value.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;	// the record is not needed
+	shard->rc = shard->cursorp->get(shard->cursorp, &shard->key, &value, flags);
+	if(0 == shard->rc && shard->key.size != sizeof(uuid_t)) shard->rc = DB_NOTFOUND;
+	return shard->rc;
+}
+
+long db_helpler_list_users(db_helpler_t * db, DB_TXN * txn, long start, long count, db_user_visit_fn visit, void * user_data)
+{
+	if(start < 0 || count <= 0) return 0;
+	
+	int num_shards = db->num_shards;
+	struct shard_cursor * shards = calloc(num_shards, sizeof(*shards));
+	assert(shards);
+	
+	int rc = 0;
+	for(int i = 0; 0 == rc && i < num_shards; ++i) {
+		struct shard_cursor * shard = &shards[i];
+		shard->key.flags = DB_DBT_REALLOC;
+		shard->value.flags = DB_DBT_REALLOC;
+		rc = db->shards[i].users_db->cursor(db->shards[i].users_db, txn, &shard->cursorp, 0);
+		if(0 == rc) rc = shard_cursor_next(shard, DB_FIRST);
+		if(rc == DB_NOTFOUND) rc = 0;
+	}
+	
+	long num_skipped = 0, num_visited = 0;
+	while(0 == rc && num_visited < count) {
+		struct shard_cursor * next = NULL;
+		for(int i = 0; i < num_shards; ++i) {
+			struct shard_cursor * shard = &shards[i];
+			if(shard->rc) continue;
+			if(NULL == next || memcmp(shard->key.data, next->key.data, sizeof(uuid_t)) < 0) next = shard;
+		}
+		if(NULL == next) break;
+		
+		if(num_skipped < start) ++num_skipped;
+		else {
+			rc = next->cursorp->get(next->cursorp, &next->key, &next->value, DB_CURRENT);
+			if(rc) break;
+			
+			struct db_user_record user[1];
+			memset(user, 0, sizeof(user));
+			if(0 == decode_user_record(&next->key, &next->value, user)) {
+				++num_visited;
+				if(visit(user, user_data)) break;
+			}
+		}
+		if(shard_cursor_next(next, DB_NEXT) && next->rc != DB_NOTFOUND) rc = next->rc;
+	}
+	
+	for(int i = 0; i < num_shards; ++i) {
+		if(shards[i].cursorp) shards[i].cursorp->close(shards[i].cursorp);
+		free(shards[i].key.data);
+		free(shards[i].value.data);
+	}
+	free(shards);
+	
+	if(rc && rc != DB_NOTFOUND) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return -1;
+	}
+	return num_visited;
+}
+
+static int is_condition_empty(const struct db_user_condition * cond)
+{
+	return !((cond->prefix && cond->prefix[0]) || cond->lower || cond->upper);
+}
+
+static int match_condition(const struct db_user_condition * cond, const char * value)
+{
+	if(cond->prefix && cond->prefix[0]) return (strncmp(value, cond->prefix, strlen(cond->prefix)) == 0);
+	if(cond->lower && strcmp(value, cond->lower) < 0) return 0;
+	if(cond->upper && strcmp(value, cond->upper) >= 0) return 0;
+	return 1;
+}
+
+static int match_user(const struct db_user_query * query, const struct db_user_record * user)
+{
+	const char * values[DB_USER_FIELDS_COUNT] = {
+		[DB_USER_FIELD_NAME] = user->name,
+		[DB_USER_FIELD_EMAIL] = user->email,
+		[DB_USER_FIELD_PHONE] = user->phone,
+	};
+	for(int i = 0; i < DB_USER_FIELDS_COUNT; ++i) {
+		if(is_condition_empty(&query->conds[i])) continue;
+		if(!match_condition(&query->conds[i], values[i])) return 0;
+	}
+	return 1;
+}
+
+struct member_search_context
+{
+	db_helpler_t * db;
+	DB_TXN * txn;
+	const struct db_user_query * query;
+	db_user_visit_fn visit;
+	void * user_data;
+	
+	int has_conds;
+	long offset;	// remaining rows to skip
+	long num_matched;
+	long num_visited;
+	long max_count;
+	DBT value;
+	int rc;
+};
+
+static int on_member_search(uint32_t user_no, void * user_data)
+{
+	struct member_search_context * ctx = user_data;
+	const struct db_user_query * query = ctx->query;
+	
+	// without field conditions, rows are skipped by bitmap_foreach() and every bit is counted
+	if(!ctx->has_conds && ctx->num_visited >= query->limit) return 1;
+	
+	uuid_t uid;
+	int rc = db_helpler_get_user_by_number(ctx->db, ctx->txn, user_no, uid);
+	if(rc == DB_NOTFOUND) return 0;
+	if(rc) {
+		ctx->rc = rc;
+		return 1;
+	}
+	
+	DB * dbp = db_helpler_get_shard(ctx->db, uid)->users_db;
+	DBT key;
+	memset(&key, 0, sizeof(key));
+	key.data = uid;
+	key.size = sizeof(uuid_t);
+	rc = dbp->get(dbp, ctx->txn, &key, &ctx->value, 0);
+	if(rc == DB_NOTFOUND) return 0;
+	if(rc) {
+		ctx->rc = rc;
+		return 1;
+	}
+	
+	struct db_user_record user[1];
+	memset(user, 0, sizeof(user));
+	if(decode_user_record(&key, &ctx->value, user)) return 0;
+	if(ctx->has_conds && !match_user(query, user)) return 0;
+	
+	if(ctx->has_conds && ++ctx->num_matched >= ctx->max_count) rc = 1;
+	if(ctx->offset > 0) {
+		--ctx->offset;
+		return rc;
+	}
+	if(ctx->num_visited >= query->limit) return rc;
+	++ctx->num_visited;
+	if(ctx->visit && ctx->visit(user, ctx->user_data)) return 1;
+	return rc;
+}
+
+static long search_members(db_helpler_t * db, DB_TXN * txn, const struct db_user_query * query, const bitmap_t * members, db_user_visit_fn visit, void * user_data, long * p_count)
+{
+	struct member_search_context ctx[1];
+	memset(ctx, 0, sizeof(ctx));
+	ctx->db = db;
+	ctx->txn = txn;
+	ctx->query = query;
+	ctx->visit = visit;
+	ctx->user_data = user_data;
+	ctx->value.flags = DB_DBT_REALLOC;
+	
+	for(int i = 0; i < DB_USER_FIELDS_COUNT; ++i) ctx->has_conds |= !is_condition_empty(&query->conds[i]);
+	ctx->max_count = query->max_count;
+	if(ctx->max_count < query->offset + query->limit) ctx->max_count = query->offset + query->limit;
+	
+	uint64_t start = 0;
+	if(ctx->has_conds) ctx->offset = query->offset;
+	else start = query->offset;
+	
+	bitmap_foreach(members, start, on_member_search, ctx);
+	free(ctx->value.data);
+	
+	if(ctx->rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(ctx->rc));
+		return -1;
+	}
+	if(p_count) {
+		if(ctx->has_conds) *p_count = ctx->num_matched;
+		else *p_count = bitmap_cardinality(members);
+	}
+	return ctx->num_visited;
+}
+
+int db_helpler_query_index(const struct db_user_query * query)
+{
+	for(int kind = 0; kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		const struct db_member_filter * filter = &query->members[kind];
+		if(filter->num_all > 0 || filter->num_any > 0 || filter->num_none > 0) return -1;	// read by user number
+	}
+	for(int field = 0; field < DB_USER_FIELDS_COUNT; ++field) {
+		if(!is_condition_empty(&query->conds[field])) return field;
+	}
+	return -1;
+}
+
+/*
+ * walks the index of 'field' from the condition's lower bound, in index order (then uuid order),
+ * stopping at the matches. The record is read (and decoded into 'user') when asked for
+ * or when other conditions have to be checked, the buffers are reused from one match to the next.
+ */
+struct index_cursor
+{
+	const struct db_user_query * query;
+	const struct db_user_condition * cond;
+	int num_conds;
+	DBC * cursorp;
+	int flags;
+	DBT skey, pkey, value;
+	int has_value;
+	struct db_user_record user[1];
+	long num_matched;
+};
+
+static int index_cursor_open(struct index_cursor * ic, DB * sdbp, DB_TXN * txn, const struct db_user_query * query, int field)
+{
+	memset(ic, 0, sizeof(*ic));
+	ic->query = query;
+	ic->cond = &query->conds[field];
+	for(int i = 0; i < DB_USER_FIELDS_COUNT; ++i) ic->num_conds += !is_condition_empty(&query->conds[i]);
+	
+	int rc = sdbp->cursor(sdbp, txn, &ic->cursorp, 0);
+	if(rc) return rc;
+	
+	const char * lower = (ic->cond->prefix && ic->cond->prefix[0])?ic->cond->prefix:ic->cond->lower;
+	if(NULL == lower) lower = "";
+	size_t cb_lower = strlen(lower);
+	
+	ic->skey.flags = DB_DBT_REALLOC;
+	ic->pkey.flags = DB_DBT_REALLOC;
+	ic->value.flags = DB_DBT_REALLOC;
+	ic->skey.data = malloc(cb_lower + 1);
+	assert(ic->skey.data);
+	memcpy(ic->skey.data, lower, cb_lower);
+	ic->skey.size = cb_lower;
+	ic->flags = DB_SET_RANGE;
+	return 0;
+}
+
+static void index_cursor_close(struct index_cursor * ic)
+{
+	if(ic->cursorp) ic->cursorp->close(ic->cursorp);
+	ic->cursorp = NULL;
+	free(ic->skey.data);
+	free(ic->pkey.data);
+	free(ic->value.data);
+	memset(&ic->skey, 0, sizeof(ic->skey));
+	memset(&ic->pkey, 0, sizeof(ic->pkey));
+	memset(&ic->value, 0, sizeof(ic->value));
+}
+
+// 0: on the next match, DB_NOTFOUND: no more matches
+static int index_cursor_next(struct index_cursor * ic, int need_value)
+{
+	// counted-only rows do not need the record, unless other conditions have to be checked
+	int read_value = need_value || (ic->num_conds > 1);
+	while(1) {
+		if(read_value) ic->value.flags = DB_DBT_REALLOC;
+		else {
+			ic->value.flags = DB_DBT_REALLOC | DB_DBT_PARTIAL;
+			ic->value.doff = 0;
+			ic->value.dlen = 0;
+		}
+		ic->has_value = 0;
+		
+		int rc = ic->cursorp->pget(ic->cursorp, &ic->skey, &ic->pkey, &ic->value, ic->flags);
+		ic->flags = DB_NEXT;
+		if(rc) return rc;
+		
+		// secondary keys are nul-terminated strings
+		const char * key = ic->skey.data;
+		if(ic->skey.size == 0 || key[ic->skey.size - 1] != '\0') continue;
+		
+		// early cut-off: keys are sorted, the first mismatch ends the scan
+		if(!match_condition(ic->cond, key)) return DB_NOTFOUND;
+		
+		if(read_value) {
+			memset(ic->user, 0, sizeof(ic->user));
+			if(decode_user_record(&ic->pkey, &ic->value, ic->user)) continue;
+			if(ic->num_conds > 1 && !match_user(ic->query, ic->user)) continue;
+			ic->has_value = 1;
+		}
+		++ic->num_matched;
+		return 0;
+	}
+}
+
+// the record of a match found without it
+static int index_cursor_read_value(struct index_cursor * ic)
+{
+	if(ic->has_value) return 0;
+	ic->value.flags = DB_DBT_REALLOC;
+	int rc = ic->cursorp->pget(ic->cursorp, &ic->skey, &ic->pkey, &ic->value, DB_CURRENT);
+	if(0 == rc) {
+		memset(ic->user, 0, sizeof(ic->user));
+		rc = decode_user_record(&ic->pkey, &ic->value, ic->user) ? DB_NOTFOUND : 0;
+	}
+	if(0 == rc) ic->has_value = 1;
+	return rc;
+}
+
+/*
+ * scans the index of 'field' from the condition's lower bound, in index order (then uuid order):
+ * the matches from 'offset' to 'offset + limit' are passed to on_match() (non-zero stops),
+ * the others are only counted, up to max_count.
+ */
+typedef int (* index_match_fn)(const DBT * skey, const DBT * pkey, const DBT * value, const struct db_user_record * user, void * user_data);
+static int scan_index(DB * sdbp, DB_TXN * txn, const struct db_user_query * query, int field, 
+	long offset, long limit, long max_count, index_match_fn on_match, void * user_data, long * p_num_matched, long * p_num_visited)
+{
+	struct index_cursor ic[1];
+	int rc = index_cursor_open(ic, sdbp, txn, query, field);
+	if(rc) return rc;
+	
+	long num_visited = 0;
+	while(ic->num_matched < max_count) {
+		long pos = ic->num_matched;
+		rc = index_cursor_next(ic, pos >= offset && num_visited < limit);
+		if(rc) break;
+		if(pos < offset || num_visited >= limit) continue;
+		
+		++num_visited;
+		if(on_match && on_match(&ic->skey, &ic->pkey, &ic->value, ic->user, user_data)) break;
+	}
+	*p_num_matched = ic->num_matched;
+	index_cursor_close(ic);
+	
+	if(rc == DB_NOTFOUND) rc = 0;
+	if(p_num_visited) *p_num_visited = num_visited;
+	return rc;
+}
+
+struct visit_context
+{
+	db_user_visit_fn visit;
+	void * user_data;
+};
+static int on_index_visit(const DBT * skey, const DBT * pkey, const DBT * value, const struct db_user_record * user, void * user_data)
+{
+	struct visit_context * ctx = user_data;
+	return ctx->visit ? ctx->visit(user, ctx->user_data) : 0;
+}
+
+/*
+ * sharded search: the shard cursors are merged by (index key, uuid) on the fly, like list_merged_users():
+ * the rows before 'offset' are stepped over without reading the records, then the remaining matches
+ * of every shard are counted.
+ */
+static int compare_index_cursors(const struct index_cursor * a, const struct index_cursor * b)
+{
+	// nul-terminated keys: same order as the btree's byte comparison
+	int cmp = strcmp((const char *)a->skey.data, (const char *)b->skey.data);
+	if(cmp) return cmp;
+	return memcmp(a->pkey.data, b->pkey.data, sizeof(uuid_t));
+}
+
+static long search_shards(db_helpler_t * db, DB_TXN * txn, const struct db_user_query * query, int field, 
+	long max_count, db_user_visit_fn visit, void * user_data, long * p_count)
+{
+	int num_shards = db->num_shards;
+	struct index_cursor * shards = calloc(num_shards, sizeof(*shards));
+	int * shard_rcs = calloc(num_shards, sizeof(*shard_rcs));
+	assert(shards && shard_rcs);
+	
+	int rc = 0;
+	for(int i = 0; 0 == rc && i < num_shards; ++i) {
+		rc = index_cursor_open(&shards[i], db->shards[i].sdbs[field], txn, query, field);
+		if(0 == rc) rc = shard_rcs[i] = index_cursor_next(&shards[i], 0 >= query->offset);
+		if(rc == DB_NOTFOUND) rc = 0;
+	}
+	
+	long num_visited = 0;
+	for(long pos = 0; 0 == rc && num_visited < query->limit; ++pos) {
+		int next = -1;
+		for(int i = 0; i < num_shards; ++i) {
+			if(shard_rcs[i]) continue;
+			if(next < 0 || compare_index_cursors(&shards[i], &shards[next]) < 0) next = i;
+		}
+		if(next < 0) break;
+		
+		struct index_cursor * ic = &shards[next];
+		int stop = 0;
+		if(pos >= query->offset && 0 == index_cursor_read_value(ic)) {
+			++num_visited;
+			stop = (visit && visit(ic->user, user_data));
+		}
+		rc = shard_rcs[next] = index_cursor_next(ic, pos + 1 >= query->offset);
+		if(rc == DB_NOTFOUND) rc = 0;
+		if(stop) break;
+	}
+	
+	// the counts: every match of every shard, up to max_count in all
+	long num_matched = 0;
+	for(int i = 0; i < num_shards; ++i) num_matched += shards[i].num_matched;
+	for(int i = 0; 0 == rc && i < num_shards; ++i) {
+		struct index_cursor * ic = &shards[i];
+		while(0 == shard_rcs[i] && num_matched < max_count) {
+			shard_rcs[i] = index_cursor_next(ic, 0);
+			if(0 == shard_rcs[i]) ++num_matched;
+		}
+		if(shard_rcs[i] != DB_NOTFOUND) rc = shard_rcs[i];
+	}
+	
+	for(int i = 0; i < num_shards; ++i) index_cursor_close(&shards[i]);
+	free(shards);
+	free(shard_rcs);
+	
+	if(rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return -1;
+	}
+	if(p_count) *p_count = (num_matched < max_count) ? num_matched : max_count;
+	return num_visited;
+}
+
+long db_helpler_search_users(db_helpler_t * db, DB_TXN * txn, const struct db_user_query * query, db_user_visit_fn visit, void * user_data, long * p_count)
+{
+	assert(db && query);
+	if(p_count) *p_count = 0;
+	
+	// membership filters: the bitmaps are combined first, then the (usually few) members are read
+	bitmap_t members[1];
+	bitmap_init(members);
+	int rc = db_helpler_query_members(db, txn, query, members);
+	if(rc <= 0) {
+		long num_visited = (0 == rc) ? search_members(db, txn, query, members, visit, user_data, p_count) : -1;
+		bitmap_cleanup(members);
+		return num_visited;
+	}
+	
+	int field = 0;
+	for(field = 0; field < DB_USER_FIELDS_COUNT; ++field) {
+		if(!is_condition_empty(&query->conds[field])) break;
+	}
+	if(field == DB_USER_FIELDS_COUNT) return -1;	// use db_helpler_list_users() to list all
+	
+	long offset = query->offset;
+	long limit = query->limit;
+	long max_count = query->max_count;
+	if(max_count < offset + limit) max_count = offset + limit;
+	if(db->num_shards > 1) return search_shards(db, txn, query, field, max_count, visit, user_data, p_count);
+	
+	struct visit_context ctx = { .visit = visit, .user_data = user_data };
+	long num_matched = 0;
+	long num_visited = 0;
+	rc = scan_index(db->users_sdbs[field], txn, query, field, offset, limit, max_count, on_index_visit, &ctx, &num_matched, &num_visited);
+	if(rc) {
+		fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+		return -1;
+	}
+	if(p_count) *p_count = num_matched;
+	return num_visited;
+}
+
+
+/**********************************************
+ * writes / bulk load
+**********************************************/
+int db_helpler_get_user(db_helpler_t * db, DB_TXN * txn, const uuid_t uid, struct db_user_record * user, void ** p_buf)
+{
+	assert(db && uid && user && p_buf);
+	DB * dbp = db_helpler_get_shard(db, uid)->users_db;
+	*p_buf = NULL;
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)uid;
+	key.size = sizeof(uuid_t);
+	value.flags = DB_DBT_MALLOC;
+	
+	int rc = dbp->get(dbp, txn, &key, &value, 0);
+	if(rc) return rc;
+	
+	memset(user, 0, sizeof(*user));
+	if(decode_user_record(&key, &value, user)) {
+		free(value.data);
+		return DB_NOTFOUND;
+	}
+	*p_buf = value.data;
+	return 0;
+}
+
+/*
+ * indexes one users_db record: puts its secondary key(s) ==> primary key into sdbp.
+ * keys already present are skipped (DB_NODUPDATA), *p_num_keys: number of keys of the record
+ */
+static int put_index_keys(DB * sdbp, DB_TXN * txn, const struct index_db_desc * desc, const DBT * key, const DBT * value, long * p_num_keys)
+{
+	DBT skey;
+	memset(&skey, 0, sizeof(skey));
+	int rc = desc->fn(sdbp, key, value, &skey);
+	if(rc == DB_DONOTINDEX) return 0;
+	if(rc) return rc;
+	
+	// DB_DBT_MULTIPLE: skey.data is an array of skey.size keys
+	DBT * skeys = &skey;
+	u_int32_t num_skeys = 1;
+	if(skey.flags & DB_DBT_MULTIPLE) {
+		skeys = skey.data;
+		num_skeys = skey.size;
+	}
+	
+	DBT pkey;
+	memset(&pkey, 0, sizeof(pkey));
+	pkey.data = key->data;
+	pkey.size = key->size;
+	for(u_int32_t i = 0; 0 == rc && i < num_skeys; ++i) {
+		rc = sdbp->put(sdbp, txn, &skeys[i], &pkey, DB_NODUPDATA);
+		if(rc == DB_KEYEXIST) rc = 0;
+	}
+	if(skey.flags & DB_DBT_APPMALLOC) free(skey.data);
+	if(0 == rc) *p_num_keys += num_skeys;
+	return rc;
+}
+
+/*
+ * db_helpler_get_index_state() rereads a BUILDING state from meta_db:
+ * in a prefork worker, the index is built (and set READY) by the supervisor
+ */
+static int has_unready_index(db_helpler_t * db)
+{
+	struct db_helpler_private * priv = db->priv;
+	if(NULL == priv->build_sdbs) return 0;
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+		if(db_helpler_get_index_state(db, i) != DB_INDEX_READY) return 1;
+	}
+	return 0;
+}
+
+/*
+ * an index being built only has the keys of the records the builder has reached (and of the ones written since).
+ * Updating or deleting any other record would make the association look up its old keys, not find them
+ * and fail with DB_SECONDARY_BAD: the record's current keys are put first, in the writer's transaction.
+ * The builder skips the keys that already exist.
+ */
+static int index_record_for_write(db_helpler_t * db, DB_TXN * txn, int shard, const DBT * key, const DBT * value)
+{
+	struct db_helpler_private * priv = db->priv;
+	if(NULL == priv->build_sdbs) return 0;
+	
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+		DB * sdbp = priv->build_sdbs[shard * DB_USERS_SDBS_COUNT + i];
+		if(NULL == sdbp || db_helpler_get_index_state(db, i) == DB_INDEX_READY) continue;
+		
+		long num_keys = 0;
+		int rc = put_index_keys(sdbp, txn, &s_users_index_desc[i], key, value, &num_keys);
+		if(rc) return rc;
+	}
+	return 0;
+}
+
+// the stored version of 'key', if any, before it is overwritten or deleted
+static int index_current_record(db_helpler_t * db, DB_TXN * txn, int shard, const DBT * key)
+{
+	if(!has_unready_index(db)) return 0;
+	
+	DB * dbp = db->shards[shard].users_db;
+	DBT value;
+	memset(&value, 0, sizeof(value));
+	value.flags = DB_DBT_MALLOC;
+	int rc = dbp->get(dbp, txn, (DBT *)key, &value, DB_RMW);
+	if(rc == DB_NOTFOUND) return 0;
+	if(0 == rc) rc = index_record_for_write(db, txn, shard, key, &value);
+	free(value.data);
+	return rc;
+}
+
+/*
+ * the record and its change record are written together:
+ * without a caller transaction, a local one is used
+ * (also for the keys put into an index being built)
+ */
+static int begin_local_txn(db_helpler_t * db, DB_TXN ** p_txn, DB_TXN ** p_local_txn)
+{
+	*p_local_txn = NULL;
+	if(*p_txn || (db->skip_change_log && !has_unready_index(db))) return 0;
+	int rc = db->env->txn_begin(db->env, NULL, p_local_txn, 0);
+	if(0 == rc) *p_txn = *p_local_txn;
+	return rc;
+}
+
+static int end_local_txn(DB_TXN * local_txn, int rc)
+{
+	if(NULL == local_txn) return rc;
+	if(rc) {
+		local_txn->abort(local_txn);
+		return rc;
+	}
+	return local_txn->commit(local_txn, 0);
+}
+
+int db_helpler_put_user(db_helpler_t * db, DB_TXN * txn, const struct db_user_record * user)
+{
+	assert(db && user);
+	int shard = db_helpler_get_shard_index(db, user->uid);
+	DB * dbp = db->shards[shard].users_db;
+	
+	unsigned char data[USER_RECORD_MAX_SIZE];
+	ssize_t cb_data = user_record_encode(user, data, sizeof(data));
+	assert(cb_data > 0);
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)user->uid;
+	key.size = sizeof(uuid_t);
+	value.data = data;
+	value.size = cb_data;
+	
+	DB_TXN * local_txn = NULL;
+	int rc = begin_local_txn(db, &txn, &local_txn);
+	if(0 == rc) {
+		enum db_change_op op = DB_CHANGE_INSERT;
+		rc = dbp->put(dbp, txn, &key, &value, DB_NOOVERWRITE);
+		if(rc == DB_KEYEXIST) {
+			op = DB_CHANGE_UPDATE;
+			rc = index_current_record(db, txn, shard, &key);
+			if(0 == rc) rc = dbp->put(dbp, txn, &key, &value, 0);
+		}
+		if(0 == rc && op == DB_CHANGE_INSERT && !db->batch_live_users) rc = db_helpler_set_user_live(db, txn, user->uid, 1);
+		if(0 == rc && !db->skip_change_log) rc = db_helpler_append_change(db, txn, op, user->uid);
+	}
+	rc = end_local_txn(local_txn, rc);
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+int db_helpler_delete_user(db_helpler_t * db, DB_TXN * txn, const uuid_t uid)
+{
+	assert(db && uid);
+	int shard = db_helpler_get_shard_index(db, uid);
+	DB * dbp = db->shards[shard].users_db;
+	
+	DBT key;
+	memset(&key, 0, sizeof(key));
+	key.data = (void *)uid;
+	key.size = sizeof(uuid_t);
+	
+	DB_TXN * local_txn = NULL;
+	int rc = begin_local_txn(db, &txn, &local_txn);
+	if(0 == rc) rc = index_current_record(db, txn, shard, &key);
+	if(0 == rc) rc = dbp->del(dbp, txn, &key, 0);	// the secondary indexes are updated by the association
+	for(int kind = 0; 0 == rc && kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		rc = db_helpler_set_user_members(db, txn, uid, kind, NULL, 0);
+	}
+	if(0 == rc) rc = db_helpler_set_user_live(db, txn, uid, 0);
+	if(0 == rc && !db->skip_change_log) rc = db_helpler_append_change(db, txn, DB_CHANGE_DELETE, uid);
+	rc = end_local_txn(local_txn, rc);
+	if(rc && rc != DB_NOTFOUND) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+struct rebuild_index_context
+{
+	db_helpler_t * db;
+	int index;
+	int shard;
+	int batch_size;
+	long num_keys;
+	int rc;
+};
+
+static void * rebuild_index_thread(void * user_data)
+{
+	struct rebuild_index_context * ctx = user_data;
+	db_helpler_t * db = ctx->db;
+	DB_ENV * env = db->env;
+	DB * dbp = db->shards[ctx->shard].users_db;
+	DB * sdbp = db->shards[ctx->shard].sdbs[ctx->index];
+	const struct index_db_desc * desc = &s_users_index_desc[ctx->index];
+	
+	u_int32_t num_discarded = 0;
+	int rc = sdbp->truncate(sdbp, NULL, &num_discarded, DB_AUTO_COMMIT);
+	if(rc) {
+		ctx->rc = rc;
+		return NULL;
+	}
+	
+	DBC * cursorp = NULL;
+	DB_TXN * txn = NULL;
+	rc = dbp->cursor(dbp, NULL, &cursorp, 0);
+	if(0 == rc) rc = env->txn_begin(env, NULL, &txn, DB_TXN_NOSYNC);
+	if(rc) {
+		if(cursorp) cursorp->close(cursorp);
+		ctx->rc = rc;
+		return NULL;
+	}
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.flags = DB_DBT_REALLOC;
+	value.flags = DB_DBT_REALLOC;
+	
+	long num_pending = 0;
+	while(0 == (rc = cursorp->get(cursorp, &key, &value, DB_NEXT))) {
+		rc = put_index_keys(sdbp, txn, desc, &key, &value, &ctx->num_keys);
+		if(rc) break;
+		
+		if(++num_pending >= ctx->batch_size) {
+			rc = txn->commit(txn, 0);
+			txn = NULL;
+			if(0 == rc) rc = env->txn_begin(env, NULL, &txn, DB_TXN_NOSYNC);
+			if(rc) break;
+			num_pending = 0;
+		}
+	}
+	cursorp->close(cursorp);
+	free(key.data);
+	free(value.data);
+	
+	if(rc == DB_NOTFOUND) rc = 0;
+	if(txn) {
+		if(rc) txn->abort(txn);
+		else rc = txn->commit(txn, 0);
+	}
+	ctx->rc = rc;
+	return NULL;
+}
+
+int db_helpler_rebuild_indexes(db_helpler_t * db, int batch_size)
+{
+	assert(db && db->users_db);
+	if(!db->defer_indexes) return 0;
+	if(batch_size <= 0) batch_size = 10000;
+	
+	// one thread per index and shard
+	int num_threads = DB_USERS_SDBS_COUNT * db->num_shards;
+	pthread_t * threads = calloc(num_threads, sizeof(*threads));
+	struct rebuild_index_context * contexts = calloc(num_threads, sizeof(*contexts));
+	assert(threads && contexts);
+	
+	// the indexes are DB_INDEX_BUILDING since db_helpler_init(): an interrupted rebuild is completed by the next start
+	for(int i = 0; i < num_threads; ++i) {
+		struct rebuild_index_context * ctx = &contexts[i];
+		ctx->db = db;
+		ctx->index = i % DB_USERS_SDBS_COUNT;
+		ctx->shard = i / DB_USERS_SDBS_COUNT;
+		ctx->batch_size = batch_size;
+		int rc = pthread_create(&threads[i], NULL, rebuild_index_thread, ctx);
+		assert(0 == rc);
+	}
+	
+	int ret = 0;
+	for(int i = 0; i < num_threads; ++i) {
+		struct rebuild_index_context * ctx = &contexts[i];
+		char name[100] = "";
+		const char * sdb_name = get_shard_file_name(db, ctx->shard, s_users_index_desc[ctx->index].sdb_name, name, sizeof(name));
+		pthread_join(threads[i], NULL);
+		if(ctx->rc) {
+			fprintf(stderr, "rebuild %s: %s\n", sdb_name, db_strerror(ctx->rc));
+			ret = -1;
+			continue;
+		}
+		fprintf(stderr, "rebuild %s: %ld keys\n", sdb_name, ctx->num_keys);
+	}
+	free(threads);
+	free(contexts);
+	if(ret) return ret;
+	
+	// the indexes are complete, associate them without DB_CREATE
+	for(int shard = 0; shard < db->num_shards; ++shard) {
+		DB * dbp = db->shards[shard].users_db;
+		for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+			int rc = dbp->associate(dbp, NULL, db->shards[shard].sdbs[i], s_users_index_desc[i].fn, 0);
+			db_check_error(rc);
+		}
+	}
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+		int rc = set_index_state(db, i, DB_INDEX_READY);
+		db_check_error(rc);
+	}
+	db->defer_indexes = 0;
+	return 0;
+}
+
+/*
+ * background build of an index that is already associated with users_db (the writes maintain it):
+ * the records are indexed in transactions of DB_INDEX_BUILD_BATCH_SIZE records,
+ * the read lock on a record keeps it from changing until its keys are committed.
+ * An associated secondary can't be written directly, the keys are put through a second, unassociated handle.
+ */
+#define DB_INDEX_BUILD_BATCH_SIZE	(1000)	// bounds how long a writer waits for the scanned pages
+static int build_index_batch(db_helpler_t * db, DB * dbp, DB * sdbp, const struct index_db_desc * desc, 
+	unsigned char last_key[sizeof(uuid_t)], int * p_has_last_key, int * p_done, long * p_num_keys)
+{
+	DB_ENV * env = db->env;
+	DB_TXN * txn = NULL;
+	DBC * cursorp = NULL;
+	int rc = env->txn_begin(env, NULL, &txn, DB_TXN_NOSYNC);	// the final state is written synchronously
+	if(rc) return rc;
+	rc = dbp->cursor(dbp, txn, &cursorp, 0);
+	if(rc) {
+		txn->abort(txn);
+		return rc;
+	}
+	
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.flags = DB_DBT_REALLOC;
+	value.flags = DB_DBT_REALLOC;
+	
+	if(*p_has_last_key) {
+		// continue after the last key of the previous batch
+		key.data = malloc(sizeof(uuid_t));
+		assert(key.data);
+		memcpy(key.data, last_key, sizeof(uuid_t));
+		key.size = sizeof(uuid_t);
+		rc = cursorp->get(cursorp, &key, &value, DB_SET_RANGE);
+		if(0 == rc && key.size == sizeof(uuid_t) && memcmp(key.data, last_key, sizeof(uuid_t)) == 0) {
+			rc = cursorp->get(cursorp, &key, &value, DB_NEXT);
+		}
+	}else {
+		rc = cursorp->get(cursorp, &key, &value, DB_FIRST);
+	}
+	
+	unsigned char batch_last_key[sizeof(uuid_t)];
+	int has_batch_last_key = 0;
+	long num_keys = 0;
+	for(int i = 0; 0 == rc && i < DB_INDEX_BUILD_BATCH_SIZE; ++i) {
+		rc = put_index_keys(sdbp, txn, desc, &key, &value, &num_keys);
+		if(rc) break;
+		if(key.size == sizeof(uuid_t)) {
+			memcpy(batch_last_key, key.data, sizeof(uuid_t));
+			has_batch_last_key = 1;
+		}
+		rc = cursorp->get(cursorp, &key, &value, DB_NEXT);
+	}
+	int done = (rc == DB_NOTFOUND);
+	if(done) rc = 0;
+	cursorp->close(cursorp);
+	free(key.data);
+	free(value.data);
+	
+	if(rc) {
+		txn->abort(txn);
+		return rc;
+	}
+	rc = txn->commit(txn, 0);
+	if(rc) return rc;
+	
+	if(has_batch_last_key) {
+		memcpy(last_key, batch_last_key, sizeof(uuid_t));
+		*p_has_last_key = 1;
+	}
+	*p_done = done;
+	*p_num_keys += num_keys;
+	return 0;
+}
+
+static void * build_index_thread(void * user_data)
+{
+	struct build_index_context * ctx = user_data;
+	db_helpler_t * db = ctx->db;
+	struct db_helpler_private * priv = db->priv;
+	const struct index_db_desc * desc = &s_users_index_desc[ctx->index];
+	
+	int rc = 0;
+	int done = 0;
+	for(int shard = 0; 0 == rc && shard < db->num_shards; ++shard) {
+		char name[100] = "";
+		DB * sdbp = NULL;
+		rc = db_create(&sdbp, db->env, 0);
+		if(0 == rc) rc = sdbp->set_flags(sdbp, DB_DUPSORT);
+		if(0 == rc) rc = sdbp->open(sdbp, NULL, get_shard_file_name(db, shard, desc->sdb_name, name, sizeof(name)), NULL, DB_BTREE, 
+			DB_AUTO_COMMIT | (db->snapshot_reads ? DB_MULTIVERSION : 0), 0666);
+		
+		unsigned char last_key[sizeof(uuid_t)];
+		int has_last_key = 0;
+		done = 0;
+		while(0 == rc && !done && !__atomic_load_n(&priv->quit, __ATOMIC_ACQUIRE)) {
+			rc = build_index_batch(db, db->shards[shard].users_db, sdbp, desc, last_key, &has_last_key, &done, &ctx->num_keys);
+			if(rc == DB_LOCK_DEADLOCK) rc = 0;	// retried from the last committed batch
+		}
+		if(sdbp) sdbp->close(sdbp, 0);
+		if(!done) break;	// stopped
+	}
+	
+	if(0 == rc && done) rc = set_index_state(db, ctx->index, DB_INDEX_READY);
+	if(rc) {
+		fprintf(stderr, "build %s: %s\n", desc->sdb_name, db_strerror(rc));
+		set_index_state(db, ctx->index, DB_INDEX_FAILED);
+	}else if(done) fprintf(stderr, "build %s: %ld keys, ready\n", desc->sdb_name, ctx->num_keys);
+	ctx->rc = rc;
+	return NULL;
+}
+
+/*
+ * one thread per new or incomplete index ("lazy_indexes": 0 waits for them, as associate(DB_CREATE) did)
+ */
+static int start_index_builds(db_helpler_t * db)
+{
+	struct db_helpler_private * priv = db->priv;
+	if(db->defer_indexes || db_replication_is_replica(db->rep)) return 0;
+	
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+		if(priv->index_states[i] != DB_INDEX_BUILDING) continue;
+		struct build_index_context * ctx = &priv->builds[priv->num_builds];
+		ctx->db = db;
+		ctx->index = i;
+		int rc = pthread_create(&priv->build_threads[priv->num_builds], NULL, build_index_thread, ctx);
+		if(rc) return rc;
+		++priv->num_builds;
+	}
+	if(priv->num_builds > 0) fprintf(stderr, "db: building %d index(es) %s\n", priv->num_builds, db->lazy_indexes?"in the background":"before serving");
+	if(!db->lazy_indexes) stop_index_builds(db);
+	return 0;
+}
+static void stop_index_builds(db_helpler_t * db)
+{
+	struct db_helpler_private * priv = db->priv;
+	if(NULL == priv || priv->num_builds == 0) return;
+	
+	if(db->lazy_indexes) __atomic_store_n(&priv->quit, 1, __ATOMIC_RELEASE);
+	for(int i = 0; i < priv->num_builds; ++i) pthread_join(priv->build_threads[i], NULL);
+	priv->num_builds = 0;
+}
+
+enum db_index_state db_helpler_get_index_state(db_helpler_t * db, int index)
+{
+	assert(db && db->priv && index >= 0 && index < DB_USERS_SDBS_COUNT);
+	struct db_helpler_private * priv = db->priv;
+	enum db_index_state state = __atomic_load_n(&priv->index_states[index], __ATOMIC_ACQUIRE);
+	if(state != DB_INDEX_BUILDING) return state;
+	
+	// built by another process (the prefork supervisor, or the master of a replica)
+	if(load_index_state(db, index) == DB_INDEX_READY) {
+		__atomic_store_n(&priv->index_states[index], DB_INDEX_READY, __ATOMIC_RELEASE);
+		return DB_INDEX_READY;
+	}
+	return state;
+}
+const char * db_helpler_get_index_name(int index)
+{
+	if(index < 0 || index >= DB_USERS_SDBS_COUNT) return NULL;
+	return s_users_index_desc[index].sdb_name;
+}
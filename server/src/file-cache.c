@@ -0,0 +1,328 @@
+/*
+ * file-cache.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "file-cache.h"
+
+#define FILE_CACHE_REVALIDATE_INTERVAL	(1) // seconds
+
+struct file_cache_item
+{
+	file_cache_entry_t base;
+	int refs;
+	int is_cached;
+	
+	struct file_cache_item * prev;
+	struct file_cache_item * next;
+	
+	off_t size;
+	time_t checked_at;
+	char * path;
+};
+
+struct file_cache_private
+{
+	file_cache_t * cache;
+	GHashTable * items;	// path ==> item
+	
+	// lru list, the most recently used at head
+	struct file_cache_item * head;
+	struct file_cache_item * tail;
+};
+
+static const struct
+{
+	const char * ext;
+	const char * content_type;
+}s_content_types[] = {
+	{ ".html",  "text/html; charset=utf-8" },
+	{ ".htm",   "text/html; charset=utf-8" },
+	{ ".js",    "application/javascript; charset=utf-8" },
+	{ ".css",   "text/css; charset=utf-8" },
+	{ ".json",  "application/json" },
+	{ ".map",   "application/json" },
+	{ ".txt",   "text/plain; charset=utf-8" },
+	{ ".svg",   "image/svg+xml" },
+	{ ".png",   "image/png" },
+	{ ".jpg",   "image/jpeg" },
+	{ ".gif",   "image/gif" },
+	{ ".ico",   "image/x-icon" },
+	{ ".woff",  "font/woff" },
+	{ ".woff2", "font/woff2" },
+	{ ".ttf",   "font/ttf" },
+	{ ".eot",   "application/vnd.ms-fontobject" },
+	{ NULL, }
+};
+
+const char * file_cache_get_content_type(const char * path)
+{
+	const char * ext = strrchr(path, '.');
+	if(ext && NULL == strchr(ext, '/')) {
+		for(int i = 0; s_content_types[i].ext; ++i) {
+			if(strcasecmp(ext, s_content_types[i].ext) == 0) return s_content_types[i].content_type;
+		}
+	}
+	return "application/octet-stream";
+}
+
+static void lru_unlink(struct file_cache_private * priv, struct file_cache_item * item)
+{
+	if(item->prev) item->prev->next = item->next;
+	else priv->head = item->next;
+	if(item->next) item->next->prev = item->prev;
+	else priv->tail = item->prev;
+	item->prev = item->next = NULL;
+}
+
+static void lru_push_front(struct file_cache_private * priv, struct file_cache_item * item)
+{
+	item->prev = NULL;
+	item->next = priv->head;
+	if(priv->head) priv->head->prev = item;
+	priv->head = item;
+	if(NULL == priv->tail) priv->tail = item;
+}
+
+static void file_cache_item_free(struct file_cache_item * item)
+{
+	if(NULL == item) return;
+	if(item->base.data) munmap((void *)item->base.data, item->base.length);
+	free(item->path);
+	free(item);
+}
+
+void file_cache_entry_ref(const file_cache_entry_t * entry)
+{
+	struct file_cache_item * item = (struct file_cache_item *)entry;
+	assert(item && item->refs > 0);
+	++item->refs;
+}
+
+void file_cache_entry_unref(void * entry)
+{
+	struct file_cache_item * item = entry;
+	if(NULL == item) return;
+	assert(item->refs > 0);
+	if(--item->refs == 0) file_cache_item_free(item);
+}
+
+static void file_cache_remove(struct file_cache_private * priv, struct file_cache_item * item)
+{
+	file_cache_t * cache = priv->cache;
+	assert(item->is_cached);
+	
+	item->is_cached = 0;
+	lru_unlink(priv, item);
+	g_hash_table_remove(priv->items, item->path);
+	
+	--cache->num_entries;
+	cache->bytes_cached -= item->base.length;
+	file_cache_entry_unref(item);	// release the cache's reference
+}
+
+static void file_cache_evict(struct file_cache_private * priv, size_t incoming_bytes)
+{
+	file_cache_t * cache = priv->cache;
+	while(priv->tail
+		&& (cache->num_entries >= cache->max_entries
+			|| (cache->bytes_cached + incoming_bytes) > cache->max_bytes))
+	{
+		file_cache_remove(priv, priv->tail);
+		++cache->num_evictions;
+	}
+}
+
+static int is_valid_path(const char * path)
+{
+	if(NULL == path || path[0] != '/') return 0;
+	if(strlen(path) >= PATH_MAX / 2) return 0;
+	
+	// reject any '..' segment
+	for(const char * p = path; (p = strstr(p, "..")); p += 2) {
+		if(p[-1] == '/' && (p[2] == '/' || p[2] == '\0')) return 0;
+	}
+	return 1;
+}
+
+static struct file_cache_item * file_cache_load(file_cache_t * cache, const char * path)
+{
+	char full_path[PATH_MAX] = "";
+	char real_path[PATH_MAX] = "";
+	int cb = snprintf(full_path, sizeof(full_path), "%s%s", cache->document_root, path);
+	if(cb <= 0 || cb >= sizeof(full_path)) return NULL;
+	
+	// symlinks must not escape document_root
+	if(NULL == realpath(full_path, real_path)) return NULL;
+	size_t cb_root = strlen(cache->document_root);
+	if(strncmp(real_path, cache->document_root, cb_root) != 0 || real_path[cb_root] != '/') return NULL;
+	
+	int fd = open(real_path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return NULL;
+	
+	struct stat st[1];
+	memset(st, 0, sizeof(st));
+	if(fstat(fd, st) || !S_ISREG(st->st_mode)) {
+		close(fd);
+		return NULL;
+	}
+	
+	void * data = NULL;
+	if(st->st_size > 0) {
+		data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(data == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+	
+	struct file_cache_item * item = calloc(1, sizeof(*item));
+	assert(item);
+	item->refs = 1;
+	item->path = strdup(path);
+	item->size = st->st_size;
+	item->checked_at = time(NULL);
+	
+	file_cache_entry_t * entry = &item->base;
+	entry->path = item->path;
+	entry->content_type = file_cache_get_content_type(path);
+	entry->data = data;
+	entry->length = st->st_size;
+	entry->mtime = st->st_mtime;
+	snprintf(entry->etag, sizeof(entry->etag), "\"%lx-%lx\"", (long)st->st_size, (long)st->st_mtime);
+	
+	SoupDate * date = soup_date_new_from_time_t(st->st_mtime);
+	char * sz_date = soup_date_to_string(date, SOUP_DATE_HTTP);
+	strncpy(entry->last_modified, sz_date, sizeof(entry->last_modified) - 1);
+	g_free(sz_date);
+	soup_date_free(date);
+	
+	return item;
+}
+
+static int file_cache_revalidate(file_cache_t * cache, struct file_cache_item * item, time_t now)
+{
+	if((now - item->checked_at) < FILE_CACHE_REVALIDATE_INTERVAL) return 0;
+	
+	char full_path[PATH_MAX] = "";
+	snprintf(full_path, sizeof(full_path), "%s%s", cache->document_root, item->path);
+	
+	struct stat st[1];
+	if(stat(full_path, st) || st->st_size != item->size || st->st_mtime != item->base.mtime) return -1;
+	
+	item->checked_at = now;
+	return 0;
+}
+
+const file_cache_entry_t * file_cache_get(file_cache_t * cache, const char * path)
+{
+	assert(cache && cache->priv);
+	struct file_cache_private * priv = cache->priv;
+	
+	if(!is_valid_path(path)) return NULL;
+	
+	struct file_cache_item * item = g_hash_table_lookup(priv->items, path);
+	if(item) {
+		if(0 == file_cache_revalidate(cache, item, time(NULL))) {
+			++cache->num_hits;
+			lru_unlink(priv, item);
+			lru_push_front(priv, item);
+			++item->refs;
+			return &item->base;
+		}
+		file_cache_remove(priv, item);	// modified or removed from disk
+	}
+	
+	++cache->num_misses;
+	item = file_cache_load(cache, path);
+	if(NULL == item) return NULL;
+	
+	if(item->base.length <= cache->max_file_size) {
+		file_cache_evict(priv, item->base.length);
+		
+		item->is_cached = 1;
+		++item->refs;	// the cache's reference
+		g_hash_table_insert(priv->items, item->path, item);
+		lru_push_front(priv, item);
+		++cache->num_entries;
+		cache->bytes_cached += item->base.length;
+	}
+	return &item->base;
+}
+
+file_cache_t * file_cache_init(file_cache_t * cache, const char * document_root, size_t max_entries, size_t max_bytes, void * user_data)
+{
+	assert(document_root);
+	if(NULL == cache) cache = calloc(1, sizeof(*cache));
+	assert(cache);
+	cache->user_data = user_data;
+	
+	strncpy(cache->document_root, document_root, sizeof(cache->document_root) - 1);
+	size_t cb = strlen(cache->document_root);
+	while(cb > 1 && cache->document_root[cb - 1] == '/') cache->document_root[--cb] = '\0';
+	
+	if(0 == max_entries) max_entries = 256;
+	if(0 == max_bytes) max_bytes = 64 * 1024 * 1024;
+	cache->max_entries = max_entries;
+	cache->max_bytes = max_bytes;
+	cache->max_file_size = max_bytes / 8;
+	
+	struct file_cache_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->cache = cache;
+	priv->items = g_hash_table_new(g_str_hash, g_str_equal);
+	cache->priv = priv;
+	
+	return cache;
+}
+
+void file_cache_cleanup(file_cache_t * cache)
+{
+	if(NULL == cache || NULL == cache->priv) return;
+	struct file_cache_private * priv = cache->priv;
+	
+	// entries still referenced by pending responses are unmapped when released
+	while(priv->head) file_cache_remove(priv, priv->head);
+	g_hash_table_destroy(priv->items);
+	
+	cache->priv = NULL;
+	free(priv);
+	return;
+}
@@ -32,18 +32,55 @@
 #include <assert.h>
 
 #include "app.h"
+#include "json-writer.h"
 #include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <libsoup/soup.h>
 #include <jwt.h> // libjwt-dev_1.10.1
 
 static void on_document_root(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
 static void on_login(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
 static void on_favicon(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+static void on_healthz(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+static void on_readyz(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
 static void on_auth_token(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+static void on_metrics(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+static void on_debug_timings(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+
+static void on_request_started(SoupServer * server, SoupMessage * msg, SoupClientContext * client, http_server_t * http);
+static void on_request_read(SoupServer * server, SoupMessage * msg, SoupClientContext * client, http_server_t * http);
+static void on_request_finished(SoupServer * server, SoupMessage * msg, SoupClientContext * client, http_server_t * http);
 
 /******************************************************
  * http server 
 ******************************************************/
+static gboolean listen_reuseport(SoupServer * server, unsigned int port, SoupServerListenOptions flags, GError ** p_error)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		perror("socket");
+		return FALSE;
+	}
+	
+	int on = 1;
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY), };
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+		|| setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+		|| bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+		|| listen(fd, SOMAXCONN))
+	{
+		perror("listen_reuseport");
+		close(fd);
+		return FALSE;
+	}
+	
+	// IPV4_ONLY is implied by the socket, soup_server_listen_fd() only accepts HTTPS
+	return soup_server_listen_fd(server, fd, flags & SOUP_SERVER_LISTEN_HTTPS, p_error);
+}
+
 http_server_t * http_server_init(http_server_t * http, void * user_data)
 {
 	app_context_t * app = user_data;
@@ -55,13 +92,83 @@ http_server_t * http_server_init(http_server_t * http, void * user_data)
 	assert(http);
 	http->user_data = app;
 	
-	char path_name[PATH_MAX] = "";
-	ssize_t cb = readlink("/proc/self/exe", path_name, sizeof(path_name));
-	assert(cb > 0);
+	// "document_root" in config.json: absolute, or relative to the executable's directory.
+	// It is served without authentication, so there is no implicit default: unset, no static file is served.
+	const char * doc_root = json_get_value(jconfig, string, document_root);
+	if(doc_root && doc_root[0]) {
+		char root_path[PATH_MAX] = "";
+		if(doc_root[0] == '/') strncpy(root_path, doc_root, sizeof(root_path) - 1);
+		else {
+			char path_name[PATH_MAX] = "";
+			ssize_t cb = readlink("/proc/self/exe", path_name, sizeof(path_name) - 1);
+			assert(cb > 0);
+			snprintf(root_path, sizeof(root_path), "%s/%s", dirname(path_name), doc_root);
+		}
+		
+		char * real_path = realpath(root_path, NULL);
+		if(NULL == real_path) {
+			perror(root_path);
+			exit(1);
+		}
+		strncpy(http->document_root, real_path, sizeof(http->document_root) - 1);
+		free(real_path);
+	}else {
+		fprintf(stderr, "WARNING: no 'document_root' in config, static files are not served.\n");
+	}
+	
+	size_t cache_entries = json_get_value(jconfig, int, static_cache_entries);
+	size_t cache_size = (size_t)json_get_value(jconfig, int, static_cache_mb) * 1024 * 1024;
+	file_cache_t * static_files = file_cache_init(http->static_files, http->document_root, cache_entries, cache_size, http);
+	assert(static_files);
+	
+	// "asset_manifest": written by tools/build-assets.sh, relative to document_root
+	asset_manifest_t * assets = asset_manifest_init(http->assets, http->document_root, json_get_value(jconfig, string, asset_manifest), http);
+	if(NULL == assets) exit(1);
+	
+	const char * jwt_secret = json_get_value(jconfig, string, jwt_secret);
+	if(NULL == jwt_secret || !jwt_secret[0]) fprintf(stderr, "WARNING: no 'jwt_secret' in config, bearer tokens will be rejected.\n");
+	unsigned int jwt_cache_entries = json_get_value(jconfig, int, jwt_cache_entries);
+	unsigned int jwt_cache_shards = json_get_value(jconfig, int, jwt_cache_shards);
+	jwt_cache_t * jwt_cache = jwt_cache_init(http->jwt_cache, jwt_secret, jwt_cache_entries, jwt_cache_shards, http);
+	assert(jwt_cache);
+	
+	credentials_t * credentials = credentials_init(http->credentials, json_get_value(jconfig, string, login_credentials), http);
+	if(NULL == credentials) exit(1);
+	http->token_ttl = json_get_value(jconfig, int, jwt_ttl);
+	if(0 == http->token_ttl) http->token_ttl = 3600;
+	
+	metrics_t * metrics = metrics_init(http->metrics, http);
+	assert(metrics);
+	http->metrics_remote = json_get_value(jconfig, int, metrics_remote);
+	static const char * routes[] = { "/", "/favicon.ico", "/login", "/auth", "/api/users", "/metrics", };
+	for(int i = 0; i < G_N_ELEMENTS(routes); ++i) metrics_register_route(metrics, routes[i]);
+	
+	admission_t * admission = admission_init(http->admission, json_get_value(jconfig, int, rate_limit_slots), http);
+	assert(admission);
+	admission_set_limits(admission, 
+		json_get_value(jconfig, double, rate_limit_ip_rps), 
+		json_get_value(jconfig, double, rate_limit_ip_burst), 
+		json_get_value(jconfig, int, max_inflight_requests));
+	const char * rate_limit_routes = json_get_value(jconfig, string, rate_limit_routes);
+	if(admission_set_routes(admission, rate_limit_routes) < 0) {
+		fprintf(stderr, "invalid 'rate_limit_routes': %s (expected \"path:rate:burst,...\")\n", rate_limit_routes);
+		exit(1);
+	}
 	
-	char * document_root = dirname(path_name);
-	assert(document_root);
-	strncpy(http->document_root, document_root, sizeof(http->document_root));
+	int timing_sample_rate = json_get_value(jconfig, int, timing_sample_rate);
+	server_timing_t * timing = server_timing_init(http->timing, 
+		json_get_value(jconfig, int, server_timing), 
+		(timing_sample_rate > 0) ? timing_sample_rate : 0, 
+		json_get_value(jconfig, int, timing_ring_size), 
+		http);
+	assert(timing);
+	
+	// "request_arena_chunk_kb": per-request scratch memory, "request_arena_free_chunks": chunks kept for reuse
+	request_arena_pool_t * arenas = request_arena_pool_init(http->arenas, 
+		(size_t)json_get_value(jconfig, int, request_arena_chunk_kb) * 1024, 
+		json_get_value(jconfig, int, request_arena_free_chunks), 
+		http);
+	assert(arenas);
 	
 	unsigned int port = json_get_value(jconfig, int, port);
 	if(port == 0 || port > 65535) port = DEFAULT_LISTEN_PORT;
@@ -89,9 +196,25 @@ http_server_t * http_server_init(http_server_t * http, void * user_data)
 	soup_server_add_handler(server, "/favicon.ico", on_favicon, app, NULL);
 	soup_server_add_handler(server, "/login", on_login, app, NULL);
 	soup_server_add_handler(server, "/auth", on_auth_token, app, NULL);
+	soup_server_add_handler(server, "/api/users", on_api_users, app, NULL);
+	soup_server_add_handler(server, "/metrics", on_metrics, app, NULL);
+	soup_server_add_handler(server, "/healthz", on_healthz, app, NULL);
+	soup_server_add_handler(server, "/readyz", on_readyz, app, NULL);
+	soup_server_add_handler(server, "/debug/timings", on_debug_timings, app, NULL);
+	soup_server_add_websocket_handler(server, "/ws/users", NULL, NULL, on_ws_users, app, NULL);
+	
+	g_signal_connect(server, "request-started", G_CALLBACK(on_request_started), http);
+	g_signal_connect(server, "request-read", G_CALLBACK(on_request_read), http);
+	g_signal_connect(server, "request-finished", G_CALLBACK(on_request_finished), http);
+	g_signal_connect(server, "request-aborted", G_CALLBACK(on_request_finished), http);
 	
-	ok = soup_server_listen_all(server, port, flags, &gerr);
-	assert(ok && NULL == gerr);
+	// prefork mode: every worker process binds the same port, the kernel balances the connections
+	if(app->prefork.num_processes > 0) ok = listen_reuseport(server, port, flags, &gerr);
+	else ok = soup_server_listen_all(server, port, flags, &gerr);
+	if(!ok) {
+		fprintf(stderr, "listen on port %u failed: %s\n", port, gerr?gerr->message:"unknown error");
+		exit(1);
+	}
 	http->server = server;
 	
 	GSList * uris = soup_server_get_uris(server);
@@ -109,18 +232,589 @@ http_server_t * http_server_init(http_server_t * http, void * user_data)
 }
 void http_server_cleanup(http_server_t * http)
 {
+	file_cache_cleanup(http->static_files);
+	asset_manifest_cleanup(http->assets);
+	jwt_cache_cleanup(http->jwt_cache);
+	credentials_cleanup(http->credentials);
+	metrics_cleanup(http->metrics);
+	admission_cleanup(http->admission);
+	server_timing_cleanup(http->timing);
+	request_arena_pool_cleanup(http->arenas);
+	
+	SoupSession * session = http->master_session;
+	http->master_session = NULL;
+	if(session) {
+		soup_session_abort(session);
+		g_object_unref(session);
+	}
 	return;
 }
 
+/******************************************************
+ * request metrics
+******************************************************/
+#define METRICS_START_TIME_KEY	"metrics.start_time"
+#define ADMISSION_ADMITTED_KEY	"admission.admitted"	// set on admitted messages, see on_request_read()
+#define SERVER_TIMING_KEY	"server_timing"
+#define REQUEST_ARENA_KEY	"request_arena"
+static void on_request_started(SoupServer * server, SoupMessage * msg, SoupClientContext * client, http_server_t * http)
+{
+	gint64 * start_time = g_new(gint64, 1);
+	*start_time = g_get_monotonic_time();
+	g_object_set_data_full(G_OBJECT(msg), METRICS_START_TIME_KEY, start_time, g_free);
+	
+	request_timing_t * timing = server_timing_start(http->timing);
+	if(timing) {
+		timing->start_us = *start_time;
+		g_object_set_data_full(G_OBJECT(msg), SERVER_TIMING_KEY, timing, g_free);
+	}
+}
+
+request_timing_t * http_server_get_timing(SoupMessage * msg)
+{
+	return g_object_get_data(G_OBJECT(msg), SERVER_TIMING_KEY);
+}
+
+static void on_arena_message_finished(SoupMessage * msg, gpointer user_data)
+{
+	// the response buffers keep their references until libsoup frees the body
+	g_signal_handlers_disconnect_by_func(msg, on_arena_message_finished, user_data);
+	g_object_set_data(G_OBJECT(msg), REQUEST_ARENA_KEY, NULL);
+}
+
+request_arena_t * http_server_get_arena(http_server_t * http, SoupMessage * msg)
+{
+	request_arena_t * arena = g_object_get_data(G_OBJECT(msg), REQUEST_ARENA_KEY);
+	if(arena) return arena;
+	
+	arena = request_arena_new(http->arenas);
+	g_object_set_data_full(G_OBJECT(msg), REQUEST_ARENA_KEY, arena, (GDestroyNotify)request_arena_unref);
+	g_signal_connect(msg, "finished", G_CALLBACK(on_arena_message_finished), NULL);
+	return arena;
+}
+
+static void on_request_finished(SoupServer * server, SoupMessage * msg, SoupClientContext * client, http_server_t * http)
+{
+	// also connected to "request-aborted" (status is whatever was set before the connection dropped)
+	if(g_object_steal_data(G_OBJECT(msg), ADMISSION_ADMITTED_KEY)) admission_release(http->admission);
+	
+	gint64 * start_time = g_object_get_data(G_OBJECT(msg), METRICS_START_TIME_KEY);
+	SoupURI * uri = soup_message_get_uri(msg);
+	if(NULL == start_time || NULL == uri) return;
+	
+	request_timing_t * timing = http_server_get_timing(msg);
+	if(timing && timing->sampled) server_timing_record(http->timing, timing, msg->method, uri->path, msg->status_code);
+	
+	int route = metrics_find_route(http->metrics, uri->path);
+	if(route < 0) return;
+	
+	gint64 latency = g_get_monotonic_time() - *start_time;
+	metrics_record_request(http->metrics, route, msg->status_code, latency > 0 ? latency : 0);
+}
+
+/******************************************************
+ * admission control
+ * "request-read" is emitted before the handler is called,
+ * a status set here answers the request without running the handler.
+******************************************************/
+static void on_request_read(SoupServer * server, SoupMessage * msg, SoupClientContext * client, http_server_t * http)
+{
+	request_timing_t * timing = http_server_get_timing(msg);
+	if(timing) request_timing_add(timing, "read", timing->start_us);	// headers and body
+	
+	int64_t begin_us = request_timing_now(timing);
+	SoupURI * uri = soup_message_get_uri(msg);
+	unsigned int retry_after = 0;
+	unsigned int status = admission_check(http->admission, soup_client_context_get_host(client), uri?uri->path:NULL, 1, &retry_after);
+	request_timing_add(timing, "admission", begin_us);
+	if(0 == status) {
+		g_object_set_data(G_OBJECT(msg), ADMISSION_ADMITTED_KEY, GINT_TO_POINTER(1));
+		
+		// the websocket handler has no SoupMessage to answer: the handshake is checked here
+		if(uri && uri->path && strcmp(uri->path, "/ws/users") == 0) users_api_check_ws_handshake(http->user_data, msg);
+		return;
+	}
+	
+	char sz_retry_after[32] = "";
+	snprintf(sz_retry_after, sizeof(sz_retry_after), "%u", retry_after);
+	soup_message_headers_replace(msg->response_headers, "Retry-After", sz_retry_after);
+	if(status == HTTP_STATUS_TOO_MANY_REQUESTS) soup_message_set_status_full(msg, status, "Too Many Requests");
+	else soup_message_set_status(msg, status);
+}
+
+/******************************************************
+ * static files
+******************************************************/
+static int is_not_modified(SoupMessageHeaders * req_headers, const file_cache_entry_t * entry)
+{
+	const char * if_none_match = soup_message_headers_get_list(req_headers, "If-None-Match");
+	if(if_none_match) {
+		return (strcmp(if_none_match, "*") == 0 || strstr(if_none_match, entry->etag) != NULL);
+	}
+	
+	const char * if_modified_since = soup_message_headers_get_one(req_headers, "If-Modified-Since");
+	if(if_modified_since) {
+		SoupDate * date = soup_date_new_from_string(if_modified_since);
+		if(NULL == date) return 0;
+		time_t since = soup_date_to_time_t(date);
+		soup_date_free(date);
+		return (entry->mtime <= since);
+	}
+	return 0;
+}
+
+static void append_file_data(SoupMessageBody * body, const file_cache_entry_t * entry, goffset start, goffset length)
+{
+	if(length <= 0) return;
+	
+	// zero-copy: the buffer holds a reference on the mapped file until libsoup has sent it
+	file_cache_entry_ref(entry);
+	SoupBuffer * buffer = soup_buffer_new_with_owner(entry->data + start, length, (gpointer)entry, file_cache_entry_unref);
+	soup_message_body_append_buffer(body, buffer);
+	soup_buffer_free(buffer);
+}
+
+/*
+ * the precompressed variant to send, 0: identity
+ */
+static int select_encoding(SoupMessageHeaders * req_headers, int encodings)
+{
+	const char * accept_encoding = soup_message_headers_get_list(req_headers, "Accept-Encoding");
+	if(0 == encodings || NULL == accept_encoding) return 0;
+	
+	int accepted = 0;
+	GSList * codings = soup_header_parse_quality_list(accept_encoding, NULL);	// without the q=0 ones
+	for(GSList * coding = codings; coding; coding = coding->next) {
+		const char * name = coding->data;
+		if(strcasecmp(name, "br") == 0) accepted |= ASSET_ENCODING_BR;
+		else if(strcasecmp(name, "gzip") == 0 || strcasecmp(name, "x-gzip") == 0) accepted |= ASSET_ENCODING_GZIP;
+	}
+	soup_header_free_list(codings);
+	
+	// brotli is smaller, the client's q-values are not weighed
+	accepted &= encodings;
+	if(accepted & ASSET_ENCODING_BR) return ASSET_ENCODING_BR;
+	return accepted & ASSET_ENCODING_GZIP;
+}
+
+/*
+ * index.html with the hashed asset urls
+ */
+static int serve_rewritten_index(http_server_t * http, SoupMessage * msg, const file_cache_entry_t * entry)
+{
+	size_t length = 0;
+	const char * etag = NULL;
+	const char * html = asset_manifest_rewrite_index(http->assets, entry, &length, &etag);
+	if(NULL == html) return -1;
+	
+	SoupMessageHeaders * resp_headers = msg->response_headers;
+	soup_message_headers_replace(resp_headers, "ETag", etag);
+	soup_message_headers_replace(resp_headers, "Cache-Control", "no-cache");
+	
+	const char * if_none_match = soup_message_headers_get_list(msg->request_headers, "If-None-Match");
+	if(if_none_match && (strcmp(if_none_match, "*") == 0 || strstr(if_none_match, etag) != NULL)) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_MODIFIED);
+		return 0;
+	}
+	
+	soup_message_headers_set_content_type(resp_headers, entry->content_type, NULL);
+	soup_message_body_append(msg->response_body, SOUP_MEMORY_COPY, html, length);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	return 0;
+}
+
+/*
+ * only plain paths under document_root: no '.' or '..' segments and no hidden files (.git, .htpasswd),
+ * file_cache_get() also refuses a file whose real path (symlinks resolved) is outside document_root
+ */
+static int is_public_path(const char * path)
+{
+	return (path && path[0] == '/' && NULL == strstr(path, "/."));
+}
+
+/*
+ * returns 0 if the request has been answered, -1 if there is no such file
+ */
+static int serve_static_file(http_server_t * http, SoupMessage * msg, const char * path)
+{
+	if(!http->document_root[0] || !is_public_path(path)) return -1;
+	
+	char index_path[PATH_MAX] = "";
+	size_t cb_path = strlen(path);
+	if(cb_path == 0 || path[cb_path - 1] == '/') {
+		snprintf(index_path, sizeof(index_path), "%sindex.html", cb_path?path:"/");
+		path = index_path;
+	}
+	
+	SoupMessageHeaders * req_headers = msg->request_headers;
+	SoupMessageHeaders * resp_headers = msg->response_headers;
+	
+	// hashed asset: pick a precompressed variant, never compressed here
+	const asset_entry_t * asset = asset_manifest_find(http->assets, path);
+	const file_cache_entry_t * entry = NULL;
+	int encoding = asset ? select_encoding(req_headers, asset->encodings) : 0;
+	if(encoding) {
+		char variant_path[PATH_MAX] = "";
+		snprintf(variant_path, sizeof(variant_path), "%s%s", path, (encoding == ASSET_ENCODING_BR) ? ".br" : ".gz");
+		entry = file_cache_get(http->static_files, variant_path);
+		if(NULL == entry) encoding = 0;	// removed since startup
+	}
+	if(NULL == entry) entry = file_cache_get(http->static_files, path);
+	if(NULL == entry) return -1;
+	
+	if(http->assets->num_assets > 0 && strcmp(path, "/index.html") == 0) {
+		int rc = serve_rewritten_index(http, msg, entry);
+		file_cache_entry_unref((void *)entry);
+		return rc;
+	}
+	
+	soup_message_headers_replace(resp_headers, "ETag", entry->etag);
+	soup_message_headers_replace(resp_headers, "Last-Modified", entry->last_modified);
+	soup_message_headers_replace(resp_headers, "Cache-Control", asset ? "public, max-age=31536000, immutable" : "no-cache");
+	soup_message_headers_replace(resp_headers, "Accept-Ranges", "bytes");
+	if(asset && asset->encodings) soup_message_headers_append(resp_headers, "Vary", "Accept-Encoding");
+	if(encoding) soup_message_headers_replace(resp_headers, "Content-Encoding", (encoding == ASSET_ENCODING_BR) ? "br" : "gzip");
+	
+	if(is_not_modified(req_headers, entry)) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_MODIFIED);
+		file_cache_entry_unref((void *)entry);
+		return 0;
+	}
+	
+	soup_message_headers_set_content_type(resp_headers, asset ? asset->content_type : entry->content_type, NULL);
+	
+	goffset length = entry->length;
+	const char * range = soup_message_headers_get_one(req_headers, "Range");
+	const char * if_range = soup_message_headers_get_one(req_headers, "If-Range");
+	if(range && (NULL == if_range || strcmp(if_range, entry->etag) == 0)) {
+		SoupRange * ranges = NULL;
+		int num_ranges = 0;
+		if(!soup_message_headers_get_ranges(req_headers, length, &ranges, &num_ranges)) {
+			char content_range[100] = "";
+			snprintf(content_range, sizeof(content_range), "bytes */%ld", (long)length);
+			soup_message_headers_replace(resp_headers, "Content-Range", content_range);
+			soup_message_set_status(msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+			file_cache_entry_unref((void *)entry);
+			return 0;
+		}
+		
+		if(num_ranges == 1) {
+			goffset start = ranges[0].start;
+			goffset end = ranges[0].end;
+			soup_message_headers_free_ranges(req_headers, ranges);
+			
+			soup_message_headers_set_content_range(resp_headers, start, end, length);
+			append_file_data(msg->response_body, entry, start, end - start + 1);
+			soup_message_set_status(msg, SOUP_STATUS_PARTIAL_CONTENT);
+			file_cache_entry_unref((void *)entry);
+			return 0;
+		}
+		
+		// multiple ranges: libsoup builds the multipart/byteranges response from a complete 200 body
+		soup_message_headers_free_ranges(req_headers, ranges);
+	}
+	
+	append_file_data(msg->response_body, entry, 0, length);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	file_cache_entry_unref((void *)entry);
+	return 0;
+}
+
+/******************************************************
+ * http tasks (run on the worker pool)
+******************************************************/
+struct http_task_private
+{
+	pthread_mutex_t mutex;
+	int refs;
+	int headers_sent;
+	GSList * chunks;	// pending chunks (GString *), in reverse order
+};
+
+static void free_chunk(gpointer chunk)
+{
+	g_string_free(chunk, TRUE);
+}
+
+static void on_task_message_finished(SoupMessage * msg, http_task_t * task)
+{
+	__atomic_store_n(&task->finished, 1, __ATOMIC_RELEASE);	// read by the worker
+}
+
+static void http_task_unref(http_task_t * task)
+{
+	if(NULL == task) return;
+	struct http_task_private * priv = task->priv;
+	
+	pthread_mutex_lock(&priv->mutex);
+	int refs = --priv->refs;
+	pthread_mutex_unlock(&priv->mutex);
+	if(refs > 0) return;
+	
+	if(task->free_data) task->free_data(task->task_data);
+	if(task->body) g_string_free(task->body, TRUE);
+	if(task->msg) g_object_unref(task->msg);
+	request_arena_unref(task->arena);
+	
+	g_slist_free_full(priv->chunks, free_chunk);
+	pthread_mutex_destroy(&priv->mutex);
+	free(priv);
+	free(task);
+}
+
+static void http_task_send_chunks(http_task_t * task)
+{
+	struct http_task_private * priv = task->priv;
+	SoupMessage * msg = task->msg;
+	
+	pthread_mutex_lock(&priv->mutex);
+	GSList * chunks = g_slist_reverse(priv->chunks);
+	priv->chunks = NULL;
+	pthread_mutex_unlock(&priv->mutex);
+	
+	for(GSList * item = chunks; item; item = item->next) {
+		GString * chunk = item->data;
+		item->data = NULL;
+		if(__atomic_load_n(&task->finished, __ATOMIC_ACQUIRE)) {
+			g_string_free(chunk, TRUE);
+			continue;
+		}
+		gsize length = chunk->len;
+		soup_message_body_append(msg->response_body, SOUP_MEMORY_TAKE, g_string_free(chunk, FALSE), length);
+	}
+	g_slist_free(chunks);
+}
+
+static void http_task_send_headers(http_task_t * task)
+{
+	struct http_task_private * priv = task->priv;
+	SoupMessage * msg = task->msg;
+	if(priv->headers_sent) return;
+	priv->headers_sent = 1;
+	
+	if(task->content_type) soup_message_headers_set_content_type(msg->response_headers, task->content_type, NULL);
+	if(task->chunked) {
+		// each chunk is freed once written, instead of the whole body being kept until the end
+		soup_message_headers_set_encoding(msg->response_headers, SOUP_ENCODING_CHUNKED);
+		soup_message_body_set_accumulate(msg->response_body, FALSE);
+	}
+	server_timing_set_header(task->http->timing, task->timing, msg->response_headers);	// chunked: the spans recorded before the first chunk
+	soup_message_set_status(msg, task->status?task->status:SOUP_STATUS_INTERNAL_SERVER_ERROR);
+}
+
+static gboolean on_task_chunks_ready(gpointer user_data)
+{
+	http_task_t * task = user_data;
+	if(!__atomic_load_n(&task->finished, __ATOMIC_ACQUIRE)) {
+		http_task_send_headers(task);
+		http_task_send_chunks(task);
+		soup_server_unpause_message(task->http->server, task->msg);
+	}
+	http_task_unref(task);
+	return G_SOURCE_REMOVE;
+}
+
+void http_task_flush(http_task_t * task)
+{
+	struct http_task_private * priv = task->priv;
+	assert(task->chunked);
+	if(NULL == task->body || task->body->len == 0) return;
+	
+	// the buffer is handed to libsoup as is (no copy), the next chunk gets a new one of the same size
+	GString * chunk = task->body;
+	task->body = g_string_sized_new(chunk->allocated_len);
+	
+	pthread_mutex_lock(&priv->mutex);
+	priv->chunks = g_slist_prepend(priv->chunks, chunk);
+	++priv->refs;
+	pthread_mutex_unlock(&priv->mutex);
+	
+	g_idle_add_full(G_PRIORITY_DEFAULT, on_task_chunks_ready, task, NULL);
+}
+
+static void http_task_run(void * task_data)
+{
+	http_task_t * task = task_data;
+	request_timing_add(task->timing, "queue", task->queued_us);
+	if(__atomic_load_n(&task->finished, __ATOMIC_ACQUIRE)) return;
+	task->run(task);
+}
+
+static void http_task_complete(void * task_data)
+{
+	http_task_t * task = task_data;
+	SoupMessage * msg = task->msg;
+	
+	g_signal_handlers_disconnect_by_func(msg, on_task_message_finished, task);
+	if(!__atomic_load_n(&task->finished, __ATOMIC_ACQUIRE)) {
+		http_task_send_headers(task);
+		http_task_send_chunks(task);
+		if(task->body && task->body->len > 0) {
+			gsize length = task->body->len;
+			soup_message_body_append(msg->response_body, SOUP_MEMORY_TAKE, g_string_free(task->body, FALSE), length);
+			task->body = NULL;
+		}
+		if(task->chunked) soup_message_body_complete(msg->response_body);
+		soup_server_unpause_message(task->http->server, msg);
+	}
+	http_task_unref(task);
+}
+
+int http_server_dispatch(http_server_t * http, SoupMessage * msg, http_task_fn run, void * task_data, GDestroyNotify free_data)
+{
+	app_context_t * app = http->user_data;
+	assert(app);
+	return http_server_dispatch_to(http, app->workers, msg, run, task_data, free_data);
+}
+
+int http_server_dispatch_to(http_server_t * http, worker_pool_t * pool, SoupMessage * msg, http_task_fn run, void * task_data, GDestroyNotify free_data)
+{
+	assert(pool && run);
+	
+	http_task_t * task = calloc(1, sizeof(*task));
+	assert(task);
+	struct http_task_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	pthread_mutex_init(&priv->mutex, NULL);
+	priv->refs = 1;
+	
+	task->priv = priv;
+	task->http = http;
+	task->msg = g_object_ref(msg);
+	task->run = run;
+	task->task_data = task_data;
+	task->free_data = free_data;
+	task->body = g_string_new(NULL);
+	task->timing = http_server_get_timing(msg);
+	task->queued_us = request_timing_now(task->timing);
+	task->arena = request_arena_ref(http_server_get_arena(http, msg));
+	
+	int rc = worker_pool_push(pool, http_task_run, http_task_complete, task);
+	if(rc) { 
+		// back-pressure: the pool is saturated
+		http_task_unref(task);
+		
+		soup_message_headers_replace(msg->response_headers, "Retry-After", "1");
+		soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+		return -1;
+	}
+	
+	g_signal_connect(msg, "finished", G_CALLBACK(on_task_message_finished), task);
+	soup_server_pause_message(http->server, msg);
+	return 0;
+}
+
+/******************************************************
+ * replication: forward writes to the master
+******************************************************/
+struct forward_context
+{
+	http_server_t * http;
+	SoupMessage * msg;
+	int finished;	// the client went away
+};
+
+static int is_hop_by_hop_header(const char * name)
+{
+	static const char * names[] = { "Connection", "Keep-Alive", "Transfer-Encoding", "TE", "Trailer", "Upgrade", "Host", "Content-Length", NULL };
+	for(int i = 0; names[i]; ++i) if(strcasecmp(name, names[i]) == 0) return 1;
+	return 0;
+}
+
+static void copy_header(const char * name, const char * value, gpointer user_data)
+{
+	SoupMessageHeaders * headers = user_data;
+	if(is_hop_by_hop_header(name)) return;
+	soup_message_headers_append(headers, name, value);
+}
+
+static void on_forwarded_message_finished(SoupMessage * msg, struct forward_context * ctx)
+{
+	ctx->finished = 1;
+}
+
+static void on_master_response(SoupSession * session, SoupMessage * fwd, gpointer user_data)
+{
+	struct forward_context * ctx = user_data;
+	SoupMessage * msg = ctx->msg;
+	g_signal_handlers_disconnect_by_func(msg, on_forwarded_message_finished, ctx);
+	
+	if(!ctx->finished) {
+		if(SOUP_STATUS_IS_TRANSPORT_ERROR(fwd->status_code)) {
+			soup_message_set_status(msg, SOUP_STATUS_BAD_GATEWAY);
+		}else {
+			soup_message_headers_foreach(fwd->response_headers, copy_header, msg->response_headers);
+			soup_message_body_append(msg->response_body, SOUP_MEMORY_COPY, fwd->response_body->data, fwd->response_body->length);
+			soup_message_set_status(msg, fwd->status_code);
+		}
+		soup_server_unpause_message(ctx->http->server, msg);
+	}
+	g_object_unref(msg);
+	free(ctx);
+}
+
+int http_server_forward_to_master(http_server_t * http, SoupMessage * msg)
+{
+	app_context_t * app = http->user_data;
+	const char * master_url = app->db->rep->master_url;
+	if(!master_url[0]) {
+		soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+		return -1;
+	}
+	
+	SoupURI * uri = soup_message_get_uri(msg);
+	char url[PATH_MAX] = "";
+	snprintf(url, sizeof(url), "%s%s%s%s", master_url, uri->path, uri->query?"?":"", uri->query?uri->query:"");
+	
+	SoupMessage * fwd = soup_message_new(msg->method, url);
+	if(NULL == fwd) {
+		soup_message_set_status(msg, SOUP_STATUS_BAD_GATEWAY);
+		return -1;
+	}
+	soup_message_headers_foreach(msg->request_headers, copy_header, fwd->request_headers);
+	if(msg->request_body->length > 0) {
+		soup_message_body_append(fwd->request_body, SOUP_MEMORY_COPY, msg->request_body->data, msg->request_body->length);
+	}
+	
+	if(NULL == http->master_session) {
+		http->master_session = soup_session_new_with_options(SOUP_SESSION_TIMEOUT, 30, NULL);
+		assert(http->master_session);
+	}
+	
+	struct forward_context * ctx = calloc(1, sizeof(*ctx));
+	assert(ctx);
+	ctx->http = http;
+	ctx->msg = g_object_ref(msg);
+	g_signal_connect(msg, "finished", G_CALLBACK(on_forwarded_message_finished), ctx);
+	
+	soup_server_pause_message(http->server, msg);
+	soup_session_queue_message(http->master_session, fwd, on_master_response, ctx);
+	return 0;
+}
+
 /******************************************************
  * http server message handlers
 ******************************************************/
 static void on_document_root(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
 {
+	app_context_t * app = user_data;
 	SoupMessageHeaders * req_headers = msg->request_headers;
 	SoupMessageHeaders * resp_headers = msg->response_headers;
 	assert(req_headers && resp_headers);
 	
+	request_timing_t * timing = http_server_get_timing(msg);
+	
+	// static assets (index.html, webix, material-design) are public
+	if(msg->method == SOUP_METHOD_GET || msg->method == SOUP_METHOD_HEAD) {
+		int64_t begin_us = request_timing_now(timing);
+		int rc = serve_static_file(app->http, msg, path);
+		request_timing_add(timing, "static", begin_us);
+		if(0 == rc) {
+			server_timing_set_header(app->http->timing, timing, resp_headers);
+			return;
+		}
+	}
+	
 	const char * auth = soup_message_headers_get_one(req_headers, "Authorization");
 	if(NULL == auth || strncasecmp(auth, "Bearer ", sizeof("Bearer")) != 0) {
 		static const char * redirect_page = "/login";
@@ -129,23 +823,89 @@ static void on_document_root(SoupServer * server, SoupMessage * msg, const char
 		return;
 	}
 	
-	// todo: verify token
-	// ...
+	jwt_claims_t claims[1];
+	memset(claims, 0, sizeof(claims));
+	int64_t begin_us = request_timing_now(timing);
+	int rc = jwt_cache_verify(app->http->jwt_cache, auth + sizeof("Bearer"), claims, 0);
+	request_timing_add(timing, "auth", begin_us);
+	server_timing_set_header(app->http->timing, timing, resp_headers);
+	if(rc) {
+		soup_message_headers_append(resp_headers, "WWW-Authenticate", "Bearer error=\"invalid_token\"");
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+		return;
+	}
 	
 	SoupMessageBody * body = msg->response_body;
 	soup_message_headers_set_content_type(resp_headers, "text/plain", NULL);
 	
-	char sz_resp[PATH_MAX] = "";
-	ssize_t cb_resp = snprintf(sz_resp, sizeof(sz_resp), 
+	request_arena_t * arena = http_server_get_arena(app->http, msg);
+	size_t cb_resp = 0;
+	char * sz_resp = request_arena_printf(arena, &cb_resp, 
 		"method: %s, \npath: %s, \nquery=%p\n"
-		"Authorization: %s\n",
+		"Authorization: %s\n"
+		"sub: %s\n",
 		msg->method, path, query,
-		auth
+		auth, claims->sub
 	); 
-	soup_message_body_append(body, SOUP_MEMORY_COPY, sz_resp, cb_resp);
+	jwt_claims_clear(claims);
+	request_arena_append(arena, body, sz_resp, cb_resp);
 	soup_message_set_status(msg, SOUP_STATUS_OK);
 	return;
 }
+struct login_context
+{
+	char * username;
+	char * password;
+};
+static void login_context_free(void * user_data)
+{
+	struct login_context * ctx = user_data;
+	if(NULL == ctx) return;
+	if(ctx->password) explicit_bzero(ctx->password, strlen(ctx->password));
+	free(ctx->username);
+	free(ctx->password);
+	free(ctx);
+}
+
+/*
+ * (login worker) hashes the password, responds { "token": ..., "token_type": "Bearer", "expires_in": seconds }
+ */
+static void login_verify(http_task_t * task)
+{
+	struct login_context * ctx = task->task_data;
+	http_server_t * http = task->http;
+	
+	int64_t begin_us = request_timing_now(task->timing);
+	int rc = credentials_verify(http->credentials, ctx->username, ctx->password);
+	request_timing_add(task->timing, "kdf", begin_us);
+	if(rc) {
+		task->status = SOUP_STATUS_UNAUTHORIZED;
+		return;
+	}
+	
+	char * token = jwt_cache_issue(http->jwt_cache, ctx->username, http->token_ttl);
+	if(NULL == token) {
+		task->status = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+		return;
+	}
+	
+	json_writer_t json[1];
+	json_writer_init(json, task->body);
+	json_writer_begin_object(json);
+	json_writer_add_string(json, "token", token);
+	json_writer_add_string(json, "token_type", "Bearer");
+	json_writer_add_int64(json, "expires_in", http->token_ttl);
+	json_writer_end_object(json);
+	free(token);
+	
+	task->status = SOUP_STATUS_OK;
+	task->content_type = "application/json";
+	return;
+}
+
+/*
+ * POST /login	username=...&password=... (application/x-www-form-urlencoded)
+ */
 static void on_login(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
 {
 	// todo
@@ -160,9 +920,33 @@ static void on_login(SoupServer * server, SoupMessage * msg, const char * path,
 		return;
 	}
 	
-	// TODO: 
-	// 
-	soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+	SoupMessageBody * body = msg->request_body;
+	GHashTable * form = NULL;
+	if(body->data && body->length > 0) {
+		char * data = g_strndup(body->data, body->length);
+		form = soup_form_decode(data);
+		explicit_bzero(data, body->length);
+		g_free(data);
+	}
+	const char * username = form ? g_hash_table_lookup(form, "username") : NULL;
+	const char * password = form ? g_hash_table_lookup(form, "password") : NULL;
+	if(NULL == username || !username[0] || NULL == password) {
+		if(form) g_hash_table_destroy(form);
+		soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+	
+	struct login_context * ctx = calloc(1, sizeof(*ctx));
+	assert(ctx);
+	ctx->username = strdup(username);
+	ctx->password = strdup(password);
+	explicit_bzero((char *)password, strlen(password));
+	g_hash_table_destroy(form);
+	
+	// password hashing takes tens of milliseconds of CPU: it runs on its own bounded pool,
+	// a login burst is rejected (503) instead of queueing behind / in front of the other routes
+	app_context_t * app = user_data;
+	http_server_dispatch_to(app->http, app->login_workers, msg, login_verify, ctx, login_context_free);
 	return;
 }
 
@@ -170,6 +954,182 @@ static void on_favicon(SoupServer * server, SoupMessage * msg, const char * path
 {
 	soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
 }
+/*
+ * liveness: the main loop answers.
+ * readiness: running, and every secondary index is built (users_db itself is served from the start,
+ * the routes that need an index answer 503 until it is ready, see on_api_users()).
+ */
+static void on_healthz(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+	soup_message_set_response(msg, "text/plain", SOUP_MEMORY_STATIC, "ok\n", 3);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+static void on_readyz(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+	static const char * s_states[] = {
+		[DB_INDEX_READY] = "ready",
+		[DB_INDEX_BUILDING] = "building",
+		[DB_INDEX_FAILED] = "failed",
+	};
+	app_context_t * app = user_data;
+	int ready = app->is_running;
+	
+	json_object * jresult = json_object_new_object();
+	json_object * jindexes = json_object_new_object();
+	for(int i = 0; i < DB_USERS_SDBS_COUNT; ++i) {
+		enum db_index_state state = db_helpler_get_index_state(app->db, i);
+		if(state != DB_INDEX_READY) ready = 0;
+		json_object_object_add(jindexes, db_helpler_get_index_name(i), json_object_new_string(s_states[state]));
+	}
+	json_object_object_add(jresult, "indexes", jindexes);
+	json_object_object_add(jresult, "ready", json_object_new_boolean(ready));
+	
+	const char * sz_resp = json_object_to_json_string_ext(jresult, JSON_C_TO_STRING_PLAIN);
+	soup_message_set_response(msg, "application/json", SOUP_MEMORY_COPY, sz_resp, strlen(sz_resp));
+	json_object_put(jresult);
+	soup_message_set_status(msg, ready ? SOUP_STATUS_OK : SOUP_STATUS_SERVICE_UNAVAILABLE);
+}
+
+static int is_loopback_client(SoupClientContext * client)
+{
+	GSocketAddress * addr = soup_client_context_get_remote_address(client);
+	GInetAddress * inet_addr = G_IS_INET_SOCKET_ADDRESS(addr) ? g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(addr)) : NULL;
+	return (inet_addr && g_inet_address_get_is_loopback(inet_addr));
+}
+
+/*
+ * local clients only, unless "metrics_remote" is set
+ */
+static void on_metrics(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+	if(msg->method != SOUP_METHOD_GET) {
+		soup_message_set_status(msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+		return;
+	}
+	
+	app_context_t * app = user_data;
+	http_server_t * http = app->http;
+	if(!http->metrics_remote && !is_loopback_client(client)) {
+		soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+		return;
+	}
+	
+	GString * out = g_string_sized_new(64 * 1024);
+	
+	metrics_render(http->metrics, out);
+	
+	worker_pool_t * workers = app->workers;
+	g_string_append_printf(out, 
+		"# HELP webapi_worker_pending_tasks Tasks queued or running on the worker pool.\n"
+		"# TYPE webapi_worker_pending_tasks gauge\n"
+		"webapi_worker_pending_tasks %ld\n"
+		"# HELP webapi_worker_completed_total Tasks completed by the worker pool.\n"
+		"# TYPE webapi_worker_completed_total counter\n"
+		"webapi_worker_completed_total %ld\n"
+		"# HELP webapi_worker_rejected_total Requests rejected because the worker pool was saturated.\n"
+		"# TYPE webapi_worker_rejected_total counter\n"
+		"webapi_worker_rejected_total %ld\n",
+		worker_pool_get_pending(workers), workers->num_completed, workers->num_rejected);
+	
+	worker_pool_t * login_workers = app->login_workers;
+	credentials_t * credentials = http->credentials;
+	g_string_append_printf(out, 
+		"# HELP webapi_login_pending_tasks Logins queued or running on the login pool.\n"
+		"# TYPE webapi_login_pending_tasks gauge\n"
+		"webapi_login_pending_tasks %ld\n"
+		"# HELP webapi_login_rejected_total Logins rejected because the login pool was saturated.\n"
+		"# TYPE webapi_login_rejected_total counter\n"
+		"webapi_login_rejected_total %ld\n"
+		"# HELP webapi_login_attempts_total Password checks by result.\n"
+		"# TYPE webapi_login_attempts_total counter\n"
+		"webapi_login_attempts_total{result=\"ok\"} %lu\n"
+		"webapi_login_attempts_total{result=\"failed\"} %lu\n",
+		worker_pool_get_pending(login_workers), login_workers->num_rejected,
+		(unsigned long)__atomic_load_n(&credentials->num_verified, __ATOMIC_RELAXED),
+		(unsigned long)__atomic_load_n(&credentials->num_failed, __ATOMIC_RELAXED));
+	
+	file_cache_t * static_files = http->static_files;
+	g_string_append_printf(out, 
+		"# HELP webapi_static_cache_hits_total Static file cache hits.\n"
+		"# TYPE webapi_static_cache_hits_total counter\n"
+		"webapi_static_cache_hits_total %ld\n"
+		"# HELP webapi_static_cache_misses_total Static file cache misses.\n"
+		"# TYPE webapi_static_cache_misses_total counter\n"
+		"webapi_static_cache_misses_total %ld\n"
+		"# HELP webapi_static_cache_bytes Bytes mapped by the static file cache.\n"
+		"# TYPE webapi_static_cache_bytes gauge\n"
+		"webapi_static_cache_bytes %lu\n",
+		static_files->num_hits, static_files->num_misses, (unsigned long)static_files->bytes_cached);
+	
+	struct jwt_cache_stats jwt_stats[1];
+	memset(jwt_stats, 0, sizeof(jwt_stats));
+	jwt_cache_get_stats(http->jwt_cache, jwt_stats);
+	g_string_append_printf(out, 
+		"# HELP webapi_jwt_cache_hits_total Bearer tokens found in the verified-token cache.\n"
+		"# TYPE webapi_jwt_cache_hits_total counter\n"
+		"webapi_jwt_cache_hits_total %lu\n"
+		"# HELP webapi_jwt_cache_misses_total Bearer tokens decoded and verified.\n"
+		"# TYPE webapi_jwt_cache_misses_total counter\n"
+		"webapi_jwt_cache_misses_total %lu\n"
+		"# HELP webapi_jwt_invalid_total Rejected bearer tokens.\n"
+		"# TYPE webapi_jwt_invalid_total counter\n"
+		"webapi_jwt_invalid_total %lu\n",
+		(unsigned long)jwt_stats->hits, (unsigned long)jwt_stats->misses, (unsigned long)jwt_stats->failures);
+	
+	request_arena_pool_t * arenas = http->arenas;
+	g_string_append_printf(out, 
+		"# HELP webapi_arena_requests_total Per-request arenas created.\n"
+		"# TYPE webapi_arena_requests_total counter\n"
+		"webapi_arena_requests_total %lu\n"
+		"# HELP webapi_arena_chunks_total Arena chunks by source (malloc, reused from the pool, large allocations).\n"
+		"# TYPE webapi_arena_chunks_total counter\n"
+		"webapi_arena_chunks_total{source=\"malloc\"} %lu\n"
+		"webapi_arena_chunks_total{source=\"reused\"} %lu\n"
+		"webapi_arena_chunks_total{source=\"large\"} %lu\n"
+		"# HELP webapi_arena_free_chunks Arena chunks kept for the next requests.\n"
+		"# TYPE webapi_arena_free_chunks gauge\n"
+		"webapi_arena_free_chunks %u\n",
+		(unsigned long)__atomic_load_n(&arenas->num_arenas, __ATOMIC_RELAXED),
+		(unsigned long)__atomic_load_n(&arenas->num_chunk_mallocs, __ATOMIC_RELAXED),
+		(unsigned long)__atomic_load_n(&arenas->num_chunk_reuses, __ATOMIC_RELAXED),
+		(unsigned long)__atomic_load_n(&arenas->num_large_allocs, __ATOMIC_RELAXED),
+		request_arena_pool_get_free_chunks(arenas));
+	
+	admission_append_metrics(http->admission, out);
+	db_helpler_append_metrics(app->db, out);
+	change_feed_append_metrics(app->changes, out);
+	write_batcher_append_metrics(app->writes, out);
+	
+	soup_message_headers_set_content_type(msg->response_headers, "text/plain; version=0.0.4", NULL);
+	soup_message_body_append(msg->response_body, SOUP_MEMORY_TAKE, out->str, out->len);
+	g_string_free(out, FALSE);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
+/*
+ * the sampled request spans (see "timing_sample_rate"), local clients only
+ */
+static void on_debug_timings(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+	app_context_t * app = user_data;
+	server_timing_t * timing = app->http->timing;
+	if(0 == timing->sample_rate) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+	
+	if(!is_loopback_client(client)) {
+		soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+		return;
+	}
+	
+	GString * out = g_string_new(NULL);
+	server_timing_dump(timing, out);
+	soup_message_set_response(msg, "application/json", SOUP_MEMORY_TAKE, out->str, out->len);
+	g_string_free(out, FALSE);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
 static void on_auth_token(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
 {
 	// TODO:
@@ -0,0 +1,219 @@
+/*
+ * json-writer.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <math.h>
+#include "json-writer.h"
+
+/*
+ * characters that must be escaped: control characters, '"' and '\'.
+ * 0: copied as is, 'u': \u00XX, others: \<c>
+ */
+static const char s_escapes[256] = {
+	['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n', ['\f'] = 'f', ['\r'] = 'r',
+	[0x00] = 'u', [0x01] = 'u', [0x02] = 'u', [0x03] = 'u', [0x04] = 'u', [0x05] = 'u', [0x06] = 'u', [0x07] = 'u',
+	[0x0b] = 'u', [0x0e] = 'u', [0x0f] = 'u',
+	[0x10] = 'u', [0x11] = 'u', [0x12] = 'u', [0x13] = 'u', [0x14] = 'u', [0x15] = 'u', [0x16] = 'u', [0x17] = 'u',
+	[0x18] = 'u', [0x19] = 'u', [0x1a] = 'u', [0x1b] = 'u', [0x1c] = 'u', [0x1d] = 'u', [0x1e] = 'u', [0x1f] = 'u',
+	['"'] = '"', ['\\'] = '\\',
+};
+
+/*
+ * length of the prefix that can be copied without escaping,
+ * 16 bytes are checked at once (gcc vector extensions, SSE2 / NEON code on x86-64 / arm64)
+ */
+typedef unsigned char json_u8x16 __attribute__((vector_size(16)));
+typedef signed char json_i8x16 __attribute__((vector_size(16)));	// comparison results
+static size_t scan_plain(const unsigned char * p, size_t length)
+{
+	size_t i = 0;
+	for(; i + 16 <= length; i += 16) {
+		json_u8x16 v;
+		memcpy(&v, p + i, 16);
+		json_i8x16 special = (v < 0x20) | (v == '"') | (v == '\\');
+		
+		uint64_t words[2];
+		memcpy(words, &special, 16);
+		if(words[0] | words[1]) break;
+	}
+	for(; i < length; ++i) if(s_escapes[p[i]]) break;
+	return i;
+}
+
+void json_append_escaped(GString * out, const char * value, size_t length)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char * p = (const unsigned char *)value;
+	
+	g_string_append_c(out, '"');
+	while(length > 0) {
+		size_t cb = scan_plain(p, length);
+		if(cb > 0) g_string_append_len(out, (const char *)p, cb);
+		p += cb;
+		length -= cb;
+		if(0 == length) break;
+		
+		char escape[6] = { '\\', s_escapes[*p] };
+		if(escape[1] == 'u') {
+			escape[2] = '0';
+			escape[3] = '0';
+			escape[4] = hex[*p >> 4];
+			escape[5] = hex[*p & 0x0f];
+			g_string_append_len(out, escape, 6);
+		}else g_string_append_len(out, escape, 2);
+		++p;
+		--length;
+	}
+	g_string_append_c(out, '"');
+}
+
+json_writer_t * json_writer_init(json_writer_t * writer, GString * out)
+{
+	if(NULL == writer) writer = calloc(1, sizeof(*writer));
+	assert(writer);
+	memset(writer, 0, sizeof(*writer));
+	writer->out = out;
+	return writer;
+}
+
+static inline void begin_value(json_writer_t * writer)
+{
+	if(writer->after_key) {
+		writer->after_key = 0;
+		return;
+	}
+	if(0 == writer->depth) return;
+	
+	uint64_t bit = (uint64_t)1 << (writer->depth - 1);
+	if(writer->has_members & bit) g_string_append_c(writer->out, ',');
+	else writer->has_members |= bit;
+}
+
+static inline void push(json_writer_t * writer, char c)
+{
+	begin_value(writer);
+	g_string_append_c(writer->out, c);
+	assert(writer->depth < JSON_WRITER_MAX_DEPTH);
+	writer->has_members &= ~((uint64_t)1 << writer->depth);
+	++writer->depth;
+}
+
+static inline void pop(json_writer_t * writer, char c)
+{
+	assert(writer->depth > 0 && !writer->after_key);
+	--writer->depth;
+	g_string_append_c(writer->out, c);
+}
+
+void json_writer_begin_object(json_writer_t * writer) { push(writer, '{'); }
+void json_writer_end_object(json_writer_t * writer) { pop(writer, '}'); }
+void json_writer_begin_array(json_writer_t * writer) { push(writer, '['); }
+void json_writer_end_array(json_writer_t * writer) { pop(writer, ']'); }
+
+void json_writer_key(json_writer_t * writer, const char * key)
+{
+	assert(key && !writer->after_key);
+	begin_value(writer);
+	json_append_escaped(writer->out, key, strlen(key));
+	g_string_append_c(writer->out, ':');
+	writer->after_key = 1;
+}
+
+void json_writer_string_len(json_writer_t * writer, const char * value, size_t length)
+{
+	begin_value(writer);
+	json_append_escaped(writer->out, value, length);
+}
+
+void json_writer_string(json_writer_t * writer, const char * value)
+{
+	if(NULL == value) {
+		json_writer_null(writer);
+		return;
+	}
+	json_writer_string_len(writer, value, strlen(value));
+}
+
+static void append_uint64(GString * out, uint64_t value, int negative)
+{
+	char buf[24];
+	char * p = buf + sizeof(buf);
+	do {
+		*--p = '0' + (value % 10);
+		value /= 10;
+	}while(value);
+	if(negative) *--p = '-';
+	g_string_append_len(out, p, buf + sizeof(buf) - p);
+}
+
+void json_writer_int64(json_writer_t * writer, int64_t value)
+{
+	begin_value(writer);
+	if(value < 0) append_uint64(writer->out, (uint64_t)0 - (uint64_t)value, 1);
+	else append_uint64(writer->out, value, 0);
+}
+
+void json_writer_uint64(json_writer_t * writer, uint64_t value)
+{
+	begin_value(writer);
+	append_uint64(writer->out, value, 0);
+}
+
+void json_writer_double(json_writer_t * writer, double value)
+{
+	if(!isfinite(value)) {
+		json_writer_null(writer);	// not representable in JSON
+		return;
+	}
+	begin_value(writer);
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+	g_string_append(writer->out, g_ascii_dtostr(buf, sizeof(buf), value));	// locale independent
+}
+
+void json_writer_bool(json_writer_t * writer, int value)
+{
+	begin_value(writer);
+	if(value) g_string_append_len(writer->out, "true", 4);
+	else g_string_append_len(writer->out, "false", 5);
+}
+
+void json_writer_null(json_writer_t * writer)
+{
+	begin_value(writer);
+	g_string_append_len(writer->out, "null", 4);
+}
+
+void json_writer_raw(json_writer_t * writer, const char * json, size_t length)
+{
+	begin_value(writer);
+	g_string_append_len(writer->out, json, length);
+}
@@ -0,0 +1,330 @@
+/*
+ * jwt-cache.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <jwt.h>
+
+#include "jwt-cache.h"
+
+#define JWT_CACHE_WAYS	(4)	// entries per set
+#define JWT_CACHE_DEFAULT_TTL	(300)	// tokens without 'exp'
+
+struct jwt_cache_entry
+{
+	uint64_t hash;
+	char * token;
+	size_t cb_token;
+	time_t expires_at;
+	uint64_t last_used;	// shard tick, updated under the read lock (atomic)
+	jwt_claims_t claims;
+};
+
+struct jwt_cache_shard
+{
+	pthread_rwlock_t rwlock;
+	unsigned int num_sets;
+	struct jwt_cache_entry * entries;	// [num_sets][JWT_CACHE_WAYS]
+	
+	uint64_t tick;
+	struct jwt_cache_stats stats;	// atomic counters
+}__attribute__((aligned(64)));
+
+struct jwt_cache_private
+{
+	jwt_cache_t * cache;
+	unsigned int num_shards;
+	struct jwt_cache_shard * shards;
+};
+
+#define atomic_inc(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+
+static uint64_t hash_token(const char * token, size_t cb_token)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < cb_token; ++i) {
+		hash ^= (unsigned char)token[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+void jwt_claims_clear(jwt_claims_t * claims)
+{
+	if(NULL == claims) return;
+	free(claims->json);
+	memset(claims, 0, sizeof(*claims));
+}
+
+static void copy_claims(jwt_claims_t * dst, const jwt_claims_t * src, int flags)
+{
+	if(NULL == dst) return;
+	memcpy(dst->sub, src->sub, sizeof(dst->sub));
+	dst->iat = src->iat;
+	dst->exp = src->exp;
+	dst->json = NULL;
+	if((flags & JWT_CACHE_WITH_JSON) && src->json) dst->json = strdup(src->json);
+}
+
+static void entry_clear(struct jwt_cache_entry * entry)
+{
+	free(entry->token);
+	jwt_claims_clear(&entry->claims);
+	memset(entry, 0, sizeof(*entry));
+}
+
+static inline struct jwt_cache_entry * shard_get_set(struct jwt_cache_shard * shard, uint64_t hash)
+{
+	// the low bits select the shard, the high bits the set
+	return &shard->entries[((hash >> 32) % shard->num_sets) * JWT_CACHE_WAYS];
+}
+
+static struct jwt_cache_entry * shard_find(struct jwt_cache_shard * shard, uint64_t hash, const char * token, size_t cb_token)
+{
+	struct jwt_cache_entry * set = shard_get_set(shard, hash);
+	for(int i = 0; i < JWT_CACHE_WAYS; ++i) {
+		struct jwt_cache_entry * entry = &set[i];
+		if(entry->token && entry->hash == hash && entry->cb_token == cb_token 
+			&& memcmp(entry->token, token, cb_token) == 0) return entry;
+	}
+	return NULL;
+}
+
+static int decode_token(jwt_cache_t * cache, const char * token, jwt_claims_t * claims, time_t now)
+{
+	jwt_t * jwt = NULL;
+	int rc = jwt_decode(&jwt, token, cache->key, cache->cb_key);
+	if(rc || NULL == jwt) return -1;
+	
+	// only what jwt_cache_issue() signs: never unsigned tokens, nor another algorithm keyed with the secret
+	if(jwt_get_alg(jwt) != JWT_ALG_HS256) {
+		jwt_free(jwt);
+		return -1;
+	}
+	
+	errno = 0;
+	long exp = jwt_get_grant_int(jwt, "exp");
+	if(errno) exp = 0;
+	if(exp && exp <= now) {
+		jwt_free(jwt);
+		return -1;
+	}
+	
+	errno = 0;
+	long iat = jwt_get_grant_int(jwt, "iat");
+	if(errno) iat = 0;
+	
+	memset(claims, 0, sizeof(*claims));
+	const char * sub = jwt_get_grant(jwt, "sub");
+	if(sub) strncpy(claims->sub, sub, sizeof(claims->sub) - 1);
+	claims->iat = iat;
+	claims->exp = exp;
+	claims->json = jwt_get_grants_json(jwt, NULL);
+	
+	jwt_free(jwt);
+	return 0;
+}
+
+static void shard_insert(jwt_cache_t * cache, struct jwt_cache_shard * shard, uint64_t hash, const char * token, size_t cb_token, jwt_claims_t * claims, time_t now)
+{
+	pthread_rwlock_wrlock(&shard->rwlock);
+	if(shard_find(shard, hash, token, cb_token)) {	// inserted by another thread
+		pthread_rwlock_unlock(&shard->rwlock);
+		jwt_claims_clear(claims);
+		return;
+	}
+	
+	struct jwt_cache_entry * set = shard_get_set(shard, hash);
+	struct jwt_cache_entry * slot = NULL;
+	for(int i = 0; i < JWT_CACHE_WAYS; ++i) {
+		struct jwt_cache_entry * entry = &set[i];
+		if(NULL == entry->token || entry->expires_at <= now) {
+			if(entry->token) ++shard->stats.expired;
+			slot = entry;
+			break;
+		}
+		// least recently used
+		if(NULL == slot || entry->last_used < slot->last_used) slot = entry;
+	}
+	if(slot->token && slot->expires_at > now) ++shard->stats.evictions;
+	entry_clear(slot);
+	
+	slot->hash = hash;
+	slot->token = malloc(cb_token + 1);
+	assert(slot->token);
+	memcpy(slot->token, token, cb_token + 1);
+	slot->cb_token = cb_token;
+	slot->claims = *claims;	// take ownership of claims->json
+	slot->expires_at = now + cache->max_ttl;
+	if(claims->exp && claims->exp < slot->expires_at) slot->expires_at = claims->exp;
+	slot->last_used = ++shard->tick;
+	++shard->stats.inserts;
+	
+	pthread_rwlock_unlock(&shard->rwlock);
+	memset(claims, 0, sizeof(*claims));
+}
+
+int jwt_cache_verify(jwt_cache_t * cache, const char * token, jwt_claims_t * claims, int flags)
+{
+	assert(cache && cache->priv);
+	struct jwt_cache_private * priv = cache->priv;
+	if(NULL == token || !token[0]) return -1;
+	if(NULL == cache->key || 0 == cache->cb_key) return -1;	// no jwt_secret: an empty HMAC key would verify forged tokens
+	
+	time_t now = time(NULL);
+	size_t cb_token = strlen(token);
+	uint64_t hash = hash_token(token, cb_token);
+	struct jwt_cache_shard * shard = &priv->shards[hash % priv->num_shards];
+	
+	pthread_rwlock_rdlock(&shard->rwlock);
+	struct jwt_cache_entry * entry = shard_find(shard, hash, token, cb_token);
+	if(entry && entry->expires_at > now) {
+		__atomic_store_n(&entry->last_used, atomic_inc(&shard->tick), __ATOMIC_RELAXED);
+		copy_claims(claims, &entry->claims, flags);
+		pthread_rwlock_unlock(&shard->rwlock);
+		
+		atomic_inc(&shard->stats.hits);
+		return 0;
+	}
+	pthread_rwlock_unlock(&shard->rwlock);
+	atomic_inc(&shard->stats.misses);
+	
+	// verify outside the lock
+	jwt_claims_t decoded[1];
+	if(decode_token(cache, token, decoded, now)) {
+		atomic_inc(&shard->stats.failures);
+		return -1;
+	}
+	
+	copy_claims(claims, decoded, flags);
+	shard_insert(cache, shard, hash, token, cb_token, decoded, now);
+	return 0;
+}
+
+char * jwt_cache_issue(jwt_cache_t * cache, const char * sub, time_t ttl)
+{
+	assert(cache);
+	if(NULL == cache->key || 0 == cache->cb_key) return NULL;	// the token could not be verified
+	
+	jwt_t * jwt = NULL;
+	int rc = jwt_new(&jwt);
+	if(rc) return NULL;
+	
+	time_t now = time(NULL);
+	rc = jwt_add_grant(jwt, "sub", sub);
+	if(0 == rc) rc = jwt_add_grant_int(jwt, "iat", now);
+	if(0 == rc) rc = jwt_add_grant_int(jwt, "exp", now + ttl);
+	if(0 == rc) rc = jwt_set_alg(jwt, JWT_ALG_HS256, cache->key, cache->cb_key);
+	char * token = rc ? NULL : jwt_encode_str(jwt);
+	jwt_free(jwt);
+	return token;
+}
+
+void jwt_cache_get_stats(jwt_cache_t * cache, struct jwt_cache_stats * stats)
+{
+	assert(cache && cache->priv && stats);
+	struct jwt_cache_private * priv = cache->priv;
+	
+	memset(stats, 0, sizeof(*stats));
+	for(unsigned int i = 0; i < priv->num_shards; ++i) {
+		struct jwt_cache_stats * shard_stats = &priv->shards[i].stats;
+		stats->hits      += __atomic_load_n(&shard_stats->hits, __ATOMIC_RELAXED);
+		stats->misses    += __atomic_load_n(&shard_stats->misses, __ATOMIC_RELAXED);
+		stats->inserts   += __atomic_load_n(&shard_stats->inserts, __ATOMIC_RELAXED);
+		stats->evictions += __atomic_load_n(&shard_stats->evictions, __ATOMIC_RELAXED);
+		stats->expired   += __atomic_load_n(&shard_stats->expired, __ATOMIC_RELAXED);
+		stats->failures  += __atomic_load_n(&shard_stats->failures, __ATOMIC_RELAXED);
+	}
+}
+
+jwt_cache_t * jwt_cache_init(jwt_cache_t * cache, const char * secret, unsigned int max_entries, unsigned int num_shards, void * user_data)
+{
+	if(NULL == cache) cache = calloc(1, sizeof(*cache));
+	assert(cache);
+	cache->user_data = user_data;
+	
+	if(0 == num_shards) num_shards = 16;
+	if(max_entries < num_shards * JWT_CACHE_WAYS) max_entries = num_shards * JWT_CACHE_WAYS;
+	cache->num_shards = num_shards;
+	cache->max_entries = max_entries;
+	cache->max_ttl = JWT_CACHE_DEFAULT_TTL;
+	
+	if(secret) {
+		cache->cb_key = strlen(secret);
+		cache->key = (unsigned char *)strdup(secret);
+	}
+	
+	struct jwt_cache_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->cache = cache;
+	priv->num_shards = num_shards;
+	
+	int rc = posix_memalign((void **)&priv->shards, 64, sizeof(*priv->shards) * num_shards);
+	assert(0 == rc);
+	memset(priv->shards, 0, sizeof(*priv->shards) * num_shards);
+	
+	unsigned int num_sets = max_entries / num_shards / JWT_CACHE_WAYS;
+	for(unsigned int i = 0; i < num_shards; ++i) {
+		struct jwt_cache_shard * shard = &priv->shards[i];
+		pthread_rwlock_init(&shard->rwlock, NULL);
+		shard->num_sets = num_sets;
+		shard->entries = calloc(num_sets * JWT_CACHE_WAYS, sizeof(*shard->entries));
+		assert(shard->entries);
+	}
+	cache->priv = priv;
+	return cache;
+}
+
+void jwt_cache_cleanup(jwt_cache_t * cache)
+{
+	if(NULL == cache || NULL == cache->priv) return;
+	struct jwt_cache_private * priv = cache->priv;
+	
+	for(unsigned int i = 0; i < priv->num_shards; ++i) {
+		struct jwt_cache_shard * shard = &priv->shards[i];
+		for(unsigned int j = 0; j < shard->num_sets * JWT_CACHE_WAYS; ++j) entry_clear(&shard->entries[j]);
+		free(shard->entries);
+		pthread_rwlock_destroy(&shard->rwlock);
+	}
+	free(priv->shards);
+	cache->priv = NULL;
+	free(priv);
+	
+	if(cache->key) {
+		memset(cache->key, 0, cache->cb_key);
+		free(cache->key);
+		cache->key = NULL;
+	}
+	cache->cb_key = 0;
+}
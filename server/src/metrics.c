@@ -0,0 +1,280 @@
+/*
+ * metrics.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include "metrics.h"
+
+#define METRICS_SUB_BUCKET_BITS	(3)	// log2(METRICS_SUB_BUCKETS)
+#define METRICS_MAX_EXPONENT	(35)	// ~9.5 hours in microseconds
+
+struct route_stats
+{
+	uint64_t count;
+	uint64_t status[6];	// [status / 100], 0: other
+	uint64_t sum_us;
+	uint64_t buckets[METRICS_NUM_BUCKETS];
+};
+
+struct metrics_shard
+{
+	struct metrics_shard * next;
+	metrics_t * metrics;
+	struct route_stats routes[METRICS_MAX_ROUTES];
+};
+
+struct metrics_private
+{
+	metrics_t * metrics;
+	pthread_mutex_t mutex;	// only taken to register a new shard, or to scrape
+	struct metrics_shard * shards;
+};
+
+static __thread struct metrics_shard * t_shard;
+
+/*
+ * the buckets are (lower, upper]: a power of two is the last value of its bucket,
+ * the prometheus buckets (le: less or equal) end on a fine bucket
+ */
+static inline int bucket_index(uint64_t value)
+{
+	if(value > 0) --value;
+	if(value < 2 * METRICS_SUB_BUCKETS) return (int)value;
+	
+	int exponent = 63 - __builtin_clzll(value);
+	if(exponent > METRICS_MAX_EXPONENT) return METRICS_NUM_BUCKETS - 1;
+	
+	int sub_bucket = (value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+	return 2 * METRICS_SUB_BUCKETS + (exponent - (METRICS_SUB_BUCKET_BITS + 1)) * METRICS_SUB_BUCKETS + sub_bucket;
+}
+
+static inline uint64_t bucket_upper_bound(int index)	// inclusive
+{
+	if(index < 2 * METRICS_SUB_BUCKETS) return index + 1;
+	
+	index -= 2 * METRICS_SUB_BUCKETS;
+	int exponent = (index / METRICS_SUB_BUCKETS) + (METRICS_SUB_BUCKET_BITS + 1);
+	uint64_t sub_bucket = index % METRICS_SUB_BUCKETS;
+	return (METRICS_SUB_BUCKETS + sub_bucket + 1) << (exponent - METRICS_SUB_BUCKET_BITS);
+}
+
+static struct metrics_shard * get_shard(metrics_t * metrics)
+{
+	struct metrics_shard * shard = t_shard;
+	if(shard && shard->metrics == metrics) return shard;
+	
+	struct metrics_private * priv = metrics->priv;
+	shard = calloc(1, sizeof(*shard));
+	assert(shard);
+	shard->metrics = metrics;
+	
+	pthread_mutex_lock(&priv->mutex);
+	shard->next = priv->shards;
+	priv->shards = shard;
+	pthread_mutex_unlock(&priv->mutex);
+	
+	t_shard = shard;
+	return shard;
+}
+
+// single writer per shard: plain read, relaxed atomic store (readers never see torn values)
+#define shard_add(p, value) __atomic_store_n(p, *(p) + (value), __ATOMIC_RELAXED)
+
+void metrics_record_request(metrics_t * metrics, int route, unsigned int status, uint64_t latency_us)
+{
+	if(NULL == metrics || NULL == metrics->priv) return;
+	if(route < 0 || route >= metrics->num_routes) return;
+	
+	struct metrics_shard * shard = get_shard(metrics);
+	struct route_stats * stats = &shard->routes[route];
+	
+	unsigned int status_class = status / 100;
+	if(status_class >= 6) status_class = 0;
+	
+	shard_add(&stats->count, 1);
+	shard_add(&stats->status[status_class], 1);
+	shard_add(&stats->sum_us, latency_us);
+	shard_add(&stats->buckets[bucket_index(latency_us)], 1);
+}
+
+int metrics_register_route(metrics_t * metrics, const char * path)
+{
+	assert(metrics && path);
+	int route = metrics_find_route(metrics, path);
+	if(route >= 0 && strcmp(metrics->routes[route], path) == 0) return route;
+	
+	if(metrics->num_routes >= METRICS_MAX_ROUTES) return -1;
+	route = metrics->num_routes;
+	strncpy(metrics->routes[route], path, sizeof(metrics->routes[route]) - 1);
+	__atomic_store_n(&metrics->num_routes, route + 1, __ATOMIC_RELEASE);
+	return route;
+}
+
+int metrics_find_route(metrics_t * metrics, const char * path)
+{
+	int route = -1;
+	size_t cb_match = 0;
+	if(NULL == path) return -1;
+	
+	for(int i = 0; i < metrics->num_routes; ++i) {
+		const char * prefix = metrics->routes[i];
+		size_t cb = strlen(prefix);
+		if(strncmp(path, prefix, cb) != 0) continue;
+		
+		// match whole path segments ("/" matches everything)
+		if(path[cb] != '\0' && path[cb] != '/' && prefix[cb - 1] != '/') continue;
+		if(route < 0 || cb > cb_match) {
+			route = i;
+			cb_match = cb;
+		}
+	}
+	return route;
+}
+
+static void merge_route_stats(struct metrics_private * priv, int route, struct route_stats * stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for(struct metrics_shard * shard = priv->shards; shard; shard = shard->next) {
+		const struct route_stats * src = &shard->routes[route];
+		stats->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+		stats->sum_us += __atomic_load_n(&src->sum_us, __ATOMIC_RELAXED);
+		for(int i = 0; i < 6; ++i) stats->status[i] += __atomic_load_n(&src->status[i], __ATOMIC_RELAXED);
+		for(int i = 0; i < METRICS_NUM_BUCKETS; ++i) stats->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	}
+}
+
+static double get_quantile(const struct route_stats * stats, double quantile)
+{
+	uint64_t total = 0;
+	for(int i = 0; i < METRICS_NUM_BUCKETS; ++i) total += stats->buckets[i];
+	if(total == 0) return 0.0;
+	
+	uint64_t rank = (uint64_t)(quantile * total + 0.5);
+	if(rank == 0) rank = 1;
+	uint64_t count = 0;
+	for(int i = 0; i < METRICS_NUM_BUCKETS; ++i) {
+		count += stats->buckets[i];
+		if(count >= rank) return bucket_upper_bound(i) / 1000000.0;
+	}
+	return bucket_upper_bound(METRICS_NUM_BUCKETS - 1) / 1000000.0;
+}
+
+void metrics_render(metrics_t * metrics, GString * out)
+{
+	assert(metrics && metrics->priv && out);
+	struct metrics_private * priv = metrics->priv;
+	static const char * status_classes[6] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	
+	struct route_stats * all_stats = calloc(metrics->num_routes?metrics->num_routes:1, sizeof(*all_stats));
+	assert(all_stats);
+	
+	pthread_mutex_lock(&priv->mutex);
+	for(int route = 0; route < metrics->num_routes; ++route) merge_route_stats(priv, route, &all_stats[route]);
+	pthread_mutex_unlock(&priv->mutex);
+	
+	g_string_append(out, 
+		"# HELP webapi_http_requests_total Requests by route and status class.\n"
+		"# TYPE webapi_http_requests_total counter\n");
+	for(int route = 0; route < metrics->num_routes; ++route) {
+		const struct route_stats * stats = &all_stats[route];
+		for(int i = 0; i < 6; ++i) {
+			if(0 == stats->status[i]) continue;
+			g_string_append_printf(out, "webapi_http_requests_total{route=\"%s\",code=\"%s\"} %lu\n", 
+				metrics->routes[route], status_classes[i], (unsigned long)stats->status[i]);
+		}
+	}
+	
+	// prometheus buckets at powers of two (16us .. 32s), aligned to the fine buckets
+	g_string_append(out, 
+		"# HELP webapi_http_request_duration_seconds Request latency, from the request line to the end of the response.\n"
+		"# TYPE webapi_http_request_duration_seconds histogram\n");
+	for(int route = 0; route < metrics->num_routes; ++route) {
+		const struct route_stats * stats = &all_stats[route];
+		const char * path = metrics->routes[route];
+		
+		uint64_t cumulative = 0;
+		int index = 0;
+		for(int exponent = 4; exponent <= 25; ++exponent) {
+			int end = bucket_index(1ULL << exponent) + 1;	// values <= 2^exponent
+			for(; index < end; ++index) cumulative += stats->buckets[index];
+			g_string_append_printf(out, "webapi_http_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %lu\n", 
+				path, (double)(1ULL << exponent) / 1000000.0, (unsigned long)cumulative);
+		}
+		g_string_append_printf(out, "webapi_http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %lu\n", path, (unsigned long)stats->count);
+		g_string_append_printf(out, "webapi_http_request_duration_seconds_sum{route=\"%s\"} %.6f\n", path, stats->sum_us / 1000000.0);
+		g_string_append_printf(out, "webapi_http_request_duration_seconds_count{route=\"%s\"} %lu\n", path, (unsigned long)stats->count);
+	}
+	
+	g_string_append(out, 
+		"# HELP webapi_http_request_duration_quantile_seconds Latency quantiles from the HDR histogram (since start).\n"
+		"# TYPE webapi_http_request_duration_quantile_seconds gauge\n");
+	for(int route = 0; route < metrics->num_routes; ++route) {
+		const struct route_stats * stats = &all_stats[route];
+		if(0 == stats->count) continue;
+		for(int i = 0; i < G_N_ELEMENTS(quantiles); ++i) {
+			g_string_append_printf(out, "webapi_http_request_duration_quantile_seconds{route=\"%s\",quantile=\"%g\"} %.6f\n", 
+				metrics->routes[route], quantiles[i], get_quantile(stats, quantiles[i]));
+		}
+	}
+	free(all_stats);
+}
+
+metrics_t * metrics_init(metrics_t * metrics, void * user_data)
+{
+	if(NULL == metrics) metrics = calloc(1, sizeof(*metrics));
+	assert(metrics);
+	metrics->user_data = user_data;
+	
+	struct metrics_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->metrics = metrics;
+	pthread_mutex_init(&priv->mutex, NULL);
+	metrics->priv = priv;
+	return metrics;
+}
+
+void metrics_cleanup(metrics_t * metrics)
+{
+	if(NULL == metrics || NULL == metrics->priv) return;
+	struct metrics_private * priv = metrics->priv;
+	metrics->priv = NULL;
+	
+	struct metrics_shard * shard = priv->shards;
+	while(shard) {
+		struct metrics_shard * next = shard->next;
+		free(shard);
+		shard = next;
+	}
+	pthread_mutex_destroy(&priv->mutex);
+	free(priv);
+}
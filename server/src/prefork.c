@@ -0,0 +1,337 @@
+/*
+ * prefork.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "app.h"
+
+/*
+ * prefork mode:
+ * the supervisor opens the environment once with DB_RECOVER, then forks 'num_processes' workers.
+ * Every worker opens its own handles on the shared environment and listens on the same port (SO_REUSEPORT).
+ *
+ * supervisor signals:
+ *   SIGCHLD:         a dead worker is restarted, after DB_ENV->failchk() released its locks / transactions
+ *   SIGHUP:          rolling restart, one worker at a time (the new one must be listening before the old one stops)
+ *   SIGTERM, SIGINT: stops all workers, then exits
+ */
+#define PREFORK_READY_TIMEOUT	(30)	// seconds
+#define PREFORK_STOP_TIMEOUT	(30)	// seconds, then SIGKILL
+#define PREFORK_MAX_BACKOFF	(5)	// seconds between restarts of a crashing worker
+
+struct prefork_worker
+{
+	pid_t pid;
+	int ready_fd;	// read end of the readiness pipe
+	time_t started_at;
+	int num_crashes;	// consecutive early exits
+};
+
+struct prefork_context
+{
+	app_context_t * app;
+	prefork_worker_fn worker_main;
+	sigset_t old_mask;
+	
+	int num_workers;
+	struct prefork_worker * workers;
+};
+
+void prefork_notify_ready(app_context_t * app)
+{
+	int fd = app->prefork.ready_fd;
+	if(fd < 0) return;
+	
+	app->prefork.ready_fd = -1;
+	ssize_t cb = write(fd, "1", 1);
+	if(cb != 1) perror("prefork_notify_ready");
+	close(fd);
+}
+
+static pid_t spawn_worker(struct prefork_context * ctx, int worker_id, int * p_ready_fd)
+{
+	int fds[2] = { -1, -1 };
+	if(pipe2(fds, O_CLOEXEC)) {
+		perror("pipe2");
+		return -1;
+	}
+	
+	pid_t pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	
+	if(0 == pid) {	// worker
+		close(fds[0]);
+		for(int i = 0; i < ctx->num_workers; ++i) {
+			if(ctx->workers[i].ready_fd >= 0) close(ctx->workers[i].ready_fd);
+		}
+		sigprocmask(SIG_SETMASK, &ctx->old_mask, NULL);
+		signal(SIGPIPE, SIG_IGN);
+		
+		app_context_t * app = ctx->app;
+		app->prefork.worker_id = worker_id;
+		app->prefork.ready_fd = fds[1];
+		
+		// the supervisor's handles must not be used (or closed) by the child
+		memset(app->db, 0, sizeof(app->db));
+		
+		int rc = ctx->worker_main(app);
+		app_context_cleanup(app);
+		_exit(rc ? 1 : 0);
+	}
+	
+	close(fds[1]);
+	*p_ready_fd = fds[0];
+	return pid;
+}
+
+static int wait_ready(int ready_fd, int timeout_seconds)
+{
+	struct pollfd pfd = { .fd = ready_fd, .events = POLLIN };
+	int n = 0;
+	do {
+		n = poll(&pfd, 1, timeout_seconds * 1000);
+	}while(n < 0 && errno == EINTR);
+	if(n <= 0) return -1;
+	
+	char c = 0;
+	return (read(ready_fd, &c, 1) == 1) ? 0 : -1;	// EOF: the worker exited before listening
+}
+
+static int start_worker(struct prefork_context * ctx, int index)
+{
+	struct prefork_worker * worker = &ctx->workers[index];
+	int ready_fd = -1;
+	pid_t pid = spawn_worker(ctx, index, &ready_fd);
+	if(pid < 0) return -1;
+	
+	worker->pid = pid;
+	worker->ready_fd = ready_fd;
+	worker->started_at = time(NULL);
+	fprintf(stderr, "[prefork] worker %d started, pid=%d\n", index, (int)pid);
+	return 0;
+}
+
+static void close_ready_fd(struct prefork_worker * worker)
+{
+	if(worker->ready_fd >= 0) close(worker->ready_fd);
+	worker->ready_fd = -1;
+}
+
+static int stop_process(pid_t pid)
+{
+	int status = 0;
+	kill(pid, SIGTERM);
+	for(int i = 0; i < PREFORK_STOP_TIMEOUT * 10; ++i) {
+		pid_t rc = waitpid(pid, &status, WNOHANG);
+		if(rc == pid || (rc < 0 && errno == ECHILD)) return 0;
+		usleep(100 * 1000);
+	}
+	fprintf(stderr, "[prefork] pid %d did not stop, killed\n", (int)pid);
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	return -1;
+}
+
+static void stop_all_workers(struct prefork_context * ctx)
+{
+	for(int i = 0; i < ctx->num_workers; ++i) {
+		struct prefork_worker * worker = &ctx->workers[i];
+		if(worker->pid > 0) kill(worker->pid, SIGTERM);
+	}
+	for(int i = 0; i < ctx->num_workers; ++i) {
+		struct prefork_worker * worker = &ctx->workers[i];
+		if(worker->pid > 0) stop_process(worker->pid);
+		worker->pid = 0;
+		close_ready_fd(worker);
+	}
+}
+
+static int recover_environment(struct prefork_context * ctx)
+{
+	app_context_t * app = ctx->app;
+	db_helpler_cleanup(app->db);
+	memset(app->db, 0, sizeof(app->db));
+	
+	app->db->run_recovery = 1;
+	db_helpler_t * db = db_helpler_init(app->db, app);
+	return db ? 0 : -1;
+}
+
+static void restart_all_workers(struct prefork_context * ctx)
+{
+	fprintf(stderr, "[prefork] environment needs recovery, restarting all workers\n");
+	stop_all_workers(ctx);
+	int rc = recover_environment(ctx);
+	assert(0 == rc);
+	for(int i = 0; i < ctx->num_workers; ++i) start_worker(ctx, i);
+}
+
+static void on_worker_exit(struct prefork_context * ctx, pid_t pid, int status)
+{
+	int index = -1;
+	for(int i = 0; i < ctx->num_workers; ++i) {
+		if(ctx->workers[i].pid == pid) {
+			index = i;
+			break;
+		}
+	}
+	if(index < 0) return;	// replaced by a rolling restart
+	
+	struct prefork_worker * worker = &ctx->workers[index];
+	worker->pid = 0;
+	close_ready_fd(worker);
+	
+	if(WIFSIGNALED(status)) fprintf(stderr, "[prefork] worker %d (pid=%d) killed by signal %d\n", index, (int)pid, WTERMSIG(status));
+	else fprintf(stderr, "[prefork] worker %d (pid=%d) exited with status %d\n", index, (int)pid, WEXITSTATUS(status));
+	
+	// release what the dead process held in the shared environment
+	int rc = db_helpler_failchk(ctx->app->db);
+	if(rc == DB_RUNRECOVERY) {
+		restart_all_workers(ctx);
+		return;
+	}
+	
+	// back off if the worker keeps crashing right after start
+	if((time(NULL) - worker->started_at) < 2) {
+		if(worker->num_crashes < PREFORK_MAX_BACKOFF) ++worker->num_crashes;
+		sleep(worker->num_crashes);
+	}else {
+		worker->num_crashes = 0;
+	}
+	start_worker(ctx, index);
+}
+
+static void rolling_restart(struct prefork_context * ctx)
+{
+	fprintf(stderr, "[prefork] rolling restart\n");
+	for(int i = 0; i < ctx->num_workers; ++i) {
+		struct prefork_worker * worker = &ctx->workers[i];
+		pid_t old_pid = worker->pid;
+		close_ready_fd(worker);
+		
+		if(start_worker(ctx, i)) break;
+		if(wait_ready(worker->ready_fd, PREFORK_READY_TIMEOUT)) {
+			fprintf(stderr, "[prefork] worker %d (pid=%d) failed to start, rolling restart aborted\n", i, (int)worker->pid);
+			stop_process(worker->pid);
+			close_ready_fd(worker);
+			worker->pid = old_pid;
+			break;
+		}
+		close_ready_fd(worker);
+		
+		if(old_pid > 0) stop_process(old_pid);
+	}
+}
+
+int prefork_run(app_context_t * app, prefork_worker_fn worker_main)
+{
+	assert(app && worker_main);
+	int num_workers = app->prefork.num_processes;
+	assert(num_workers > 0);
+	
+	struct prefork_context ctx[1];
+	memset(ctx, 0, sizeof(ctx));
+	ctx->app = app;
+	ctx->worker_main = worker_main;
+	ctx->num_workers = num_workers;
+	ctx->workers = calloc(num_workers, sizeof(*ctx->workers));
+	assert(ctx->workers);
+	for(int i = 0; i < num_workers; ++i) ctx->workers[i].ready_fd = -1;
+	
+	app->prefork.worker_id = -1;
+	app->prefork.ready_fd = -1;
+	
+	// signals are handled synchronously (sigtimedwait), the workers restore the old mask
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &ctx->old_mask);
+	
+	// recovery runs once, before any worker attaches to the environment
+	int rc = recover_environment(ctx);
+	assert(0 == rc);
+	
+	for(int i = 0; i < num_workers; ++i) start_worker(ctx, i);
+	
+	int quit = 0;
+	while(!quit) {
+		struct timespec timeout = { .tv_sec = 1 };
+		int sig = sigtimedwait(&mask, NULL, &timeout);
+		
+		// a worker that is listening does not need its readiness pipe anymore
+		for(int i = 0; i < num_workers; ++i) {
+			struct prefork_worker * worker = &ctx->workers[i];
+			if(worker->ready_fd >= 0 && 0 == wait_ready(worker->ready_fd, 0)) close_ready_fd(worker);
+		}
+		
+		switch(sig) {
+		case SIGCHLD:
+			{
+				int status = 0;
+				pid_t pid;
+				while((pid = waitpid(-1, &status, WNOHANG)) > 0) on_worker_exit(ctx, pid, status);
+			}
+			break;
+		case SIGHUP:
+			rolling_restart(ctx);
+			break;
+		case SIGTERM:
+		case SIGINT:
+			quit = 1;
+			break;
+		default:
+			break;
+		}
+	}
+	
+	fprintf(stderr, "[prefork] stopping workers\n");
+	stop_all_workers(ctx);
+	free(ctx->workers);
+	sigprocmask(SIG_SETMASK, &ctx->old_mask, NULL);
+	return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * request-arena.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "request-arena.h"
+
+#define REQUEST_ARENA_DEFAULT_CHUNK_SIZE	(32 * 1024)
+#define REQUEST_ARENA_MIN_CHUNK_SIZE	(1024)
+#define ARENA_ALIGN(size)	(((size) + 15) & ~(size_t)15)
+
+struct arena_chunk
+{
+	struct arena_chunk * next;
+	size_t size;	// of data[]
+	size_t used;
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+struct request_arena
+{
+	request_arena_pool_t * pool;
+	int refs;
+	struct arena_chunk * chunks;	// pooled, the head is the one being filled (it also holds this struct)
+	struct arena_chunk * large;	// own blocks, larger than a chunk
+};
+
+struct request_arena_pool_private
+{
+	pthread_mutex_t mutex;
+	struct arena_chunk * free_chunks;
+	unsigned int num_free;
+};
+
+static struct arena_chunk * take_chunk(request_arena_pool_t * pool)
+{
+	struct request_arena_pool_private * priv = pool->priv;
+	struct arena_chunk * chunk = NULL;
+	if(priv) {
+		pthread_mutex_lock(&priv->mutex);
+		chunk = priv->free_chunks;
+		if(chunk) {
+			priv->free_chunks = chunk->next;
+			--priv->num_free;
+		}
+		pthread_mutex_unlock(&priv->mutex);
+	}
+	
+	if(chunk) {
+		__atomic_add_fetch(&pool->num_chunk_reuses, 1, __ATOMIC_RELAXED);
+	}else {
+		chunk = malloc(pool->chunk_size);
+		assert(chunk);
+		chunk->size = pool->chunk_size - sizeof(*chunk);
+		__atomic_add_fetch(&pool->num_chunk_mallocs, 1, __ATOMIC_RELAXED);
+	}
+	chunk->next = NULL;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void release_chunks(request_arena_pool_t * pool, struct arena_chunk * chunks)
+{
+	struct request_arena_pool_private * priv = pool->priv;
+	if(priv) {
+		pthread_mutex_lock(&priv->mutex);
+		while(chunks && priv->num_free < pool->max_free_chunks) {
+			struct arena_chunk * chunk = chunks;
+			chunks = chunk->next;
+			chunk->next = priv->free_chunks;
+			priv->free_chunks = chunk;
+			++priv->num_free;
+		}
+		pthread_mutex_unlock(&priv->mutex);
+	}
+	
+	// over the limit (or the pool is gone)
+	while(chunks) {
+		struct arena_chunk * next = chunks->next;
+		free(chunks);
+		chunks = next;
+	}
+}
+
+request_arena_t * request_arena_new(request_arena_pool_t * pool)
+{
+	assert(pool);
+	struct arena_chunk * chunk = take_chunk(pool);
+	request_arena_t * arena = (request_arena_t *)chunk->data;
+	chunk->used = ARENA_ALIGN(sizeof(*arena));
+	
+	memset(arena, 0, sizeof(*arena));
+	arena->pool = pool;
+	arena->refs = 1;
+	arena->chunks = chunk;
+	__atomic_add_fetch(&pool->num_arenas, 1, __ATOMIC_RELAXED);
+	return arena;
+}
+
+request_arena_t * request_arena_ref(request_arena_t * arena)
+{
+	assert(arena);
+	__atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+	return arena;
+}
+
+void request_arena_unref(request_arena_t * arena)
+{
+	if(NULL == arena) return;
+	if(__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	
+	struct arena_chunk * large = arena->large;
+	while(large) {
+		struct arena_chunk * next = large->next;
+		free(large);
+		large = next;
+	}
+	
+	// the arena itself lives in the last chunk of the list
+	release_chunks(arena->pool, arena->chunks);
+}
+
+void * request_arena_alloc(request_arena_t * arena, size_t size)
+{
+	assert(arena);
+	size = ARENA_ALIGN(size ? size : 1);
+	
+	struct arena_chunk * chunk = arena->chunks;
+	if(size > chunk->size) {
+		chunk = malloc(sizeof(*chunk) + size);
+		assert(chunk);
+		chunk->size = size;
+		chunk->used = size;
+		chunk->next = arena->large;
+		arena->large = chunk;
+		__atomic_add_fetch(&arena->pool->num_large_allocs, 1, __ATOMIC_RELAXED);
+		return chunk->data;
+	}
+	
+	if(chunk->size - chunk->used < size) {
+		chunk = take_chunk(arena->pool);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	void * p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+void * request_arena_alloc0(request_arena_t * arena, size_t size)
+{
+	void * p = request_arena_alloc(arena, size);
+	memset(p, 0, size);
+	return p;
+}
+
+char * request_arena_strndup(request_arena_t * arena, const char * str, size_t length)
+{
+	if(NULL == str) return NULL;
+	char * p = request_arena_alloc(arena, length + 1);
+	memcpy(p, str, length);
+	p[length] = '\0';
+	return p;
+}
+
+char * request_arena_strdup(request_arena_t * arena, const char * str)
+{
+	if(NULL == str) return NULL;
+	return request_arena_strndup(arena, str, strlen(str));
+}
+
+char * request_arena_printf(request_arena_t * arena, size_t * p_length, const char * fmt, ...)
+{
+	assert(arena && fmt);
+	
+	// try the space left in the current chunk first
+	struct arena_chunk * chunk = arena->chunks;
+	size_t avail = chunk->size - chunk->used;
+	char * p = (char *)chunk->data + chunk->used;
+	
+	va_list args, args_copy;
+	va_start(args, fmt);
+	va_copy(args_copy, args);
+	int cb = vsnprintf(p, avail, fmt, args);
+	va_end(args);
+	assert(cb >= 0);
+	
+	if((size_t)cb < avail) {
+		chunk->used += ARENA_ALIGN(cb + 1);
+		if(chunk->used > chunk->size) chunk->used = chunk->size;
+	}else {
+		p = request_arena_alloc(arena, cb + 1);
+		vsnprintf(p, cb + 1, fmt, args_copy);
+	}
+	va_end(args_copy);
+	
+	if(p_length) *p_length = cb;
+	return p;
+}
+
+void request_arena_append(request_arena_t * arena, SoupMessageBody * body, const void * data, size_t length)
+{
+	assert(arena && body);
+	if(0 == length) return;
+	
+	// the buffer holds a reference until libsoup frees the body
+	SoupBuffer * buffer = soup_buffer_new_with_owner(data, length, request_arena_ref(arena), (GDestroyNotify)request_arena_unref);
+	soup_message_body_append_buffer(body, buffer);
+	soup_buffer_free(buffer);
+}
+
+request_arena_pool_t * request_arena_pool_init(request_arena_pool_t * pool, size_t chunk_size, unsigned int max_free_chunks, void * user_data)
+{
+	if(NULL == pool) pool = calloc(1, sizeof(*pool));
+	assert(pool);
+	pool->user_data = user_data;
+	
+	if(0 == chunk_size) chunk_size = REQUEST_ARENA_DEFAULT_CHUNK_SIZE;
+	if(chunk_size < REQUEST_ARENA_MIN_CHUNK_SIZE) chunk_size = REQUEST_ARENA_MIN_CHUNK_SIZE;
+	pool->chunk_size = chunk_size;
+	pool->max_free_chunks = max_free_chunks;
+	
+	struct request_arena_pool_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	pthread_mutex_init(&priv->mutex, NULL);
+	pool->priv = priv;
+	return pool;
+}
+
+void request_arena_pool_cleanup(request_arena_pool_t * pool)
+{
+	if(NULL == pool || NULL == pool->priv) return;
+	struct request_arena_pool_private * priv = pool->priv;
+	
+	pthread_mutex_lock(&priv->mutex);
+	pool->priv = NULL;
+	struct arena_chunk * chunks = priv->free_chunks;
+	priv->free_chunks = NULL;
+	priv->num_free = 0;
+	pthread_mutex_unlock(&priv->mutex);
+	
+	release_chunks(pool, chunks);
+	pthread_mutex_destroy(&priv->mutex);
+	free(priv);
+}
+
+unsigned int request_arena_pool_get_free_chunks(request_arena_pool_t * pool)
+{
+	struct request_arena_pool_private * priv = pool->priv;
+	if(NULL == priv) return 0;
+	
+	pthread_mutex_lock(&priv->mutex);
+	unsigned int num_free = priv->num_free;
+	pthread_mutex_unlock(&priv->mutex);
+	return num_free;
+}
@@ -0,0 +1,213 @@
+/*
+ * server-timing.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "server-timing.h"
+#include "json-writer.h"
+
+#define SERVER_TIMING_DEFAULT_RING_SIZE	(1024)
+
+struct server_timing_sample
+{
+	uint64_t seq;	// odd while the slot is being written
+	int64_t time_ms;	// CLOCK_REALTIME, end of the request
+	char method[8];
+	char path[64];
+	unsigned int status;
+	int64_t total_us;
+	int num_spans;
+	struct request_span spans[REQUEST_TIMING_MAX_SPANS];
+};
+
+struct server_timing_private
+{
+	uint64_t head;	// next slot (atomic, increasing)
+	struct server_timing_sample * ring;
+};
+
+void request_timing_add_us(request_timing_t * timing, const char * name, int64_t dur_us)
+{
+	if(NULL == timing) return;
+	if(dur_us < 0) dur_us = 0;
+	for(int i = 0; i < timing->num_spans; ++i) {
+		if(timing->spans[i].name == name || strcmp(timing->spans[i].name, name) == 0) {
+			timing->spans[i].dur_us += dur_us;
+			return;
+		}
+	}
+	if(timing->num_spans >= REQUEST_TIMING_MAX_SPANS) return;
+	timing->spans[timing->num_spans].name = name;
+	timing->spans[timing->num_spans].dur_us = dur_us;
+	++timing->num_spans;
+}
+
+void request_timing_add(request_timing_t * timing, const char * name, int64_t begin_us)
+{
+	if(NULL == timing) return;
+	request_timing_add_us(timing, name, g_get_monotonic_time() - begin_us);
+}
+
+int64_t request_timing_get_us(const request_timing_t * timing, const char * name)
+{
+	if(NULL == timing) return 0;
+	for(int i = 0; i < timing->num_spans; ++i) {
+		if(strcmp(timing->spans[i].name, name) == 0) return timing->spans[i].dur_us;
+	}
+	return 0;
+}
+
+request_timing_t * server_timing_start(server_timing_t * st)
+{
+	if(!st->emit_header && 0 == st->sample_rate) return NULL;
+	
+	request_timing_t * timing = g_new0(request_timing_t, 1);
+	timing->start_us = g_get_monotonic_time();
+	uint64_t n = __atomic_fetch_add(&st->num_requests, 1, __ATOMIC_RELAXED);
+	timing->sampled = (st->sample_rate > 0 && (n % st->sample_rate) == 0);
+	return timing;
+}
+
+void server_timing_set_header(server_timing_t * st, const request_timing_t * timing, SoupMessageHeaders * headers)
+{
+	if(NULL == timing || !st->emit_header) return;
+	
+	// e.g. "read;dur=0.120, auth;dur=0.034, db;dur=1.502, total;dur=1.804" (milliseconds)
+	char value[512] = "";
+	int cb = 0;
+	for(int i = 0; i < timing->num_spans && cb < (int)sizeof(value); ++i) {
+		cb += snprintf(value + cb, sizeof(value) - cb, "%s;dur=%.3f, ", timing->spans[i].name, timing->spans[i].dur_us / 1000.0);
+	}
+	if(cb < (int)sizeof(value)) snprintf(value + cb, sizeof(value) - cb, "total;dur=%.3f", (g_get_monotonic_time() - timing->start_us) / 1000.0);
+	soup_message_headers_replace(headers, "Server-Timing", value);
+}
+
+void server_timing_record(server_timing_t * st, const request_timing_t * timing, const char * method, const char * path, unsigned int status)
+{
+	struct server_timing_private * priv = st->priv;
+	if(NULL == timing || !timing->sampled || NULL == priv) return;
+	
+	uint64_t index = __atomic_fetch_add(&priv->head, 1, __ATOMIC_RELAXED);
+	struct server_timing_sample * sample = &priv->ring[index & (st->ring_size - 1)];
+	
+	uint64_t seq = __atomic_load_n(&sample->seq, __ATOMIC_RELAXED);
+	if(seq & 1) return;	// a writer that wrapped around the ring is still on this slot
+	if(!__atomic_compare_exchange_n(&sample->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+	
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	sample->time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	strncpy(sample->method, method ? method : "", sizeof(sample->method) - 1);
+	sample->method[sizeof(sample->method) - 1] = '\0';
+	strncpy(sample->path, path ? path : "", sizeof(sample->path) - 1);
+	sample->path[sizeof(sample->path) - 1] = '\0';
+	sample->status = status;
+	sample->total_us = g_get_monotonic_time() - timing->start_us;
+	sample->num_spans = timing->num_spans;
+	memcpy(sample->spans, timing->spans, sizeof(sample->spans));
+	
+	__atomic_store_n(&sample->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&st->num_sampled, 1, __ATOMIC_RELAXED);
+}
+
+void server_timing_dump(server_timing_t * st, GString * out)
+{
+	struct server_timing_private * priv = st->priv;
+	json_writer_t json[1];
+	json_writer_init(json, out);
+	json_writer_begin_object(json);
+	json_writer_add_int64(json, "sample_rate", st->sample_rate);
+	json_writer_add_int64(json, "sampled", __atomic_load_n(&st->num_sampled, __ATOMIC_RELAXED));
+	json_writer_key(json, "requests");
+	json_writer_begin_array(json);
+	
+	uint64_t head = priv ? __atomic_load_n(&priv->head, __ATOMIC_ACQUIRE) : 0;
+	uint64_t count = (head < st->ring_size) ? head : st->ring_size;
+	for(uint64_t i = 1; i <= count; ++i) {
+		const struct server_timing_sample * slot = &priv->ring[(head - i) & (st->ring_size - 1)];
+		
+		// copy, then check that no writer changed the slot meanwhile
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq == 0 || (seq & 1)) continue;
+		struct server_timing_sample sample;
+		memcpy(&sample, slot, sizeof(sample));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) continue;
+		
+		json_writer_begin_object(json);
+		json_writer_add_int64(json, "time", sample.time_ms);
+		json_writer_add_string(json, "method", sample.method);
+		json_writer_add_string(json, "path", sample.path);
+		json_writer_add_int64(json, "status", sample.status);
+		json_writer_add_int64(json, "total_us", sample.total_us);
+		json_writer_key(json, "spans_us");
+		json_writer_begin_object(json);
+		for(int j = 0; j < sample.num_spans && j < REQUEST_TIMING_MAX_SPANS; ++j) {
+			json_writer_add_int64(json, sample.spans[j].name, sample.spans[j].dur_us);
+		}
+		json_writer_end_object(json);
+		json_writer_end_object(json);
+	}
+	json_writer_end_array(json);
+	json_writer_end_object(json);
+}
+
+server_timing_t * server_timing_init(server_timing_t * st, int emit_header, unsigned int sample_rate, unsigned int ring_size, void * user_data)
+{
+	if(NULL == st) st = calloc(1, sizeof(*st));
+	assert(st);
+	st->user_data = user_data;
+	st->emit_header = emit_header;
+	st->sample_rate = sample_rate;
+	if(0 == sample_rate) return st;
+	
+	if(0 == ring_size) ring_size = SERVER_TIMING_DEFAULT_RING_SIZE;
+	unsigned int size = 1;
+	while(size < ring_size) size <<= 1;
+	st->ring_size = size;
+	
+	struct server_timing_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->ring = calloc(size, sizeof(*priv->ring));
+	assert(priv->ring);
+	st->priv = priv;
+	return st;
+}
+
+void server_timing_cleanup(server_timing_t * st)
+{
+	if(NULL == st || NULL == st->priv) return;
+	struct server_timing_private * priv = st->priv;
+	st->priv = NULL;
+	free(priv->ring);
+	free(priv);
+}
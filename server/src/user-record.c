@@ -0,0 +1,173 @@
+/*
+ * user-record.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "app.h"
+#include "user-record.h"
+
+struct user_record_v0
+{
+	char name[128];
+	char email[128];
+	char phone[32];
+};
+
+static const size_t s_v0_offsets[USER_RECORD_FIELDS] = {
+	offsetof(struct user_record_v0, name),
+	offsetof(struct user_record_v0, email),
+	offsetof(struct user_record_v0, phone),
+};
+static const size_t s_v0_sizes[USER_RECORD_FIELDS] = {
+	sizeof(((struct user_record_v0 *)0)->name),
+	sizeof(((struct user_record_v0 *)0)->email),
+	sizeof(((struct user_record_v0 *)0)->phone),
+};
+
+static inline unsigned char * varint_encode(unsigned char * p, size_t value)
+{
+	while(value >= 0x80) {
+		*p++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (unsigned char)value;
+	return p;
+}
+
+static inline const unsigned char * varint_decode(const unsigned char * p, const unsigned char * p_end, size_t * p_value)
+{
+	size_t value = 0;
+	for(int shift = 0; p < p_end && shift < 35; shift += 7) {
+		unsigned char c = *p++;
+		value |= (size_t)(c & 0x7f) << shift;
+		if(!(c & 0x80)) {
+			*p_value = value;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+int user_record_get_version(const void * data, size_t size)
+{
+	const unsigned char * p = data;
+	if(NULL == data || size == 0) return -1;
+	if(p[0] == USER_RECORD_VERSION) return USER_RECORD_VERSION;
+	
+	// a v0 record starts with the name (printable) and has a fixed size
+	if(size == USER_RECORD_V0_SIZE) return 0;
+	return -1;
+}
+
+ssize_t user_record_encode(const struct db_user_record * user, unsigned char * buf, size_t size)
+{
+	const char * values[USER_RECORD_FIELDS] = { user->name, user->email, user->phone };
+	
+	unsigned char * p = buf;
+	unsigned char * p_end = buf + size;
+	if(p >= p_end) return -1;
+	*p++ = USER_RECORD_VERSION;
+	
+	for(int i = 0; i < USER_RECORD_FIELDS; ++i) {
+		const char * value = values[i]?values[i]:"";
+		size_t length = strnlen(value, USER_RECORD_FIELD_MAX);
+		if((p_end - p) < (5 + length + 1)) return -1;
+		
+		p = varint_encode(p, length);
+		memcpy(p, value, length);
+		p += length;
+		*p++ = '\0';
+	}
+	return p - buf;
+}
+
+static int v0_get_field(const unsigned char * data, int field, const char ** p_value, size_t * p_length)
+{
+	const char * value = (const char *)data + s_v0_offsets[field];
+	size_t length = strnlen(value, s_v0_sizes[field]);
+	if(length == s_v0_sizes[field]) return -1;	// not nul-terminated
+	
+	*p_value = value;
+	*p_length = length;
+	return 0;
+}
+
+int user_record_get_field(const void * data, size_t size, int field, const char ** p_value, size_t * p_length)
+{
+	assert(field >= 0 && field < USER_RECORD_FIELDS);
+	int version = user_record_get_version(data, size);
+	if(version == 0) return v0_get_field(data, field, p_value, p_length);
+	if(version != USER_RECORD_VERSION) return -1;
+	
+	const unsigned char * p = (const unsigned char *)data + 1;
+	const unsigned char * p_end = (const unsigned char *)data + size;
+	for(int i = 0; i <= field; ++i) {
+		size_t length = 0;
+		p = varint_decode(p, p_end, &length);
+		if(NULL == p || (p_end - p) < (length + 1) || p[length] != '\0') return -1;
+		if(i == field) {
+			*p_value = (const char *)p;
+			*p_length = length;
+			return 0;
+		}
+		p += length + 1;
+	}
+	return -1;
+}
+
+int user_record_decode(const void * data, size_t size, struct db_user_record * user)
+{
+	const char * values[USER_RECORD_FIELDS] = { NULL };
+	int version = user_record_get_version(data, size);
+	if(version < 0) return -1;
+	
+	if(version == 0) {
+		for(int i = 0; i < USER_RECORD_FIELDS; ++i) {
+			size_t length = 0;
+			if(v0_get_field(data, i, &values[i], &length)) return -1;
+		}
+	}else {
+		const unsigned char * p = (const unsigned char *)data + 1;
+		const unsigned char * p_end = (const unsigned char *)data + size;
+		for(int i = 0; i < USER_RECORD_FIELDS; ++i) {
+			size_t length = 0;
+			p = varint_decode(p, p_end, &length);
+			if(NULL == p || (p_end - p) < (length + 1) || p[length] != '\0') return -1;
+			values[i] = (const char *)p;
+			p += length + 1;
+		}
+	}
+	
+	user->name = values[DB_USER_FIELD_NAME];
+	user->email = values[DB_USER_FIELD_EMAIL];
+	user->phone = values[DB_USER_FIELD_PHONE];
+	return version;
+}
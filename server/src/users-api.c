@@ -0,0 +1,624 @@
+/*
+ * users-api.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <libsoup/soup.h>
+#include <json-c/json.h>
+#include <uuid/uuid.h>
+#include "app.h"
+#include "json-writer.h"
+
+#define USERS_API_DEFAULT_COUNT	(100)
+#define USERS_API_MAX_COUNT	(1000)
+#define USERS_API_CHUNK_SIZE	(16 * 1024)
+#define USERS_API_COUNT_AHEAD	(10000)	// matches counted beyond the requested page
+
+static long query_get_long(GHashTable * query, const char * name, long default_value)
+{
+	if(NULL == query) return default_value;
+	const char * value = g_hash_table_lookup(query, name);
+	if(NULL == value || !value[0]) return default_value;
+	
+	char * p_end = NULL;
+	long ret = strtol(value, &p_end, 10);
+	if(p_end == value || *p_end) return default_value;
+	return ret;
+}
+
+static const char * s_user_fields[DB_USER_FIELDS_COUNT] = {
+	[DB_USER_FIELD_NAME] = "name",
+	[DB_USER_FIELD_EMAIL] = "email",
+	[DB_USER_FIELD_PHONE] = "phone",
+};
+
+/******************************************************
+ * GET /api/users?start=&count=	(Authorization: Bearer <token from /login>)
+ * 
+ * webix dynamic loading format:
+ *   { "pos": start, "total_count": N, "data": [ { "id": uuid, "name": ..., "email": ..., "phone": ... }, ... ] }
+ * 
+ * filters (served from the secondary indexes):
+ *   filter[name|email|phone]=prefix	(webix serverFilter)
+ *   by=name|email|phone&from=&to=	(range: from <= value < to)
+ * 
+ * membership filters (bitmap indexes), comma-separated ids:
+ *   roles=1,2	(member of every role),  roles_any=	(of at least one),  roles_not=	(of none)
+ *   groups=, groups_any=, groups_not=
+ * 
+ * substring search (trigram index), ranked by relevance instead of sorted by value:
+ *   q=text&q_field=name|email|phone	(any field if q_field is omitted, not combined with the other filters)
+ *   a q shorter than 3 bytes falls back to filter[q_field or name]=q
+ *   "truncated": true when more users matched the trigrams than were ranked (total_count is then a lower bound)
+******************************************************/
+struct users_list_context
+{
+	long start;
+	long count;
+	http_task_t * task;
+	DB_TXN * txn;	// snapshot of the rows (and of a search's total_count), or NULL
+	json_writer_t json[1];	// writes into task->body
+	
+	int has_filter;
+	struct db_user_query query;
+	int has_text;
+	struct db_text_query text_query;
+	request_arena_t * arena;	// holds this context and the copies below, released with the request
+	char * values[DB_USER_FIELDS_COUNT + 3];	// copies of the query strings
+	uint32_t * member_ids[DB_MEMBER_KINDS_COUNT][3];	// all / any / none
+};
+
+static int parse_user_field(const char * name)
+{
+	if(NULL == name) return -1;
+	for(int i = 0; i < DB_USER_FIELDS_COUNT; ++i) {
+		if(strcmp(name, s_user_fields[i]) == 0) return i;
+	}
+	return -1;
+}
+
+static const char * s_member_kinds[DB_MEMBER_KINDS_COUNT] = {
+	[DB_MEMBER_ROLE] = "roles",
+	[DB_MEMBER_GROUP] = "groups",
+};
+
+static int parse_ids(request_arena_t * arena, const char * value, uint32_t ** p_ids)
+{
+	int max_ids = 1;
+	for(const char * p = value; *p; ++p) max_ids += (*p == ',');
+	
+	uint32_t * ids = request_arena_alloc0(arena, max_ids * sizeof(*ids));
+	int count = 0;
+	const char * p = value;
+	while(*p) {
+		char * p_end = NULL;
+		unsigned long id = strtoul(p, &p_end, 10);
+		if(p_end == p || id > UINT32_MAX || (*p_end && *p_end != ',')) return -1;
+		ids[count++] = id;
+		p = *p_end ? p_end + 1 : p_end;
+	}
+	*p_ids = ids;
+	return count;
+}
+
+static int parse_member_filters(struct users_list_context * ctx, GHashTable * query)
+{
+	static const char * suffixes[3] = { "", "_any", "_not" };
+	for(int kind = 0; kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		struct db_member_filter * filter = &ctx->query.members[kind];
+		for(int i = 0; i < 3; ++i) {
+			char name[64] = "";
+			snprintf(name, sizeof(name), "%s%s", s_member_kinds[kind], suffixes[i]);
+			const char * value = g_hash_table_lookup(query, name);
+			if(NULL == value || !value[0]) continue;
+			
+			uint32_t * ids = NULL;
+			int count = parse_ids(ctx->arena, value, &ids);
+			if(count < 0) return -1;
+			ctx->member_ids[kind][i] = ids;
+			switch(i) {
+			case 0: filter->all = ids; filter->num_all = count; break;
+			case 1: filter->any = ids; filter->num_any = count; break;
+			default: filter->none = ids; filter->num_none = count; break;
+			}
+			ctx->has_filter = 1;
+		}
+	}
+	return 0;
+}
+
+static int parse_text_query(struct users_list_context * ctx, GHashTable * query)
+{
+	const char * text = g_hash_table_lookup(query, "q");
+	if(NULL == text || !text[0]) return 0;
+	
+	int field = -1;
+	const char * q_field = g_hash_table_lookup(query, "q_field");
+	if(q_field && q_field[0]) {
+		field = parse_user_field(q_field);
+		if(field < 0) return -1;
+	}
+	
+	if(strlen(text) < DB_TEXT_QUERY_MIN_LENGTH) {
+		// too short for a trigram, search by prefix instead
+		if(field < 0) field = DB_USER_FIELD_NAME;
+		if(NULL == ctx->query.conds[field].prefix) {
+			ctx->values[DB_USER_FIELDS_COUNT + 2] = request_arena_strdup(ctx->arena, text);
+			ctx->query.conds[field].prefix = ctx->values[DB_USER_FIELDS_COUNT + 2];
+		}
+		ctx->has_filter = 1;
+		return 0;
+	}
+	
+	ctx->values[DB_USER_FIELDS_COUNT + 2] = request_arena_strdup(ctx->arena, text);
+	ctx->text_query.text = ctx->values[DB_USER_FIELDS_COUNT + 2];
+	ctx->text_query.field = field;
+	ctx->has_text = 1;
+	return 0;
+}
+
+static int parse_filters(struct users_list_context * ctx, GHashTable * query)
+{
+	if(NULL == query) return 0;
+	
+	for(int i = 0; i < DB_USER_FIELDS_COUNT; ++i) {
+		char name[64] = "";
+		snprintf(name, sizeof(name), "filter[%s]", s_user_fields[i]);
+		const char * value = g_hash_table_lookup(query, name);
+		if(NULL == value || !value[0]) continue;
+		
+		ctx->values[i] = request_arena_strdup(ctx->arena, value);
+		ctx->query.conds[i].prefix = ctx->values[i];
+		ctx->has_filter = 1;
+	}
+	
+	const char * by = g_hash_table_lookup(query, "by");
+	if(by) {
+		int field = parse_user_field(by);
+		if(field < 0) return -1;
+		
+		const char * from = g_hash_table_lookup(query, "from");
+		const char * to = g_hash_table_lookup(query, "to");
+		if(from) ctx->query.conds[field].lower = ctx->values[DB_USER_FIELDS_COUNT] = request_arena_strdup(ctx->arena, from);
+		if(to) ctx->query.conds[field].upper = ctx->values[DB_USER_FIELDS_COUNT + 1] = request_arena_strdup(ctx->arena, to);
+		ctx->has_filter = 1;
+	}
+	if(parse_text_query(ctx, query)) return -1;
+	return parse_member_filters(ctx, query);
+}
+
+static int on_list_user(const struct db_user_record * user, void * user_data)
+{
+	struct users_list_context * ctx = user_data;
+	http_task_t * task = ctx->task;
+	json_writer_t * json = ctx->json;
+	int64_t begin_us = request_timing_now(task->timing);
+	
+	char sz_uid[40] = "";
+	uuid_unparse_lower(user->uid, sz_uid);
+	
+	json_writer_begin_object(json);
+	json_writer_add_string(json, "id", sz_uid);
+	json_writer_add_string(json, "name", user->name);
+	json_writer_add_string(json, "email", user->email);
+	json_writer_add_string(json, "phone", user->phone);
+	json_writer_end_object(json);
+	
+	// stream the rows while walking the cursor
+	if(task->body->len >= USERS_API_CHUNK_SIZE) {
+		http_task_flush(task);
+		json->out = task->body;
+	}
+	request_timing_add(task->timing, "json", begin_us);
+	return 0;
+}
+
+static void users_search_run(http_task_t * task)
+{
+	struct users_list_context * ctx = task->task_data;
+	app_context_t * app = task->http->user_data;
+	db_helpler_t * db = app->db;
+	
+	struct db_user_query * query = &ctx->query;
+	query->offset = ctx->start;
+	query->limit = ctx->count;
+	query->max_count = ctx->start + ctx->count + USERS_API_COUNT_AHEAD;
+	
+	task->status = SOUP_STATUS_OK;
+	task->content_type = "application/json";
+	task->chunked = 1;
+	
+	// total_count is only known after the scan, send it last
+	long total_count = 0;
+	json_writer_t * json = json_writer_init(ctx->json, task->body);
+	json_writer_begin_object(json);
+	json_writer_add_int64(json, "pos", ctx->start);
+	json_writer_key(json, "data");
+	json_writer_begin_array(json);
+	db_helpler_search_users(db, ctx->txn, query, on_list_user, ctx, &total_count);
+	json_writer_end_array(json);
+	json_writer_add_int64(json, "total_count", total_count);
+	json_writer_end_object(json);
+	return;
+}
+
+static void users_text_search_run(http_task_t * task)
+{
+	struct users_list_context * ctx = task->task_data;
+	app_context_t * app = task->http->user_data;
+	db_helpler_t * db = app->db;
+	
+	struct db_text_query * query = &ctx->text_query;
+	query->offset = ctx->start;
+	query->limit = ctx->count;
+	
+	task->status = SOUP_STATUS_OK;
+	task->content_type = "application/json";
+	task->chunked = 1;
+	
+	// the candidates are ranked before the first row, but total_count still goes last
+	long total_count = 0;
+	int truncated = 0;
+	json_writer_t * json = json_writer_init(ctx->json, task->body);
+	json_writer_begin_object(json);
+	json_writer_add_int64(json, "pos", ctx->start);
+	json_writer_key(json, "data");
+	json_writer_begin_array(json);
+	db_helpler_text_search(db, ctx->txn, query, on_list_user, ctx, &total_count, &truncated);
+	json_writer_end_array(json);
+	json_writer_add_int64(json, "total_count", total_count);
+	if(truncated) json_writer_add_bool(json, "truncated", 1);
+	json_writer_end_object(json);
+	return;
+}
+
+static void users_list_scan(http_task_t * task)
+{
+	struct users_list_context * ctx = task->task_data;
+	app_context_t * app = task->http->user_data;
+	db_helpler_t * db = app->db;
+	
+	long total_count = db_helpler_count_users(db);
+	if(total_count < 0) {
+		task->status = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+		return;
+	}
+	
+	task->status = SOUP_STATUS_OK;
+	task->content_type = "application/json";
+	task->chunked = 1;
+	
+	json_writer_t * json = json_writer_init(ctx->json, task->body);
+	json_writer_begin_object(json);
+	json_writer_add_int64(json, "pos", ctx->start);
+	json_writer_add_int64(json, "total_count", total_count);
+	json_writer_key(json, "data");
+	json_writer_begin_array(json);
+	db_helpler_list_users(db, ctx->txn, ctx->start, ctx->count, on_list_user, ctx);
+	json_writer_end_array(json);
+	json_writer_end_object(json);
+	return;
+}
+
+static void users_list_run(http_task_t * task)
+{
+	struct users_list_context * ctx = task->task_data;
+	app_context_t * app = task->http->user_data;
+	db_helpler_t * db = app->db;
+	ctx->task = task;
+	int64_t begin_us = request_timing_now(task->timing);
+	
+	// a long (streamed) scan must not hold read locks: writers would wait for the slowest client
+	if(db_helpler_begin_snapshot(db, &ctx->txn)) {
+		task->status = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+		return;
+	}
+	if(ctx->has_text) users_text_search_run(task);
+	else if(ctx->has_filter) users_search_run(task);
+	else users_list_scan(task);
+	
+	db_helpler_end_snapshot(db, ctx->txn);
+	ctx->txn = NULL;
+	
+	// the rows are formatted while walking the cursors: "db" is the rest of the run
+	if(task->timing) {
+		int64_t run_us = g_get_monotonic_time() - begin_us;
+		request_timing_add_us(task->timing, "db", run_us - request_timing_get_us(task->timing, "json"));
+	}
+	return;
+}
+
+/******************************************************
+ * POST /api/users	{ "name": ..., "email": ..., "phone": ..., "roles": [ids], "groups": [ids] }
+ * PUT /api/users/{id}	(replaces the record, and the memberships that are present)
+ * DELETE /api/users/{id}
+ * 
+ * requires a bearer token, responds { "id": uuid }
+******************************************************/
+enum users_write_op
+{
+	USERS_WRITE_CREATE,
+	USERS_WRITE_UPDATE,
+	USERS_WRITE_DELETE,
+};
+struct users_write_context
+{
+	enum users_write_op op;
+	struct db_user_record user;
+	request_arena_t * arena;	// holds this context and the copies below, released with the request
+	char * values[DB_USER_FIELDS_COUNT];	// copies of name / email / phone
+	
+	int has_members[DB_MEMBER_KINDS_COUNT];
+	uint32_t * member_ids[DB_MEMBER_KINDS_COUNT];
+	int num_member_ids[DB_MEMBER_KINDS_COUNT];
+};
+
+static int parse_user_json(struct users_write_context * ctx, SoupMessageBody * body)
+{
+	if(NULL == body || NULL == body->data || body->length == 0) return -1;
+	
+	json_tokener * tok = json_tokener_new();
+	json_object * juser = json_tokener_parse_ex(tok, body->data, body->length);
+	json_tokener_free(tok);
+	if(NULL == juser) return -1;
+	
+	int rc = json_object_is_type(juser, json_type_object) ? 0 : -1;
+	for(int i = 0; 0 == rc && i < DB_USER_FIELDS_COUNT; ++i) {
+		json_object * jvalue = NULL;
+		if(!json_object_object_get_ex(juser, s_user_fields[i], &jvalue)) continue;
+		ctx->values[i] = request_arena_strdup(ctx->arena, json_object_get_string(jvalue));
+	}
+	for(int kind = 0; 0 == rc && kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		json_object * jids = NULL;
+		if(!json_object_object_get_ex(juser, s_member_kinds[kind], &jids)) continue;
+		if(!json_object_is_type(jids, json_type_array)) {
+			rc = -1;
+			break;
+		}
+		int count = json_object_array_length(jids);
+		ctx->member_ids[kind] = request_arena_alloc0(ctx->arena, (count + 1) * sizeof(uint32_t));
+		for(int i = 0; i < count; ++i) {
+			int64_t id = json_object_get_int64(json_object_array_get_idx(jids, i));
+			if(id < 0 || id > UINT32_MAX) {
+				rc = -1;
+				break;
+			}
+			ctx->member_ids[kind][i] = id;
+		}
+		ctx->num_member_ids[kind] = count;
+		ctx->has_members[kind] = 1;
+	}
+	json_object_put(juser);
+	
+	ctx->user.name = ctx->values[DB_USER_FIELD_NAME];
+	ctx->user.email = ctx->values[DB_USER_FIELD_EMAIL] ? ctx->values[DB_USER_FIELD_EMAIL] : "";
+	ctx->user.phone = ctx->values[DB_USER_FIELD_PHONE] ? ctx->values[DB_USER_FIELD_PHONE] : "";
+	if(NULL == ctx->user.name || !ctx->user.name[0]) rc = -1;
+	return rc;
+}
+
+static int users_write_apply(db_helpler_t * db, DB_TXN * txn, void * data)
+{
+	struct users_write_context * ctx = data;
+	int rc = 0;
+	if(ctx->op == USERS_WRITE_DELETE) rc = db_helpler_delete_user(db, txn, ctx->user.uid);
+	else rc = db_helpler_put_user(db, txn, &ctx->user);
+	for(int kind = 0; 0 == rc && kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		if(!ctx->has_members[kind]) continue;
+		rc = db_helpler_set_user_members(db, txn, ctx->user.uid, kind, ctx->member_ids[kind], ctx->num_member_ids[kind]);
+	}
+	return rc;
+}
+
+static void users_write_run(http_task_t * task)
+{
+	struct users_write_context * ctx = task->task_data;
+	app_context_t * app = task->http->user_data;
+	
+	// group commit: blocks until the batch holding this write is durable
+	int64_t begin_us = request_timing_now(task->timing);
+	int rc = write_batcher_submit(app->writes, users_write_apply, ctx);
+	request_timing_add(task->timing, "commit", begin_us);
+	if(rc) {
+		task->status = (rc == DB_NOTFOUND) ? SOUP_STATUS_NOT_FOUND : SOUP_STATUS_INTERNAL_SERVER_ERROR;
+		return;
+	}
+	
+	char sz_uid[40] = "";
+	uuid_unparse_lower(ctx->user.uid, sz_uid);
+	json_writer_t json[1];
+	json_writer_init(json, task->body);
+	json_writer_begin_object(json);
+	json_writer_add_string(json, "id", sz_uid);
+	json_writer_end_object(json);
+	
+	task->status = (ctx->op == USERS_WRITE_CREATE) ? SOUP_STATUS_CREATED : SOUP_STATUS_OK;
+	task->content_type = "application/json";
+	return;
+}
+
+// answers 401 if the bearer token is missing or invalid
+static int verify_bearer_token(app_context_t * app, SoupMessage * msg, const char * token)
+{
+	int rc = -1;
+	if(token && token[0]) {
+		request_timing_t * timing = http_server_get_timing(msg);
+		int64_t begin_us = request_timing_now(timing);
+		rc = jwt_cache_verify(app->http->jwt_cache, token, NULL, 0);
+		request_timing_add(timing, "auth", begin_us);
+	}
+	if(rc) {
+		soup_message_headers_append(msg->response_headers, "WWW-Authenticate", "Bearer");
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+	}
+	return rc;
+}
+
+static int verify_bearer(app_context_t * app, SoupMessage * msg)
+{
+	const char * auth = soup_message_headers_get_one(msg->request_headers, "Authorization");
+	if(auth && strncasecmp(auth, "Bearer ", sizeof("Bearer")) != 0) auth = NULL;
+	return verify_bearer_token(app, msg, auth ? auth + sizeof("Bearer") : NULL);
+}
+
+static void on_api_users_write(app_context_t * app, SoupMessage * msg, const char * path)
+{
+	if(verify_bearer(app, msg)) return;
+	
+	// "/api/users" or "/api/users/{id}"
+	const char * id = path + sizeof("/api/users") - 1;
+	if(*id == '/') ++id;
+	
+	request_arena_t * arena = http_server_get_arena(app->http, msg);
+	struct users_write_context * ctx = request_arena_alloc0(arena, sizeof(*ctx));
+	ctx->arena = arena;
+	guint status = SOUP_STATUS_OK;
+	if(msg->method == SOUP_METHOD_POST && !id[0]) {
+		ctx->op = USERS_WRITE_CREATE;
+		uuid_generate(ctx->user.uid);
+	}else if((msg->method == SOUP_METHOD_PUT || msg->method == SOUP_METHOD_DELETE) && id[0]) {
+		ctx->op = (msg->method == SOUP_METHOD_PUT) ? USERS_WRITE_UPDATE : USERS_WRITE_DELETE;
+		if(uuid_parse(id, ctx->user.uid) != 0) status = SOUP_STATUS_NOT_FOUND;
+	}else status = SOUP_STATUS_METHOD_NOT_ALLOWED;
+	
+	if(status == SOUP_STATUS_OK && ctx->op != USERS_WRITE_DELETE && parse_user_json(ctx, msg->request_body)) status = SOUP_STATUS_BAD_REQUEST;
+	if(status != SOUP_STATUS_OK) {
+		soup_message_set_status(msg, status);
+		return;
+	}
+	http_server_dispatch(app->http, msg, users_write_run, ctx, NULL);
+	return;
+}
+
+void on_api_users(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+	app_context_t * app = user_data;
+	assert(app);
+	
+	if(msg->method != SOUP_METHOD_GET) {
+		// writes are served by the master, the databases of a replica are read-only
+		if(db_replication_is_replica(app->db->rep)) {
+			http_server_forward_to_master(app->http, msg);
+			return;
+		}
+		on_api_users_write(app, msg, path);
+		return;
+	}
+	if(strcmp(path, "/api/users") != 0) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+	// the rows hold email addresses and phone numbers: same token as the writes
+	if(verify_bearer(app, msg)) return;
+	
+	long start = query_get_long(query, "start", 0);
+	long count = query_get_long(query, "count", USERS_API_DEFAULT_COUNT);
+	if(start < 0 || count <= 0) {
+		soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+	if(count > USERS_API_MAX_COUNT) count = USERS_API_MAX_COUNT;
+	
+	request_arena_t * arena = http_server_get_arena(app->http, msg);
+	struct users_list_context * ctx = request_arena_alloc0(arena, sizeof(*ctx));
+	ctx->arena = arena;
+	ctx->start = start;
+	ctx->count = count;
+	if(parse_filters(ctx, query)) {
+		soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+	
+	// an index still being built (startup) would return partial results
+	int index = ctx->has_text ? DB_USER_FIELDS_COUNT : (ctx->has_filter ? db_helpler_query_index(&ctx->query) : -1);
+	if(index >= 0 && db_helpler_get_index_state(app->db, index) != DB_INDEX_READY) {
+		soup_message_headers_replace(msg->response_headers, "Retry-After", "5");
+		soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+		return;
+	}
+	
+	http_server_dispatch(app->http, msg, users_list_run, ctx, NULL);
+	return;
+}
+
+/******************************************************
+ * WebSocket /ws/users?since=seq&access_token=: live changes (change-feed.h)
+******************************************************/
+/*
+ * the same-origin pages only: a browser sends the Origin of the page opening the socket
+ * (other clients don't, they are authenticated by the token alone)
+ */
+static int is_same_origin(SoupMessage * msg)
+{
+	const char * origin = soup_message_headers_get_one(msg->request_headers, "Origin");
+	if(NULL == origin) return 1;
+	
+	const char * host = soup_message_headers_get_one(msg->request_headers, "Host");
+	const char * sep = strstr(origin, "://");
+	return (host && sep && strcasecmp(sep + 3, host) == 0);
+}
+
+/*
+ * called before the upgrade (see on_request_read()): a browser can't set the Authorization header
+ * of a WebSocket, the token is also accepted as the access_token query parameter.
+ * Answers 403 or 401, the handshake is then not completed.
+ */
+int users_api_check_ws_handshake(app_context_t * app, SoupMessage * msg)
+{
+	if(!is_same_origin(msg)) {
+		soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+		return -1;
+	}
+	
+	if(soup_message_headers_get_one(msg->request_headers, "Authorization")) return verify_bearer(app, msg);
+	
+	SoupURI * uri = soup_message_get_uri(msg);
+	GHashTable * query = (uri && uri->query) ? soup_form_decode(uri->query) : NULL;
+	int rc = verify_bearer_token(app, msg, query ? g_hash_table_lookup(query, "access_token") : NULL);
+	if(query) g_hash_table_destroy(query);
+	return rc;
+}
+
+void on_ws_users(SoupServer * server, SoupWebsocketConnection * conn, const char * path, SoupClientContext * client, gpointer user_data)
+{
+	app_context_t * app = user_data;
+	assert(app);
+	
+	long since = 0;
+	SoupURI * uri = soup_websocket_connection_get_uri(conn);
+	if(uri && uri->query) {
+		GHashTable * query = soup_form_decode(uri->query);
+		since = query_get_long(query, "since", 0);
+		g_hash_table_destroy(query);
+	}
+	if(since < 0 || since > UINT32_MAX) since = 0;
+	change_feed_add_client(app->changes, conn, since);
+}
@@ -0,0 +1,285 @@
+/*
+ * users-import.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <ctype.h>
+#include <time.h>
+#include <json-c/json.h>
+#include <uuid/uuid.h>
+#include "app.h"
+
+#define USERS_IMPORT_DEFAULT_BATCH_SIZE	(10000)
+#define USERS_IMPORT_READ_SIZE	(64 * 1024)
+
+// namespace of the name-based uuids generated from numeric user ids
+static const char * s_users_uuid_namespace = "a3f6f58e-3c1e-4b7d-9a54-2f0b2e8c7d10";
+
+struct users_import_context
+{
+	db_helpler_t * db;
+	uuid_t ns;
+	int batch_size;
+	
+	DB_TXN * txn;
+	db_members_batch_t * members;	// "roles" / "groups" of the pending rows
+	long num_pending;
+	long num_rows;
+	long num_committed;	// rows in the committed batches
+	long num_skipped;
+};
+
+static int import_commit(struct users_import_context * ctx)
+{
+	if(NULL == ctx->txn) return 0;
+	int rc = db_members_batch_flush(ctx->members, ctx->txn);
+	if(rc) {
+		ctx->txn->abort(ctx->txn);
+		ctx->txn = NULL;
+		return rc;
+	}
+	rc = ctx->txn->commit(ctx->txn, 0);
+	ctx->txn = NULL;
+	ctx->num_pending = 0;
+	if(0 == rc) ctx->num_committed = ctx->num_rows;
+	if(rc) fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+	return rc;
+}
+
+static const char * s_member_kinds[DB_MEMBER_KINDS_COUNT] = {
+	[DB_MEMBER_ROLE] = "roles",
+	[DB_MEMBER_GROUP] = "groups",
+};
+
+/*
+ * "roles": [ role ids ], "groups": [ group ids ] (optional)
+ */
+static int import_user_members(struct users_import_context * ctx, json_object * juser, const uuid_t uid)
+{
+	for(int kind = 0; kind < DB_MEMBER_KINDS_COUNT; ++kind) {
+		json_object * jids = NULL;
+		if(!json_object_object_get_ex(juser, s_member_kinds[kind], &jids)) continue;
+		if(!json_object_is_type(jids, json_type_array)) continue;
+		
+		int count = json_object_array_length(jids);
+		uint32_t * ids = calloc(count + 1, sizeof(*ids));
+		assert(ids);
+		int num_ids = 0;
+		for(int i = 0; i < count; ++i) {
+			json_object * jid = json_object_array_get_idx(jids, i);
+			int64_t id = json_object_get_int64(jid);
+			if(id < 0 || id > UINT32_MAX) continue;
+			ids[num_ids++] = id;
+		}
+		int rc = db_members_batch_add(ctx->members, ctx->txn, uid, kind, ids, num_ids);
+		free(ids);
+		if(rc) return rc;
+	}
+	return 0;
+}
+
+static int import_user(struct users_import_context * ctx, json_object * juser)
+{
+	if(!json_object_is_type(juser, json_type_object)) {
+		++ctx->num_skipped;
+		return 0;
+	}
+	
+	struct db_user_record user[1];
+	memset(user, 0, sizeof(user));
+	user->name = json_get_value(juser, string, name);
+	user->email = json_get_value(juser, string, email);
+	user->phone = json_get_value(juser, string, phone);
+	if(NULL == user->name) {
+		++ctx->num_skipped;
+		return 0;
+	}
+	
+	// "id": a uuid string, or a numeric id (stable name-based uuid, re-imports overwrite the same records)
+	json_object * jid = NULL;
+	json_object_object_get_ex(juser, "id", &jid);
+	const char * id = jid?json_object_get_string(jid):NULL;
+	if(NULL == id || uuid_parse(id, user->uid) != 0) {
+		if(id) uuid_generate_sha1(user->uid, ctx->ns, id, strlen(id));
+		else uuid_generate(user->uid);
+	}
+	
+	DB_ENV * env = ctx->db->env;
+	if(NULL == ctx->txn) {
+		int rc = env->txn_begin(env, NULL, &ctx->txn, DB_TXN_NOSYNC);
+		if(rc) {
+			fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+			return rc;
+		}
+	}
+	
+	int rc = db_helpler_put_user(ctx->db, ctx->txn, user);
+	if(0 == rc) rc = db_members_batch_add_user(ctx->members, ctx->txn, user->uid);
+	if(0 == rc) rc = import_user_members(ctx, juser, user->uid);
+	if(rc) return rc;
+	
+	++ctx->num_rows;
+	if(++ctx->num_pending >= ctx->batch_size) return import_commit(ctx);
+	return 0;
+}
+
+/*
+ * streams a json array of users: only one array element is parsed at a time
+ */
+static int import_users_file(struct users_import_context * ctx, FILE * fp)
+{
+	json_tokener * tok = json_tokener_new();
+	assert(tok);
+	
+	char * buf = malloc(USERS_IMPORT_READ_SIZE);
+	assert(buf);
+	
+	int rc = 0;
+	int started = 0;	// '[' found
+	int in_value = 0;	// the tokener holds a partial element
+	int done = 0;
+	size_t cb = 0;
+	while(!done && 0 == rc && (cb = fread(buf, 1, USERS_IMPORT_READ_SIZE, fp)) > 0) {
+		size_t pos = 0;
+		while(pos < cb) {
+			if(!in_value) {
+				char c = buf[pos];
+				if(isspace((unsigned char)c) || (started && c == ',')) { ++pos; continue; }
+				if(!started) {
+					if(c != '[') { rc = -1; break; }
+					started = 1;
+					++pos;
+					continue;
+				}
+				if(c == ']') { done = 1; break; }
+				in_value = 1;
+			}
+			
+			json_object * juser = json_tokener_parse_ex(tok, buf + pos, cb - pos);
+			enum json_tokener_error err = json_tokener_get_error(tok);
+			if(err == json_tokener_continue) break;	// need more data
+			if(err != json_tokener_success) {
+				fprintf(stderr, "json error after %ld rows: %s\n", ctx->num_rows, json_tokener_error_desc(err));
+				rc = -1;
+				break;
+			}
+			pos += tok->char_offset;
+			json_tokener_reset(tok);
+			in_value = 0;
+			
+			rc = import_user(ctx, juser);
+			json_object_put(juser);
+			if(rc) break;
+		}
+	}
+	if(0 == rc && !done) {
+		fprintf(stderr, "unexpected end of file\n");
+		rc = -1;
+	}
+	
+	free(buf);
+	json_tokener_free(tok);
+	return rc;
+}
+
+int users_import(app_context_t * app)
+{
+	assert(app && app->import.file);
+	db_helpler_t * db = app->db;
+	
+	FILE * fp = strcmp(app->import.file, "-")?fopen(app->import.file, "r"):stdin;
+	if(NULL == fp) {
+		perror(app->import.file);
+		return -1;
+	}
+	
+	// without the secondary indexes, puts only touch users_db
+	// (they are marked as being built from now on: an aborted import is indexed by the next start)
+	db->defer_indexes = app->import.defer_indexes;
+	db->skip_change_log = 1;	// one DB_CHANGE_RESET record at the end instead of one per row
+	db->batch_live_users = 1;	// merged into the bitmap once per transaction
+	db_helpler_t * ok = db_helpler_init(db, app);
+	assert(ok);
+	
+	struct users_import_context ctx[1];
+	memset(ctx, 0, sizeof(ctx));
+	ctx->db = db;
+	ctx->members = db_members_batch_new(db);
+	ctx->batch_size = app->import.batch_size;
+	if(ctx->batch_size <= 0) ctx->batch_size = USERS_IMPORT_DEFAULT_BATCH_SIZE;
+	uuid_parse(s_users_uuid_namespace, ctx->ns);
+	
+	struct timespec begin;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	
+	int rc = import_users_file(ctx, fp);
+	if(fp != stdin) fclose(fp);
+	
+	if(0 == rc) rc = import_commit(ctx);
+	else if(ctx->txn) {
+		ctx->txn->abort(ctx->txn);
+		ctx->txn = NULL;
+	}
+	db_members_batch_free(ctx->members);
+	ctx->members = NULL;
+	
+	// connected clients reload the user list, also after a failure: the batches committed so far stay
+	if(ctx->num_committed > 0) {
+		int ret = db_helpler_append_change(db, NULL, DB_CHANGE_RESET, NULL);
+		if(0 == rc) rc = ret;
+	}
+	
+	// batches were committed with DB_TXN_NOSYNC, make them durable once
+	int ret = db->env->log_flush(db->env, NULL);
+	if(0 == rc) rc = ret;
+	
+	double load_time = elapsed_seconds(&begin);
+	fprintf(stderr, "import: %ld rows (%ld skipped) in %.3f s, %.0f rows/s\n", 
+		ctx->num_rows, ctx->num_skipped, load_time, 
+		load_time > 0?ctx->num_rows / load_time:0.0);
+	if(rc) return rc;
+	
+	if(db->defer_indexes) {
+		struct timespec index_begin;
+		clock_gettime(CLOCK_MONOTONIC, &index_begin);
+		
+		rc = db_helpler_rebuild_indexes(db, ctx->batch_size);
+		if(0 == rc) rc = db->env->log_flush(db->env, NULL);
+		
+		double index_time = elapsed_seconds(&index_begin);
+		fprintf(stderr, "indexes: rebuilt in %.3f s, %.0f rows/s\n", 
+			index_time, index_time > 0?ctx->num_rows / index_time:0.0);
+	}
+	
+	double total_time = elapsed_seconds(&begin);
+	fprintf(stderr, "total: %.3f s, %.0f rows/s\n", total_time, total_time > 0?ctx->num_rows / total_time:0.0);
+	return rc;
+}
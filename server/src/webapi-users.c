@@ -34,6 +34,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <limits.h>
+#include <getopt.h>
+#include <signal.h>
+#include <glib-unix.h>
 
 #include <json-c/json.h>
 #include "app.h"
@@ -43,19 +46,59 @@
 **********************************************/
 static int app_init(app_context_t * app)
 {
+	json_object * jconfig = app->jconfig;
+	int num_workers = json_get_value(jconfig, int, worker_threads);
+	int max_queue = json_get_value(jconfig, int, worker_queue_limit);
+	worker_pool_t * workers = worker_pool_init(app->workers, "workers", num_workers, max_queue, app);
+	assert(workers);
+	
+	// a quarter of the cores by default: a login burst must leave cpu to the main loop and the other routes
+	int login_threads = json_get_value(jconfig, int, login_threads);
+	if(login_threads <= 0) login_threads = sysconf(_SC_NPROCESSORS_ONLN) / 4;
+	if(login_threads <= 0) login_threads = 1;
+	int login_queue = json_get_value(jconfig, int, login_queue_limit);
+	if(login_queue <= 0) login_queue = login_threads * 4;
+	worker_pool_t * login_workers = worker_pool_init(app->login_workers, "login", login_threads, login_queue, app);
+	assert(login_workers);
+	
 	http_server_t *http = http_server_init(app->http, app);
 	assert(http);
 	
 	db_helpler_t * db = db_helpler_init(app->db, app);
 	assert(db);
+	
+	change_feed_t * changes = app->changes;
+	changes->max_events = json_get_value(jconfig, int, change_feed_events);
+	changes->window = json_get_value(jconfig, int, change_feed_window);
+	changes->retention = json_get_value(jconfig, int, change_feed_retention);
+	changes->trim = (app->prefork.num_processes <= 0 || app->prefork.worker_id == 0);
+	changes = change_feed_init(changes, db, app);
+	assert(changes);
+	
+	int write_batch_size = json_get_value(jconfig, int, write_batch_size);
+	unsigned int write_batch_window = json_get_value(jconfig, int, write_batch_window_us);
+	write_batcher_t * writes = write_batcher_init(app->writes, db, write_batch_size, write_batch_window, app);
+	assert(writes);
 	return 0;
 }
 
+static int app_stop(app_context_t * app);
+static gboolean on_terminate(gpointer user_data)
+{
+	app_context_t * app = user_data;
+	app_stop(app);
+	return G_SOURCE_REMOVE;
+}
+
 static int app_run(app_context_t * app)
 {
 	GMainLoop * loop = g_main_loop_new(NULL, FALSE);
 	app->loop = loop;
 	app->is_running = 1;
+	
+	// graceful shutdown (the prefork supervisor stops workers with SIGTERM)
+	g_unix_signal_add(SIGTERM, on_terminate, app);
+	g_unix_signal_add(SIGINT, on_terminate, app);
 	g_main_loop_run(loop);
 	app->is_running = 0;
 	return 0;
@@ -79,14 +122,78 @@ static json_object * generate_default_config(void)
 	assert(jconfig);
 	json_object_object_add(jconfig, "port", json_object_new_int(DEFAULT_LISTEN_PORT));
 	json_object_object_add(jconfig, "db_home", json_object_new_string("db"));
+	json_object_object_add(jconfig, "document_root", json_object_new_string("../public"));
+	json_object_object_add(jconfig, "static_cache_entries", json_object_new_int(256));
+	json_object_object_add(jconfig, "static_cache_mb", json_object_new_int(64));
+	json_object_object_add(jconfig, "jwt_secret", json_object_new_string(""));
+	json_object_object_add(jconfig, "jwt_cache_entries", json_object_new_int(4096));
+	json_object_object_add(jconfig, "jwt_cache_shards", json_object_new_int(16));
+	json_object_object_add(jconfig, "worker_threads", json_object_new_int(0)); // 0: number of cpu cores
+	json_object_object_add(jconfig, "worker_queue_limit", json_object_new_int(256));
+	json_object_object_add(jconfig, "login_threads", json_object_new_int(0)); // 0: a quarter of the cpu cores
+	json_object_object_add(jconfig, "login_queue_limit", json_object_new_int(0)); // 0: 4 per login thread
+	json_object_object_add(jconfig, "processes", json_object_new_int(0)); // prefork workers, 0: single process
+	json_object_object_add(jconfig, "change_feed_events", json_object_new_int(4096)); // /ws/users: changes kept in memory
+	json_object_object_add(jconfig, "change_feed_window", json_object_new_int(1024)); // unacknowledged changes per client
+	json_object_object_add(jconfig, "change_feed_retention", json_object_new_int(65536)); // records kept in changes.db
 	return jconfig;
 }
 
+static void print_usage(const char * exe_name)
+{
+	fprintf(stderr, "Usage: %s [--conf=conf/config.json] [--processes=N]\n"
+		"    [--import=users.json] [--batch-size=10000] [--inline-indexes]\n"
+		"\n"
+		"  --processes       prefork N worker processes sharing the port (SO_REUSEPORT)\n"
+		"                    and the db environment (SIGHUP: rolling restart)\n"
+		"  --import          bulk load a json array of users ('-' for stdin) and exit\n"
+		"  --batch-size      rows per transaction\n"
+		"  --inline-indexes  update the secondary indexes on every put,\n"
+		"                    instead of rebuilding them in parallel after the load\n",
+		exe_name);
+}
+
+static int parse_args(app_context_t * app, int argc, char ** argv, const char ** p_conf_file)
+{
+	static struct option options[] = {
+		{"conf", required_argument, 0, 'c' },
+		{"import", required_argument, 0, 'i' },
+		{"batch-size", required_argument, 0, 'b' },
+		{"inline-indexes", no_argument, 0, 'n' },
+		{"processes", required_argument, 0, 'p' },
+		{"help", no_argument, 0, 'h' },
+		{NULL},
+	};
+	
+	app->import.defer_indexes = 1;
+	while(1) {
+		int index = 0;
+		int c = getopt_long(argc, argv, "c:i:b:np:h", options, &index);
+		if(c == -1) break;
+		
+		switch(c) {
+		case 'c': *p_conf_file = optarg; break;
+		case 'i': app->import.file = optarg; break;
+		case 'b': app->import.batch_size = atoi(optarg); break;
+		case 'n': app->import.defer_indexes = 0; break;
+		case 'p': app->prefork.num_processes = atoi(optarg); break;
+		case 'h': 
+		default:
+			print_usage(argv[0]);
+			exit(c != 'h');
+		}
+	}
+	return 0;
+}
+
 static app_context_t g_app[1];
 app_context_t * app_context_init(app_context_t * app, int argc, char ** argv, void * user_data)
 {
 	if(NULL ==  app) app = g_app;
 	const char * conf_file = "conf/config.json";
+	app->prefork.num_processes = -1;	// not set on the command line
+	if(argc > 1) parse_args(app, argc, argv, &conf_file);
+	
 	json_object * jconfig = json_object_from_file(conf_file);
 	if(NULL == jconfig) {
 		jconfig = generate_default_config();
@@ -95,6 +202,9 @@ app_context_t * app_context_init(app_context_t * app, int argc, char ** argv, vo
 	
 	app->user_data = user_data;
 	app->jconfig = jconfig;
+	app->prefork.worker_id = -1;
+	app->prefork.ready_fd = -1;
+	if(app->prefork.num_processes < 0) app->prefork.num_processes = json_get_value(jconfig, int, processes);
 	
 	return app;
  
@@ -102,7 +212,11 @@ app_context_t * app_context_init(app_context_t * app, int argc, char ** argv, vo
 void app_context_cleanup(app_context_t * app)
 {
 	app_stop(app);
+	change_feed_cleanup(app->changes);
+	worker_pool_cleanup(app->login_workers);	// before the http server: the logins use its credentials
 	http_server_cleanup(app->http);
+	worker_pool_cleanup(app->workers);
+	write_batcher_cleanup(app->writes);	// after the workers: they may be waiting for a batch
 	db_helpler_cleanup(app->db);
 	
 	json_object * jconfig = app->jconfig;
@@ -115,11 +229,31 @@ void app_context_cleanup(app_context_t * app)
 /**********************************************
  * Main
 **********************************************/
+static int run_worker(app_context_t * app)
+{
+	app_init(app);
+	prefork_notify_ready(app);
+	app_run(app);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	app_context_t * app = app_context_init(NULL, argc, argv, NULL);
 	assert(app);
 	
+	if(app->import.file) {
+		int rc = users_import(app);
+		app_context_cleanup(app);
+		return rc?1:0;
+	}
+	
+	if(app->prefork.num_processes > 0) {
+		int rc = prefork_run(app, run_worker);
+		app_context_cleanup(app);
+		return rc?1:0;
+	}
+	
 	app_init(app);
 	app_run(app);
 	app_context_cleanup(app);
@@ -0,0 +1,232 @@
+/*
+ * worker-pool.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "worker-pool.h"
+
+struct worker_job
+{
+	struct worker_job * next;
+	struct worker_job * prev;	// in 'completing'
+	struct worker_pool_private * priv;
+	guint source_id;	// on_job_completed(), not run yet
+	worker_task_fn task;
+	worker_complete_fn on_complete;
+	void * task_data;
+};
+
+struct worker_pool_private
+{
+	worker_pool_t * pool;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	
+	int quit;
+	long num_pending;
+	
+	struct worker_job * head;
+	struct worker_job * tail;
+	struct worker_job * completing;	// handed back to the main loop
+	
+	int num_threads;
+	pthread_t * threads;
+};
+
+static gboolean on_job_completed(gpointer user_data)
+{
+	struct worker_job * job = user_data;
+	struct worker_pool_private * priv = job->priv;
+	assert(priv);
+	
+	pthread_mutex_lock(&priv->mutex);
+	if(job->prev) job->prev->next = job->next;
+	else priv->completing = job->next;
+	if(job->next) job->next->prev = job->prev;
+	pthread_mutex_unlock(&priv->mutex);
+	
+	if(job->on_complete) job->on_complete(job->task_data);
+	
+	pthread_mutex_lock(&priv->mutex);
+	--priv->num_pending;
+	++priv->pool->num_completed;
+	pthread_mutex_unlock(&priv->mutex);
+	
+	free(job);
+	return G_SOURCE_REMOVE;
+}
+
+static void * worker_thread(void * user_data)
+{
+	struct worker_pool_private * priv = user_data;
+	assert(priv);
+	
+	while(1) {
+		pthread_mutex_lock(&priv->mutex);
+		while(!priv->quit && NULL == priv->head) {
+			pthread_cond_wait(&priv->cond, &priv->mutex);
+		}
+		
+		// drain the queue before quit
+		struct worker_job * job = priv->head;
+		if(NULL == job) {
+			pthread_mutex_unlock(&priv->mutex);
+			break;
+		}
+		priv->head = job->next;
+		if(NULL == priv->head) priv->tail = NULL;
+		pthread_mutex_unlock(&priv->mutex);
+		
+		job->next = NULL;
+		if(job->task) job->task(job->task_data);
+		
+		// hand the result back to the main loop
+		pthread_mutex_lock(&priv->mutex);
+		job->next = priv->completing;
+		if(priv->completing) priv->completing->prev = job;
+		priv->completing = job;
+		job->source_id = g_idle_add_full(G_PRIORITY_DEFAULT, on_job_completed, job, NULL);
+		pthread_mutex_unlock(&priv->mutex);
+	}
+	return NULL;
+}
+
+worker_pool_t * worker_pool_init(worker_pool_t * pool, const char * name, int num_workers, int max_queue, void * user_data)
+{
+	if(NULL == pool) pool = calloc(1, sizeof(*pool));
+	assert(pool);
+	pool->user_data = user_data;
+	
+	if(num_workers <= 0) num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_workers <= 0) num_workers = 1;
+	if(max_queue <= 0) max_queue = num_workers * 64;
+	
+	if(name) strncpy(pool->name, name, sizeof(pool->name) - 1);
+	pool->num_workers = num_workers;
+	pool->max_queue = max_queue;
+	
+	struct worker_pool_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->pool = pool;
+	pool->priv = priv;
+	
+	pthread_mutex_init(&priv->mutex, NULL);
+	pthread_cond_init(&priv->cond, NULL);
+	
+	priv->threads = calloc(num_workers, sizeof(*priv->threads));
+	assert(priv->threads);
+	for(int i = 0; i < num_workers; ++i) {
+		int rc = pthread_create(&priv->threads[i], NULL, worker_thread, priv);
+		assert(0 == rc);
+		++priv->num_threads;
+	}
+	
+	fprintf(stderr, "worker pool '%s': %d threads, max_queue=%d\n", pool->name, num_workers, max_queue);
+	return pool;
+}
+
+void worker_pool_cleanup(worker_pool_t * pool)
+{
+	if(NULL == pool) return;
+	struct worker_pool_private * priv = pool->priv;
+	if(NULL == priv) return;
+	
+	pthread_mutex_lock(&priv->mutex);
+	priv->quit = 1;
+	pthread_cond_broadcast(&priv->cond);
+	pthread_mutex_unlock(&priv->mutex);
+	
+	for(int i = 0; i < priv->num_threads; ++i) {
+		pthread_join(priv->threads[i], NULL);
+	}
+	free(priv->threads);
+	priv->threads = NULL;
+	priv->num_threads = 0;
+	
+	// the completions not dispatched yet would run after the pool (and their tasks) are gone
+	while(priv->completing) {
+		struct worker_job * job = priv->completing;
+		priv->completing = job->next;
+		g_source_remove(job->source_id);
+		free(job);
+	}
+	
+	pthread_cond_destroy(&priv->cond);
+	pthread_mutex_destroy(&priv->mutex);
+	
+	pool->priv = NULL;
+	free(priv);
+	return;
+}
+
+int worker_pool_push(worker_pool_t * pool, worker_task_fn task, worker_complete_fn on_complete, void * task_data)
+{
+	assert(pool && pool->priv);
+	struct worker_pool_private * priv = pool->priv;
+	
+	pthread_mutex_lock(&priv->mutex);
+	if(priv->quit || priv->num_pending >= pool->max_queue) {
+		++pool->num_rejected;
+		pthread_mutex_unlock(&priv->mutex);
+		return -1;
+	}
+	
+	struct worker_job * job = calloc(1, sizeof(*job));
+	assert(job);
+	job->priv = priv;
+	job->task = task;
+	job->on_complete = on_complete;
+	job->task_data = task_data;
+	
+	if(priv->tail) priv->tail->next = job;
+	else priv->head = job;
+	priv->tail = job;
+	++priv->num_pending;
+	
+	pthread_cond_signal(&priv->cond);
+	pthread_mutex_unlock(&priv->mutex);
+	return 0;
+}
+
+long worker_pool_get_pending(worker_pool_t * pool)
+{
+	assert(pool && pool->priv);
+	struct worker_pool_private * priv = pool->priv;
+	
+	pthread_mutex_lock(&priv->mutex);
+	long num_pending = priv->num_pending;
+	pthread_mutex_unlock(&priv->mutex);
+	return num_pending;
+}
@@ -0,0 +1,263 @@
+/*
+ * write-batch.c
+ * 
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+#include "app.h"
+#include "write-batch.h"
+
+#define WRITE_BATCH_DEFAULT_SIZE	(64)
+#define WRITE_BATCH_MAX_RETRIES	(3)
+
+struct write_request
+{
+	struct write_request * next;
+	write_batch_fn write;
+	void * data;
+	int rc;
+	int done;
+};
+
+struct write_batcher_private
+{
+	write_batcher_t * batcher;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;	// committer: requests queued
+	pthread_cond_t done_cond;	// writers: a batch is committed
+	int quit;
+	
+	struct write_request * head;
+	struct write_request * tail;
+	int num_queued;
+	
+	pthread_t thread;
+	int has_thread;
+};
+
+#define atomic_add(p, n) __atomic_add_fetch(p, n, __ATOMIC_RELAXED)
+
+static int run_write(DB_ENV * env, DB_TXN * parent, db_helpler_t * db, struct write_request * req, write_batcher_t * batcher)
+{
+	int rc = 0;
+	for(int attempt = 0; ; ++attempt) {
+		DB_TXN * child = NULL;
+		rc = env->txn_begin(env, parent, &child, 0);
+		if(0 == rc) {
+			rc = req->write(db, child, req->data);
+			if(rc) child->abort(child);
+			else rc = child->commit(child, 0);	// merged into the parent, nothing is flushed yet
+		}
+		if(rc != DB_LOCK_DEADLOCK || attempt >= WRITE_BATCH_MAX_RETRIES) break;
+		atomic_add(&batcher->num_retries, 1);
+	}
+	return rc;
+}
+
+static void run_batch(struct write_batcher_private * priv, struct write_request * batch, int count)
+{
+	write_batcher_t * batcher = priv->batcher;
+	db_helpler_t * db = batcher->db;
+	DB_ENV * env = db->env;
+	
+	DB_TXN * txn = NULL;
+	int rc = env->txn_begin(env, NULL, &txn, 0);
+	int num_failed = 0;
+	struct write_request * req = batch;
+	for(int i = 0; i < count; ++i, req = req->next) {
+		req->rc = rc ? rc : run_write(env, txn, db, req, batcher);
+		if(req->rc) ++num_failed;
+	}
+	
+	// one commit (and log flush) for the whole batch
+	if(0 == rc) {
+		rc = txn->commit(txn, 0);
+		if(rc) {
+			fprintf(stderr, "%s(): %s\n", __FUNCTION__, db_strerror(rc));
+			req = batch;
+			for(int i = 0; i < count; ++i, req = req->next) {
+				if(0 == req->rc) {
+					req->rc = rc;
+					++num_failed;
+				}
+			}
+		}
+	}
+	
+	atomic_add(&batcher->num_batches, 1);
+	atomic_add(&batcher->num_writes, count);
+	atomic_add(&batcher->num_failed, num_failed);
+}
+
+static void * committer_thread(void * user_data)
+{
+	struct write_batcher_private * priv = user_data;
+	write_batcher_t * batcher = priv->batcher;
+	
+	pthread_mutex_lock(&priv->mutex);
+	while(1) {
+		while(!priv->quit && NULL == priv->head) pthread_cond_wait(&priv->cond, &priv->mutex);
+		if(NULL == priv->head) break;	// quit, the queue is drained
+		
+		// wait (at most window_us) for the batch to fill up
+		if(batcher->window_us > 0 && priv->num_queued < batcher->max_batch && !priv->quit) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += (long)batcher->window_us * 1000;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			while(!priv->quit && priv->num_queued < batcher->max_batch) {
+				if(pthread_cond_timedwait(&priv->cond, &priv->mutex, &deadline) == ETIMEDOUT) break;
+			}
+		}
+		
+		struct write_request * batch = priv->head;
+		struct write_request * last = batch;
+		int count = 1;
+		while(count < batcher->max_batch && last->next) {
+			last = last->next;
+			++count;
+		}
+		priv->head = last->next;
+		if(NULL == priv->head) priv->tail = NULL;
+		priv->num_queued -= count;
+		pthread_mutex_unlock(&priv->mutex);
+		
+		run_batch(priv, batch, count);
+		
+		// the requests live on the writers' stacks: read 'next' before releasing them (under the mutex)
+		pthread_mutex_lock(&priv->mutex);
+		struct write_request * req = batch;
+		for(int i = 0; i < count; ++i) {
+			struct write_request * next = req->next;
+			req->done = 1;
+			req = next;
+		}
+		pthread_cond_broadcast(&priv->done_cond);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	return NULL;
+}
+
+int write_batcher_submit(write_batcher_t * batcher, write_batch_fn write, void * data)
+{
+	assert(batcher && batcher->priv && write);
+	struct write_batcher_private * priv = batcher->priv;
+	
+	struct write_request req[1];
+	memset(req, 0, sizeof(req));
+	req->write = write;
+	req->data = data;
+	
+	pthread_mutex_lock(&priv->mutex);
+	if(priv->quit) {
+		pthread_mutex_unlock(&priv->mutex);
+		return EINVAL;
+	}
+	if(priv->tail) priv->tail->next = req;
+	else priv->head = req;
+	priv->tail = req;
+	++priv->num_queued;
+	pthread_cond_signal(&priv->cond);
+	
+	while(!req->done) pthread_cond_wait(&priv->done_cond, &priv->mutex);
+	pthread_mutex_unlock(&priv->mutex);
+	return req->rc;
+}
+
+write_batcher_t * write_batcher_init(write_batcher_t * batcher, struct db_helpler * db, int max_batch, unsigned int window_us, void * user_data)
+{
+	assert(db);
+	if(NULL == batcher) batcher = calloc(1, sizeof(*batcher));
+	assert(batcher);
+	batcher->user_data = user_data;
+	batcher->db = db;
+	
+	if(max_batch <= 0) max_batch = WRITE_BATCH_DEFAULT_SIZE;
+	batcher->max_batch = max_batch;
+	batcher->window_us = window_us;
+	
+	struct write_batcher_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->batcher = batcher;
+	pthread_mutex_init(&priv->mutex, NULL);
+	pthread_cond_init(&priv->cond, NULL);
+	pthread_cond_init(&priv->done_cond, NULL);
+	batcher->priv = priv;
+	
+	int rc = pthread_create(&priv->thread, NULL, committer_thread, priv);
+	assert(0 == rc);
+	priv->has_thread = 1;
+	return batcher;
+}
+
+void write_batcher_cleanup(write_batcher_t * batcher)
+{
+	if(NULL == batcher || NULL == batcher->priv) return;
+	struct write_batcher_private * priv = batcher->priv;
+	
+	// queued writes are committed before the thread exits
+	pthread_mutex_lock(&priv->mutex);
+	priv->quit = 1;
+	pthread_cond_signal(&priv->cond);
+	pthread_mutex_unlock(&priv->mutex);
+	if(priv->has_thread) pthread_join(priv->thread, NULL);
+	
+	pthread_cond_destroy(&priv->done_cond);
+	pthread_cond_destroy(&priv->cond);
+	pthread_mutex_destroy(&priv->mutex);
+	batcher->priv = NULL;
+	free(priv);
+	return;
+}
+
+void write_batcher_append_metrics(write_batcher_t * batcher, GString * out)
+{
+	g_string_append_printf(out,
+		"# HELP webapi_write_batches_total Group commits of user writes (one log flush each).\n"
+		"# TYPE webapi_write_batches_total counter\n"
+		"webapi_write_batches_total %lu\n"
+		"# HELP webapi_write_batch_writes_total User writes committed through the group commit.\n"
+		"# TYPE webapi_write_batch_writes_total counter\n"
+		"webapi_write_batch_writes_total %lu\n"
+		"# HELP webapi_write_batch_failed_total User writes that failed (aborted alone, or with their batch).\n"
+		"# TYPE webapi_write_batch_failed_total counter\n"
+		"webapi_write_batch_failed_total %lu\n"
+		"# HELP webapi_write_batch_retries_total Writes retried after a deadlock.\n"
+		"# TYPE webapi_write_batch_retries_total counter\n"
+		"webapi_write_batch_retries_total %lu\n",
+		(unsigned long)__atomic_load_n(&batcher->num_batches, __ATOMIC_RELAXED),
+		(unsigned long)__atomic_load_n(&batcher->num_writes, __ATOMIC_RELAXED),
+		(unsigned long)__atomic_load_n(&batcher->num_failed, __ATOMIC_RELAXED),
+		(unsigned long)__atomic_load_n(&batcher->num_retries, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# fingerprints the static assets referenced by index.html and precompresses them:
+#   <document_root>/assets/<path>/<name>.<hash>.<ext>	(+ .gz, and .br if brotli is installed)
+#   <document_root>/assets/manifest.json	{ "<path>/<name>.<ext>": "assets/<path>/<name>.<hash>.<ext>", ... }
+#
+# the server loads the manifest at startup ("asset_manifest"), rewrites the index.html references
+# to the hashed urls and serves them as immutable, picking the variant from Accept-Encoding.
+# run it again whenever an asset changes (make assets).
+#
+# usage: tools/build-assets.sh [document_root (../public)]
+#
+
+set -e
+cd "$(dirname "$0")/.."
+ROOT=$(cd "${1:-../public}" && pwd)
+OUT_DIR=assets
+
+# stylesheets are rewritten to the hashed urls of the files they reference (fonts), so those go first
+ASSETS="webix/codebase/webix.js webix/codebase/webix.css material-design/css/materialdesignicons.css"
+
+cd "$ROOT"
+rm -rf "$OUT_DIR"
+mkdir -p "$OUT_DIR"
+
+declare -A HASHED	# path -> hashed path (relative to ROOT)
+
+# copies 'src' (content from 'data', defaults to 'src') as assets/<dir>/<name>.<hash>.<ext>
+add_asset() {
+	local src=$1 data=${2:-$1}
+	local hash=$(sha256sum "$data" | cut -c1-12)
+	local dir=$(dirname "$src") name=$(basename "$src")
+	local dst="$OUT_DIR/$dir/${name%.*}.$hash.${name##*.}"
+	mkdir -p "$OUT_DIR/$dir"
+	cp "$data" "$dst"
+	
+	# already compressed formats are served as they are
+	case "$name" in
+	*.woff|*.woff2|*.png|*.jpg|*.gif) ;;
+	*)
+		gzip -9 -n -c "$dst" > "$dst.gz"
+		[ $(stat -c %s "$dst.gz") -lt $(stat -c %s "$dst") ] || rm -f "$dst.gz"
+		if command -v brotli > /dev/null; then
+			brotli -q 11 -c "$dst" > "$dst.br"
+			[ $(stat -c %s "$dst.br") -lt $(stat -c %s "$dst") ] || rm -f "$dst.br"
+		fi
+		;;
+	esac
+	HASHED[$src]=$dst
+}
+
+for asset in $ASSETS; do
+	case "$asset" in
+	*.css)
+		dir=$(dirname "$asset")
+		tmp=$(mktemp)
+		cp "$asset" "$tmp"
+		# url("../fonts/x.woff2?v=1") -> url("../fonts/x.<hash>.woff2"), the relative layout is kept under assets/
+		for ref in $(grep -o "url([\"']\?[^\"')]*" "$asset" | sed "s/^url([\"']\?//" | grep -v '^data:\|^https\?:\|^/' | sort -u); do
+			file=$(realpath -m --relative-to="$ROOT" "$dir/${ref%%[?#]*}")
+			[ -f "$file" ] || continue
+			[ -n "${HASHED[$file]}" ] || add_asset "$file"
+			hashed=$(realpath -m --relative-to="$OUT_DIR/$dir" "${HASHED[$file]}")
+			sed -i "s|url\(([\"']\?\)$(printf '%s' "$ref" | sed 's/[.[\*^$|&]/\\&/g')\([\"')]\)|url\1$hashed\2|g" "$tmp"
+		done
+		add_asset "$asset" "$tmp"
+		rm -f "$tmp"
+		;;
+	*)
+		add_asset "$asset"
+		;;
+	esac
+done
+
+{
+	echo "{"
+	sep=""
+	for src in $(printf '%s\n' "${!HASHED[@]}" | sort); do
+		printf '%s\t"%s": "%s"' "$sep" "$src" "${HASHED[$src]}"
+		sep=$',\n'
+	done
+	echo
+	echo "}"
+} > "$OUT_DIR/manifest.json"
+
+echo "$(ls "$OUT_DIR" -R | grep -c '\.[0-9a-f]\{12\}\.[a-z0-9]*$') assets in $ROOT/$OUT_DIR"